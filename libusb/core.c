@@ -34,25 +34,40 @@
 #include "libusbi.h"
 
 #if defined(OS_LINUX)
-const struct usbi_os_backend * const usbi_backend = &linux_usbfs_backend;
+#define OS_BACKEND &linux_usbfs_backend
 #elif defined(OS_DARWIN)
-const struct usbi_os_backend * const usbi_backend = &darwin_backend;
+#define OS_BACKEND &darwin_backend
 #elif defined(OS_OPENBSD)
-const struct usbi_os_backend * const usbi_backend = &openbsd_backend;
+#define OS_BACKEND &openbsd_backend
 #elif defined(OS_WINDOWS)
-const struct usbi_os_backend * const usbi_backend = &windows_backend;
+#define OS_BACKEND &windows_backend
 #else
 #error "Unsupported OS"
 #endif
 
+/* the backend can only be switched before the first context is created,
+ * see libusb_init() */
+const struct usbi_os_backend *usbi_backend = OS_BACKEND;
+
 struct libusb_context *usbi_default_context = NULL;
 const struct libusb_version libusb_version_internal =
 	{ LIBUSB_MAJOR, LIBUSB_MINOR, LIBUSB_MICRO, LIBUSB_NANO,
 	  LIBUSB_RC, "http://libusbx.org" };
 static int default_context_refcnt = 0;
 static usbi_mutex_static_t default_context_lock = USBI_MUTEX_INITIALIZER;
+
+struct list_head active_contexts_list = {
+	&active_contexts_list, &active_contexts_list
+};
+usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
 static struct timeval timestamp_origin = { 0, 0 };
 
+#ifdef ENABLE_DEBUG_LOGGING
+int usbi_log_level_max = LIBUSB_LOG_LEVEL_DEBUG;
+#else
+int usbi_log_level_max = LIBUSB_LOG_LEVEL_NONE;
+#endif
+
 /**
  * \mainpage libusbx-1.0 API Reference
  *
@@ -145,6 +160,26 @@ static struct timeval timestamp_origin = { 0, 0 };
  * always logged. libusb_set_debug() and the LIBUSB_DEBUG environment variable
  * have no effects.
  *
+ * Messages above a given verbosity can also be left out of the library at
+ * compile time, by defining USBI_MAX_LOG_LEVEL to that level (for example
+ * with CFLAGS=-DUSBI_MAX_LOG_LEVEL=2 to keep errors and warnings only). The
+ * arguments of a message that is compiled out, or that no context of the
+ * process has asked for, are never evaluated.
+ *
+ * \subsection logsink Redirecting messages
+ *
+ * Writing to stderr from the thread that logs a message can disturb timing
+ * sensitive code when debug messages are enabled under load. An application
+ * can take over the messages of a context instead:
+ * - libusb_set_log_cb() hands every message to a callback instead of
+ *   printing it, from whatever thread logged it.
+ * - libusb_set_log_ring() makes libusbx queue the formatted messages in a
+ *   fixed size ring, without taking any lock. The application then calls
+ *   libusb_drain_log() from a thread of its choice, for instance a low
+ *   priority logging thread or its main loop, to deliver them to the
+ *   callback (or to stderr if there is none). Messages logged while the ring
+ *   is full are dropped and reported by the next drain.
+ *
  * \section remarks Other remarks
  *
  * libusbx does have imperfections. The \ref caveats "caveats" page attempts
@@ -185,13 +220,14 @@ static struct timeval timestamp_origin = { 0, 0 };
  * - Clearing of halt/stall condition (libusb_clear_halt())
  * - Device resets (libusb_reset_device())
  *
- * \section nohotplug No hotplugging
+ * \section hotplugsupport Hotplugging
  *
- * libusbx-1.0 lacks functionality for providing notifications of when devices
- * are added or removed. This functionality is planned to be implemented
- * in a later version of libusbx.
+ * Notifications of devices being added or removed are available on Linux and
+ * Darwin, see \ref hotplug. Elsewhere, applications have to look for changes
+ * with libusb_get_device_list().
  *
- * That said, there is basic disconnection handling for open device handles:
+ * In every case, there is basic disconnection handling for open device
+ * handles:
  *  - If there are ongoing transfers, libusbx's handle_events loop will detect
  *    disconnections and complete ongoing transfers with the
  *    LIBUSB_TRANSFER_NO_DEVICE status code.
@@ -495,6 +531,15 @@ static void discovered_devs_free(struct discovered_devs *discdevs)
 	free(discdevs);
 }
 
+/* bucket of a session ID in the device hash of a context */
+static unsigned int session_hash(unsigned long session_id)
+{
+	uint32_t h = (uint32_t)(session_id ^ (session_id >> 16));
+
+	h *= 2654435761u;
+	return (h >> 16) % USBI_SESSION_HASH_SIZE;
+}
+
 /* Allocate a new device with a specific session ID. The returned device has
  * a reference count of 1. */
 struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
@@ -521,6 +566,7 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_add(&dev->list, &ctx->usb_devs);
+	list_add(&dev->hash_list, &ctx->usb_devs_hash[session_hash(session_id)]);
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
 	return dev;
 }
@@ -533,7 +579,7 @@ int usbi_sanitize_device(struct libusb_device *dev)
 	int r;
 	unsigned char raw_desc[DEVICE_DESC_LENGTH];
 	uint8_t num_configurations;
-	int host_endian;
+	int host_endian = 0;
 
 	r = usbi_backend->get_device_descriptor(dev, raw_desc, &host_endian);
 	if (r < 0)
@@ -547,9 +593,66 @@ int usbi_sanitize_device(struct libusb_device *dev)
 		usbi_dbg("zero configurations, maybe an unauthorized device");
 
 	dev->num_configurations = num_configurations;
+
+	memcpy(&dev->device_descriptor, raw_desc, sizeof(raw_desc));
+	if (!host_endian) {
+		dev->device_descriptor.bcdUSB =
+			libusb_le16_to_cpu(dev->device_descriptor.bcdUSB);
+		dev->device_descriptor.idVendor =
+			libusb_le16_to_cpu(dev->device_descriptor.idVendor);
+		dev->device_descriptor.idProduct =
+			libusb_le16_to_cpu(dev->device_descriptor.idProduct);
+		dev->device_descriptor.bcdDevice =
+			libusb_le16_to_cpu(dev->device_descriptor.bcdDevice);
+	}
 	return 0;
 }
 
+/* drop the device list kept by the context, while devices come and go. must
+ * be called with the device_list_lock of the context held. */
+static void drop_device_list(struct libusb_context *ctx)
+{
+	if (ctx->device_list) {
+		discovered_devs_free(ctx->device_list);
+		ctx->device_list = NULL;
+	}
+}
+
+/* Report a device as attached. The context then holds a reference on it
+ * until usbi_disconnect_device(), so that its departure can be notified.
+ * Hotplug callbacks are notified of its arrival if notify is set. Must be
+ * called with the device_list_lock of the context held. */
+void usbi_connect_device(struct libusb_device *dev, int notify)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+
+	if (dev->attached)
+		return;
+
+	dev->attached = 1;
+	libusb_ref_device(dev);
+	if (notify) {
+		drop_device_list(ctx);
+		usbi_hotplug_notification(ctx, dev,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+	}
+}
+
+/* Report a device as detached, notifying hotplug callbacks and releasing the
+ * reference of the context if it was attached. Must be called with the
+ * device_list_lock of the context held, and a reference on the device. */
+void usbi_disconnect_device(struct libusb_device *dev)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+
+	drop_device_list(ctx);
+	usbi_hotplug_notification(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
+	if (dev->attached) {
+		dev->attached = 0;
+		libusb_unref_device(dev);
+	}
+}
+
 /* Examine libusbx's internal list of known devices, looking for one with
  * a specific session ID. Returns the matching device if it was found, and
  * NULL otherwise. */
@@ -560,7 +663,8 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	struct libusb_device *ret = NULL;
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
-	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+	list_for_each_entry(dev, &ctx->usb_devs_hash[session_hash(session_id)],
+			hash_list, struct libusb_device)
 		if (dev->session_data == session_id) {
 			ret = dev;
 			break;
@@ -570,6 +674,163 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	return ret;
 }
 
+/* Like usbi_get_device_by_session_id(), but returns a new reference on the
+ * device, and never a device that is being destroyed. */
+struct libusb_device *usbi_ref_device_by_session_id(
+	struct libusb_context *ctx, unsigned long session_id)
+{
+	struct libusb_device *dev;
+	struct libusb_device *ret = NULL;
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	list_for_each_entry(dev, &ctx->usb_devs_hash[session_hash(session_id)],
+			hash_list, struct libusb_device) {
+		if (dev->session_data != session_id)
+			continue;
+
+		usbi_mutex_lock(&dev->lock);
+		if (dev->refcnt > 0) {
+			dev->refcnt++;
+			ret = dev;
+		}
+		usbi_mutex_unlock(&dev->lock);
+		if (ret)
+			break;
+	}
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+	return ret;
+}
+
+/* whether a device matches a filter. the port path is only checked if
+ * check_path is set, in which case the parents of the device must stay alive
+ * meanwhile. */
+static int device_matches(struct libusb_device *dev,
+	const struct libusb_device_filter *filter, int check_path)
+{
+	struct libusb_device_descriptor desc;
+	struct libusb_device *parent;
+	int i;
+
+	/* not every backend fills in dev->device_descriptor, so go through
+	 * libusb_get_device_descriptor(), which uses it when it can */
+	if (filter->vendor_id != LIBUSB_DEVICE_FILTER_ANY
+			|| filter->product_id != LIBUSB_DEVICE_FILTER_ANY
+			|| filter->dev_class != LIBUSB_DEVICE_FILTER_ANY) {
+		if (libusb_get_device_descriptor(dev, &desc) < 0)
+			return 0;
+		if (filter->vendor_id != LIBUSB_DEVICE_FILTER_ANY
+				&& filter->vendor_id != desc.idVendor)
+			return 0;
+		if (filter->product_id != LIBUSB_DEVICE_FILTER_ANY
+				&& filter->product_id != desc.idProduct)
+			return 0;
+		if (filter->dev_class != LIBUSB_DEVICE_FILTER_ANY
+				&& filter->dev_class != desc.bDeviceClass)
+			return 0;
+	}
+	if (filter->bus_number != LIBUSB_DEVICE_FILTER_ANY
+			&& filter->bus_number != dev->bus_number)
+		return 0;
+	if (!check_path || filter->port_numbers_len <= 0)
+		return 1;
+
+	/* walk the path up from the device, as libusb_get_port_path() does */
+	i = filter->port_numbers_len;
+	for (parent = dev; parent && parent->port_number != 0;
+			parent = parent->parent_dev) {
+		if (--i < 0 || filter->port_numbers[i] != parent->port_number)
+			return 0;
+	}
+	return i == 0;
+}
+
+static ssize_t get_device_list(struct libusb_context *ctx,
+	const struct libusb_device_filter *filter, libusb_device ***list)
+{
+	struct discovered_devs *discdevs;
+	struct libusb_device **ret;
+	unsigned long stamp = 0;
+	int keep = 0;
+	int check_path = 1;
+	int r;
+	ssize_t i, n, len;
+
+	usbi_mutex_lock(&ctx->device_list_lock);
+	if (usbi_backend->get_device_list_stamp)
+		keep = usbi_backend->get_device_list_stamp(ctx, &stamp) == 0;
+
+	if (keep && ctx->device_list && stamp == ctx->device_list_stamp) {
+		usbi_dbg("device list unchanged");
+		discdevs = ctx->device_list;
+	} else if (filter && usbi_backend->get_device_list_filtered) {
+		/* a partial list is not worth keeping. it lacks the parents of
+		 * the devices, so their port path is left to the backend. */
+		check_path = 0;
+		discdevs = discovered_devs_alloc();
+		if (!discdevs) {
+			len = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+
+		r = usbi_backend->get_device_list_filtered(ctx, filter, &discdevs);
+		if (r < 0) {
+			discovered_devs_free(discdevs);
+			len = r;
+			goto out;
+		}
+	} else {
+		discdevs = discovered_devs_alloc();
+		if (!discdevs) {
+			len = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+
+		r = usbi_backend->get_device_list(ctx, &discdevs);
+		if (r < 0) {
+			discovered_devs_free(discdevs);
+			len = r;
+			goto out;
+		}
+
+		/* only drop the previous list now, so that the devices still
+		 * attached were found by their session ID */
+		if (ctx->device_list)
+			discovered_devs_free(ctx->device_list);
+		ctx->device_list = NULL;
+		if (keep) {
+			ctx->device_list = discdevs;
+			ctx->device_list_stamp = stamp;
+		}
+	}
+
+	/* convert discovered_devs into a list */
+	len = 0;
+	for (i = 0; i < discdevs->len; i++)
+		if (!filter || device_matches(discdevs->devices[i], filter,
+				check_path))
+			len++;
+	ret = calloc(len + 1, sizeof(struct libusb_device *));
+	if (ret) {
+		ret[len] = NULL;
+		for (i = 0, n = 0; i < discdevs->len; i++) {
+			struct libusb_device *dev = discdevs->devices[i];
+			if (!filter || device_matches(dev, filter, check_path))
+				ret[n++] = libusb_ref_device(dev);
+		}
+		*list = ret;
+	} else {
+		len = LIBUSB_ERROR_NO_MEM;
+	}
+
+	if (discdevs != ctx->device_list)
+		discovered_devs_free(discdevs);
+
+out:
+	usbi_mutex_unlock(&ctx->device_list_lock);
+	return len;
+}
+
 /** @ingroup dev
  * Returns a list of USB devices currently attached to the system. This is
  * your entry point into finding a USB device to operate.
@@ -589,44 +850,36 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
  * libusb_free_device_list().
  * \returns the number of devices in the outputted list, or any
  * \ref libusb_error according to errors encountered by the backend.
+ * \see libusb_get_device_list_filtered()
  */
 ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 	libusb_device ***list)
 {
-	struct discovered_devs *discdevs = discovered_devs_alloc();
-	struct libusb_device **ret;
-	int r = 0;
-	ssize_t i, len;
 	USBI_GET_CONTEXT(ctx);
 	usbi_dbg("");
+	return get_device_list(ctx, NULL, list);
+}
 
-	if (!discdevs)
-		return LIBUSB_ERROR_NO_MEM;
-
-	r = usbi_backend->get_device_list(ctx, &discdevs);
-	if (r < 0) {
-		len = r;
-		goto out;
-	}
-
-	/* convert discovered_devs into a list */
-	len = discdevs->len;
-	ret = calloc(len + 1, sizeof(struct libusb_device *));
-	if (!ret) {
-		len = LIBUSB_ERROR_NO_MEM;
-		goto out;
-	}
-
-	ret[len] = NULL;
-	for (i = 0; i < len; i++) {
-		struct libusb_device *dev = discdevs->devices[i];
-		ret[i] = libusb_ref_device(dev);
-	}
-	*list = ret;
-
-out:
-	discovered_devs_free(discdevs);
-	return len;
+/** @ingroup dev
+ * Like libusb_get_device_list(), but only lists the devices that match a
+ * filter. Where the backend supports it, the other devices are left out
+ * while the system is scanned, so that nothing gets allocated or read for
+ * them, which matters on systems with many devices.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param filter the criteria the devices must match, or NULL to list all the
+ * devices
+ * \param list output location for a list of devices. Must be later freed with
+ * libusb_free_device_list().
+ * \returns the number of devices in the outputted list, or any
+ * \ref libusb_error according to errors encountered by the backend.
+ */
+ssize_t API_EXPORTED libusb_get_device_list_filtered(libusb_context *ctx,
+	const struct libusb_device_filter *filter, libusb_device ***list)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_dbg("");
+	return get_device_list(ctx, filter, list);
 }
 
 /** \ingroup dev
@@ -805,8 +1058,10 @@ int API_EXPORTED libusb_get_max_packet_size(libusb_device *dev,
 	}
 
 	ep = find_endpoint(config, endpoint);
-	if (!ep)
+	if (!ep) {
+		libusb_free_config_descriptor(config);
 		return LIBUSB_ERROR_NOT_FOUND;
+	}
 
 	r = ep->wMaxPacketSize;
 	libusb_free_config_descriptor(config);
@@ -856,8 +1111,10 @@ int API_EXPORTED libusb_get_max_iso_packet_size(libusb_device *dev,
 	}
 
 	ep = find_endpoint(config, endpoint);
-	if (!ep)
+	if (!ep) {
+		libusb_free_config_descriptor(config);
 		return LIBUSB_ERROR_NOT_FOUND;
+	}
 
 	val = ep->wMaxPacketSize;
 	ep_type = (enum libusb_transfer_type) (ep->bmAttributes & 0x3);
@@ -905,9 +1162,12 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 
 		if (usbi_backend->destroy_device)
 			usbi_backend->destroy_device(dev);
+		usbi_clear_config_cache(dev);
+		usbi_clear_string_cache(dev);
 
 		usbi_mutex_lock(&dev->ctx->usb_devs_lock);
 		list_del(&dev->list);
+		list_del(&dev->hash_list);
 		usbi_mutex_unlock(&dev->ctx->usb_devs_lock);
 
 		usbi_mutex_destroy(&dev->lock);
@@ -999,17 +1259,24 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 
 	_handle->dev = libusb_ref_device(dev);
 	_handle->claimed_interfaces = 0;
+	memset(_handle->endpoints, 0, sizeof(_handle->endpoints));
+	usbi_init_flying_list(_handle);
+	usbi_assign_event_partition(_handle);
 	memset(&_handle->os_priv, 0, priv_size);
 
 	r = usbi_backend->open(_handle);
 	if (r < 0) {
 		usbi_dbg("could not open device: %s", libusb_error_name(r));
 		libusb_unref_device(dev);
+		usbi_exit_flying_list(_handle);
 		usbi_mutex_destroy(&_handle->lock);
 		free(_handle);
 		return r;
 	}
 
+	/* the configuration may have been changed while nobody had it open */
+	usbi_invalidate_active_config(dev);
+
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_add(&_handle->list, &ctx->open_devs);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
@@ -1046,34 +1313,23 @@ DEFAULT_VISIBILITY
 libusb_device_handle * LIBUSB_CALL libusb_open_device_with_vid_pid(
 	libusb_context *ctx, uint16_t vendor_id, uint16_t product_id)
 {
+	struct libusb_device_filter filter;
 	struct libusb_device **devs;
-	struct libusb_device *found = NULL;
-	struct libusb_device *dev;
 	struct libusb_device_handle *handle = NULL;
-	size_t i = 0;
 	int r;
 
-	if (libusb_get_device_list(ctx, &devs) < 0)
+	libusb_init_device_filter(&filter);
+	filter.vendor_id = vendor_id;
+	filter.product_id = product_id;
+	if (libusb_get_device_list_filtered(ctx, &filter, &devs) < 0)
 		return NULL;
 
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		r = libusb_get_device_descriptor(dev, &desc);
-		if (r < 0)
-			goto out;
-		if (desc.idVendor == vendor_id && desc.idProduct == product_id) {
-			found = dev;
-			break;
-		}
-	}
-
-	if (found) {
-		r = libusb_open(found, &handle);
+	if (devs[0]) {
+		r = libusb_open(devs[0], &handle);
 		if (r < 0)
 			handle = NULL;
 	}
 
-out:
 	libusb_free_device_list(devs, 1);
 	return handle;
 }
@@ -1087,16 +1343,14 @@ static void do_close(struct libusb_context *ctx,
 	libusb_lock_events(ctx);
 
 	/* remove any transfers in flight that are for this device */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	usbi_wait_for_cancel_walks(dev_handle);
 
 	/* safe iteration because transfers may be being deleted */
-	list_for_each_entry_safe(itransfer, tmp, &ctx->flying_transfers, list, struct usbi_transfer) {
+	list_for_each_entry_safe(itransfer, tmp, &dev_handle->flying_transfers, list, struct usbi_transfer) {
 		struct libusb_transfer *transfer =
 		        USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
-		if (transfer->dev_handle != dev_handle)
-			continue;
-
 		if (!(itransfer->flags & USBI_TRANSFER_DEVICE_DISAPPEARED)) {
 			usbi_err(ctx, "Device handle closed while transfer was still being processed, but the device is still connected as far as we know");
 
@@ -1111,7 +1365,7 @@ static void do_close(struct libusb_context *ctx,
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
 		usbi_mutex_lock(&itransfer->lock);
-		list_del(&itransfer->list);
+		usbi_remove_from_flying_list(itransfer);
 		transfer->dev_handle = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 
@@ -1122,16 +1376,18 @@ static void do_close(struct libusb_context *ctx,
 		usbi_dbg("Removed transfer %p from the in-flight list because device handle %p closed",
 			 transfer, dev_handle);
 	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
 	libusb_unlock_events(ctx);
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_del(&dev_handle->list);
+	usbi_retire_transfer_stats(dev_handle);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
 	usbi_backend->close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
+	usbi_exit_flying_list(dev_handle);
 	usbi_mutex_destroy(&dev_handle->lock);
 	free(dev_handle);
 }
@@ -1150,6 +1406,7 @@ static void do_close(struct libusb_context *ctx,
 void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 {
 	struct libusb_context *ctx;
+	struct usbi_event_partition *part;
 	unsigned char dummy = 1;
 	ssize_t r;
 
@@ -1181,8 +1438,10 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 		return;
 	}
 
-	/* take event handling lock */
+	/* take event handling lock, and that of the event thread serving the
+	 * device if it is not the main one */
 	libusb_lock_events(ctx);
+	part = usbi_lock_event_partition(dev_handle);
 
 	/* read the dummy data */
 	r = usbi_read(ctx->ctrl_pipe[0], &dummy, sizeof(dummy));
@@ -1196,6 +1455,7 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 	usbi_mutex_lock(&ctx->pollfd_modify_lock);
 	ctx->pollfd_modify--;
 	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	usbi_unlock_event_partition(part);
 
 	/* Release event handling lock and wake up event waiters */
 	libusb_unlock_events(ctx);
@@ -1306,8 +1566,68 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev,
 int API_EXPORTED libusb_set_configuration(libusb_device_handle *dev,
 	int configuration)
 {
+	int r;
+
 	usbi_dbg("configuration %d", configuration);
-	return usbi_backend->set_configuration(dev, configuration);
+	r = usbi_backend->set_configuration(dev, configuration);
+	/* even a failed request may have left the device unconfigured */
+	usbi_invalidate_active_config(dev->dev);
+	return r;
+}
+
+/* rebuild the endpoint table of a device handle for an interface now in
+ * altsetting alternate_setting, or no longer claimed if alternate_setting is
+ * negative. must be called with the handle lock held. */
+static void update_endpoints(struct libusb_device_handle *handle,
+	int interface_number, int alternate_setting)
+{
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *altsetting = NULL;
+	struct usbi_endpoint *ep;
+	int i;
+
+	for (i = 0; i < USB_MAXENDPOINTS; i++)
+		if (handle->endpoints[i].interface == interface_number)
+			handle->endpoints[i].claimed = 0;
+
+	if (alternate_setting < 0)
+		return;
+
+	/* the configuration, once read, is served from the device cache */
+	if (libusb_get_active_config_descriptor(handle->dev, &config) < 0) {
+		usbi_warn(HANDLE_CTX(handle), "no endpoint data for interface %d",
+			interface_number);
+		return;
+	}
+
+	for (i = 0; i < config->bNumInterfaces && !altsetting; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+		int j;
+
+		for (j = 0; j < iface->num_altsetting; j++) {
+			if (iface->altsetting[j].bInterfaceNumber == interface_number
+					&& iface->altsetting[j].bAlternateSetting
+						== alternate_setting) {
+				altsetting = &iface->altsetting[j];
+				break;
+			}
+		}
+	}
+
+	if (altsetting) {
+		for (i = 0; i < altsetting->bNumEndpoints; i++) {
+			const struct libusb_endpoint_descriptor *desc =
+				&altsetting->endpoint[i];
+
+			ep = usbi_handle_endpoint(handle, desc->bEndpointAddress);
+			ep->claimed = 1;
+			ep->interface = (uint8_t) interface_number;
+			ep->type = desc->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+			ep->max_packet_size = desc->wMaxPacketSize;
+		}
+	}
+
+	libusb_free_config_descriptor(config);
 }
 
 /** \ingroup dev
@@ -1348,8 +1668,10 @@ int API_EXPORTED libusb_claim_interface(libusb_device_handle *dev,
 		goto out;
 
 	r = usbi_backend->claim_interface(dev, interface_number);
-	if (r == 0)
+	if (r == 0) {
 		dev->claimed_interfaces |= 1 << interface_number;
+		update_endpoints(dev, interface_number, 0);
+	}
 
 out:
 	usbi_mutex_unlock(&dev->lock);
@@ -1387,8 +1709,10 @@ int API_EXPORTED libusb_release_interface(libusb_device_handle *dev,
 	}
 
 	r = usbi_backend->release_interface(dev, interface_number);
-	if (r == 0)
+	if (r == 0) {
 		dev->claimed_interfaces &= ~(1 << interface_number);
+		update_endpoints(dev, interface_number, -1);
+	}
 
 out:
 	usbi_mutex_unlock(&dev->lock);
@@ -1419,6 +1743,8 @@ out:
 int API_EXPORTED libusb_set_interface_alt_setting(libusb_device_handle *dev,
 	int interface_number, int alternate_setting)
 {
+	int r;
+
 	usbi_dbg("interface %d altsetting %d",
 		interface_number, alternate_setting);
 	if (interface_number >= USB_MAXINTERFACES)
@@ -1431,8 +1757,15 @@ int API_EXPORTED libusb_set_interface_alt_setting(libusb_device_handle *dev,
 	}
 	usbi_mutex_unlock(&dev->lock);
 
-	return usbi_backend->set_interface_altsetting(dev, interface_number,
+	r = usbi_backend->set_interface_altsetting(dev, interface_number,
 		alternate_setting);
+	if (r == 0) {
+		usbi_mutex_lock(&dev->lock);
+		if (dev->claimed_interfaces & (1 << interface_number))
+			update_endpoints(dev, interface_number, alternate_setting);
+		usbi_mutex_unlock(&dev->lock);
+	}
+	return r;
 }
 
 /** \ingroup dev
@@ -1479,8 +1812,22 @@ int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev,
  */
 int API_EXPORTED libusb_reset_device(libusb_device_handle *dev)
 {
+	int r;
+	int i;
+
 	usbi_dbg("");
-	return usbi_backend->reset_device(dev);
+	r = usbi_backend->reset_device(dev);
+
+	/* interfaces still claimed are back to their first altsetting */
+	usbi_mutex_lock(&dev->lock);
+	for (i = 0; i < USB_MAXINTERFACES; i++) {
+		if (dev->claimed_interfaces & (1L << i))
+			update_endpoints(dev, i, 0);
+		else
+			update_endpoints(dev, i, -1);
+	}
+	usbi_mutex_unlock(&dev->lock);
+	return r;
 }
 
 /** \ingroup dev
@@ -1571,6 +1918,151 @@ int API_EXPORTED libusb_attach_kernel_driver(libusb_device_handle *dev,
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
+/** \ingroup dev
+ * Allocate USB 3.0 bulk streams on one or more endpoints.
+ *
+ * Bulk streams let a SuperSpeed device handle several bulk transfers on the
+ * same endpoint at once, each on a stream of its own, as done by the USB
+ * Attached SCSI protocol. Transfers are sent on a stream with
+ * libusb_fill_bulk_stream_transfer().
+ *
+ * The same number of streams is allocated on every endpoint, which must
+ * all belong to claimed interfaces. Stream ids go from 1 to the number of
+ * streams allocated, which may be less than requested.
+ *
+ * \param dev a device handle
+ * \param num_streams number of streams to allocate on each endpoint
+ * \param endpoints array of endpoints to allocate streams on
+ * \param num_endpoints number of endpoints in the array
+ * \returns the number of streams allocated on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms where the functionality
+ * is not available, or if the device or host controller lacks bulk streams
+ * \returns another LIBUSB_ERROR code on other failure
+ * \see libusb_free_streams()
+ */
+int API_EXPORTED libusb_alloc_streams(libusb_device_handle *dev,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+{
+	usbi_dbg("streams %u eps %d", (unsigned) num_streams, num_endpoints);
+
+	if (!usbi_backend->alloc_streams)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return usbi_backend->alloc_streams(dev, num_streams, endpoints,
+		num_endpoints);
+}
+
+/** \ingroup dev
+ * Free the bulk streams allocated with libusb_alloc_streams().
+ *
+ * Releasing the interfaces of the endpoints also frees their streams.
+ *
+ * \param dev a device handle
+ * \param endpoints array of endpoints to free the streams of
+ * \param num_endpoints number of endpoints in the array
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms where the functionality
+ * is not available
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_free_streams(libusb_device_handle *dev,
+	unsigned char *endpoints, int num_endpoints)
+{
+	usbi_dbg("eps %d", num_endpoints);
+
+	if (!usbi_backend->free_streams)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return usbi_backend->free_streams(dev, endpoints, num_endpoints);
+}
+
+/** \ingroup dev
+ * Limit how many pieces of a bulk or interrupt transfer are in flight.
+ *
+ * Where the OS cannot take a large transfer in one go, libusbx splits it
+ * into smaller requests (URBs on Linux), which are normally all submitted
+ * at once. On older Linux kernels, whose requests are at most 16 kB, this
+ * means hundreds of requests in flight for a transfer of a few megabytes.
+ * With a limit set, at most max_urbs requests of each transfer are in
+ * flight, the next one being submitted as soon as one completes.
+ *
+ * The limit applies to the transfers submitted on the device handle after
+ * the call.
+ *
+ * \param dev a device handle
+ * \param max_urbs the most requests of a transfer in flight at once, or 0
+ * for no limit, which is the default
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if max_urbs is negative
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms where the functionality
+ * is not available
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_set_max_urbs_per_transfer(libusb_device_handle *dev,
+	int max_urbs)
+{
+	usbi_dbg("max urbs %d", max_urbs);
+
+	if (max_urbs < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!usbi_backend->set_max_urbs)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return usbi_backend->set_max_urbs(dev, max_urbs);
+}
+
+/** \ingroup dev
+ * Allocate memory that the device can do I/O on directly.
+ *
+ * Transfers submitted on the same device handle with all or part of this
+ * memory as their buffer do not need the OS to copy their data to or from
+ * a buffer of its own. This saves a memory copy per transfer, which makes
+ * a difference for high bandwidth bulk and isochronous streaming.
+ *
+ * On Linux, this is DMA-able memory mapped from the usbfs device file,
+ * which requires kernel 4.6 or newer.
+ *
+ * The memory must be freed with libusb_dev_mem_free() before the device
+ * handle is closed, and must not be freed with free(); in particular, do
+ * not use it with the
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ * "LIBUSB_TRANSFER_FREE_BUFFER" flag.
+ *
+ * \param dev a device handle
+ * \param length size of the memory to allocate
+ * \returns a pointer to the newly allocated memory, or NULL on failure or
+ * if the functionality is not available
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev,
+	size_t length)
+{
+	if (!usbi_backend->dev_mem_alloc)
+		return NULL;
+	return usbi_backend->dev_mem_alloc(dev, length);
+}
+
+/** \ingroup dev
+ * Free memory allocated with libusb_dev_mem_alloc().
+ *
+ * It is not legal to free memory which is still in use by an active
+ * transfer.
+ *
+ * \param dev the device handle the memory was allocated for
+ * \param buffer pointer to the memory to free
+ * \param length size of the memory, as passed to libusb_dev_mem_alloc()
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms where the functionality
+ * is not available
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev,
+	unsigned char *buffer, size_t length)
+{
+	if (!usbi_backend->dev_mem_free)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return usbi_backend->dev_mem_free(dev, buffer, length);
+}
+
 /** \ingroup lib
  * Set log message verbosity.
  *
@@ -1601,6 +2093,149 @@ void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
 	USBI_GET_CONTEXT(ctx);
 	if (!ctx->debug_fixed)
 		ctx->debug = level;
+	if (ctx->debug > usbi_log_level_max)
+		usbi_log_level_max = ctx->debug;
+}
+
+/** \ingroup lib
+ * Set a callback to receive the log messages of a context, instead of them
+ * being printed to stderr. The verbosity is still controlled by
+ * libusb_set_debug().
+ *
+ * Without a log ring, the callback is called synchronously from the thread
+ * that logs the message, so it must not call back into libusbx. With a log
+ * ring set up by libusb_set_log_ring(), it is only called from
+ * libusb_drain_log().
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param cb the callback, or NULL to print messages to stderr again
+ * \param user_data user data to pass to the callback
+ * \see logsink
+ */
+void API_EXPORTED libusb_set_log_cb(libusb_context *ctx, libusb_log_cb cb,
+	void *user_data)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->log_lock);
+	ctx->log_cb_user_data = user_data;
+	ctx->log_cb = cb;
+	usbi_mutex_unlock(&ctx->log_lock);
+}
+
+/** \ingroup lib
+ * Queue the log messages of a context in a ring, to be delivered by
+ * libusb_drain_log(), instead of printing them from the thread that logs
+ * them. Queueing a message doesn't take any lock and doesn't block; when the
+ * ring is full the message is dropped. Messages longer than the ring slots
+ * are truncated.
+ *
+ * The ring can only be set up once for a context, and stays in use until
+ * libusb_exit(), which delivers any messages still queued.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param num_messages the number of messages the ring can hold, rounded up
+ * to a power of two of at least 2
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if num_messages is not positive
+ * \returns LIBUSB_ERROR_BUSY if the context already has a log ring
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \see logsink
+ */
+int API_EXPORTED libusb_set_log_ring(libusb_context *ctx, int num_messages)
+{
+	struct usbi_log_ring *ring;
+	/* a single slot would look free for the next lap as soon as it is
+	 * published, so the ring has at least two */
+	long size = 2;
+	long i;
+
+	USBI_GET_CONTEXT(ctx);
+	if (num_messages <= 0 || num_messages > (1 << 20))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (ctx->log_ring)
+		return LIBUSB_ERROR_BUSY;
+
+	while (size < num_messages)
+		size <<= 1;
+	ring = malloc(sizeof(*ring) + size * sizeof(ring->entries[0]));
+	if (!ring)
+		return LIBUSB_ERROR_NO_MEM;
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->size = size;
+	ring->dropped = 0;
+	for (i = 0; i < size; i++)
+		ring->entries[i].seq = i;
+
+	if (usbi_atomic_cas_ptr(&ctx->log_ring, NULL, ring) != NULL) {
+		free(ring);
+		return LIBUSB_ERROR_BUSY;
+	}
+	return 0;
+}
+
+static void deliver_log_message(struct libusb_context *ctx,
+	enum libusb_log_level level, const char *str)
+{
+	if (ctx->log_cb)
+		ctx->log_cb(ctx, level, str, ctx->log_cb_user_data);
+	else
+		fprintf(stderr, "%s\n", str);
+}
+
+/** \ingroup lib
+ * Deliver the messages queued in the log ring of a context to the callback
+ * set with libusb_set_log_cb(), or to stderr if there is none. This function
+ * can be called from any thread, but not from the log callback itself.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns the number of messages delivered, or 0 if the context has no
+ * log ring
+ * \see logsink
+ */
+int API_EXPORTED libusb_drain_log(libusb_context *ctx)
+{
+	struct usbi_log_ring *ring;
+	struct usbi_log_entry *entry;
+	char str[USBI_LOG_LINE_SIZE];
+	long dropped;
+	int count = 0;
+
+	USBI_GET_CONTEXT(ctx);
+	ring = ctx->log_ring;
+	if (!ring)
+		return 0;
+
+	usbi_mutex_lock(&ctx->log_lock);
+	while (1) {
+		entry = &ring->entries[ring->tail & (ring->size - 1)];
+		/* the slot is published once its producer bumped seq past it. this
+		 * compare and swap leaves seq untouched, it only orders the reads
+		 * of the message after it. */
+		if (usbi_atomic_cas(&entry->seq, ring->tail + 1, ring->tail + 1)
+				!= ring->tail + 1)
+			break;
+		deliver_log_message(ctx, entry->level, entry->str);
+		/* hand the slot over to the producer of the next lap */
+		usbi_atomic_cas(&entry->seq, ring->tail + 1, ring->tail + ring->size);
+		ring->tail++;
+		count++;
+	}
+
+	do {
+		dropped = ring->dropped;
+	} while (usbi_atomic_cas(&ring->dropped, dropped, 0) != dropped);
+	if (dropped) {
+		snprintf(str, sizeof(str),
+			"libusbx: warning [%s] %ld log messages dropped", __FUNCTION__,
+			dropped);
+		str[sizeof(str) - 1] = '\0';
+		deliver_log_message(ctx, LIBUSB_LOG_LEVEL_WARNING, str);
+	}
+	usbi_mutex_unlock(&ctx->log_lock);
+
+	return count;
 }
 
 /** \ingroup lib
@@ -1621,10 +2256,17 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	char *dbg;
 	struct libusb_context *ctx;
 	int r = 0;
+	int i;
 
 	usbi_mutex_static_lock(&default_context_lock);
 
 	if (!timestamp_origin.tv_sec) {
+#ifdef ENABLE_MOCK_BACKEND
+		/* first call in this process, no context uses the backend yet */
+		const char *backend = getenv("LIBUSB_BACKEND");
+		if (backend && !strcmp(backend, "mock"))
+			usbi_backend = &mock_backend;
+#endif
 		usbi_gettimeofday(&timestamp_origin, NULL);
 	}
 
@@ -1651,6 +2293,8 @@ int API_EXPORTED libusb_init(libusb_context **context)
 		if (ctx->debug)
 			ctx->debug_fixed = 1;
 	}
+	if (ctx->debug > usbi_log_level_max)
+		usbi_log_level_max = ctx->debug;
 
 	/* default context should be initialized before calling usbi_dbg */
 	if (!usbi_default_context) {
@@ -1670,8 +2314,13 @@ int API_EXPORTED libusb_init(libusb_context **context)
 
 	usbi_mutex_init(&ctx->usb_devs_lock, NULL);
 	usbi_mutex_init(&ctx->open_devs_lock, NULL);
+	usbi_mutex_init(&ctx->device_list_lock, NULL);
+	usbi_mutex_init(&ctx->log_lock, NULL);
 	list_init(&ctx->usb_devs);
+	for (i = 0; i < USBI_SESSION_HASH_SIZE; i++)
+		list_init(&ctx->usb_devs_hash[i]);
 	list_init(&ctx->open_devs);
+	usbi_hotplug_init(ctx);
 
 	r = usbi_io_init(ctx);
 	if (r < 0) {
@@ -1680,6 +2329,10 @@ int API_EXPORTED libusb_init(libusb_context **context)
 		goto err_destroy_mutex;
 	}
 
+	usbi_mutex_static_lock(&active_contexts_lock);
+	list_add(&ctx->list, &active_contexts_list);
+	usbi_mutex_static_unlock(&active_contexts_lock);
+
 	if (context) {
 		*context = ctx;
 	}
@@ -1688,6 +2341,9 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	return 0;
 
 err_destroy_mutex:
+	usbi_hotplug_exit(ctx);
+	usbi_mutex_destroy(&ctx->log_lock);
+	usbi_mutex_destroy(&ctx->device_list_lock);
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 err_free_ctx:
@@ -1697,6 +2353,29 @@ err_unlock:
 	return r;
 }
 
+/* release the references held on the attached devices of a context. must be
+ * called with its device_list_lock held. */
+static void release_attached_devices(struct libusb_context *ctx)
+{
+	struct libusb_device *dev;
+	int found;
+
+	do {
+		found = 0;
+		usbi_mutex_lock(&ctx->usb_devs_lock);
+		list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+			if (dev->attached) {
+				dev->attached = 0;
+				found = 1;
+				break;
+			}
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+		if (found)
+			libusb_unref_device(dev);
+	} while (found);
+}
+
 /** \ingroup lib
  * Deinitialize libusb. Should be called after closing all open devices and
  * before your application terminates.
@@ -1721,15 +2400,36 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 		usbi_mutex_static_unlock(&default_context_lock);
 	}
 
+	libusb_stop_event_thread(ctx);
+
 	/* a little sanity check. doesn't bother with open_devs locking because
 	 * unless there is an application bug, nobody will be accessing this. */
 	if (!list_empty(&ctx->open_devs))
 		usbi_warn(ctx, "application left some devices open");
 
+	/* backends no longer deliver hotplug events to this context */
+	usbi_mutex_static_lock(&active_contexts_lock);
+	list_del(&ctx->list);
+	usbi_mutex_static_unlock(&active_contexts_lock);
+
+	usbi_mutex_lock(&ctx->device_list_lock);
+	drop_device_list(ctx);
+	release_attached_devices(ctx);
+	usbi_mutex_unlock(&ctx->device_list_lock);
+	usbi_hotplug_exit(ctx);
+
 	usbi_io_exit(ctx);
 	if (usbi_backend->exit)
 		usbi_backend->exit();
 
+	/* deliver what is left of the log ring */
+	if (ctx->log_ring) {
+		libusb_drain_log(ctx);
+		free(ctx->log_ring);
+	}
+
+	usbi_mutex_destroy(&ctx->log_lock);
+	usbi_mutex_destroy(&ctx->device_list_lock);
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	free(ctx);
@@ -1746,6 +2446,12 @@ int API_EXPORTED libusb_has_capability(uint32_t capability)
 	switch (capability) {
 	case LIBUSB_CAP_HAS_CAPABILITY:
 		return 1;
+	case LIBUSB_CAP_HAS_HOTPLUG:
+		return !!(usbi_backend->caps & USBI_CAP_HAS_HOTPLUG);
+#ifdef ENABLE_TRANSFER_STATS
+	case LIBUSB_CAP_HAS_TRANSFER_STATS:
+		return 1;
+#endif
 	}
 	return 0;
 }
@@ -1796,45 +2502,69 @@ int usbi_gettimeofday(struct timeval *tp, void *tzp)
 }
 #endif
 
+/* reserve a slot of a log ring. returns NULL, counting the message as
+ * dropped, if the ring is full. */
+static struct usbi_log_entry *log_ring_reserve(struct usbi_log_ring *ring,
+	long *pos)
+{
+	struct usbi_log_entry *entry;
+	long p = ring->head;
+	long seq, dif;
+
+	while (1) {
+		entry = &ring->entries[p & (ring->size - 1)];
+		/* read seq with a barrier, so that writing the message can't be
+		 * ordered before the consumer is done with the previous one */
+		seq = usbi_atomic_cas(&entry->seq, p, p);
+		dif = (long)((unsigned long)seq - (unsigned long)p);
+		if (dif == 0) {
+			/* the slot is free for this lap, try to claim it */
+			long prev = usbi_atomic_cas(&ring->head, p, p + 1);
+			if (prev == p)
+				break;
+			p = prev;
+		} else if (dif < 0) {
+			/* the consumer hasn't released it yet: the ring is full */
+			usbi_atomic_inc(&ring->dropped);
+			return NULL;
+		} else {
+			/* another producer claimed it first */
+			p = ring->head;
+		}
+	}
+
+	*pos = p;
+	return entry;
+}
+
 void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, va_list args)
 {
 	const char *prefix = "";
 	struct timeval now;
+	struct usbi_log_ring *ring;
+	struct usbi_log_entry *entry = NULL;
+	libusb_log_cb cb;
+	char header[64];
+	char line[USBI_LOG_LINE_SIZE];
+	char *str;
+	long pos = 0;
 	int global_debug;
+	int len;
 	static int has_debug_header_been_displayed = 0;
 
 #ifdef ENABLE_DEBUG_LOGGING
 	global_debug = 1;
-	UNUSED(ctx);
+	USBI_GET_CONTEXT(ctx);
 #else
 	USBI_GET_CONTEXT(ctx);
 	if (ctx == NULL)
 		return;
 	global_debug = (ctx->debug == LIBUSB_LOG_LEVEL_DEBUG);
-	if (!ctx->debug)
-		return;
-	if (level == LIBUSB_LOG_LEVEL_WARNING && ctx->debug < LIBUSB_LOG_LEVEL_WARNING)
-		return;
-	if (level == LIBUSB_LOG_LEVEL_INFO && ctx->debug < LIBUSB_LOG_LEVEL_INFO)
-		return;
-	if (level == LIBUSB_LOG_LEVEL_DEBUG && ctx->debug < LIBUSB_LOG_LEVEL_DEBUG)
+	if (!ctx->debug || (int)level > ctx->debug)
 		return;
 #endif
 
-	usbi_gettimeofday(&now, NULL);
-	if ((global_debug) && (!has_debug_header_been_displayed)) {
-		has_debug_header_been_displayed = 1;
-		fprintf(stderr, "[timestamp] [threadID] facility level [function call] <message>\n");
-		fprintf(stderr, "--------------------------------------------------------------------------------\n");
-	}
-	if (now.tv_usec < timestamp_origin.tv_usec) {
-		now.tv_sec--;
-		now.tv_usec += 1000000;
-	}
-	now.tv_sec -= timestamp_origin.tv_sec;
-	now.tv_usec -= timestamp_origin.tv_usec;
-
 	switch (level) {
 	case LIBUSB_LOG_LEVEL_INFO:
 		prefix = "info";
@@ -1855,16 +2585,58 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 		break;
 	}
 
+	/* only the verbose header carries a timestamp */
 	if (global_debug) {
-		fprintf(stderr, "[%2d.%06d] [%08x] libusbx: %s [%s] ",
-			(int)now.tv_sec, (int)now.tv_usec, usbi_get_tid(), prefix, function);
+		usbi_gettimeofday(&now, NULL);
+		if (now.tv_usec < timestamp_origin.tv_usec) {
+			now.tv_sec--;
+			now.tv_usec += 1000000;
+		}
+		now.tv_sec -= timestamp_origin.tv_sec;
+		now.tv_usec -= timestamp_origin.tv_usec;
+		snprintf(header, sizeof(header), "[%2d.%06d] [%08x] libusbx: %s ",
+			(int)now.tv_sec, (int)now.tv_usec, usbi_get_tid(), prefix);
+	} else {
+		snprintf(header, sizeof(header), "libusbx: %s ", prefix);
+	}
+	header[sizeof(header) - 1] = '\0';
+
+	ring = ctx ? ctx->log_ring : NULL;
+	cb = ctx ? ctx->log_cb : NULL;
+	if (!ring && !cb) {
+		if ((global_debug) && (!has_debug_header_been_displayed)) {
+			has_debug_header_been_displayed = 1;
+			fprintf(stderr, "[timestamp] [threadID] facility level [function call] <message>\n");
+			fprintf(stderr, "--------------------------------------------------------------------------------\n");
+		}
+		fprintf(stderr, "%s[%s] ", header, function);
+		vfprintf(stderr, format, args);
+		fprintf(stderr, "\n");
+		return;
+	}
+
+	if (ring) {
+		entry = log_ring_reserve(ring, &pos);
+		if (!entry)
+			return;
+		str = entry->str;
 	} else {
-		fprintf(stderr, "libusbx: %s [%s] ", prefix, function);
+		str = line;
 	}
 
-	vfprintf(stderr, format, args);
+	/* format straight into the reserved slot */
+	len = snprintf(str, USBI_LOG_LINE_SIZE, "%s[%s] ", header, function);
+	if (len >= 0 && len < USBI_LOG_LINE_SIZE)
+		vsnprintf(str + len, USBI_LOG_LINE_SIZE - len, format, args);
+	str[USBI_LOG_LINE_SIZE - 1] = '\0';
 
-	fprintf(stderr, "\n");
+	if (entry) {
+		entry->level = level;
+		/* publish the message to the consumer */
+		usbi_atomic_cas(&entry->seq, pos, pos + 1);
+	} else {
+		cb(ctx, level, str, ctx->log_cb_user_data);
+	}
 }
 
 void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
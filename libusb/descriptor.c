@@ -69,33 +69,177 @@ int usbi_parse_descriptor(unsigned char *source, const char *descriptor,
 	return (int) (sp - source);
 }
 
-static void clear_endpoint(struct libusb_endpoint_descriptor *endpoint)
+/* Parsed configurations are laid out in a single block: the array of
+ * interfaces, followed by all the altsettings, all the endpoints and all the
+ * extra descriptors, so that they are freed in one go. The parser goes twice
+ * over the raw descriptors: the first pass only measures how much of each it
+ * stores, in scratch space that ends up unused, and the second pass fills in
+ * the block sized after the first. */
+struct desc_arena {
+	struct libusb_context *ctx;
+	int measuring;
+
+	struct libusb_interface *interfaces;
+	struct libusb_interface_descriptor *altsettings;
+	struct libusb_endpoint_descriptor *endpoints;
+	unsigned char *extra;
+
+	/* the amounts stored so far, and the capacity of the block */
+	int num_interfaces;
+	int num_altsettings;
+	int num_endpoints;
+	int extra_length;
+	int max_interfaces;
+	int max_altsettings;
+	int max_endpoints;
+	int max_extra_length;
+
+	struct libusb_interface scratch_interfaces[USB_MAXINTERFACES];
+	struct libusb_interface_descriptor scratch_altsetting;
+	struct libusb_endpoint_descriptor scratch_endpoints[USB_MAXENDPOINTS];
+};
+
+/* problems are only reported by the first pass */
+#define parse_err(arena, ...) \
+	do { if ((arena)->measuring) usbi_err((arena)->ctx, __VA_ARGS__); } while (0)
+#define parse_warn(arena, ...) \
+	do { if ((arena)->measuring) usbi_warn((arena)->ctx, __VA_ARGS__); } while (0)
+#define parse_dbg(arena, ...) \
+	do { if ((arena)->measuring) usbi_dbg(__VA_ARGS__); } while (0)
+
+static void arena_init(struct desc_arena *arena, struct libusb_context *ctx)
+{
+	arena->ctx = ctx;
+	arena->measuring = 1;
+	arena->num_interfaces = 0;
+	arena->num_altsettings = 0;
+	arena->num_endpoints = 0;
+	arena->extra_length = 0;
+}
+
+/* size of the block needed after the first pass */
+static size_t arena_size(struct desc_arena *arena)
+{
+	return arena->num_interfaces * sizeof(struct libusb_interface)
+		+ arena->num_altsettings * sizeof(struct libusb_interface_descriptor)
+		+ arena->num_endpoints * sizeof(struct libusb_endpoint_descriptor)
+		+ arena->extra_length;
+}
+
+/* set up the second pass, filling in the given block */
+static void arena_fill(struct desc_arena *arena, unsigned char *block)
+{
+	arena->measuring = 0;
+	arena->max_interfaces = arena->num_interfaces;
+	arena->max_altsettings = arena->num_altsettings;
+	arena->max_endpoints = arena->num_endpoints;
+	arena->max_extra_length = arena->extra_length;
+	arena->num_interfaces = 0;
+	arena->num_altsettings = 0;
+	arena->num_endpoints = 0;
+	arena->extra_length = 0;
+
+	arena->interfaces = (struct libusb_interface *) block;
+	arena->altsettings = (struct libusb_interface_descriptor *)
+		(arena->interfaces + arena->max_interfaces);
+	arena->endpoints = (struct libusb_endpoint_descriptor *)
+		(arena->altsettings + arena->max_altsettings);
+	arena->extra = (unsigned char *)
+		(arena->endpoints + arena->max_endpoints);
+}
+
+/* the allocators below return NULL if the second pass goes beyond what the
+ * first one measured, which cannot happen as both parse the same data */
+
+static struct libusb_interface *arena_alloc_interfaces(
+	struct desc_arena *arena, int n)
+{
+	struct libusb_interface *interfaces;
+
+	if (arena->measuring) {
+		arena->num_interfaces += n;
+		return arena->scratch_interfaces;
+	}
+	if (arena->num_interfaces + n > arena->max_interfaces)
+		return NULL;
+	interfaces = arena->interfaces + arena->num_interfaces;
+	arena->num_interfaces += n;
+	return interfaces;
+}
+
+/* the altsettings of an interface are allocated one by one, but end up
+ * contiguous as no other interface is parsed in between */
+static struct libusb_interface_descriptor *arena_alloc_altsetting(
+	struct desc_arena *arena)
 {
-	if (endpoint->extra)
-		free((unsigned char *) endpoint->extra);
+	if (arena->measuring) {
+		arena->num_altsettings++;
+		return &arena->scratch_altsetting;
+	}
+	if (arena->num_altsettings == arena->max_altsettings)
+		return NULL;
+	return arena->altsettings + arena->num_altsettings++;
 }
 
-static int parse_endpoint(struct libusb_context *ctx,
+static struct libusb_endpoint_descriptor *arena_alloc_endpoints(
+	struct desc_arena *arena, int n)
+{
+	struct libusb_endpoint_descriptor *endpoints;
+
+	if (arena->measuring) {
+		arena->num_endpoints += n;
+		return arena->scratch_endpoints;
+	}
+	if (arena->num_endpoints + n > arena->max_endpoints)
+		return NULL;
+	endpoints = arena->endpoints + arena->num_endpoints;
+	arena->num_endpoints += n;
+	return endpoints;
+}
+
+/* copy extra descriptors into the block. the copy is only made by the second
+ * pass, the first one gets a NULL pointer that is never looked at. */
+static const unsigned char *arena_copy_extra(struct desc_arena *arena,
+	const unsigned char *data, int len, int *r)
+{
+	unsigned char *extra;
+
+	*r = 0;
+	if (arena->measuring) {
+		arena->extra_length += len;
+		return NULL;
+	}
+	if (arena->extra_length + len > arena->max_extra_length) {
+		*r = LIBUSB_ERROR_NO_MEM;
+		return NULL;
+	}
+	extra = arena->extra + arena->extra_length;
+	arena->extra_length += len;
+	memcpy(extra, data, len);
+	return extra;
+}
+
+static int parse_endpoint(struct desc_arena *arena,
 	struct libusb_endpoint_descriptor *endpoint, unsigned char *buffer,
 	int size, int host_endian)
 {
 	struct usb_descriptor_header header;
-	unsigned char *extra;
 	unsigned char *begin;
 	int parsed = 0;
 	int len;
+	int r;
 
 	usbi_parse_descriptor(buffer, "bb", &header, 0);
 
 	/* Everything should be fine being passed into here, but we sanity */
 	/*  check JIC */
 	if (header.bLength > size) {
-		usbi_err(ctx, "ran out of descriptors parsing");
+		parse_err(arena, "ran out of descriptors parsing");
 		return -1;
 	}
 
 	if (header.bDescriptorType != LIBUSB_DT_ENDPOINT) {
-		usbi_err(ctx, "unexpected descriptor %x (expected %x)",
+		parse_err(arena, "unexpected descriptor %x (expected %x)",
 			header.bDescriptorType, LIBUSB_DT_ENDPOINT);
 		return parsed;
 	}
@@ -116,7 +260,7 @@ static int parse_endpoint(struct libusb_context *ctx,
 		usbi_parse_descriptor(buffer, "bb", &header, 0);
 
 		if (header.bLength < 2) {
-			usbi_err(ctx, "invalid descriptor length %d", header.bLength);
+			parse_err(arena, "invalid descriptor length %d", header.bLength);
 			return -1;
 		}
 
@@ -127,7 +271,7 @@ static int parse_endpoint(struct libusb_context *ctx,
 				(header.bDescriptorType == LIBUSB_DT_DEVICE))
 			break;
 
-		usbi_dbg("skipping descriptor %x", header.bDescriptorType);
+		parse_dbg(arena, "skipping descriptor %x", header.bDescriptorType);
 		buffer += header.bLength;
 		size -= header.bLength;
 		parsed += header.bLength;
@@ -142,45 +286,17 @@ static int parse_endpoint(struct libusb_context *ctx,
 		return parsed;
 	}
 
-	extra = malloc(len);
-	endpoint->extra = extra;
-	if (!extra) {
+	endpoint->extra = arena_copy_extra(arena, begin, len, &r);
+	if (r < 0) {
 		endpoint->extra_length = 0;
-		return LIBUSB_ERROR_NO_MEM;
+		return r;
 	}
-
-	memcpy(extra, begin, len);
 	endpoint->extra_length = len;
 
 	return parsed;
 }
 
-static void clear_interface(struct libusb_interface *usb_interface)
-{
-	int i;
-	int j;
-
-	if (usb_interface->altsetting) {
-		for (i = 0; i < usb_interface->num_altsetting; i++) {
-			struct libusb_interface_descriptor *ifp =
-				(struct libusb_interface_descriptor *)
-				usb_interface->altsetting + i;
-			if (ifp->extra)
-				free((void *) ifp->extra);
-			if (ifp->endpoint) {
-				for (j = 0; j < ifp->bNumEndpoints; j++)
-					clear_endpoint((struct libusb_endpoint_descriptor *)
-						ifp->endpoint + j);
-				free((void *) ifp->endpoint);
-			}
-		}
-		free((void *) usb_interface->altsetting);
-		usb_interface->altsetting = NULL;
-	}
-
-}
-
-static int parse_interface(libusb_context *ctx,
+static int parse_interface(struct desc_arena *arena,
 	struct libusb_interface *usb_interface, unsigned char *buffer, int size,
 	int host_endian)
 {
@@ -188,26 +304,20 @@ static int parse_interface(libusb_context *ctx,
 	int len;
 	int r;
 	int parsed = 0;
-	size_t tmp;
 	struct usb_descriptor_header header;
 	struct libusb_interface_descriptor *ifp;
 	unsigned char *begin;
 
 	usb_interface->num_altsetting = 0;
+	usb_interface->altsetting = NULL;
 
 	while (size >= INTERFACE_DESC_LENGTH) {
-		struct libusb_interface_descriptor *altsetting =
-			(struct libusb_interface_descriptor *) usb_interface->altsetting;
-		altsetting = usbi_reallocf(altsetting,
-			sizeof(struct libusb_interface_descriptor) *
-			(usb_interface->num_altsetting + 1));
-		if (!altsetting) {
-			r = LIBUSB_ERROR_NO_MEM;
-			goto err;
-		}
-		usb_interface->altsetting = altsetting;
+		ifp = arena_alloc_altsetting(arena);
+		if (!ifp)
+			return LIBUSB_ERROR_NO_MEM;
+		if (!usb_interface->altsetting)
+			usb_interface->altsetting = ifp;
 
-		ifp = altsetting + usb_interface->num_altsetting;
 		usb_interface->num_altsetting++;
 		usbi_parse_descriptor(buffer, "bbbbbbbbb", ifp, 0);
 		ifp->extra = NULL;
@@ -225,12 +335,11 @@ static int parse_interface(libusb_context *ctx,
 		while (size >= DESC_HEADER_LENGTH) {
 			usbi_parse_descriptor(buffer, "bb", &header, 0);
 			if (header.bLength < 2) {
-				usbi_err(ctx, "invalid descriptor of length %d",
+				parse_err(arena, "invalid descriptor of length %d",
 					header.bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header.bLength > size) {
-				usbi_warn(ctx, "invalid descriptor of length %d",
+				parse_warn(arena, "invalid descriptor of length %d",
 					header.bLength);
 				/* The remaining bytes are bogus, but at least
 				 * one interface is OK, so let's continue. */
@@ -253,12 +362,9 @@ static int parse_interface(libusb_context *ctx,
 		/*  drivers to later parse */
 		len = (int)(buffer - begin);
 		if (len) {
-			ifp->extra = malloc(len);
-			if (!ifp->extra) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
-			memcpy((unsigned char *) ifp->extra, begin, len);
+			ifp->extra = arena_copy_extra(arena, begin, len, &r);
+			if (r < 0)
+				return r;
 			ifp->extra_length = len;
 		}
 
@@ -272,35 +378,31 @@ static int parse_interface(libusb_context *ctx,
 		}
 
 		if (ifp->bNumEndpoints > USB_MAXENDPOINTS) {
-			usbi_err(ctx, "too many endpoints (%d)", ifp->bNumEndpoints);
-			r = LIBUSB_ERROR_IO;
-			goto err;
+			parse_err(arena, "too many endpoints (%d)", ifp->bNumEndpoints);
+			return LIBUSB_ERROR_IO;
 		}
 
 		if (ifp->bNumEndpoints > 0) {
 			struct libusb_endpoint_descriptor *endpoint;
-			tmp = ifp->bNumEndpoints * sizeof(struct libusb_endpoint_descriptor);
-			endpoint = malloc(tmp);
+			endpoint = arena_alloc_endpoints(arena, ifp->bNumEndpoints);
+			if (!endpoint)
+				return LIBUSB_ERROR_NO_MEM;
 			ifp->endpoint = endpoint;
-			if (!endpoint) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
 
-			memset(endpoint, 0, tmp);
+			memset(endpoint, 0,
+				ifp->bNumEndpoints * sizeof(struct libusb_endpoint_descriptor));
 			for (i = 0; i < ifp->bNumEndpoints; i++) {
 				usbi_parse_descriptor(buffer, "bb", &header, 0);
 
 				if (header.bLength > size) {
-					usbi_err(ctx, "ran out of descriptors parsing");
-					r = LIBUSB_ERROR_IO;
-					goto err;
+					parse_err(arena, "ran out of descriptors parsing");
+					return LIBUSB_ERROR_IO;
 				}
 
-				r = parse_endpoint(ctx, endpoint + i, buffer, size,
+				r = parse_endpoint(arena, endpoint + i, buffer, size,
 					host_endian);
 				if (r < 0)
-					goto err;
+					return r;
 
 				buffer += r;
 				parsed += r;
@@ -317,32 +419,15 @@ static int parse_interface(libusb_context *ctx,
 	}
 
 	return parsed;
-err:
-	clear_interface(usb_interface);
-	return r;
 }
 
-static void clear_configuration(struct libusb_config_descriptor *config)
-{
-	if (config->interface) {
-		int i;
-		for (i = 0; i < config->bNumInterfaces; i++)
-			clear_interface((struct libusb_interface *)
-				config->interface + i);
-		free((void *) config->interface);
-	}
-	if (config->extra)
-		free((void *) config->extra);
-}
-
-static int parse_configuration(struct libusb_context *ctx,
+static int parse_configuration(struct desc_arena *arena,
 	struct libusb_config_descriptor *config, unsigned char *buffer,
 	int host_endian)
 {
 	int i;
 	int r;
 	int size;
-	size_t tmp;
 	struct usb_descriptor_header header;
 	struct libusb_interface *usb_interface;
 
@@ -350,17 +435,17 @@ static int parse_configuration(struct libusb_context *ctx,
 	size = config->wTotalLength;
 
 	if (config->bNumInterfaces > USB_MAXINTERFACES) {
-		usbi_err(ctx, "too many interfaces (%d)", config->bNumInterfaces);
+		parse_err(arena, "too many interfaces (%d)", config->bNumInterfaces);
 		return LIBUSB_ERROR_IO;
 	}
 
-	tmp = config->bNumInterfaces * sizeof(struct libusb_interface);
-	usb_interface = malloc(tmp);
+	usb_interface = arena_alloc_interfaces(arena, config->bNumInterfaces);
 	config->interface = usb_interface;
 	if (!config->interface)
 		return LIBUSB_ERROR_NO_MEM;
 
-	memset(usb_interface, 0, tmp);
+	memset(usb_interface, 0,
+		config->bNumInterfaces * sizeof(struct libusb_interface));
 	buffer += config->bLength;
 	size -= config->bLength;
 
@@ -380,17 +465,16 @@ static int parse_configuration(struct libusb_context *ctx,
 			/* If we've parsed at least one config descriptor then
 			 * let's return that. */
 			if (header.bLength > size && i) {
-				usbi_warn(ctx, "invalid descriptor length of %d",
+				parse_warn(arena, "invalid descriptor length of %d",
 					header.bLength);
 				return size;
 			}
 
 			if ((header.bLength > size) ||
 					(header.bLength < DESC_HEADER_LENGTH)) {
-				usbi_err(ctx, "invalid descriptor length of %d",
+				parse_err(arena, "invalid descriptor length of %d",
 					header.bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			}
 
 			/* If we find another "proper" descriptor then we're done */
@@ -400,7 +484,7 @@ static int parse_configuration(struct libusb_context *ctx,
 					(header.bDescriptorType == LIBUSB_DT_DEVICE))
 				break;
 
-			usbi_dbg("skipping descriptor 0x%x\n", header.bDescriptorType);
+			parse_dbg(arena, "skipping descriptor 0x%x\n", header.bDescriptorType);
 			buffer += header.bLength;
 			size -= header.bLength;
 		}
@@ -411,30 +495,23 @@ static int parse_configuration(struct libusb_context *ctx,
 		if (len) {
 			/* FIXME: We should realloc and append here */
 			if (!config->extra_length) {
-				config->extra = malloc(len);
-				if (!config->extra) {
-					r = LIBUSB_ERROR_NO_MEM;
-					goto err;
-				}
-
-				memcpy((unsigned char *) config->extra, begin, len);
+				config->extra = arena_copy_extra(arena, begin, len, &r);
+				if (r < 0)
+					return r;
 				config->extra_length = len;
 			}
 		}
 
-		r = parse_interface(ctx, usb_interface + i, buffer, size, host_endian);
+		r = parse_interface(arena, usb_interface + i, buffer, size,
+			host_endian);
 		if (r < 0)
-			goto err;
+			return r;
 
 		buffer += r;
 		size -= r;
 	}
 
 	return size;
-
-err:
-	clear_configuration(config);
-	return r;
 }
 
 /** \ingroup desc
@@ -454,6 +531,14 @@ int API_EXPORTED libusb_get_device_descriptor(libusb_device *dev,
 	int r;
 
 	usbi_dbg("");
+
+	/* the copy taken when the backend had the device sanitized, so that
+	 * filtering devices on their descriptor does not cost a read each */
+	if (dev->device_descriptor.bLength) {
+		memcpy(desc, &dev->device_descriptor, sizeof(*desc));
+		return 0;
+	}
+
 	r = usbi_backend->get_device_descriptor(dev, raw_desc, &host_endian);
 	if (r < 0)
 		return r;
@@ -468,76 +553,231 @@ int API_EXPORTED libusb_get_device_descriptor(libusb_device *dev,
 	return 0;
 }
 
-/** \ingroup desc
- * Get the USB configuration descriptor for the currently active configuration.
- * This is a non-blocking function which does not involve any requests being
- * sent to the device.
- *
- * \param dev a device
- * \param config output location for the USB configuration descriptor. Only
- * valid if 0 was returned. Must be freed with libusb_free_config_descriptor()
- * after use.
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NOT_FOUND if the device is in unconfigured state
- * \returns another LIBUSB_ERROR code on error
- * \see libusb_get_config_descriptor
- */
-int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
-	struct libusb_config_descriptor **config)
+/* A configuration descriptor as handed out to applications. Parsed
+ * configurations are cached by their device and shared by all the callers
+ * asking for them, each of which holds a reference. */
+struct usbi_config_descriptor {
+	volatile long refcnt;
+	struct libusb_config_descriptor desc;
+};
+
+static void unref_config(struct usbi_config_descriptor *config)
+{
+	/* the whole configuration lives in the same block, see read_config */
+	if (usbi_atomic_dec(&config->refcnt) == 0)
+		free(config);
+}
+
+/* read and parse configuration config_index of a device, or its active
+ * configuration if config_index is negative. the parsed configuration is
+ * followed in the same block by its interfaces, altsettings, endpoints and
+ * extra descriptors. */
+static int read_config(struct libusb_device *dev, int config_index,
+	struct usbi_config_descriptor **config)
 {
-	struct libusb_config_descriptor *_config = malloc(sizeof(*_config));
+	struct usbi_config_descriptor *_config;
+	struct libusb_config_descriptor measured;
+	struct desc_arena arena;
 	unsigned char tmp[8];
 	unsigned char *buf = NULL;
+	uint16_t total_length;
 	int host_endian = 0;
 	int r;
 
-	usbi_dbg("");
-	if (!_config)
-		return LIBUSB_ERROR_NO_MEM;
-
-	r = usbi_backend->get_active_config_descriptor(dev, tmp, sizeof(tmp),
-		&host_endian);
+	if (config_index < 0)
+		r = usbi_backend->get_active_config_descriptor(dev, tmp,
+			sizeof(tmp), &host_endian);
+	else
+		r = usbi_backend->get_config_descriptor(dev, (uint8_t) config_index,
+			tmp, sizeof(tmp), &host_endian);
 	if (r < 0)
-		goto err;
+		return r;
 
-	_config->wTotalLength = 0;
-	usbi_parse_descriptor(tmp, "bbw", _config, host_endian);
-	if (_config->wTotalLength != 0)
-		buf = malloc(_config->wTotalLength);
-	if (!buf) {
-		r = LIBUSB_ERROR_NO_MEM;
-		goto err;
-	}
+	measured.wTotalLength = 0;
+	usbi_parse_descriptor(tmp, "bbw", &measured, host_endian);
+	total_length = measured.wTotalLength;
+	if (total_length != 0)
+		buf = malloc(total_length);
+	if (!buf)
+		return LIBUSB_ERROR_NO_MEM;
 
-	r = usbi_backend->get_active_config_descriptor(dev, buf,
-		_config->wTotalLength, &host_endian);
+	host_endian = 0;
+	if (config_index < 0)
+		r = usbi_backend->get_active_config_descriptor(dev, buf,
+			total_length, &host_endian);
+	else
+		r = usbi_backend->get_config_descriptor(dev, (uint8_t) config_index,
+			buf, total_length, &host_endian);
 	if (r < 0)
-		goto err;
+		goto out;
 
-	r = parse_configuration(dev->ctx, _config, buf, host_endian);
+	arena_init(&arena, dev->ctx);
+	r = parse_configuration(&arena, &measured, buf, host_endian);
 	if (r < 0) {
 		usbi_err(dev->ctx, "parse_configuration failed with error %d", r);
-		goto err;
+		goto out;
 	} else if (r > 0) {
 		usbi_warn(dev->ctx, "descriptor data still left");
 	}
 
-	free(buf);
+	_config = malloc(sizeof(*_config) + arena_size(&arena));
+	if (!_config) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+
+	arena_fill(&arena, (unsigned char *)(_config + 1));
+	r = parse_configuration(&arena, &_config->desc, buf, host_endian);
+	if (r < 0) {
+		usbi_err(dev->ctx, "parse_configuration failed with error %d", r);
+		free(_config);
+		goto out;
+	}
+
+	_config->refcnt = 1;
 	*config = _config;
-	return 0;
+	r = 0;
 
-err:
-	free(_config);
-	if (buf)
-		free(buf);
+out:
+	free(buf);
 	return r;
 }
 
+/* get a reference to configuration config_index of a device, or to its
+ * active configuration if config_index is negative, parsing it only if it
+ * is not in the cache of the device yet */
+static int get_config(struct libusb_device *dev, int config_index,
+	struct libusb_config_descriptor **config)
+{
+	struct usbi_config_descriptor *_config;
+	struct usbi_config_descriptor *cached;
+	unsigned int gen;
+	int r;
+
+	usbi_mutex_lock(&dev->lock);
+	if (!dev->configs && dev->num_configurations) {
+		dev->configs = calloc(dev->num_configurations, sizeof(*dev->configs));
+		if (!dev->configs) {
+			usbi_mutex_unlock(&dev->lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+	}
+	_config = (config_index < 0) ? dev->active_config
+		: dev->configs[config_index];
+	if (_config)
+		usbi_atomic_inc(&_config->refcnt);
+	gen = dev->active_config_gen;
+	usbi_mutex_unlock(&dev->lock);
+
+	if (_config) {
+		*config = &_config->desc;
+		return 0;
+	}
+
+	/* the backend may be slow to provide the descriptor, so it is read
+	 * without the lock. whoever caches the configuration first wins. */
+	r = read_config(dev, config_index, &_config);
+	if (r < 0)
+		return r;
+
+	usbi_mutex_lock(&dev->lock);
+	if (config_index < 0) {
+		cached = dev->active_config;
+		/* do not cache a configuration that may have been replaced since */
+		if (!cached && gen == dev->active_config_gen) {
+			dev->active_config = _config;
+			usbi_atomic_inc(&_config->refcnt);
+		}
+	} else {
+		cached = dev->configs[config_index];
+		if (!cached) {
+			dev->configs[config_index] = _config;
+			usbi_atomic_inc(&_config->refcnt);
+		}
+	}
+	if (cached)
+		usbi_atomic_inc(&cached->refcnt);
+	usbi_mutex_unlock(&dev->lock);
+
+	if (cached) {
+		unref_config(_config);
+		_config = cached;
+	}
+	*config = &_config->desc;
+	return 0;
+}
+
+/* forget the cached active configuration of a device, after it may have
+ * changed */
+void usbi_invalidate_active_config(struct libusb_device *dev)
+{
+	struct usbi_config_descriptor *config;
+
+	usbi_mutex_lock(&dev->lock);
+	config = dev->active_config;
+	dev->active_config = NULL;
+	dev->active_config_gen++;
+	usbi_mutex_unlock(&dev->lock);
+
+	if (config)
+		unref_config(config);
+}
+
+/* drop all the cached configurations of a device being destroyed. the
+ * applications may still hold references to some of them. */
+void usbi_clear_config_cache(struct libusb_device *dev)
+{
+	int i;
+
+	if (dev->active_config)
+		unref_config(dev->active_config);
+	dev->active_config = NULL;
+
+	if (!dev->configs)
+		return;
+	for (i = 0; i < dev->num_configurations; i++)
+		if (dev->configs[i])
+			unref_config(dev->configs[i]);
+	free(dev->configs);
+	dev->configs = NULL;
+}
+
+/** \ingroup desc
+ * Get the USB configuration descriptor for the currently active configuration.
+ * This is a non-blocking function which does not involve any requests being
+ * sent to the device.
+ *
+ * The descriptor is parsed on first use and then cached by the device, so
+ * that further calls are cheap. It is shared with the other callers and must
+ * be treated as read-only. The cached active configuration is refreshed
+ * whenever the configuration is changed through libusb_set_configuration(),
+ * and when the device is opened.
+ *
+ * \param dev a device
+ * \param config output location for the USB configuration descriptor. Only
+ * valid if 0 was returned. Must be freed with libusb_free_config_descriptor()
+ * after use.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the device is in unconfigured state
+ * \returns another LIBUSB_ERROR code on error
+ * \see libusb_get_config_descriptor
+ */
+int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
+	struct libusb_config_descriptor **config)
+{
+	usbi_dbg("");
+	return get_config(dev, -1, config);
+}
+
 /** \ingroup desc
  * Get a USB configuration descriptor based on its index.
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * As for libusb_get_active_config_descriptor(), the descriptor is cached by
+ * the device, shared with the other callers and must be treated as
+ * read-only.
+ *
  * \param dev a device
  * \param config_index the index of the configuration you wish to retrieve
  * \param config output location for the USB configuration descriptor. Only
@@ -552,55 +792,11 @@ err:
 int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	uint8_t config_index, struct libusb_config_descriptor **config)
 {
-	struct libusb_config_descriptor *_config;
-	unsigned char tmp[8];
-	unsigned char *buf = NULL;
-	int host_endian = 0;
-	int r;
-
 	usbi_dbg("index %d", config_index);
 	if (config_index >= dev->num_configurations)
 		return LIBUSB_ERROR_NOT_FOUND;
 
-	_config = malloc(sizeof(*_config));
-	if (!_config)
-		return LIBUSB_ERROR_NO_MEM;
-
-	r = usbi_backend->get_config_descriptor(dev, config_index, tmp,
-		sizeof(tmp), &host_endian);
-	if (r < 0)
-		goto err;
-
-	usbi_parse_descriptor(tmp, "bbw", _config, host_endian);
-	buf = malloc(_config->wTotalLength);
-	if (!buf) {
-		r = LIBUSB_ERROR_NO_MEM;
-		goto err;
-	}
-
-	host_endian = 0;
-	r = usbi_backend->get_config_descriptor(dev, config_index, buf,
-		_config->wTotalLength, &host_endian);
-	if (r < 0)
-		goto err;
-
-	r = parse_configuration(dev->ctx, _config, buf, host_endian);
-	if (r < 0) {
-		usbi_err(dev->ctx, "parse_configuration failed with error %d", r);
-		goto err;
-	} else if (r > 0) {
-		usbi_warn(dev->ctx, "descriptor data still left");
-	}
-
-	free(buf);
-	*config = _config;
-	return 0;
-
-err:
-	free(_config);
-	if (buf)
-		free(buf);
-	return r;
+	return get_config(dev, config_index, config);
 }
 
 /* iterate through all configurations, returning the index of the configuration
@@ -664,6 +860,8 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
 /** \ingroup desc
  * Free a configuration descriptor obtained from
  * libusb_get_active_config_descriptor() or libusb_get_config_descriptor().
+ * This releases the reference of the caller to the shared descriptor, which
+ * is actually freed once neither the device nor any other caller use it.
  * It is safe to call this function with a NULL config parameter, in which
  * case the function simply returns.
  *
@@ -675,8 +873,123 @@ void API_EXPORTED libusb_free_config_descriptor(
 	if (!config)
 		return;
 
-	clear_configuration(config);
-	free(config);
+	unref_config(container_of(config, struct usbi_config_descriptor, desc));
+}
+
+/* A string descriptor read from a device. Strings do not change while a
+ * device is attached, so they are kept by the device for later lookups. */
+struct usbi_string_descriptor {
+	struct usbi_string_descriptor *next;
+	uint16_t langid;
+	uint8_t desc_index;
+	/* the descriptor as read, of data[0] bytes, see usbi_cache_string() */
+	unsigned char data[1];
+};
+
+/* copy a string descriptor of a device kept by usbi_cache_string() to data.
+ * returns the number of bytes copied, or LIBUSB_ERROR_NOT_FOUND if it has
+ * not been read yet. */
+int usbi_get_cached_string(struct libusb_device *dev, uint8_t desc_index,
+	uint16_t langid, unsigned char *data, int length)
+{
+	struct usbi_string_descriptor *string;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&dev->lock);
+	for (string = dev->strings; string; string = string->next) {
+		if (string->desc_index != desc_index || string->langid != langid)
+			continue;
+
+		r = MIN(length, string->data[0]);
+		memcpy(data, string->data, r);
+		break;
+	}
+	usbi_mutex_unlock(&dev->lock);
+	return r;
+}
+
+/* keep a string descriptor read from a device, unless it was cut short */
+void usbi_cache_string(struct libusb_device *dev, uint8_t desc_index,
+	uint16_t langid, const unsigned char *data, int length)
+{
+	struct usbi_string_descriptor *string, *old;
+
+	if (length < 2 || data[1] != LIBUSB_DT_STRING || data[0] > length
+			|| data[0] < 2)
+		return;
+
+	string = malloc(offsetof(struct usbi_string_descriptor, data) + data[0]);
+	if (!string)
+		return;
+	string->desc_index = desc_index;
+	string->langid = langid;
+	memcpy(string->data, data, data[0]);
+
+	usbi_mutex_lock(&dev->lock);
+	for (old = dev->strings; old; old = old->next)
+		if (old->desc_index == desc_index && old->langid == langid)
+			break;
+	if (!old) {
+		string->next = dev->strings;
+		dev->strings = string;
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	/* read concurrently by someone else */
+	if (old)
+		free(string);
+}
+
+/* drop the strings kept by a device being destroyed */
+void usbi_clear_string_cache(struct libusb_device *dev)
+{
+	struct usbi_string_descriptor *string, *next;
+
+	for (string = dev->strings; string; string = next) {
+		next = string->next;
+		free(string);
+	}
+	dev->strings = NULL;
+}
+
+/* convert a string descriptor of len bytes to a C style ASCII string in
+ * data. returns the length of the string. */
+int usbi_string_to_ascii(const unsigned char *desc, int len,
+	unsigned char *data, int length)
+{
+	int si, di;
+
+	if (len < 2 || desc[1] != LIBUSB_DT_STRING || desc[0] > len)
+		return LIBUSB_ERROR_IO;
+
+	for (di = 0, si = 2; si < desc[0]; si += 2) {
+		if (di >= (length - 1))
+			break;
+
+		if ((desc[si] & 0x80) || (desc[si + 1])) /* non-ASCII */
+			data[di++] = '?';
+		else
+			data[di++] = desc[si];
+	}
+
+	data[di] = 0;
+	return di;
+}
+
+/* read a string descriptor, from the cache of the device if it was already */
+static int get_string_descriptor(libusb_device_handle *dev,
+	uint8_t desc_index, uint16_t langid, unsigned char *data, int length)
+{
+	int r;
+
+	r = usbi_get_cached_string(dev->dev, desc_index, langid, data, length);
+	if (r != LIBUSB_ERROR_NOT_FOUND)
+		return r;
+
+	r = libusb_get_string_descriptor(dev, desc_index, langid, data, length);
+	if (r >= 0)
+		usbi_cache_string(dev->dev, desc_index, langid, data, r);
+	return r;
 }
 
 /** \ingroup desc
@@ -685,6 +998,9 @@ void API_EXPORTED libusb_free_config_descriptor(
  * Wrapper around libusb_get_string_descriptor(). Uses the first language
  * supported by the device.
  *
+ * The strings are kept by the device once read, so that asking for a string
+ * again does not cost any request to the device.
+ *
  * \param dev a device handle
  * \param desc_index the index of the descriptor to retrieve
  * \param data output buffer for ASCII string descriptor
@@ -695,7 +1011,7 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	uint8_t desc_index, unsigned char *data, int length)
 {
 	unsigned char tbuf[255]; /* Some devices choke on size > 255 */
-	int r, si, di;
+	int r;
 	uint16_t langid;
 
 	/* Asking for the zero'th index is special - it returns a string
@@ -710,7 +1026,7 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	if (desc_index == 0)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	r = libusb_get_string_descriptor(dev, 0, 0, tbuf, sizeof(tbuf));
+	r = get_string_descriptor(dev, 0, 0, tbuf, sizeof(tbuf));
 	if (r < 0)
 		return r;
 
@@ -719,27 +1035,154 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 
 	langid = tbuf[2] | (tbuf[3] << 8);
 
-	r = libusb_get_string_descriptor(dev, desc_index, langid, tbuf,
-		sizeof(tbuf));
+	r = get_string_descriptor(dev, desc_index, langid, tbuf, sizeof(tbuf));
 	if (r < 0)
 		return r;
 
-	if (tbuf[1] != LIBUSB_DT_STRING)
-		return LIBUSB_ERROR_IO;
+	return usbi_string_to_ascii(tbuf, r, data, length);
+}
 
-	if (tbuf[0] > r)
-		return LIBUSB_ERROR_IO;
+/* the state of libusb_get_string_descriptor_ascii_async() */
+struct string_request {
+	libusb_device_handle *dev_handle;
+	uint8_t desc_index;
+	uint16_t langid;
+	int have_langid;
+	unsigned char *data;
+	int length;
+	libusb_string_cb_fn cb;
+	void *user_data;
+};
+
+static void string_request_done(struct string_request *req, int r)
+{
+	req->cb(req->dev_handle, req->desc_index, r, req->data, req->user_data);
+	free(req);
+}
 
-	for (di = 0, si = 2; si < tbuf[0]; si += 2) {
-		if (di >= (length - 1))
-			break;
+static void LIBUSB_CALL string_request_cb(struct libusb_transfer *transfer)
+{
+	struct string_request *req = transfer->user_data;
+	unsigned char *desc = libusb_control_transfer_get_data(transfer);
+	uint16_t langid = req->have_langid ? req->langid : 0;
+	uint8_t desc_index = req->have_langid ? req->desc_index : 0;
+	int r = usbi_control_transfer_result(transfer);
+
+	if (r >= 0)
+		usbi_cache_string(req->dev_handle->dev, desc_index, langid, desc, r);
+
+	if (r >= 0 && req->have_langid) {
+		r = usbi_string_to_ascii(desc, r, req->data, req->length);
+	} else if (r >= 0) {
+		if (r < 4) {
+			r = LIBUSB_ERROR_IO;
+		} else {
+			/* go on with the string in the first language */
+			req->langid = desc[2] | (desc[3] << 8);
+			req->have_langid = 1;
+			libusb_fill_control_setup(transfer->buffer, LIBUSB_ENDPOINT_IN,
+				LIBUSB_REQUEST_GET_DESCRIPTOR,
+				(uint16_t)((LIBUSB_DT_STRING << 8) | req->desc_index),
+				req->langid, 255);
+			r = libusb_submit_transfer(transfer);
+			if (r == 0)
+				return;
+		}
+	}
 
-		if ((tbuf[si] & 0x80) || (tbuf[si + 1])) /* non-ASCII */
-			data[di++] = '?';
-		else
-			data[di++] = tbuf[si];
+	libusb_free_transfer(transfer);
+	string_request_done(req, r);
+}
+
+/** \ingroup desc
+ * Retrieve a string descriptor in C style ASCII, asynchronously. This is
+ * the asynchronous version of libusb_get_string_descriptor_ascii(): the
+ * requests to the device are submitted as asynchronous transfers. cb is
+ * invoked with the outcome from within event handling once they complete.
+ *
+ * If the device had the string read before, as kept by the device, cb is
+ * invoked before this function returns.
+ *
+ * \param dev_handle a device handle
+ * \param desc_index the index of the descriptor to retrieve
+ * \param data output buffer for ASCII string descriptor, which must remain
+ * valid until cb is invoked
+ * \param length size of data buffer
+ * \param cb the function to invoke with the outcome: the length of the string
+ * in data, or a LIBUSB_ERROR code on failure
+ * \param user_data user data to pass to cb
+ * \param timeout timeout (in millseconds) of each request to the device. For
+ * an unlimited timeout, use value 0.
+ * \returns 0 on success, in which case cb is invoked exactly once
+ * \returns LIBUSB_ERROR_INVALID_PARAM if desc_index is 0
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if the request could not be submitted
+ */
+int API_EXPORTED libusb_get_string_descriptor_ascii_async(
+	libusb_device_handle *dev_handle, uint8_t desc_index,
+	unsigned char *data, int length, libusb_string_cb_fn cb,
+	void *user_data, unsigned int timeout)
+{
+	struct libusb_device *dev = dev_handle->dev;
+	struct libusb_transfer *transfer;
+	struct string_request *req;
+	unsigned char tbuf[255];
+	unsigned char *buffer;
+	uint16_t langid = 0;
+	int have_langid = 0;
+	int r;
+
+	if (desc_index == 0 || !cb)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = usbi_get_cached_string(dev, 0, 0, tbuf, sizeof(tbuf));
+	if (r >= 4) {
+		langid = tbuf[2] | (tbuf[3] << 8);
+		have_langid = 1;
+		r = usbi_get_cached_string(dev, desc_index, langid, tbuf,
+			sizeof(tbuf));
+		if (r >= 0) {
+			cb(dev_handle, desc_index,
+				usbi_string_to_ascii(tbuf, r, data, length), data, user_data);
+			return 0;
+		}
 	}
 
-	data[di] = 0;
-	return di;
+	req = malloc(sizeof(*req));
+	transfer = libusb_alloc_transfer(0);
+	buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + 255);
+	if (!req || !transfer || !buffer) {
+		free(req);
+		libusb_free_transfer(transfer);
+		free(buffer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	req->dev_handle = dev_handle;
+	req->desc_index = desc_index;
+	req->langid = langid;
+	req->have_langid = have_langid;
+	req->data = data;
+	req->length = length;
+	req->cb = cb;
+	req->user_data = user_data;
+
+	/* Some devices choke on size > 255 */
+	if (have_langid)
+		libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_DESCRIPTOR,
+			(uint16_t)((LIBUSB_DT_STRING << 8) | desc_index), langid, 255);
+	else
+		libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8, 0, 255);
+	libusb_fill_control_transfer(transfer, dev_handle, buffer,
+		string_request_cb, req, timeout);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		libusb_free_transfer(transfer);
+		free(req);
+	}
+	return r;
 }
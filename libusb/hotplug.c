@@ -0,0 +1,367 @@
+/*
+ * Hotplug functions for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusbi.h"
+
+/**
+ * @defgroup hotplug Device hotplug event notification
+ *
+ * This page documents libusbx's notifications of devices being plugged in
+ * and unplugged. They spare applications from calling
+ * libusb_get_device_list() periodically to find out about such changes.
+ *
+ * Hotplug notifications are only available on platforms where
+ * libusb_has_capability() reports \ref LIBUSB_CAP_HAS_HOTPLUG.
+ *
+ * \section hotplugcb Hotplug callbacks
+ *
+ * An application registers a callback for arrivals, departures or both with
+ * libusb_hotplug_register_callback(), optionally limited to devices of a
+ * given vendor ID, product ID or device class. The callback is invoked
+ * from within event handling, in the same way as transfer callbacks, so
+ * events have to be handled for notifications to be delivered, see
+ * \ref poll.
+ *
+ * With LIBUSB_HOTPLUG_ENUMERATE, the callback is also invoked for the
+ * matching devices already attached, before registration returns. This
+ * closes the window between listing the devices and registering for
+ * changes.
+ *
+ * A callback returns 1 to be deregistered, which it may also do by calling
+ * libusb_hotplug_deregister_callback() on itself.
+ *
+ * \section hotplugleft Departures
+ *
+ * Once a device has left, any handle of it only fails with
+ * LIBUSB_ERROR_NO_DEVICE, and should be closed by the application. The
+ * device itself remains valid as long as it is referenced.
+ */
+
+struct usbi_hotplug_callback {
+	libusb_hotplug_callback_handle handle;
+	libusb_hotplug_event events;
+	int vendor_id;
+	int product_id;
+	int dev_class;
+	libusb_hotplug_callback_fn cb;
+	void *user_data;
+
+	/* set for callbacks deregistered while notifications are delivered,
+	 * which are only freed afterwards */
+	int deregistered;
+
+	struct list_head list;
+};
+
+struct usbi_hotplug_message {
+	libusb_hotplug_event event;
+	struct libusb_device *device;
+	struct list_head list;
+};
+
+void usbi_hotplug_init(struct libusb_context *ctx)
+{
+	usbi_mutex_init(&ctx->hotplug_lock, NULL);
+	list_init(&ctx->hotplug_cbs);
+	list_init(&ctx->hotplug_msgs);
+	ctx->next_hotplug_cb_handle = 1;
+	ctx->hotplug_dispatching = 0;
+}
+
+void usbi_hotplug_exit(struct libusb_context *ctx)
+{
+	struct usbi_hotplug_callback *cb, *next_cb;
+	struct usbi_hotplug_message *msg, *next_msg;
+
+	list_for_each_entry_safe(cb, next_cb, &ctx->hotplug_cbs, list,
+			struct usbi_hotplug_callback) {
+		list_del(&cb->list);
+		free(cb);
+	}
+
+	list_for_each_entry_safe(msg, next_msg, &ctx->hotplug_msgs, list,
+			struct usbi_hotplug_message) {
+		list_del(&msg->list);
+		libusb_unref_device(msg->device);
+		free(msg);
+	}
+
+	usbi_mutex_destroy(&ctx->hotplug_lock);
+}
+
+static int hotplug_match(struct usbi_hotplug_callback *cb,
+	struct libusb_device *dev, libusb_hotplug_event event)
+{
+	const struct libusb_device_descriptor *desc = &dev->device_descriptor;
+
+	if (cb->deregistered || !(cb->events & event))
+		return 0;
+	if (cb->vendor_id != LIBUSB_HOTPLUG_MATCH_ANY
+			&& cb->vendor_id != desc->idVendor)
+		return 0;
+	if (cb->product_id != LIBUSB_HOTPLUG_MATCH_ANY
+			&& cb->product_id != desc->idProduct)
+		return 0;
+	if (cb->dev_class != LIBUSB_HOTPLUG_MATCH_ANY
+			&& cb->dev_class != desc->bDeviceClass)
+		return 0;
+	return 1;
+}
+
+/* queue a notification for delivery by event handling, if any callback is
+ * registered. the notification holds its own reference on the device. */
+void usbi_hotplug_notification(struct libusb_context *ctx,
+	struct libusb_device *dev, libusb_hotplug_event event)
+{
+	struct usbi_hotplug_message *msg;
+	unsigned char dummy = 1;
+
+	usbi_mutex_lock(&ctx->hotplug_lock);
+	if (list_empty(&ctx->hotplug_cbs)) {
+		usbi_mutex_unlock(&ctx->hotplug_lock);
+		return;
+	}
+
+	msg = malloc(sizeof(*msg));
+	if (!msg) {
+		usbi_mutex_unlock(&ctx->hotplug_lock);
+		usbi_err(ctx, "hotplug event of device %d.%d lost",
+			dev->bus_number, dev->device_address);
+		return;
+	}
+
+	msg->event = event;
+	msg->device = libusb_ref_device(dev);
+	list_add_tail(&msg->list, &ctx->hotplug_msgs);
+	usbi_mutex_unlock(&ctx->hotplug_lock);
+
+	/* one byte per notification, event handling drains the queue on the
+	 * first one */
+	if (usbi_write(ctx->hotplug_pipe[1], &dummy, sizeof(dummy)) <= 0)
+		usbi_warn(ctx, "hotplug pipe write error");
+}
+
+/* deliver the queued notifications. called by event handling when the
+ * hotplug pipe is readable. */
+void usbi_hotplug_dispatch(struct libusb_context *ctx)
+{
+	struct usbi_hotplug_callback *cb, *next_cb;
+	struct usbi_hotplug_message *msg;
+	unsigned char dummy;
+
+	if (usbi_read(ctx->hotplug_pipe[0], &dummy, sizeof(dummy)) <= 0)
+		usbi_warn(ctx, "hotplug pipe read error");
+
+	usbi_mutex_lock(&ctx->hotplug_lock);
+	ctx->hotplug_dispatching = 1;
+	while (!list_empty(&ctx->hotplug_msgs)) {
+		msg = list_entry(ctx->hotplug_msgs.next,
+			struct usbi_hotplug_message, list);
+		list_del(&msg->list);
+
+		/* callbacks are only freed below, and new ones are added at the
+		 * tail, so the list can be walked with the lock dropped */
+		list_for_each_entry(cb, &ctx->hotplug_cbs, list,
+				struct usbi_hotplug_callback) {
+			int r;
+
+			if (!hotplug_match(cb, msg->device, msg->event))
+				continue;
+
+			usbi_mutex_unlock(&ctx->hotplug_lock);
+			r = cb->cb(ctx, msg->device, msg->event, cb->user_data);
+			usbi_mutex_lock(&ctx->hotplug_lock);
+			if (r)
+				cb->deregistered = 1;
+		}
+
+		usbi_mutex_unlock(&ctx->hotplug_lock);
+		libusb_unref_device(msg->device);
+		free(msg);
+		usbi_mutex_lock(&ctx->hotplug_lock);
+	}
+
+	list_for_each_entry_safe(cb, next_cb, &ctx->hotplug_cbs, list,
+			struct usbi_hotplug_callback) {
+		if (cb->deregistered) {
+			list_del(&cb->list);
+			free(cb);
+		}
+	}
+	ctx->hotplug_dispatching = 0;
+	usbi_mutex_unlock(&ctx->hotplug_lock);
+}
+
+/* mark the devices present as attached, so that the departure of those not
+ * referenced elsewhere is still noticed, and report them to a callback being
+ * registered if enumerate is set. returns 1 if the callback asked to be
+ * deregistered. */
+static int hotplug_attach_devices(struct libusb_context *ctx,
+	struct usbi_hotplug_callback *cb, int enumerate)
+{
+	struct libusb_device **devs;
+	ssize_t len;
+	ssize_t i;
+	int r = 0;
+
+	len = libusb_get_device_list(ctx, &devs);
+	if (len < 0) {
+		usbi_warn(ctx, "could not enumerate devices: %s",
+			libusb_error_name((int)len));
+		return 0;
+	}
+
+	usbi_mutex_lock(&ctx->device_list_lock);
+	for (i = 0; i < len; i++)
+		usbi_connect_device(devs[i], 0);
+	usbi_mutex_unlock(&ctx->device_list_lock);
+
+	for (i = 0; i < len && enumerate && !r; i++) {
+		if (hotplug_match(cb, devs[i], LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED))
+			r = cb->cb(ctx, devs[i], LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+				cb->user_data);
+	}
+
+	libusb_free_device_list(devs, 1);
+	return r;
+}
+
+/** \ingroup hotplug
+ * Register a hotplug callback. The callback is invoked from within event
+ * handling for every matching device that arrives or leaves, until it is
+ * deregistered.
+ *
+ * \param ctx context to register this callback with, or NULL for the
+ * default context
+ * \param events the events to report, a bitwise OR of
+ * \ref libusb_hotplug_event values
+ * \param flags 0, or LIBUSB_HOTPLUG_ENUMERATE to also report the matching
+ * devices already attached before returning
+ * \param vendor_id the idVendor to match or LIBUSB_HOTPLUG_MATCH_ANY
+ * \param product_id the idProduct to match or LIBUSB_HOTPLUG_MATCH_ANY
+ * \param dev_class the bDeviceClass to match or LIBUSB_HOTPLUG_MATCH_ANY
+ * \param cb_fn the function to be invoked on a matching event
+ * \param user_data user data to pass to the callback function
+ * \param handle output location for the handle of the callback, to be given
+ * to libusb_hotplug_deregister_callback(). May be NULL.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if hotplug notifications are not
+ * supported on this platform
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a parameter is out of range
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
+	libusb_hotplug_event events, libusb_hotplug_flag flags,
+	int vendor_id, int product_id, int dev_class,
+	libusb_hotplug_callback_fn cb_fn, void *user_data,
+	libusb_hotplug_callback_handle *handle)
+{
+	struct usbi_hotplug_callback *cb;
+	struct usbi_hotplug_callback tmp;
+	libusb_hotplug_callback_handle cb_handle;
+	USBI_GET_CONTEXT(ctx);
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (!events || (events & ~(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+			| LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT))
+			|| (flags & ~LIBUSB_HOTPLUG_ENUMERATE) || !cb_fn)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if ((vendor_id != LIBUSB_HOTPLUG_MATCH_ANY && (vendor_id & ~0xffff))
+			|| (product_id != LIBUSB_HOTPLUG_MATCH_ANY && (product_id & ~0xffff))
+			|| (dev_class != LIBUSB_HOTPLUG_MATCH_ANY && (dev_class & ~0xff)))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	cb = malloc(sizeof(*cb));
+	if (!cb)
+		return LIBUSB_ERROR_NO_MEM;
+
+	cb->events = events;
+	cb->vendor_id = vendor_id;
+	cb->product_id = product_id;
+	cb->dev_class = dev_class;
+	cb->cb = cb_fn;
+	cb->user_data = user_data;
+	cb->deregistered = 0;
+
+	usbi_mutex_lock(&ctx->hotplug_lock);
+	cb_handle = cb->handle = ctx->next_hotplug_cb_handle++;
+	/* handles must remain positive */
+	if (ctx->next_hotplug_cb_handle < 0)
+		ctx->next_hotplug_cb_handle = 1;
+	list_add_tail(&cb->list, &ctx->hotplug_cbs);
+	/* cb must not be used once unlocked, as event handling may free it if
+	 * it gets deregistered */
+	tmp = *cb;
+	usbi_mutex_unlock(&ctx->hotplug_lock);
+
+	usbi_dbg("new hotplug callback %d", cb_handle);
+
+	if (handle)
+		*handle = cb_handle;
+
+	if (hotplug_attach_devices(ctx, &tmp, (flags & LIBUSB_HOTPLUG_ENUMERATE)
+			&& (events & LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)))
+		libusb_hotplug_deregister_callback(ctx, cb_handle);
+
+	return 0;
+}
+
+/** \ingroup hotplug
+ * Deregister a hotplug callback. The callback is no longer invoked once
+ * this function returns, except if notifications are being delivered by
+ * another thread at the time, in which case it may be invoked for the
+ * notification in progress.
+ *
+ * It is safe to call this function from within the callback itself.
+ *
+ * \param ctx the context this callback was registered with, or NULL for the
+ * default context
+ * \param handle the handle of the callback, as given by
+ * libusb_hotplug_register_callback()
+ */
+void API_EXPORTED libusb_hotplug_deregister_callback(libusb_context *ctx,
+	libusb_hotplug_callback_handle handle)
+{
+	struct usbi_hotplug_callback *cb;
+	USBI_GET_CONTEXT(ctx);
+
+	usbi_dbg("deregister hotplug callback %d", handle);
+
+	usbi_mutex_lock(&ctx->hotplug_lock);
+	list_for_each_entry(cb, &ctx->hotplug_cbs, list,
+			struct usbi_hotplug_callback) {
+		if (cb->handle != handle)
+			continue;
+
+		if (ctx->hotplug_dispatching) {
+			cb->deregistered = 1;
+		} else {
+			list_del(&cb->list);
+			free(cb);
+		}
+		break;
+	}
+	usbi_mutex_unlock(&ctx->hotplug_lock);
+}
@@ -34,6 +34,10 @@
 #include <sys/timerfd.h>
 #endif
 
+#ifdef USBI_EPOLL_AVAILABLE
+#include <sys/epoll.h>
+#endif
+
 #include "libusbi.h"
 
 /**
@@ -309,6 +313,12 @@ if (r == 0 && actual_length == sizeof(data)) {
  * transfer, fill and submit it, and when it returns with results you just
  * resubmit it for the next interrupt.
  *
+ * Applications that keep many transfers in flight, or that allocate and free
+ * them at a high rate, can allocate them from a transfer pool instead (see
+ * libusb_alloc_transfer_pool()). Pooled transfers are allocated once, and
+ * the backend keeps its per-submission state attached to them, so that
+ * reusing them does not involve the memory allocator.
+ *
  * \section asynccancel Cancellation
  *
  * Another advantage of using the asynchronous interface is that you have
@@ -492,6 +502,42 @@ if (r == 0 && actual_length == sizeof(data)) {
  *   "LIBUSB_TRANSFER_FREE_TRANSFER" causes libusbx to automatically free the
  *   transfer after the transfer callback returns.
  *
+ * \section asyncstats Transfer statistics
+ *
+ * libusbx keeps statistics on the transfers of each endpoint of a device
+ * handle: how many completed with each status, how many were short, how many
+ * bytes went through, and how long they took from submission to completion,
+ * as a histogram with power of two buckets. libusb_get_endpoint_stats()
+ * returns them for one endpoint, libusb_get_context_stats() adds them up for
+ * a whole context, including the handles that have since been closed.
+ *
+ * The counters only grow. Throughput and error rates are obtained by sampling
+ * them periodically and looking at the differences between samples.
+ *
+ * Recording the statistics costs one clock read per completion, and one per
+ * submission of a transfer without timeout. Building libusbx with
+ * --disable-transfer-stats removes them altogether, in which case
+ * libusb_has_capability() reports no
+ * \ref libusb_capability::LIBUSB_CAP_HAS_TRANSFER_STATS
+ * "LIBUSB_CAP_HAS_TRANSFER_STATS" and the functions above return
+ * LIBUSB_ERROR_NOT_SUPPORTED.
+ *
+ * \section asynctrace Tracing
+ *
+ * To correlate USB activity with the rest of a system, libusbx can report
+ * the points a transfer goes through, as listed in \ref libusb_trace_event:
+ * submission, reaping of its requests by the backend, completion and
+ * timeout. Each event carries the transfer, its endpoint, a length, a status
+ * and a monotonic timestamp.
+ *
+ * A callback set with libusb_set_trace_cb() receives the events as they
+ * happen. When libusbx is built with --enable-usdt, the same points also are
+ * USDT probes of the "libusb" provider, named "submit", "reap", "complete"
+ * and "timeout", with the transfer, endpoint, length and status as
+ * arguments. They can be used from SystemTap, bpftrace or DTrace without
+ * changing the application. With no callback set and no tracer attached,
+ * the cost of tracing is negligible.
+ *
  * \section asyncevent Event handling
  *
  * In accordance of the aim of being a lightweight library, libusbx does not
@@ -580,6 +626,59 @@ while (user_has_not_requested_exit)
  * sets of file descriptors or handling timeouts. libusb_handle_events() will
  * handle those details internally.
  *
+ * \section pollthread The event thread option
+ *
+ * Alternatively, libusbx can do all of the event handling by itself on an
+ * internal thread, started with libusb_start_event_thread(). Your
+ * application then does not need to poll anything, and must not use the
+ * file descriptors of the context. libusbx never starts the event thread by
+ * itself: as it changes the thread on which callbacks run, it is up to the
+ * application to request it.
+ *
+ * In the \ref libusb_event_thread_mode::LIBUSB_EVENT_THREAD_INLINE "inline"
+ * mode, transfer callbacks are invoked on the event thread, as soon as the
+ * transfers complete. Callbacks then run concurrently with the rest of your
+ * application, and must synchronize with it accordingly.
+ *
+ * In the \ref libusb_event_thread_mode::LIBUSB_EVENT_THREAD_QUEUED "queued"
+ * mode, the event thread only queues the completed transfers, and their
+ * callbacks are invoked on whichever of your threads calls
+ * libusb_handle_events() or one of its variants:
+\code
+// initialize libusbx
+libusb_start_event_thread(ctx, LIBUSB_EVENT_THREAD_QUEUED);
+// find and open device
+// maybe fire off some initial async I/O
+
+while (user_has_not_requested_exit)
+	libusb_handle_events(ctx); // waits for completions, invokes callbacks
+
+// clean up and exit
+\endcode
+ *
+ * When several of your threads call libusb_handle_events() in the queued
+ * mode, each of them dispatches the completions it finds, so the callbacks of
+ * different transfers may run concurrently on different threads. In either
+ * mode, the callback of a transfer never runs concurrently with itself, and
+ * the callbacks of a \ref stream "stream" are invoked one at a time.
+ * Applications that keep to the documented model of callbacks being
+ * invoked from within libusb_handle_events() on a single thread simply do
+ * not start the event thread.
+ *
+ * In both modes, libusb_handle_events() and its variants never do event
+ * handling themselves while the event thread runs: they return as soon as
+ * completions have been dispatched, or when the completion they were asked
+ * to wait for has happened. This is also what the synchronous I/O functions
+ * rely on, so that any number of threads can perform synchronous I/O without
+ * competing for the events lock.
+ *
+ * A single event thread polls all the devices of the context, which may not
+ * keep up when there are many busy ones. libusb_start_event_threads() starts
+ * several event threads instead, each of which gets its own share of the
+ * devices to poll and to handle the timeouts of, so that event handling
+ * spreads over as many cores, on the platforms that support it. Completions
+ * are delivered in the same way whatever the number of threads.
+ *
  * \section pollmain The more advanced option
  *
  * \note This functionality is currently only available on Unix-like platforms.
@@ -1044,20 +1143,46 @@ printf("completed!\n");
  * consideration that your event handling thread must apply is the one related
  * to libusb_event_handling_ok(): you must call this before every poll(), and
  * give up the events lock if instructed.
+ *
+ * Lastly, all of the above can be left to libusbx itself, through its
+ * \ref pollthread "internal event thread".
  */
 
 int usbi_io_init(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_init(&ctx->flying_transfers_lock, NULL);
+	usbi_mutex_init(&ctx->timeout_heap_lock, NULL);
 	usbi_mutex_init(&ctx->pollfds_lock, NULL);
 	usbi_mutex_init(&ctx->pollfd_modify_lock, NULL);
 	usbi_mutex_init_recursive(&ctx->events_lock, NULL);
 	usbi_mutex_init(&ctx->event_waiters_lock, NULL);
 	usbi_cond_init(&ctx->event_waiters_cond, NULL);
-	list_init(&ctx->flying_transfers);
+	ctx->timeout_heap.nodes = NULL;
+	ctx->timeout_heap.len = 0;
+	ctx->timeout_heap.size = 0;
 	list_init(&ctx->pollfds);
+	ctx->pollfds_cache = NULL;
+	ctx->pollfds_cache_handles = NULL;
+	ctx->pollfds_cache_cnt = 0;
+	ctx->pollfds_modified = 1;
+	ctx->num_event_partitions = 1;
+	ctx->event_partitions = NULL;
+	ctx->next_event_partition = 0;
+
+#ifdef USBI_EPOLL_AVAILABLE
+	/* the epoll fd must exist before any fd gets added to the poll set */
+	ctx->epoll_events = NULL;
+	ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->epoll_fd >= 0) {
+		usbi_dbg("using epoll for event handling");
+		ctx->epoll_pollfd.fd = ctx->epoll_fd;
+		ctx->epoll_pollfd.events = POLLIN;
+	} else {
+		usbi_dbg("epoll not available (code %d error %d)", ctx->epoll_fd, errno);
+		ctx->epoll_fd = -1;
+	}
+#endif
 
 	/* FIXME should use an eventfd on kernels that support it */
 	r = usbi_pipe(ctx->ctrl_pipe);
@@ -1087,13 +1212,38 @@ int usbi_io_init(struct libusb_context *ctx)
 	}
 #endif
 
+	r = usbi_pipe(ctx->hotplug_pipe);
+	if (r < 0) {
+		r = LIBUSB_ERROR_OTHER;
+		goto err_remove_fds;
+	}
+
+	r = usbi_add_pollfd(ctx, ctx->hotplug_pipe[0], POLLIN);
+	if (r < 0) {
+		usbi_close(ctx->hotplug_pipe[0]);
+		usbi_close(ctx->hotplug_pipe[1]);
+		goto err_remove_fds;
+	}
+
 	return 0;
 
+err_remove_fds:
+#ifdef USBI_TIMERFD_AVAILABLE
+	if (usbi_using_timerfd(ctx)) {
+		usbi_remove_pollfd(ctx, ctx->timerfd);
+		close(ctx->timerfd);
+	}
+#endif
+	usbi_remove_pollfd(ctx, ctx->ctrl_pipe[0]);
 err_close_pipe:
 	usbi_close(ctx->ctrl_pipe[0]);
 	usbi_close(ctx->ctrl_pipe[1]);
 err:
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		close(ctx->epoll_fd);
+#endif
+	usbi_mutex_destroy(&ctx->timeout_heap_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
 	usbi_mutex_destroy(&ctx->pollfd_modify_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
@@ -1107,13 +1257,24 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_remove_pollfd(ctx, ctx->ctrl_pipe[0]);
 	usbi_close(ctx->ctrl_pipe[0]);
 	usbi_close(ctx->ctrl_pipe[1]);
+	usbi_remove_pollfd(ctx, ctx->hotplug_pipe[0]);
+	usbi_close(ctx->hotplug_pipe[0]);
+	usbi_close(ctx->hotplug_pipe[1]);
 #ifdef USBI_TIMERFD_AVAILABLE
 	if (usbi_using_timerfd(ctx)) {
 		usbi_remove_pollfd(ctx, ctx->timerfd);
 		close(ctx->timerfd);
 	}
 #endif
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		close(ctx->epoll_fd);
+	free(ctx->epoll_events);
+#endif
+	free(ctx->pollfds_cache);
+	free(ctx->pollfds_cache_handles);
+	free(ctx->timeout_heap.nodes);
+	usbi_mutex_destroy(&ctx->timeout_heap_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
 	usbi_mutex_destroy(&ctx->pollfd_modify_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
@@ -1121,22 +1282,32 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_cond_destroy(&ctx->event_waiters_cond);
 }
 
-static int calculate_timeout(struct usbi_transfer *transfer)
+/* compute the absolute timeout of a transfer. now caches the current time
+ * across the transfers of a batch: the clock is only read the first time it
+ * is needed, as flagged by a negative now->tv_nsec. */
+static int calculate_timeout(struct usbi_transfer *transfer,
+	struct timespec *now)
 {
 	int r;
 	struct timespec current_time;
 	unsigned int timeout =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout;
 
-	if (!timeout)
+	if (!timeout) {
+		timerclear(&transfer->timeout.tv);
 		return 0;
+	}
 
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &current_time);
-	if (r < 0) {
-		usbi_err(ITRANSFER_CTX(transfer),
-			"failed to read monotonic clock, errno=%d", errno);
-		return r;
+	if (now->tv_nsec < 0) {
+		r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, now);
+		if (r < 0) {
+			usbi_err(ITRANSFER_CTX(transfer),
+				"failed to read monotonic clock, errno=%d", errno);
+			now->tv_nsec = -1;
+			return r;
+		}
 	}
+	current_time = *now;
 
 	current_time.tv_sec += timeout / 1000;
 	current_time.tv_nsec += (timeout % 1000) * 1000000;
@@ -1146,76 +1317,411 @@ static int calculate_timeout(struct usbi_transfer *transfer)
 		current_time.tv_sec++;
 	}
 
-	TIMESPEC_TO_TIMEVAL(&transfer->timeout, &current_time);
+	TIMESPEC_TO_TIMEVAL(&transfer->timeout.tv, &current_time);
 	return 0;
 }
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * returns 1 if the transfer has a timeout and it is the timeout next to
- * expire */
-static int add_to_flying_list(struct usbi_transfer *transfer)
+/* timeout heap management. a heap is an array based binary min-heap of
+ * timeout nodes, where each node records its own position so that it can be
+ * removed in O(log n). the caller is responsible for locking. */
+
+#define TIMEOUT_HEAP_SIZE_STEP	64
+
+#define timeout_node_before(a, b) timercmp(&(a)->tv, &(b)->tv, <)
+
+static void timeout_heap_set(struct usbi_timeout_heap *heap, int idx,
+	struct usbi_timeout_node *node)
 {
-	struct usbi_transfer *cur;
-	struct timeval *timeout = &transfer->timeout;
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	int r = 0;
-	int first = 1;
+	heap->nodes[idx] = node;
+	node->heap_idx = idx;
+}
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+static void timeout_heap_sift_up(struct usbi_timeout_heap *heap, int idx)
+{
+	struct usbi_timeout_node *node = heap->nodes[idx];
 
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&transfer->list, &ctx->flying_transfers);
-		goto out;
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
+		if (!timeout_node_before(node, heap->nodes[parent]))
+			break;
+		timeout_heap_set(heap, idx, heap->nodes[parent]);
+		idx = parent;
 	}
+	timeout_heap_set(heap, idx, node);
+}
 
-	/* if we have infinite timeout, append to end of list */
-	if (!timerisset(timeout)) {
-		list_add_tail(&transfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
+static void timeout_heap_sift_down(struct usbi_timeout_heap *heap, int idx)
+{
+	struct usbi_timeout_node *node = heap->nodes[idx];
+
+	while (1) {
+		int child = (2 * idx) + 1;
+		if (child >= heap->len)
+			break;
+		if (child + 1 < heap->len &&
+				timeout_node_before(heap->nodes[child + 1], heap->nodes[child]))
+			child++;
+		if (!timeout_node_before(heap->nodes[child], node))
+			break;
+		timeout_heap_set(heap, idx, heap->nodes[child]);
+		idx = child;
+	}
+	timeout_heap_set(heap, idx, node);
+}
+
+static int timeout_heap_insert(struct usbi_timeout_heap *heap,
+	struct usbi_timeout_node *node)
+{
+	if (heap->len == heap->size) {
+		int size = heap->size + TIMEOUT_HEAP_SIZE_STEP;
+		struct usbi_timeout_node **nodes = realloc(heap->nodes,
+			sizeof(*nodes) * size);
+		if (!nodes)
+			return LIBUSB_ERROR_NO_MEM;
+		heap->nodes = nodes;
+		heap->size = size;
+	}
+
+	heap->nodes[heap->len] = node;
+	timeout_heap_sift_up(heap, heap->len++);
+	return 0;
+}
+
+/* remove a node from the heap, if it is part of it. returns 1 if the node was
+ * at the top of the heap, 0 otherwise. */
+static int timeout_heap_remove(struct usbi_timeout_heap *heap,
+	struct usbi_timeout_node *node)
+{
+	int idx = node->heap_idx;
+	struct usbi_timeout_node *last;
+
+	if (idx < 0)
+		return 0;
+
+	node->heap_idx = -1;
+	last = heap->nodes[--heap->len];
+	if (last != node) {
+		timeout_heap_set(heap, idx, last);
+		if (idx > 0 && timeout_node_before(last, heap->nodes[(idx - 1) / 2]))
+			timeout_heap_sift_up(heap, idx);
+		else
+			timeout_heap_sift_down(heap, idx);
+	}
+	return (idx == 0);
+}
+
+#define timeout_heap_first(heap) \
+	((heap)->len ? (heap)->nodes[0] : NULL)
+
+#define timeout_node_to_transfer(node) \
+	container_of(node, struct usbi_transfer, timeout)
+#define timeout_node_to_handle(node) \
+	container_of(node, struct libusb_device_handle, next_timeout)
+
+static int arm_timerfd_for_next_timeout(struct libusb_context *ctx);
+static void wake_event_partition(struct usbi_event_partition *part);
+
+/* the event partition serving a device handle, or NULL if it is served by
+ * the main event thread. must be called with the pollfds_lock or the events
+ * lock held, which set_event_partitions() holds while it changes them. */
+static struct usbi_event_partition *handle_event_partition(
+	struct libusb_device_handle *handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	int p = handle->event_partition;
+
+	if (p <= 0 || p >= ctx->num_event_partitions)
+		return NULL;
+	return &ctx->event_partitions[p - 1];
+}
+
+/* reposition a device handle in the timeout heap of an event partition, or
+ * in that of the context if part is NULL. first is the top of the handle's
+ * own heap, if any. whoever waits on the heap is told about it when its next
+ * timeout changed as a result: the timerfd gets rearmed, or the partition
+ * thread woken up.
+ * returns 0 on success, or a LIBUSB_ERROR code on failure. */
+static int update_heap_timeout(struct libusb_context *ctx,
+	struct usbi_event_partition *part, struct libusb_device_handle *handle,
+	struct usbi_timeout_node *first)
+{
+	struct usbi_timeout_heap *heap =
+		part ? &part->timeout_heap : &ctx->timeout_heap;
+	usbi_mutex_t *lock =
+		part ? &part->timeout_heap_lock : &ctx->timeout_heap_lock;
+	int was_first;
+	int r = 0;
+
+	usbi_mutex_lock(lock);
+	was_first = timeout_heap_remove(heap, &handle->next_timeout);
+	if (first) {
+		handle->next_timeout.tv = first->tv;
+		r = timeout_heap_insert(heap, &handle->next_timeout);
+	}
+	if (r == 0 && (was_first || handle->next_timeout.heap_idx == 0)) {
+		if (part)
+			wake_event_partition(part);
+		else if (usbi_using_timerfd(ctx))
+			r = arm_timerfd_for_next_timeout(ctx);
+	}
+	usbi_mutex_unlock(lock);
+	return r < 0 ? r : 0;
+}
+
+/* reposition a device handle in the timeout heap it belongs to, after the
+ * top of its own timeout heap has changed. the handle moves over to another
+ * heap if the event threads were started or stopped since the last update.
+ * returns 0 on success, or a LIBUSB_ERROR code on failure.
+ * must be called with the handle's flying_transfers_lock held. */
+static int update_handle_timeout(struct libusb_device_handle *handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct usbi_timeout_node *first = timeout_heap_first(&handle->timeout_heap);
+	struct usbi_event_partition *part;
+
+	/* the partition cannot be freed before set_event_partitions() has moved
+	 * the handle off it, which takes the flying_transfers_lock */
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	part = handle_event_partition(handle);
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+
+	if (handle->timeout_partition != part) {
+		update_heap_timeout(ctx, handle->timeout_partition, handle, NULL);
+		handle->timeout_partition = part;
 	}
+	return update_heap_timeout(ctx, part, handle, first);
+}
 
-	/* otherwise, find appropriate place in list */
-	list_for_each_entry(cur, &ctx->flying_transfers, list, struct usbi_transfer) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timeval *cur_tv = &cur->timeout;
+/* set up the in-flight transfer tracking of a newly opened device handle */
+void usbi_init_flying_list(struct libusb_device_handle *handle)
+{
+	usbi_mutex_init(&handle->flying_transfers_lock, NULL);
+	list_init(&handle->flying_transfers);
+	handle->timeout_heap.nodes = NULL;
+	handle->timeout_heap.len = 0;
+	handle->timeout_heap.size = 0;
+	handle->next_timeout.heap_idx = -1;
+	handle->timeout_partition = NULL;
+	handle->cancel_walks = 0;
+	usbi_cond_init(&handle->cancel_walks_cond, NULL);
+#ifdef ENABLE_TRANSFER_STATS
+	memset(handle->stats, 0, sizeof(handle->stats));
+#endif
+}
+
+/* release the in-flight transfer tracking of a device handle being closed.
+ * all of its transfers must have been removed beforehand. */
+void usbi_exit_flying_list(struct libusb_device_handle *handle)
+{
+	free(handle->timeout_heap.nodes);
+	usbi_cond_destroy(&handle->cancel_walks_cond);
+	usbi_mutex_destroy(&handle->flying_transfers_lock);
+}
+
+/* add a run of transfers, all of the same device handle, to the active
+ * transfers list of the handle, and to its timeout heap for those that have a
+ * timeout. the handle's timeout is updated at most once for the whole run. */
+static int add_to_flying_list(struct libusb_transfer **transfers, int count)
+{
+	struct libusb_device_handle *handle = transfers[0]->dev_handle;
+	struct usbi_timeout_node *first;
+	int r = 0;
+	int i;
+
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	first = timeout_heap_first(&handle->timeout_heap);
 
-		if (!timerisset(cur_tv) || (cur_tv->tv_sec > timeout->tv_sec) ||
-				(cur_tv->tv_sec == timeout->tv_sec &&
-					cur_tv->tv_usec > timeout->tv_usec)) {
-			list_add_tail(&transfer->list, &cur->list);
-			goto out;
+	for (i = 0; i < count; i++) {
+		struct usbi_transfer *transfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		/* transfers of infinite timeout are only tracked through the list */
+		transfer->timeout.heap_idx = -1;
+		if (timerisset(&transfer->timeout.tv)) {
+			r = timeout_heap_insert(&handle->timeout_heap, &transfer->timeout);
+			if (r < 0)
+				break;
 		}
-		first = 0;
+		list_add_tail(&transfer->list, &handle->flying_transfers);
 	}
-	/* first is 0 at this stage (list not empty) */
 
-	/* otherwise we need to be inserted at the end */
-	list_add_tail(&transfer->list, &ctx->flying_transfers);
-out:
-#ifdef USBI_TIMERFD_AVAILABLE
-	if (first && usbi_using_timerfd(ctx) && timerisset(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timerfd with this transfer's timeout */
-		const struct itimerspec it = { {0, 0},
-			{ timeout->tv_sec, timeout->tv_usec * 1000 } };
-		usbi_dbg("arm timerfd for timeout in %dms (first in line)",
-			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-		r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-		if (r < 0) {
-			usbi_warn(ctx, "failed to arm first timerfd (errno %d)", errno);
-			r = LIBUSB_ERROR_OTHER;
+	/* if one of these transfers has the lowest timeout of all the handle's
+	 * active transfers, it may also be the next one to time out overall */
+	if (r == 0 && timeout_heap_first(&handle->timeout_heap) != first)
+		r = update_handle_timeout(handle);
+
+	if (r < 0) {
+		while (i-- > 0) {
+			struct usbi_transfer *transfer =
+				LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+			list_del(&transfer->list);
+			timeout_heap_remove(&handle->timeout_heap, &transfer->timeout);
 		}
+		update_handle_timeout(handle);
 	}
-#else
-	UNUSED(first);
-#endif
 
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
+	return r;
+}
+
+/* finish off the transfers of a run added by add_to_flying_list() that have
+ * been accepted by the backend: the timeouts that the backend takes care of
+ * itself stop being tracked. */
+static int finish_flying_list(struct libusb_transfer **transfers,
+	int submitted)
+{
+	struct libusb_device_handle *handle = transfers[0]->dev_handle;
+	struct usbi_timeout_node *first;
+	int os_timeouts = 0;
+	int r = 0;
+	int i;
+
+	for (i = 0; i < submitted; i++)
+		os_timeouts |= (LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i])->flags
+			& USBI_TRANSFER_OS_HANDLES_TIMEOUT);
+	if (!os_timeouts)
+		return 0;
+
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	first = timeout_heap_first(&handle->timeout_heap);
+
+	for (i = 0; i < submitted; i++) {
+		struct usbi_transfer *transfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		if (transfer->flags & USBI_TRANSFER_OS_HANDLES_TIMEOUT)
+			timeout_heap_remove(&handle->timeout_heap, &transfer->timeout);
+	}
+
+	if (timeout_heap_first(&handle->timeout_heap) != first)
+		r = update_handle_timeout(handle);
+
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
+	return r;
+}
+
+/* take transfers added by add_to_flying_list() that the backend did not
+ * accept off the flying list again. a libusb_cancel_endpoint_transfers()
+ * call may have collected them, so this waits until it is done with them,
+ * and must be called without holding the lock of any transfer. */
+static int abort_flying_list(struct libusb_transfer **transfers, int count)
+{
+	struct libusb_device_handle *handle = transfers[0]->dev_handle;
+	struct usbi_timeout_node *first;
+	int r = 0;
+	int i;
+
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	usbi_wait_for_cancel_walks(handle);
+	first = timeout_heap_first(&handle->timeout_heap);
+
+	for (i = 0; i < count; i++) {
+		struct usbi_transfer *transfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		list_del(&transfer->list);
+		timeout_heap_remove(&handle->timeout_heap, &transfer->timeout);
+	}
+
+	if (timeout_heap_first(&handle->timeout_heap) != first)
+		r = update_handle_timeout(handle);
+
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
+	return r;
+}
+
+/* remove a transfer from the active transfers list and from the timeout heap
+ * of its device handle, rearming the timerfd if required.
+ * must be called with the handle's flying_transfers_lock held. */
+int usbi_remove_from_flying_list(struct usbi_transfer *transfer)
+{
+	struct libusb_device_handle *handle =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->dev_handle;
+
+	list_del(&transfer->list);
+	if (timeout_heap_remove(&handle->timeout_heap, &transfer->timeout))
+		return update_handle_timeout(handle);
+	return 0;
+}
+
+/* wait until no libusb_cancel_endpoint_transfers() call is cancelling
+ * transfers of the handle, which may still be using the transfers it found
+ * in the flying list. must be called with the handle's flying_transfers_lock
+ * held, and without holding the lock of any of its transfers. */
+void usbi_wait_for_cancel_walks(struct libusb_device_handle *handle)
+{
+	while (handle->cancel_walks)
+		usbi_cond_wait(&handle->cancel_walks_cond,
+			&handle->flying_transfers_lock);
+}
+
+/* Returns 1 if any device handle of the context has transfers in flight, or
+ * if completions are waiting to be dispatched, in other words if event
+ * handling may be needed to make progress. */
+int usbi_transfers_pending(struct libusb_context *ctx)
+{
+	struct libusb_device_handle *handle;
+	int r = (ctx->completed_transfers != NULL);
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+		if (r)
+			break;
+		usbi_mutex_lock(&handle->flying_transfers_lock);
+		r = !list_empty(&handle->flying_transfers);
+		usbi_mutex_unlock(&handle->flying_transfers_lock);
+	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
 	return r;
 }
 
+/* Give a pooled transfer back to its pool. The public part of the transfer
+ * is reset so that it is handed out again in the same state as a freshly
+ * allocated one, while the OS private area is left untouched. A transfer
+ * freed twice is only put back once, so that it is not handed out to two
+ * owners. */
+static void release_pool_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer_pool *pool = itransfer->pool;
+
+	usbi_mutex_lock(&pool->lock);
+	if (itransfer->in_pool) {
+		usbi_mutex_unlock(&pool->lock);
+		usbi_err(pool->ctx, "pooled transfer %p freed twice",
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer));
+		return;
+	}
+
+	memset(USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer), 0,
+		sizeof(struct libusb_transfer)
+		+ sizeof(struct libusb_iso_packet_descriptor) * pool->iso_packets);
+	itransfer->transferred = 0;
+	itransfer->flags = 0;
+	itransfer->iov = NULL;
+	itransfer->num_iov = 0;
+
+	itransfer->in_pool = 1;
+	pool->free_transfers[pool->num_free++] = itransfer;
+	usbi_mutex_unlock(&pool->lock);
+}
+
+static size_t transfer_alloc_size(int iso_packets)
+{
+	size_t os_alloc_size = usbi_backend->transfer_priv_size
+		+ (usbi_backend->add_iso_packet_size * iso_packets);
+	return sizeof(struct usbi_transfer)
+		+ sizeof(struct libusb_transfer)
+		+ (sizeof(struct libusb_iso_packet_descriptor) * iso_packets)
+		+ os_alloc_size;
+}
+
+static void init_transfer(struct usbi_transfer *itransfer, int iso_packets)
+{
+	itransfer->num_iso_packets = iso_packets;
+	itransfer->timeout.heap_idx = -1;
+	usbi_mutex_init(&itransfer->lock, NULL);
+}
+
 /** \ingroup asyncio
  * Allocate a libusbx transfer with a specified number of isochronous packet
  * descriptors. The returned transfer is pre-initialized for you. When the new
@@ -1243,24 +1749,19 @@ DEFAULT_VISIBILITY
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 	int iso_packets)
 {
-	size_t os_alloc_size = usbi_backend->transfer_priv_size
-		+ (usbi_backend->add_iso_packet_size * iso_packets);
-	size_t alloc_size = sizeof(struct usbi_transfer)
-		+ sizeof(struct libusb_transfer)
-		+ (sizeof(struct libusb_iso_packet_descriptor) * iso_packets)
-		+ os_alloc_size;
-	struct usbi_transfer *itransfer = calloc(1, alloc_size);
+	struct usbi_transfer *itransfer =
+		calloc(1, transfer_alloc_size(iso_packets));
 	if (!itransfer)
 		return NULL;
 
-	itransfer->num_iso_packets = iso_packets;
-	usbi_mutex_init(&itransfer->lock, NULL);
+	init_transfer(itransfer, iso_packets);
 	return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 }
 
 /** \ingroup asyncio
  * Free a transfer structure. This should be called for all transfers
- * allocated with libusb_alloc_transfer().
+ * allocated with libusb_alloc_transfer(). Transfers taken from a pool with
+ * libusb_alloc_pool_transfer() are returned to their pool instead.
  *
  * If the \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
  * "LIBUSB_TRANSFER_FREE_BUFFER" flag is set and the transfer buffer is
@@ -1285,114 +1786,534 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 		free(transfer->buffer);
 
 	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (itransfer->pool) {
+		release_pool_transfer(itransfer);
+		return;
+	}
+
+	if (usbi_backend->destroy_transfer_priv)
+		usbi_backend->destroy_transfer_priv(itransfer);
 	usbi_mutex_destroy(&itransfer->lock);
 	free(itransfer);
 }
 
-#ifdef USBI_TIMERFD_AVAILABLE
-static int disarm_timerfd(struct libusb_context *ctx)
+/** \ingroup asyncio
+ * Set the bulk stream id of a transfer. The transfer must be of type
+ * \ref libusb_transfer_type::LIBUSB_TRANSFER_TYPE_BULK_STREAM
+ * "LIBUSB_TRANSFER_TYPE_BULK_STREAM" for the stream id to be used, and the
+ * stream must have been allocated with libusb_alloc_streams().
+ *
+ * libusb_fill_bulk_stream_transfer() calls this for you.
+ *
+ * \param transfer the transfer to set the stream id for
+ * \param stream_id the stream id to set
+ */
+void API_EXPORTED libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id)
 {
-	const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
-	int r;
+	LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->stream_id = stream_id;
+}
 
-	usbi_dbg("");
-	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
-	if (r < 0)
-		return LIBUSB_ERROR_OTHER;
-	else
-		return 0;
+/** \ingroup asyncio
+ * Get the bulk stream id of a transfer.
+ *
+ * \param transfer the transfer to get the stream id of
+ * \returns the stream id of the transfer
+ */
+uint32_t API_EXPORTED libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer)
+{
+	return LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->stream_id;
 }
 
-/* iterates through the flying transfers, and rearms the timerfd based on the
- * next upcoming timeout.
- * must be called with flying_list locked.
- * returns 0 if there was no timeout to arm, 1 if the next timeout was armed,
- * or a LIBUSB_ERROR code on failure.
+/** \ingroup asyncio
+ * Allocate a pool of transfers for repeated use with the same kind of I/O.
+ *
+ * All of the pool's transfers are allocated up front, each with room for
+ * iso_packets isochronous packet descriptors. Transfers are taken from the
+ * pool with libusb_alloc_pool_transfer() and given back with
+ * libusb_free_transfer() (or through the
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER" flag), exactly as if they had been
+ * allocated with libusb_alloc_transfer().
+ *
+ * Unlike regular transfers, pooled transfers keep the backend's private
+ * per-submission state between uses. max_length is a hint of the largest
+ * transfer length that will be submitted; where the backend supports it,
+ * that state is sized for it straight away so that submitting a pooled
+ * transfer does not allocate memory at all.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param count number of transfers in the pool
+ * \param iso_packets number of isochronous packet descriptors to allocate
+ * for each transfer
+ * \param max_length largest buffer length expected to be submitted, or 0
+ * if unknown
+ * \returns a newly allocated transfer pool, or NULL on error
  */
-static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+DEFAULT_VISIBILITY
+struct libusb_transfer_pool * LIBUSB_CALL libusb_alloc_transfer_pool(
+	libusb_context *ctx, int count, int iso_packets, int max_length)
 {
-	struct usbi_transfer *transfer;
+	struct libusb_transfer_pool *pool;
+	size_t align = 2 * sizeof(void *);
+	int i;
+	int r;
 
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
+	USBI_GET_CONTEXT(ctx);
+	if (count <= 0 || iso_packets < 0 || max_length < 0)
+		return NULL;
 
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!timerisset(cur_tv))
-			goto disarm;
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
 
-		/* act on first transfer that is not already cancelled */
-		if (!(transfer->flags & USBI_TRANSFER_TIMED_OUT)) {
-			int r;
-			const struct itimerspec it = { {0, 0},
-				{ cur_tv->tv_sec, cur_tv->tv_usec * 1000 } };
-			usbi_dbg("next timeout originally %dms", USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-			r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-			if (r < 0)
-				return LIBUSB_ERROR_OTHER;
-			return 1;
+	pool->ctx = ctx;
+	pool->count = count;
+	pool->iso_packets = iso_packets;
+	pool->transfer_size = (transfer_alloc_size(iso_packets) + align - 1)
+		& ~(align - 1);
+	pool->transfers = calloc(count, pool->transfer_size);
+	pool->free_transfers = malloc(count * sizeof(*pool->free_transfers));
+	if (!pool->transfers || !pool->free_transfers) {
+		free(pool->transfers);
+		free(pool->free_transfers);
+		free(pool);
+		return NULL;
+	}
+	usbi_mutex_init(&pool->lock, NULL);
+
+	/* fill the free stack so that the first transfer is handed out first */
+	for (i = 0; i < count; i++) {
+		struct usbi_transfer *itransfer = (struct usbi_transfer *)
+			(pool->transfers + i * pool->transfer_size);
+
+		init_transfer(itransfer, iso_packets);
+		itransfer->pool = pool;
+		itransfer->in_pool = 1;
+		pool->free_transfers[count - 1 - i] = itransfer;
+		pool->num_free++;
+
+		if (usbi_backend->prealloc_transfer_priv) {
+			r = usbi_backend->prealloc_transfer_priv(itransfer, max_length);
+			if (r < 0) {
+				usbi_err(ctx, "failed to preallocate transfer %d: %s", i,
+					libusb_error_name(r));
+				libusb_free_transfer_pool(pool);
+				return NULL;
+			}
 		}
 	}
 
-disarm:
-	return disarm_timerfd(ctx);
-}
-#else
-static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
-{
-	(void)ctx;
-	return 0;
+	usbi_dbg("pool of %d transfers, %d iso packets, max length %d", count,
+		iso_packets, max_length);
+	return pool;
 }
-#endif
 
 /** \ingroup asyncio
- * Submit a transfer. This function will fire off the USB transfer and then
- * return immediately.
+ * Take a transfer from a transfer pool. The returned transfer is
+ * pre-initialized like one returned by libusb_alloc_transfer(), and should
+ * be returned to the pool with libusb_free_transfer().
  *
- * \param transfer the transfer to submit
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
- * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
- * by the operating system.
- * \returns another LIBUSB_ERROR code on other failure
+ * This function does not allocate memory and is safe to call from any
+ * thread, including from transfer callbacks.
+ *
+ * \param pool the pool to take the transfer from
+ * \returns a transfer, or NULL if all of the pool's transfers are in use
  */
-int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+DEFAULT_VISIBILITY
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_pool_transfer(
+	struct libusb_transfer_pool *pool)
 {
-	struct libusb_context *ctx = TRANSFER_CTX(transfer);
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int r;
-	int updated_fds;
+	struct usbi_transfer *itransfer = NULL;
 
-	usbi_mutex_lock(&itransfer->lock);
-	itransfer->transferred = 0;
+	usbi_mutex_lock(&pool->lock);
+	if (pool->num_free > 0) {
+		itransfer = pool->free_transfers[--pool->num_free];
+		itransfer->in_pool = 0;
+	}
+	usbi_mutex_unlock(&pool->lock);
+
+	if (!itransfer)
+		return NULL;
+	return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+}
+
+/** \ingroup asyncio
+ * Free a transfer pool and all of its transfers.
+ *
+ * All transfers taken from the pool should have been returned with
+ * libusb_free_transfer() beforehand. It is not legal to free a pool while
+ * any of its transfers is active.
+ *
+ * It is legal to call this function with a NULL pool. In this case,
+ * the function will simply return safely.
+ *
+ * \param pool the pool to free
+ */
+void API_EXPORTED libusb_free_transfer_pool(struct libusb_transfer_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	if (pool->num_free != pool->count)
+		usbi_warn(pool->ctx, "freeing pool with %d transfers still in use",
+			pool->count - pool->num_free);
+
+	for (i = 0; i < pool->count; i++) {
+		struct usbi_transfer *itransfer = (struct usbi_transfer *)
+			(pool->transfers + i * pool->transfer_size);
+
+		if (usbi_backend->destroy_transfer_priv)
+			usbi_backend->destroy_transfer_priv(itransfer);
+		usbi_mutex_destroy(&itransfer->lock);
+	}
+
+	usbi_mutex_destroy(&pool->lock);
+	free(pool->free_transfers);
+	free(pool->transfers);
+	free(pool);
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static int disarm_timerfd(struct libusb_context *ctx)
+{
+	const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
+	int r;
+
+	usbi_dbg("");
+	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+	else
+		return 0;
+}
+
+/* rearms the timerfd based on the next upcoming timeout.
+ * must be called with timeout_heap_lock held.
+ * returns 0 if there was no timeout to arm, 1 if the next timeout was armed,
+ * or a LIBUSB_ERROR code on failure.
+ */
+static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+{
+	struct usbi_timeout_node *node = timeout_heap_first(&ctx->timeout_heap);
+
+	if (node) {
+		struct timeval *cur_tv = &node->tv;
+		int r;
+		const struct itimerspec it = { {0, 0},
+			{ cur_tv->tv_sec, cur_tv->tv_usec * 1000 } };
+		usbi_dbg("next timeout for device %d.%d",
+			timeout_node_to_handle(node)->dev->bus_number,
+			timeout_node_to_handle(node)->dev->device_address);
+		r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
+		if (r < 0)
+			return LIBUSB_ERROR_OTHER;
+		return 1;
+	}
+
+	return disarm_timerfd(ctx);
+}
+#else
+static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+{
+	(void)ctx;
+	return 0;
+}
+#endif
+
+/** \ingroup asyncio
+ * Populate the required \ref libusb_transfer fields for a bulk transfer
+ * whose data is split across several buffers.
+ *
+ * The segments are transferred in order, as if they were one contiguous
+ * buffer, without the data being copied together first where the platform
+ * supports it. For this to be the case on the wire, every segment except
+ * the last should be a multiple of the endpoint's maximum packet size.
+ *
+ * The transfer's \ref libusb_transfer::buffer "buffer" is set to NULL and
+ * its \ref libusb_transfer::length "length" to the total length of the
+ * segments. Setting a buffer later turns the transfer back into a regular
+ * one. The iov array and the segments it points to must remain valid until
+ * the transfer has completed.
+ *
+ * \param transfer the transfer to populate
+ * \param dev_handle handle of the device that will handle the transfer
+ * \param endpoint address of the endpoint where this transfer will be sent
+ * \param iov array of segments
+ * \param num_iov number of segments in iov
+ * \param callback callback function to be invoked on transfer completion
+ * \param user_data user data to pass to callback function
+ * \param timeout timeout for the transfer in milliseconds
+ */
+void API_EXPORTED libusb_fill_bulk_transfer_iov(
+	struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+	unsigned char endpoint, const struct libusb_iovec *iov, int num_iov,
+	libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int length = 0;
+	int i;
+
+	for (i = 0; i < num_iov; i++)
+		length += iov[i].length;
+
+	transfer->dev_handle = dev_handle;
+	transfer->endpoint = endpoint;
+	transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+	transfer->timeout = timeout;
+	transfer->buffer = NULL;
+	transfer->length = length;
+	transfer->user_data = user_data;
+	transfer->callback = callback;
+	itransfer->iov = iov;
+	itransfer->num_iov = num_iov;
+}
+
+/* Copy len bytes from src to the given offset of the data of a vectored
+ * transfer. src may point into the transfer's own segments. */
+void usbi_iov_move(struct usbi_transfer *itransfer, int offset,
+	const unsigned char *src, int len)
+{
+	int i;
+
+	for (i = 0; i < itransfer->num_iov && len > 0; i++) {
+		const struct libusb_iovec *iov = &itransfer->iov[i];
+		int chunk;
+
+		if (offset >= iov->length) {
+			offset -= iov->length;
+			continue;
+		}
+
+		chunk = MIN(len, iov->length - offset);
+		if (iov->buffer + offset != src)
+			memmove(iov->buffer + offset, src, chunk);
+		src += chunk;
+		len -= chunk;
+		offset = 0;
+	}
+}
+
+/* Linearize a vectored transfer into a bounce buffer for backends that
+ * cannot submit it as it is. Undone by unbounce_iov(). */
+static int bounce_iov(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	unsigned char *buffer;
+	int offset = 0;
+	int i;
+
+	buffer = malloc(transfer->length ? transfer->length : 1);
+	if (!buffer)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if ((transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
+		for (i = 0; i < itransfer->num_iov; i++) {
+			memcpy(buffer + offset, itransfer->iov[i].buffer,
+				itransfer->iov[i].length);
+			offset += itransfer->iov[i].length;
+		}
+
+	itransfer->iov_bounce = buffer;
+	transfer->buffer = buffer;
+	return 0;
+}
+
+static void unbounce_iov(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	if (!itransfer->iov_bounce)
+		return;
+
+	if ((transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+		usbi_iov_move(itransfer, 0, itransfer->iov_bounce,
+			itransfer->transferred);
+
+	free(itransfer->iov_bounce);
+	itransfer->iov_bounce = NULL;
+	transfer->buffer = NULL;
+}
+
+/* Get a transfer ready to be handed to the backend.
+ * Must be called with the transfer's lock held. */
+static int prepare_transfer(struct usbi_transfer *itransfer,
+	struct timespec *now)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int r;
+
+	itransfer->transferred = 0;
 	itransfer->flags = 0;
-	r = calculate_timeout(itransfer);
-	if (r < 0) {
-		r = LIBUSB_ERROR_OTHER;
-		goto out;
+	r = calculate_timeout(itransfer, now);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+
+#ifdef ENABLE_TRANSFER_STATS
+	/* the transfers of a batch share the submission time. a transfer without
+	 * one is left out of the latency statistics. */
+	if (now->tv_nsec < 0
+			&& usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, now) < 0)
+		now->tv_nsec = -1;
+	itransfer->submit_time = *now;
+#endif
+
+	if (usbi_transfer_has_iov(itransfer)) {
+		if (transfer->type != LIBUSB_TRANSFER_TYPE_BULK)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		if (!(usbi_backend->caps & USBI_CAP_BULK_IOV))
+			return bounce_iov(itransfer);
 	}
 
-	r = add_to_flying_list(itransfer);
-	if (r)
-		goto out;
-	r = usbi_backend->submit_transfer(itransfer);
-	if (r) {
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		list_del(&itransfer->list);
-		arm_timerfd_for_next_timeout(ctx);
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	return 0;
+}
+
+/* Submit a run of transfers that all belong to the same device handle,
+ * stopping at the first failure. The flying list and timeout bookkeeping is
+ * done once for the whole run, with all the transfers locked. Returns the
+ * number of transfers submitted, and stores the error that stopped the run,
+ * if any, in *error. */
+static int submit_transfer_run(struct libusb_transfer **transfers,
+	int count, struct timespec *now, int *error)
+{
+	struct libusb_context *ctx = HANDLE_CTX(transfers[0]->dev_handle);
+	int prepared;
+	int submitted = 0;
+	int added = 0;
+	int updated_fds = 0;
+	int r = 0;
+	int r2;
+	int i;
+
+	for (prepared = 0; prepared < count; prepared++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[prepared]);
+
+		usbi_mutex_lock(&itransfer->lock);
+		r = prepare_transfer(itransfer, now);
+		if (r < 0) {
+			usbi_mutex_unlock(&itransfer->lock);
+			break;
+		}
 	}
 
-out:
-	updated_fds = (itransfer->flags & USBI_TRANSFER_UPDATED_FDS);
-	usbi_mutex_unlock(&itransfer->lock);
+	if (prepared > 0) {
+		r2 = add_to_flying_list(transfers, prepared);
+		if (r2 == 0) {
+			added = 1;
+			for (; submitted < prepared; submitted++) {
+				struct usbi_transfer *itransfer =
+					LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[submitted]);
+
+				r2 = usbi_backend->submit_transfer(itransfer);
+				if (r2)
+					break;
+				itransfer->flags |= USBI_TRANSFER_SUBMITTED;
+				usbi_trace(ctx, submit, LIBUSB_TRACE_SUBMIT,
+					transfers[submitted], transfers[submitted]->length, 0);
+			}
+			finish_flying_list(transfers, submitted);
+		}
+		if (r2)
+			r = r2;
+	}
+
+	for (i = 0; i < prepared; i++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		if (i >= submitted)
+			unbounce_iov(itransfer);
+		updated_fds |= (itransfer->flags & USBI_TRANSFER_UPDATED_FDS);
+		usbi_mutex_unlock(&itransfer->lock);
+	}
+	if (added && submitted < prepared)
+		abort_flying_list(transfers + submitted, prepared - submitted);
 	if (updated_fds)
 		usbi_fd_notification(ctx);
+
+	*error = r;
+	return submitted;
+}
+
+/** \ingroup asyncio
+ * Submit a transfer. This function will fire off the USB transfer and then
+ * return immediately.
+ *
+ * \param transfer the transfer to submit
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
+ * by the operating system.
+ * \returns another LIBUSB_ERROR code on other failure
+ * \see libusb_submit_transfers()
+ */
+int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct timespec now;
+	int r;
+
+	now.tv_sec = 0;
+	now.tv_nsec = -1;
+	submit_transfer_run(&transfer, 1, &now, &r);
 	return r;
 }
 
+/** \ingroup asyncio
+ * Submit several transfers at once. This behaves like calling
+ * libusb_submit_transfer() on each of the transfers in turn, but the
+ * bookkeeping is shared among them: the clock is read once for all their
+ * timeouts, and consecutive transfers of the same device handle join its
+ * active transfers in a single step, rearming the timeout timer at most once.
+ * This makes it cheaper to fire off a large number of transfers, for instance
+ * to fill up a queue, or to resubmit all the transfers of a
+ * \ref libusb_alloc_transfer_pool() "transfer pool".
+ *
+ * Submission stops at the first transfer that fails to be submitted, the
+ * transfers before it remain submitted while the ones after it are left
+ * untouched. Each transfer must appear only once in the array.
+ *
+ * \param transfers the transfers to submit
+ * \param count the number of transfers in the array
+ * \returns the number of transfers submitted, which is less than count if
+ * one of them failed to be submitted
+ * \returns a LIBUSB_ERROR code, as described for libusb_submit_transfer(),
+ * if the first transfer failed to be submitted
+ * \returns LIBUSB_ERROR_INVALID_PARAM if count is not positive
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int count)
+{
+	struct timespec now;
+	int submitted = 0;
+	int r = 0;
+
+	if (!transfers || count <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	now.tv_sec = 0;
+	now.tv_nsec = -1;
+	while (submitted < count && r == 0) {
+		struct libusb_device_handle *handle = transfers[submitted]->dev_handle;
+		int run = 1;
+
+		while (submitted + run < count
+				&& transfers[submitted + run]->dev_handle == handle)
+			run++;
+		submitted += submit_transfer_run(transfers + submitted, run, &now, &r);
+	}
+
+	return submitted ? submitted : r;
+}
+
 /** \ingroup asyncio
  * Asynchronously cancel a previously submitted transfer.
  * This function returns immediately, but this does not indicate cancellation
@@ -1403,8 +2324,8 @@ out:
  *
  * \param transfer the transfer to cancel
  * \returns 0 on success
- * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is already complete or
- * cancelled.
+ * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is not submitted, or is
+ * already complete or cancelled.
  * \returns a LIBUSB_ERROR code on failure
  */
 int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
@@ -1415,6 +2336,12 @@ int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
 
 	usbi_dbg("");
 	usbi_mutex_lock(&itransfer->lock);
+	if (!(itransfer->flags & USBI_TRANSFER_SUBMITTED)
+			|| (itransfer->flags & USBI_TRANSFER_CANCELLING)) {
+		usbi_mutex_unlock(&itransfer->lock);
+		usbi_dbg("transfer not submitted or already being cancelled");
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
 	r = usbi_backend->cancel_transfer(itransfer);
 	if (r < 0) {
 		if (r != LIBUSB_ERROR_NOT_FOUND &&
@@ -1434,6 +2361,460 @@ int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
 	return r;
 }
 
+/** \ingroup asyncio
+ * Asynchronously cancel all the transfers in flight on an endpoint of a
+ * device handle, for instance to flush an endpoint after a pipe reset. This
+ * behaves like calling libusb_cancel_transfer() on each of them, but finds
+ * them in a single pass over the transfers of the handle. The transfers of
+ * the handle that complete meanwhile are only reported once all of their
+ * cancellations have been started. The transfers are cancelled from the
+ * last submitted to the first, so that the endpoint does not move on to
+ * transfers that are about to be cancelled, and their cancellations are
+ * typically reported together by the next round of event handling.
+ *
+ * As with libusb_cancel_transfer(), the callbacks of the transfers are
+ * invoked later with a status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED". Transfers already being cancelled are left
+ * alone.
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint, including the direction bit
+ * \returns the number of transfers whose cancellation was started
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns a LIBUSB_ERROR code if a cancellation failed, in which case the
+ * remaining transfers are still cancelled
+ */
+int API_EXPORTED libusb_cancel_endpoint_transfers(
+	libusb_device_handle *dev_handle, unsigned char endpoint)
+{
+	struct usbi_transfer **found;
+	struct list_head *pos;
+	int n = 0;
+	int count = 0;
+	int r = 0;
+	int i;
+
+	usbi_dbg("endpoint %x", endpoint);
+
+	/* the transfers are collected under the flying transfers lock, and
+	 * cancelled once it is released, since libusb_cancel_transfer() takes
+	 * the lock of the transfer, which submission takes before the flying
+	 * transfers lock. while cancel_walks is set none of them leaves the
+	 * flying list, so they cannot complete, or fail to be submitted, and be
+	 * freed under our feet. libusb_cancel_transfer() turns down those that
+	 * the backend did not accept and those already being cancelled. */
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	for (pos = dev_handle->flying_transfers.next;
+			pos != &dev_handle->flying_transfers; pos = pos->next)
+		n++;
+	found = malloc((n ? n : 1) * sizeof(*found));
+	if (!found) {
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	n = 0;
+	for (pos = dev_handle->flying_transfers.prev;
+			pos != &dev_handle->flying_transfers; pos = pos->prev) {
+		struct usbi_transfer *itransfer =
+			list_entry(pos, struct usbi_transfer, list);
+
+		if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->endpoint == endpoint)
+			found[n++] = itransfer;
+	}
+	if (n)
+		dev_handle->cancel_walks++;
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+
+	for (i = 0; i < n; i++) {
+		int r2 = libusb_cancel_transfer(
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(found[i]));
+		if (r2 == 0)
+			count++;
+		else if (r2 != LIBUSB_ERROR_NOT_FOUND)
+			r = r2;
+	}
+
+	if (n) {
+		usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+		if (--dev_handle->cancel_walks == 0)
+			usbi_cond_broadcast(&dev_handle->cancel_walks_cond);
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+	}
+	free(found);
+
+	return r < 0 ? r : count;
+}
+
+/* Invoke the user-supplied callback of a completed transfer, then free the
+ * transfer if it was flagged for it. */
+static void invoke_transfer_callback(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	uint8_t flags = transfer->flags;
+
+	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
+	if (transfer->callback)
+		transfer->callback(transfer);
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+}
+
+/* Push a completed transfer on the completion queue of the context. Only the
+ * event thread pushes, but any number of threads may be draining the queue
+ * at the same time, which they do by taking the whole stack at once. As
+ * nodes are never popped individually, the stack is not subject to ABA. */
+static void queue_completion(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	struct usbi_transfer *head;
+
+	do {
+		head = ctx->completed_transfers;
+		itransfer->next_completed = head;
+	} while (usbi_atomic_cas_ptr(&ctx->completed_transfers, head, itransfer)
+		!= head);
+}
+
+/* Invoke the callbacks of all the transfers on the completion queue, in the
+ * order in which they completed. Returns the number of callbacks invoked. */
+static int dispatch_completions(struct libusb_context *ctx)
+{
+	struct usbi_transfer *itransfer;
+	struct usbi_transfer *next;
+	struct usbi_transfer *list = NULL;
+	int n = 0;
+
+	if (!ctx->completed_transfers)
+		return 0;
+
+	itransfer = usbi_atomic_xchg_ptr(&ctx->completed_transfers, NULL);
+	while (itransfer) {
+		next = itransfer->next_completed;
+		itransfer->next_completed = list;
+		list = itransfer;
+		itransfer = next;
+	}
+
+	while (list) {
+		/* a resubmitted transfer may be queued again before its callback
+		 * even returns */
+		next = list->next_completed;
+		invoke_transfer_callback(list);
+		list = next;
+		n++;
+	}
+
+	if (n) {
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		usbi_cond_broadcast(&ctx->event_waiters_cond);
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+	}
+	return n;
+}
+
+#ifdef ENABLE_TRANSFER_STATS
+static void add_transfer_stats(struct libusb_transfer_stats *to,
+	const struct libusb_transfer_stats *from)
+{
+	int i;
+
+	if (!from->transfers)
+		return;
+	if (!to->transfers || from->latency_min_us < to->latency_min_us)
+		to->latency_min_us = from->latency_min_us;
+	if (from->latency_max_us > to->latency_max_us)
+		to->latency_max_us = from->latency_max_us;
+	to->transfers += from->transfers;
+	to->completed += from->completed;
+	to->short_transfers += from->short_transfers;
+	to->errors += from->errors;
+	to->timeouts += from->timeouts;
+	to->cancelled += from->cancelled;
+	to->stalls += from->stalls;
+	to->no_device += from->no_device;
+	to->overflows += from->overflows;
+	to->bytes_requested += from->bytes_requested;
+	to->bytes_transferred += from->bytes_transferred;
+	to->latency_total_us += from->latency_total_us;
+	for (i = 0; i < LIBUSB_TRANSFER_STATS_BUCKETS; i++)
+		to->latency_histogram[i] += from->latency_histogram[i];
+}
+
+/* account for a completed transfer in the statistics of its endpoint.
+ * must be called with the handle's flying_transfers_lock held. */
+static void record_transfer_stats(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status, const struct timespec *now)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_transfer_stats *stats =
+		&transfer->dev_handle->stats[usbi_endpoint_index(transfer->endpoint)];
+	int rqlen = transfer->length;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
+
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		stats->completed++;
+		if (itransfer->transferred < rqlen)
+			stats->short_transfers++;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		stats->timeouts++;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		stats->cancelled++;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		stats->stalls++;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		stats->no_device++;
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		stats->overflows++;
+		break;
+	default:
+		stats->errors++;
+		break;
+	}
+	if (rqlen > 0)
+		stats->bytes_requested += rqlen;
+	if (itransfer->transferred > 0)
+		stats->bytes_transferred += itransfer->transferred;
+
+	if (itransfer->submit_time.tv_nsec >= 0 && now->tv_nsec >= 0) {
+		int64_t us = (int64_t)(now->tv_sec - itransfer->submit_time.tv_sec)
+			* 1000000 + (now->tv_nsec - itransfer->submit_time.tv_nsec) / 1000;
+		uint32_t latency = us < 0 ? 0 : us > UINT32_MAX ? UINT32_MAX
+			: (uint32_t)us;
+		int bucket = 0;
+
+		while (bucket < LIBUSB_TRANSFER_STATS_BUCKETS - 1
+				&& (latency >> (bucket + 1)))
+			bucket++;
+		stats->latency_histogram[bucket]++;
+		stats->latency_total_us += latency;
+		if (!stats->transfers || latency < stats->latency_min_us)
+			stats->latency_min_us = latency;
+		if (latency > stats->latency_max_us)
+			stats->latency_max_us = latency;
+	}
+	stats->transfers++;
+}
+
+/* add the statistics of a device handle being closed to those of its
+ * context. must be called with the context's open_devs_lock held. */
+void usbi_retire_transfer_stats(struct libusb_device_handle *handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	int i;
+
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	for (i = 0; i < USB_MAXENDPOINTS; i++)
+		add_transfer_stats(&ctx->closed_stats, &handle->stats[i]);
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
+}
+#else
+void usbi_retire_transfer_stats(struct libusb_device_handle *handle)
+{
+	UNUSED(handle);
+}
+#endif
+
+/* Carry out a control transfer filled in by libusb_control_transfer() in a
+ * single blocking call to the backend, rather than submitting it. It gets
+ * its status and actual length, and is accounted for in the statistics and
+ * trace events of its endpoint as a submitted transfer would be.
+ * Returns the number of bytes transferred or a LIBUSB_ERROR code, as
+ * libusb_control_transfer() does. LIBUSB_ERROR_NOT_SUPPORTED means that the
+ * backend turned the transfer down before doing any I/O, and that it is to
+ * be submitted as usual. */
+int usbi_sync_control_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	struct libusb_control_setup *setup =
+		libusb_control_transfer_get_setup(transfer);
+	enum libusb_transfer_status status;
+#ifdef ENABLE_TRANSFER_STATS
+	struct timespec now;
+#endif
+	int r;
+
+	itransfer->transferred = 0;
+#ifdef ENABLE_TRANSFER_STATS
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC,
+			&itransfer->submit_time) < 0)
+		itransfer->submit_time.tv_nsec = -1;
+#endif
+	usbi_trace(ctx, submit, LIBUSB_TRACE_SUBMIT, transfer, transfer->length,
+		0);
+
+	r = usbi_backend->sync_control_transfer(transfer->dev_handle,
+		setup->bmRequestType, setup->bRequest,
+		libusb_le16_to_cpu(setup->wValue), libusb_le16_to_cpu(setup->wIndex),
+		libusb_control_transfer_get_data(transfer),
+		libusb_le16_to_cpu(setup->wLength), transfer->timeout);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED)
+		return r;
+
+	switch (r) {
+	case LIBUSB_ERROR_TIMEOUT:
+		status = LIBUSB_TRANSFER_TIMED_OUT;
+		break;
+	case LIBUSB_ERROR_PIPE:
+		status = LIBUSB_TRANSFER_STALL;
+		break;
+	case LIBUSB_ERROR_NO_DEVICE:
+		status = LIBUSB_TRANSFER_NO_DEVICE;
+		break;
+	case LIBUSB_ERROR_OVERFLOW:
+		status = LIBUSB_TRANSFER_OVERFLOW;
+		break;
+	default:
+		status = r < 0 ? LIBUSB_TRANSFER_ERROR : LIBUSB_TRANSFER_COMPLETED;
+		break;
+	}
+	if (r > 0)
+		itransfer->transferred = r;
+
+#ifdef ENABLE_TRANSFER_STATS
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) < 0)
+		now.tv_nsec = -1;
+	usbi_mutex_lock(&transfer->dev_handle->flying_transfers_lock);
+	record_transfer_stats(itransfer, status, &now);
+	usbi_mutex_unlock(&transfer->dev_handle->flying_transfers_lock);
+#endif
+
+	transfer->status = status;
+	transfer->actual_length = itransfer->transferred;
+	usbi_trace(ctx, complete, LIBUSB_TRACE_COMPLETE, transfer,
+		itransfer->transferred, status);
+	return r;
+}
+
+/* deliver a trace event to the trace callback of a context, see usbi_trace() */
+void usbi_trace_event(struct libusb_context *ctx,
+	enum libusb_trace_event event, struct libusb_transfer *transfer,
+	int length, int status)
+{
+	libusb_trace_cb cb = ctx->trace_cb;
+	struct libusb_trace_record record;
+	struct timespec now;
+
+	if (!cb)
+		return;
+
+	record.transfer = transfer;
+	record.endpoint = transfer->endpoint;
+	record.type = transfer->type;
+	record.length = length;
+	record.status = status;
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) < 0)
+		record.timestamp_ns = 0;
+	else
+		record.timestamp_ns = (uint64_t)now.tv_sec * 1000000000
+			+ now.tv_nsec;
+	cb(ctx, event, &record, ctx->trace_cb_user_data);
+}
+
+/** \ingroup asyncio
+ * Set a callback to be told when the transfers of a context are submitted,
+ * reaped, completed or time out. See \ref asynctrace.
+ *
+ * The callback should be set before transfers are submitted, or unset after
+ * they have all completed, for each transfer to get a consistent series of
+ * events.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param cb the trace callback, or NULL to stop tracing
+ * \param user_data user data to pass to the callback
+ */
+void API_EXPORTED libusb_set_trace_cb(libusb_context *ctx, libusb_trace_cb cb,
+	void *user_data)
+{
+	USBI_GET_CONTEXT(ctx);
+	ctx->trace_cb_user_data = user_data;
+	ctx->trace_cb = cb;
+}
+
+/** \ingroup asyncio
+ * Get the statistics on the transfers of an endpoint of a device handle.
+ * They cover all the transfers of the endpoint that completed since the handle
+ * was opened, whether they were submitted through the asynchronous interface
+ * or carried out by the \ref syncio "synchronous I/O functions". This
+ * includes the control requests that libusb_control_transfer() hands to the
+ * operating system in a single blocking call, whose latency is measured
+ * around that call. See \ref asyncstats.
+ *
+ * \param dev a device handle
+ * \param endpoint the address of the endpoint, with its direction bit.
+ * Control transfers are accounted to endpoint 0.
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if libusbx was built without transfer
+ * statistics
+ */
+int API_EXPORTED libusb_get_endpoint_stats(libusb_device_handle *dev,
+	unsigned char endpoint, struct libusb_transfer_stats *stats)
+{
+#ifdef ENABLE_TRANSFER_STATS
+	usbi_mutex_lock(&dev->flying_transfers_lock);
+	*stats = dev->stats[usbi_endpoint_index(endpoint)];
+	usbi_mutex_unlock(&dev->flying_transfers_lock);
+	return 0;
+#else
+	UNUSED(dev);
+	UNUSED(endpoint);
+	UNUSED(stats);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup asyncio
+ * Get the statistics on all the transfers of a context, on all the endpoints
+ * of all the device handles that have been opened since the context was
+ * initialized. See \ref asyncstats.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if libusbx was built without transfer
+ * statistics
+ */
+int API_EXPORTED libusb_get_context_stats(libusb_context *ctx,
+	struct libusb_transfer_stats *stats)
+{
+#ifdef ENABLE_TRANSFER_STATS
+	struct libusb_device_handle *handle;
+	int i;
+
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	*stats = ctx->closed_stats;
+	list_for_each_entry(handle, &ctx->open_devs, list,
+			struct libusb_device_handle) {
+		usbi_mutex_lock(&handle->flying_transfers_lock);
+		for (i = 0; i < USB_MAXENDPOINTS; i++)
+			add_transfer_stats(stats, &handle->stats[i]);
+		usbi_mutex_unlock(&handle->flying_transfers_lock);
+	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return 0;
+#else
+	UNUSED(ctx);
+	UNUSED(stats);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
 /* Handle completion of a transfer (completion might be an error condition).
  * This will invoke the user-supplied callback function, which may end up
  * freeing the transfer. Therefore you cannot use the transfer structure
@@ -1447,22 +2828,12 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *handle = transfer->dev_handle;
 	struct libusb_context *ctx = TRANSFER_CTX(transfer);
-	uint8_t flags;
-	int r = 0;
-
-	/* FIXME: could be more intelligent with the timerfd here. we don't need
-	 * to disarm the timerfd if there was no timer running, and we only need
-	 * to rearm the timerfd if the transfer that expired was the one with
-	 * the shortest timeout. */
-
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	list_del(&itransfer->list);
-	if (usbi_using_timerfd(ctx))
-		r = arm_timerfd_for_next_timeout(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	if (usbi_using_timerfd(ctx) && (r < 0))
-		return r;
+#ifdef ENABLE_TRANSFER_STATS
+	struct timespec now;
+#endif
+	int r;
 
 	if (status == LIBUSB_TRANSFER_COMPLETED
 			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
@@ -1475,16 +2846,35 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		}
 	}
 
-	flags = transfer->flags;
+#ifdef ENABLE_TRANSFER_STATS
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) < 0)
+		now.tv_nsec = -1;
+#endif
+
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	usbi_wait_for_cancel_walks(handle);
+	r = usbi_remove_from_flying_list(itransfer);
+#ifdef ENABLE_TRANSFER_STATS
+	if (r == 0)
+		record_transfer_stats(itransfer, status, &now);
+#endif
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
+	if (r < 0)
+		return r;
+
+	unbounce_iov(itransfer);
+
 	transfer->status = status;
 	transfer->actual_length = itransfer->transferred;
-	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
-	if (transfer->callback)
-		transfer->callback(transfer);
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
+	usbi_trace(ctx, complete, LIBUSB_TRACE_COMPLETE, transfer,
+		itransfer->transferred, status);
+	if (usbi_atomic_load(&ctx->queue_completions)) {
+		/* the callback is up to the thread that drains the queue */
+		queue_completion(ctx, itransfer);
+		return 0;
+	}
+
+	invoke_transfer_callback(itransfer);
 	usbi_mutex_lock(&ctx->event_waiters_lock);
 	usbi_cond_broadcast(&ctx->event_waiters_cond);
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
@@ -1499,8 +2889,15 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
  * will attempt to take the lock. */
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
 {
+	int timed_out;
+
+	/* libusb_cancel_endpoint_transfers() may still be updating the flags */
+	usbi_mutex_lock(&transfer->lock);
+	timed_out = transfer->flags & USBI_TRANSFER_TIMED_OUT;
+	usbi_mutex_unlock(&transfer->lock);
+
 	/* if the URB was cancelled due to timeout, report timeout to the user */
-	if (transfer->flags & USBI_TRANSFER_TIMED_OUT) {
+	if (timed_out) {
 		usbi_dbg("detected timeout cancellation");
 		return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_TIMED_OUT);
 	}
@@ -1761,6 +3158,8 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	int r;
 
+	usbi_trace(TRANSFER_CTX(transfer), timeout, LIBUSB_TRACE_TIMEOUT, transfer,
+		transfer->length, 0);
 	itransfer->flags |= USBI_TRANSFER_TIMED_OUT;
 	r = libusb_cancel_transfer(transfer);
 	if (r < 0)
@@ -1768,15 +3167,38 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 			"async cancel failed %d errno=%d", r, errno);
 }
 
-static int handle_timeouts_locked(struct libusb_context *ctx)
+/* handle the expired timeouts of a device handle's transfers. they are popped
+ * off the heap, but stay in the flying list until their cancellation
+ * completes. must be called with the handle's flying_transfers_lock held. */
+static void handle_timeouts_for_handle(struct libusb_device_handle *handle,
+	struct timeval *systime)
+{
+	struct usbi_timeout_node *node;
+
+	while ((node = timeout_heap_first(&handle->timeout_heap)) != NULL) {
+		/* if transfer has non-expired timeout, nothing more to do */
+		if (timercmp(&node->tv, systime, >))
+			return;
+
+		/* otherwise, we've got an expired timeout to handle */
+		timeout_heap_remove(&handle->timeout_heap, node);
+		handle_timeout(timeout_node_to_transfer(node));
+	}
+}
+
+/* handle the expired timeouts of the device handles in the timeout heap of
+ * an event partition, or in that of the context if part is NULL. the caller
+ * must keep the handles of the heap from being closed. */
+static int handle_heap_timeouts(struct libusb_context *ctx,
+	struct usbi_event_partition *part)
 {
+	struct usbi_timeout_heap *heap =
+		part ? &part->timeout_heap : &ctx->timeout_heap;
+	usbi_mutex_t *lock =
+		part ? &part->timeout_heap_lock : &ctx->timeout_heap_lock;
 	int r;
 	struct timespec systime_ts;
 	struct timeval systime;
-	struct usbi_transfer *transfer;
-
-	if (list_empty(&ctx->flying_transfers))
-		return 0;
 
 	/* get current time */
 	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts);
@@ -1785,38 +3207,40 @@ static int handle_timeouts_locked(struct libusb_context *ctx)
 
 	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!timerisset(cur_tv))
-			return 0;
+	while (1) {
+		struct usbi_timeout_node *node;
+		struct libusb_device_handle *handle = NULL;
 
-		/* ignore timeouts we've already handled */
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
+		usbi_mutex_lock(lock);
+		node = timeout_heap_first(heap);
+		if (node && !timercmp(&node->tv, &systime, >))
+			handle = timeout_node_to_handle(node);
+		usbi_mutex_unlock(lock);
 
-		/* if transfer has non-expired timeout, nothing more to do */
-		if ((cur_tv->tv_sec > systime.tv_sec) ||
-				(cur_tv->tv_sec == systime.tv_sec &&
-					cur_tv->tv_usec > systime.tv_usec))
-			return 0;
+		if (!handle)
+			break;
 
-		/* otherwise, we've got an expired timeout to handle */
-		handle_timeout(transfer);
+		usbi_mutex_lock(&handle->flying_transfers_lock);
+		handle_timeouts_for_handle(handle, &systime);
+		r = update_handle_timeout(handle);
+		usbi_mutex_unlock(&handle->flying_transfers_lock);
+		if (r < 0)
+			break;
+		r = 0;
 	}
-	return 0;
+	return r;
 }
 
 static int handle_timeouts(struct libusb_context *ctx)
 {
 	int r;
 	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	r = handle_timeouts_locked(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	/* keep device handles from being closed while we process their
+	 * timeouts, as we might not be holding the events lock */
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	r = handle_heap_timeouts(ctx, NULL);
+	usbi_mutex_unlock(&ctx->open_devs_lock);
 	return r;
 }
 
@@ -1825,54 +3249,222 @@ static int handle_timerfd_trigger(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-
 	/* process the timeout that just happened */
-	r = handle_timeouts_locked(ctx);
+	r = handle_timeouts(ctx);
 	if (r < 0)
-		goto out;
+		return r;
 
 	/* arm for next timeout*/
+	usbi_mutex_lock(&ctx->timeout_heap_lock);
 	r = arm_timerfd_for_next_timeout(ctx);
-
-out:
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&ctx->timeout_heap_lock);
 	return r;
 }
 #endif
 
-/* do the actual event handling. assumes that no other thread is concurrently
- * doing the same thing. */
-static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+/* slot of the hotplug pipe in the pollfd array, after the ctrl pipe and the
+ * timerfd, which were added to the pollfds before it */
+#define HOTPLUG_PIPE_SLOT(ctx) (usbi_using_timerfd(ctx) ? 2 : 1)
+
+/* whether the main event handler polls an fd, rather than the thread of
+ * an event partition. must be called with the pollfds_lock held. */
+static int polled_by_main(struct usbi_pollfd *ipollfd)
+{
+	return !ipollfd->handle || !handle_event_partition(ipollfd->handle);
+}
+
+/* flag the pollfds list as modified for the main event handler and the
+ * threads of all event partitions. must be called with the pollfds_lock
+ * held. */
+static void mark_pollfds_modified(struct libusb_context *ctx)
+{
+	int i;
+
+	ctx->pollfds_modified = 1;
+	for (i = 0; i < ctx->num_event_partitions - 1; i++)
+		ctx->event_partitions[i].pollfds_modified = 1;
+}
+
+#ifdef USBI_EPOLL_AVAILABLE
+/* register an fd with the epoll fd, or take it out, depending on whether the
+ * main event handler polls it. must be called with the pollfds_lock held. */
+static int sync_epoll_fd(struct libusb_context *ctx,
+	struct usbi_pollfd *ipollfd)
+{
+	int fd = ipollfd->pollfd.fd;
+	int want = polled_by_main(ipollfd);
+
+	if (want == ipollfd->in_epoll)
+		return 0;
+
+	if (want) {
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = (uint32_t)ipollfd->pollfd.events;
+		event.data.ptr = ipollfd;
+		if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			usbi_err(ctx, "failed to add fd %d to epoll set (errno %d)",
+				fd, errno);
+			return LIBUSB_ERROR_OTHER;
+		}
+	} else if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+		usbi_dbg("failed to remove fd %d from epoll set (errno %d)", fd, errno);
+	}
+	ipollfd->in_epoll = want;
+	return 0;
+}
+#endif
+
+/* rebuild the cached pollfd array from the pollfds list, if it changed since
+ * the last time we polled. must be called with the events lock held. */
+static int update_pollfds_cache(struct libusb_context *ctx)
 {
-	int r;
 	struct usbi_pollfd *ipollfd;
 	POLL_NFDS_TYPE nfds = 0;
-	struct pollfd *fds = NULL;
-	int i = -1;
-	int timeout_ms;
+	int i = 0;
 
 	usbi_mutex_lock(&ctx->pollfds_lock);
+	if (!ctx->pollfds_modified) {
+		usbi_mutex_unlock(&ctx->pollfds_lock);
+		return 0;
+	}
+
 	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
-		nfds++;
+		if (polled_by_main(ipollfd))
+			nfds++;
 
-	/* TODO: malloc when number of fd's changes, not on every poll */
-	if (nfds != 0)
-		fds = malloc(sizeof(*fds) * nfds);
-	if (!fds) {
-		usbi_mutex_unlock(&ctx->pollfds_lock);
-		return LIBUSB_ERROR_NO_MEM;
+	if (nfds != ctx->pollfds_cache_cnt) {
+		struct pollfd *fds = NULL;
+		struct libusb_device_handle **handles = NULL;
+
+		if (nfds != 0) {
+			fds = malloc(sizeof(*fds) * nfds);
+			handles = malloc(sizeof(*handles) * nfds);
+		}
+		if (!fds || !handles) {
+			free(fds);
+			free(handles);
+			usbi_mutex_unlock(&ctx->pollfds_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+#ifdef USBI_EPOLL_AVAILABLE
+		if (usbi_using_epoll(ctx)) {
+			struct epoll_event *events =
+				malloc(sizeof(*events) * nfds);
+			if (!events) {
+				free(fds);
+				free(handles);
+				usbi_mutex_unlock(&ctx->pollfds_lock);
+				return LIBUSB_ERROR_NO_MEM;
+			}
+			free(ctx->epoll_events);
+			ctx->epoll_events = events;
+		}
+#endif
+		free(ctx->pollfds_cache);
+		free(ctx->pollfds_cache_handles);
+		ctx->pollfds_cache = fds;
+		ctx->pollfds_cache_handles = handles;
+		ctx->pollfds_cache_cnt = nfds;
 	}
 
 	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd) {
 		struct libusb_pollfd *pollfd = &ipollfd->pollfd;
-		int fd = pollfd->fd;
+		if (!polled_by_main(ipollfd))
+			continue;
+		ctx->pollfds_cache[i].fd = pollfd->fd;
+		ctx->pollfds_cache[i].events = pollfd->events;
+		ctx->pollfds_cache[i].revents = 0;
+		ctx->pollfds_cache_handles[i] = ipollfd->handle;
 		i++;
-		fds[i].fd = fd;
-		fds[i].events = pollfd->events;
-		fds[i].revents = 0;
 	}
+	ctx->pollfds_modified = 0;
 	usbi_mutex_unlock(&ctx->pollfds_lock);
+	return 0;
+}
+
+struct libusb_device_handle *usbi_pollfd_handle(struct libusb_context *ctx,
+	struct pollfd *fds, POLL_NFDS_TYPE index)
+{
+	int i;
+
+	if (fds == ctx->pollfds_cache)
+		return ctx->pollfds_cache_handles[index];
+	for (i = 0; i < ctx->num_event_partitions - 1; i++)
+		if (fds == ctx->event_partitions[i].fds)
+			return ctx->event_partitions[i].handles[index];
+	return NULL;
+}
+
+#ifdef USBI_EPOLL_AVAILABLE
+/* wait for events on the epoll fd, and translate the result into the cached
+ * pollfd array so that it looks like the outcome of a poll() call: the ctrl
+ * pipe, the timerfd and the hotplug pipe keep their usual slots, and the
+ * remaining ready fds follow. returns the epoll_wait() result and updates nfds to the number
+ * of valid entries in the array. */
+static int epoll_wait_events(struct libusb_context *ctx,
+	POLL_NFDS_TYPE *nfds, int timeout_ms)
+{
+	struct pollfd *fds = ctx->pollfds_cache;
+	POLL_NFDS_TYPE n = HOTPLUG_PIPE_SLOT(ctx) + 1;
+	int r;
+	int i;
+
+	r = epoll_wait(ctx->epoll_fd, ctx->epoll_events,
+		(int)ctx->pollfds_cache_cnt, timeout_ms);
+	if (r <= 0)
+		return r;
+
+	fds[0].revents = 0;
+	if (usbi_using_timerfd(ctx))
+		fds[1].revents = 0;
+	fds[HOTPLUG_PIPE_SLOT(ctx)].revents = 0;
+
+	/* the poll(2) and epoll(7) event bits have the same values on Linux */
+	for (i = 0; i < r; i++) {
+		struct usbi_pollfd *ipollfd = ctx->epoll_events[i].data.ptr;
+		short revents = (short)ctx->epoll_events[i].events;
+
+		if (ipollfd->pollfd.fd == ctx->ctrl_pipe[0]) {
+			fds[0].revents = revents;
+			continue;
+		}
+		if (ipollfd->pollfd.fd == ctx->hotplug_pipe[0]) {
+			fds[HOTPLUG_PIPE_SLOT(ctx)].revents = revents;
+			continue;
+		}
+#ifdef USBI_TIMERFD_AVAILABLE
+		if (usbi_using_timerfd(ctx) && ipollfd->pollfd.fd == ctx->timerfd) {
+			fds[1].revents = revents;
+			continue;
+		}
+#endif
+		fds[n].fd = ipollfd->pollfd.fd;
+		fds[n].events = ipollfd->pollfd.events;
+		fds[n].revents = revents;
+		ctx->pollfds_cache_handles[n] = ipollfd->handle;
+		n++;
+	}
+
+	*nfds = n;
+	return r;
+}
+#endif
+
+/* do the actual event handling. assumes that no other thread is concurrently
+ * doing the same thing. */
+static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+{
+	int r;
+	POLL_NFDS_TYPE nfds;
+	struct pollfd *fds;
+	int timeout_ms;
+
+	r = update_pollfds_cache(ctx);
+	if (r < 0)
+		return r;
+	fds = ctx->pollfds_cache;
+	nfds = ctx->pollfds_cache_cnt;
 
 	timeout_ms = (tv->tv_sec * 1000) + (tv->tv_usec / 1000);
 
@@ -1881,16 +3473,18 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		timeout_ms++;
 
 	usbi_dbg("poll() %d fds with timeout in %dms", nfds, timeout_ms);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		r = epoll_wait_events(ctx, &nfds, timeout_ms);
+	else
+#endif
 	r = usbi_poll(fds, nfds, timeout_ms);
 	usbi_dbg("poll() returned %d", r);
 	if (r == 0) {
-		free(fds);
 		return handle_timeouts(ctx);
 	} else if (r == -1 && errno == EINTR) {
-		free(fds);
 		return LIBUSB_ERROR_INTERRUPTED;
 	} else if (r < 0) {
-		free(fds);
 		usbi_err(ctx, "poll failed %d err=%d\n", r, errno);
 		return LIBUSB_ERROR_IO;
 	}
@@ -1937,12 +3531,26 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	}
 #endif
 
+	if (fds[HOTPLUG_PIPE_SLOT(ctx)].revents) {
+		usbi_dbg("hotplug notification");
+		usbi_hotplug_dispatch(ctx);
+
+		if (r == 1) {
+			r = 0;
+			goto handled;
+		}
+
+		/* prevent OS backend from trying to handle events on the hotplug
+		 * pipe */
+		fds[HOTPLUG_PIPE_SLOT(ctx)].revents = 0;
+		r--;
+	}
+
 	r = usbi_backend->handle_events(ctx, fds, nfds, r);
 	if (r)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
 
 handled:
-	free(fds);
 	return r;
 }
 
@@ -1973,39 +3581,12 @@ static int get_next_timeout(libusb_context *ctx, struct timeval *tv,
 	return 0;
 }
 
-/** \ingroup poll
- * Handle any pending events.
- *
- * libusbx determines "pending events" by checking if any timeouts have expired
- * and by checking the set of file descriptors for activity.
- *
- * If a zero timeval is passed, this function will handle any already-pending
- * events and then immediately return in non-blocking style.
- *
- * If a non-zero timeval is passed and no events are currently pending, this
- * function will block waiting for events to handle up until the specified
- * timeout. If an event arrives or a signal is raised, this function will
- * return early.
- *
- * If the parameter completed is not NULL then <em>after obtaining the event
- * handling lock</em> this function will return immediately if the integer
- * pointed to is not 0. This allows for race free waiting for the completion
- * of a specific transfer.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param tv the maximum time to block waiting for events, or an all zero
- * timeval struct for non-blocking mode
- * \param completed pointer to completion integer to check, or NULL
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
- * \see \ref mtasync
- */
-int API_EXPORTED libusb_handle_events_timeout_completed(libusb_context *ctx,
+static int handle_events_completed(struct libusb_context *ctx,
 	struct timeval *tv, int *completed)
 {
 	int r;
 	struct timeval poll_timeout;
 
-	USBI_GET_CONTEXT(ctx);
 	r = get_next_timeout(ctx, tv, &poll_timeout);
 	if (r) {
 		/* timeout already expired */
@@ -2044,12 +3625,80 @@ retry:
 already_done:
 	libusb_unlock_event_waiters(ctx);
 
-	if (r < 0)
-		return r;
-	else if (r == 1)
-		return handle_timeouts(ctx);
-	else
-		return 0;
+	if (r < 0)
+		return r;
+	else if (r == 1)
+		return handle_timeouts(ctx);
+	else
+		return 0;
+}
+
+/* the counterpart of handle_events_completed() for the threads other than
+ * the event thread, while it is running */
+static int wait_for_completions(struct libusb_context *ctx,
+	struct timeval *tv, int *completed)
+{
+	int r = 0;
+
+	/* the usual case of a completion that is already in does not need any
+	 * locking */
+	if (dispatch_completions(ctx) && !completed)
+		return 0;
+	if (completed && *completed)
+		return 0;
+
+	libusb_lock_event_waiters(ctx);
+	if (usbi_atomic_load(&ctx->event_thread_running)
+			&& !ctx->completed_transfers
+			&& !(completed && *completed))
+		r = libusb_wait_for_event(ctx, tv);
+	libusb_unlock_event_waiters(ctx);
+
+	dispatch_completions(ctx);
+	return (r < 0) ? r : 0;
+}
+
+/** \ingroup poll
+ * Handle any pending events.
+ *
+ * libusbx determines "pending events" by checking if any timeouts have expired
+ * and by checking the set of file descriptors for activity.
+ *
+ * If a zero timeval is passed, this function will handle any already-pending
+ * events and then immediately return in non-blocking style.
+ *
+ * If a non-zero timeval is passed and no events are currently pending, this
+ * function will block waiting for events to handle up until the specified
+ * timeout. If an event arrives or a signal is raised, this function will
+ * return early.
+ *
+ * If the parameter completed is not NULL then <em>after obtaining the event
+ * handling lock</em> this function will return immediately if the integer
+ * pointed to is not 0. This allows for race free waiting for the completion
+ * of a specific transfer.
+ *
+ * While the \ref pollthread "event thread" of the context is running, this
+ * function does no event handling. It instead dispatches the completions of
+ * the event thread, waiting up until the specified timeout for some to arrive,
+ * or for the integer pointed to by completed to become non-zero.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv the maximum time to block waiting for events, or an all zero
+ * timeval struct for non-blocking mode
+ * \param completed pointer to completion integer to check, or NULL
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \see \ref mtasync
+ */
+int API_EXPORTED libusb_handle_events_timeout_completed(libusb_context *ctx,
+	struct timeval *tv, int *completed)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (usbi_atomic_load(&ctx->event_thread_running))
+		return wait_for_completions(ctx, tv, completed);
+
+	/* completions may have been left over by an event thread */
+	dispatch_completions(ctx);
+	return handle_events_completed(ctx, tv, completed);
 }
 
 /** \ingroup poll
@@ -2119,6 +3768,568 @@ int API_EXPORTED libusb_handle_events_completed(libusb_context *ctx,
 	return libusb_handle_events_timeout_completed(ctx, &tv, completed);
 }
 
+static void *event_thread_main(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	int r;
+
+	usbi_dbg("event thread started");
+	while (!usbi_atomic_load(&ctx->event_thread_stop)) {
+		struct timeval tv = { 60, 0 };
+
+		/* stop_event_threads() interrupts the poll */
+		r = handle_events_completed(ctx, &tv, NULL);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_dbg("event handling failed with error %d", r);
+
+		/* one wakeup for all the completions queued by this iteration */
+		if (ctx->completed_transfers) {
+			usbi_mutex_lock(&ctx->event_waiters_lock);
+			usbi_cond_broadcast(&ctx->event_waiters_cond);
+			usbi_mutex_unlock(&ctx->event_waiters_lock);
+		}
+	}
+	usbi_dbg("event thread stopped");
+	return NULL;
+}
+
+/* wake up the thread of an event partition, so that it recomputes its poll
+ * timeout. must be called with the timeout_heap_lock of the partition held. */
+static void wake_event_partition(struct usbi_event_partition *part)
+{
+	unsigned char dummy = 1;
+
+	if (part->wake_pending)
+		return;
+	part->wake_pending = 1;
+	if (usbi_write(part->wake_pipe[1], &dummy, sizeof(dummy)) <= 0)
+		usbi_warn(part->ctx, "internal signalling write failed");
+}
+
+/* pick the event thread that is to serve a device handle being opened */
+void usbi_assign_event_partition(struct libusb_device_handle *handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	handle->event_partition = (int)(ctx->next_event_partition++
+		% (unsigned int)ctx->num_event_partitions);
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+}
+
+/* keep the thread of the event partition serving a device handle, if any,
+ * away from the handle, the way holding the events lock does for the main
+ * event thread. must be called with the events lock held, and pollfd_modify
+ * raised so that the thread does not take its lock back. returns the
+ * partition to pass to usbi_unlock_event_partition(). */
+struct usbi_event_partition *usbi_lock_event_partition(
+	struct libusb_device_handle *handle)
+{
+	struct usbi_event_partition *part = handle_event_partition(handle);
+	unsigned char dummy = 1;
+
+	if (!part)
+		return NULL;
+	if (usbi_write(part->wake_pipe[1], &dummy, sizeof(dummy)) <= 0)
+		usbi_warn(HANDLE_CTX(handle), "internal signalling write failed");
+	usbi_mutex_lock(&part->lock);
+	return part;
+}
+
+void usbi_unlock_event_partition(struct usbi_event_partition *part)
+{
+	if (part)
+		usbi_mutex_unlock(&part->lock);
+}
+
+/* rebuild the pollfd array of an event partition from the pollfds list of
+ * the context, if it changed since the last time the partition polled */
+static int update_partition_pollfds(struct usbi_event_partition *part)
+{
+	struct libusb_context *ctx = part->ctx;
+	struct usbi_pollfd *ipollfd;
+	POLL_NFDS_TYPE nfds = 1;
+	int i = 1;
+
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	if (!part->pollfds_modified) {
+		usbi_mutex_unlock(&ctx->pollfds_lock);
+		return 0;
+	}
+
+	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
+		if (ipollfd->handle
+				&& ipollfd->handle->event_partition == part->index)
+			nfds++;
+
+	if (nfds != part->nfds) {
+		struct pollfd *fds = malloc(sizeof(*fds) * nfds);
+		struct libusb_device_handle **handles =
+			malloc(sizeof(*handles) * nfds);
+
+		if (!fds || !handles) {
+			free(fds);
+			free(handles);
+			usbi_mutex_unlock(&ctx->pollfds_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		free(part->fds);
+		free(part->handles);
+		part->fds = fds;
+		part->handles = handles;
+		part->nfds = nfds;
+	}
+
+	part->fds[0].fd = part->wake_pipe[0];
+	part->fds[0].events = POLLIN;
+	part->fds[0].revents = 0;
+	part->handles[0] = NULL;
+	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd) {
+		if (!ipollfd->handle
+				|| ipollfd->handle->event_partition != part->index)
+			continue;
+		part->fds[i].fd = ipollfd->pollfd.fd;
+		part->fds[i].events = ipollfd->pollfd.events;
+		part->fds[i].revents = 0;
+		part->handles[i] = ipollfd->handle;
+		i++;
+	}
+	part->pollfds_modified = 0;
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+	return 0;
+}
+
+/* how long the thread of an event partition may poll for, in milliseconds,
+ * given the next timeout of its device handles. returns a LIBUSB_ERROR code
+ * on failure. */
+static int get_partition_poll_timeout(struct usbi_event_partition *part)
+{
+	struct usbi_timeout_node *node;
+	struct timespec now_ts;
+	struct timeval now;
+	struct timeval next;
+	int timeout_ms;
+
+	usbi_mutex_lock(&part->timeout_heap_lock);
+	part->wake_pending = 0;
+	node = timeout_heap_first(&part->timeout_heap);
+	if (node)
+		next = node->tv;
+	usbi_mutex_unlock(&part->timeout_heap_lock);
+	if (!node)
+		return 60000;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now_ts) < 0)
+		return LIBUSB_ERROR_OTHER;
+	TIMESPEC_TO_TIMEVAL(&now, &now_ts);
+	if (!timercmp(&next, &now, >))
+		return 0;
+
+	timersub(&next, &now, &next);
+	if (next.tv_sec >= 60)
+		return 60000;
+	timeout_ms = (int)(next.tv_sec * 1000) + (int)(next.tv_usec / 1000);
+
+	/* round up to next millisecond */
+	if (next.tv_usec % 1000)
+		timeout_ms++;
+	return timeout_ms;
+}
+
+/* the counterpart of handle_events() for the thread of an event partition */
+static int handle_partition_events(struct usbi_event_partition *part)
+{
+	struct libusb_context *ctx = part->ctx;
+	int timeout_ms;
+	int r;
+
+	r = update_partition_pollfds(part);
+	if (r < 0)
+		return r;
+	timeout_ms = get_partition_poll_timeout(part);
+	if (timeout_ms < 0)
+		return timeout_ms;
+
+	usbi_dbg("event thread %d: poll() %d fds with timeout in %dms",
+		part->index, part->nfds, timeout_ms);
+	r = usbi_poll(part->fds, part->nfds, timeout_ms);
+	usbi_dbg("event thread %d: poll() returned %d", part->index, r);
+	if (r == -1 && errno == EINTR) {
+		return LIBUSB_ERROR_INTERRUPTED;
+	} else if (r < 0) {
+		usbi_err(ctx, "poll failed %d err=%d\n", r, errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	/* fds[0] is always the wake pipe */
+	if (r > 0 && part->fds[0].revents) {
+		unsigned char dummy[16];
+
+		if (usbi_read(part->wake_pipe[0], dummy, sizeof(dummy)) <= 0)
+			usbi_warn(ctx, "internal signalling read failed");
+		part->fds[0].revents = 0;
+		r--;
+	}
+
+	if (r > 0) {
+		r = usbi_backend->handle_events(ctx, part->fds, part->nfds, r);
+		if (r) {
+			usbi_err(ctx, "backend handle_events failed with error %d", r);
+			return r;
+		}
+	}
+
+	return handle_heap_timeouts(ctx, part);
+}
+
+/* whether some thread is waiting to modify the poll fds */
+static int pollfds_being_modified(struct libusb_context *ctx)
+{
+	unsigned int r;
+
+	usbi_mutex_lock(&ctx->pollfd_modify_lock);
+	r = ctx->pollfd_modify;
+	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	return r != 0;
+}
+
+static void *event_partition_main(void *arg)
+{
+	struct usbi_event_partition *part = arg;
+	struct libusb_context *ctx = part->ctx;
+	int r;
+
+	usbi_dbg("event thread %d started", part->index);
+	while (!usbi_atomic_load(&ctx->event_thread_stop)) {
+		/* like the main event thread, give way to whoever is modifying
+		 * the poll fds, see libusb_close() */
+		if (pollfds_being_modified(ctx)) {
+			struct timeval tv = { 0, 100000 };
+
+			libusb_lock_event_waiters(ctx);
+			if (pollfds_being_modified(ctx))
+				libusb_wait_for_event(ctx, &tv);
+			libusb_unlock_event_waiters(ctx);
+			continue;
+		}
+
+		usbi_mutex_lock(&part->lock);
+		r = handle_partition_events(part);
+		usbi_mutex_unlock(&part->lock);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_dbg("event handling failed with error %d", r);
+
+		/* what libusb_unlock_events() does for the main event thread */
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		usbi_cond_broadcast(&ctx->event_waiters_cond);
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+	}
+	usbi_dbg("event thread %d stopped", part->index);
+	return NULL;
+}
+
+static int init_event_partition(struct libusb_context *ctx,
+	struct usbi_event_partition *part, int index)
+{
+	part->ctx = ctx;
+	part->index = index;
+	part->fds = NULL;
+	part->handles = NULL;
+	part->nfds = 0;
+	part->pollfds_modified = 1;
+	part->timeout_heap.nodes = NULL;
+	part->timeout_heap.len = 0;
+	part->timeout_heap.size = 0;
+	part->wake_pending = 0;
+	if (usbi_pipe(part->wake_pipe) < 0)
+		return LIBUSB_ERROR_OTHER;
+	usbi_mutex_init_recursive(&part->lock, NULL);
+	usbi_mutex_init(&part->timeout_heap_lock, NULL);
+	return 0;
+}
+
+static void exit_event_partition(struct usbi_event_partition *part)
+{
+	usbi_close(part->wake_pipe[0]);
+	usbi_close(part->wake_pipe[1]);
+	free(part->fds);
+	free(part->handles);
+	free(part->timeout_heap.nodes);
+	usbi_mutex_destroy(&part->lock);
+	usbi_mutex_destroy(&part->timeout_heap_lock);
+}
+
+/* interrupt the current event handler, if any, and take the events lock
+ * from it, the way libusb_close() does */
+static void take_over_events(struct libusb_context *ctx)
+{
+	unsigned char dummy = 1;
+	ssize_t r;
+
+	usbi_mutex_lock(&ctx->pollfd_modify_lock);
+	ctx->pollfd_modify++;
+	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+
+	r = usbi_write(ctx->ctrl_pipe[1], &dummy, sizeof(dummy));
+	if (r <= 0)
+		usbi_warn(ctx, "internal signalling write failed");
+	libusb_lock_events(ctx);
+	if (r > 0 && usbi_read(ctx->ctrl_pipe[0], &dummy, sizeof(dummy)) <= 0)
+		usbi_warn(ctx, "internal signalling read failed");
+}
+
+static void release_events(struct libusb_context *ctx)
+{
+	usbi_mutex_lock(&ctx->pollfd_modify_lock);
+	ctx->pollfd_modify--;
+	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	libusb_unlock_events(ctx);
+}
+
+/* split the open device handles between the main event thread and the
+ * threads of num - 1 event partitions, or hand them all back to the main
+ * event thread if parts is NULL. must be called with the events lock held. */
+static void set_event_partitions(struct libusb_context *ctx,
+	struct usbi_event_partition *parts, int num)
+{
+	struct libusb_device_handle *handle;
+#ifdef USBI_EPOLL_AVAILABLE
+	struct usbi_pollfd *ipollfd;
+#endif
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	/* threads reading the count without the locks must never see it
+	 * cover partitions that are not there */
+	if (parts)
+		ctx->event_partitions = parts;
+	ctx->num_event_partitions = num;
+	ctx->next_event_partition = 0;
+	list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle)
+		handle->event_partition = (int)(ctx->next_event_partition++
+			% (unsigned int)num);
+	mark_pollfds_modified(ctx);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
+			sync_epoll_fd(ctx, ipollfd);
+#endif
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+
+	/* move the pending timeouts over to the heaps of the new partitions */
+	list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+		usbi_mutex_lock(&handle->flying_transfers_lock);
+		if (update_handle_timeout(handle) < 0)
+			usbi_warn(ctx, "failed to move the timeouts of device %d.%d",
+				handle->dev->bus_number, handle->dev->device_address);
+		usbi_mutex_unlock(&handle->flying_transfers_lock);
+	}
+
+	if (!parts) {
+		usbi_mutex_lock(&ctx->pollfds_lock);
+		ctx->event_partitions = NULL;
+		usbi_mutex_unlock(&ctx->pollfds_lock);
+	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+}
+
+/* hand all device handles back to the main event thread, and free the
+ * event partitions, whose threads must have been stopped */
+static void free_event_partitions(struct libusb_context *ctx)
+{
+	struct usbi_event_partition *parts = ctx->event_partitions;
+	int num = ctx->num_event_partitions;
+	int i;
+
+	if (!parts)
+		return;
+
+	take_over_events(ctx);
+	set_event_partitions(ctx, NULL, 1);
+	release_events(ctx);
+
+	for (i = 0; i < num - 1; i++)
+		exit_event_partition(&parts[i]);
+	free(parts);
+}
+
+/* stop the threads, the main event thread and those of the first num event
+ * partitions */
+static void stop_event_threads(struct libusb_context *ctx, int num)
+{
+	unsigned char dummy = 1;
+	int i;
+
+	usbi_atomic_store(&ctx->event_thread_stop, 1);
+	usbi_fd_notification(ctx);
+	for (i = 0; i < num; i++)
+		if (usbi_write(ctx->event_partitions[i].wake_pipe[1], &dummy,
+				sizeof(dummy)) <= 0)
+			usbi_warn(ctx, "internal signalling write failed");
+
+	usbi_thread_join(ctx->event_thread);
+	for (i = 0; i < num; i++)
+		usbi_thread_join(ctx->event_partitions[i].thread);
+}
+
+/** \ingroup poll
+ * Start the internal event thread of a context. From then on, the event
+ * thread takes care of all event handling for the context, and
+ * libusb_handle_events() and its variants only wait for transfer completions.
+ * See \ref pollthread for details.
+ *
+ * This is the same as calling libusb_start_event_threads() with a single
+ * thread.
+ *
+ * This function must not be called concurrently with
+ * libusb_stop_event_thread() on the same context.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param mode how the event thread delivers transfer completions
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if the event thread is already running
+ * \returns LIBUSB_ERROR_INVALID_PARAM if mode is not valid
+ * \returns LIBUSB_ERROR_OTHER if the thread could not be created
+ */
+int API_EXPORTED libusb_start_event_thread(libusb_context *ctx,
+	enum libusb_event_thread_mode mode)
+{
+	return libusb_start_event_threads(ctx, mode, 1);
+}
+
+/** \ingroup poll
+ * Start several internal event threads for a context, which split the event
+ * handling of its open devices between them. Each thread polls its own share
+ * of the device handles and handles their timeouts, so that the handling of
+ * many busy devices is spread over as many cores. The first thread also
+ * takes care of the events that are not specific to a device, like hotplug
+ * notifications. See \ref pollthread for details.
+ *
+ * The devices that are open when the threads start, and those opened later,
+ * are handed out to the threads in turn. Transfer completions are delivered
+ * as they are with a single event thread: in the
+ * \ref libusb_event_thread_mode::LIBUSB_EVENT_THREAD_INLINE "inline" mode,
+ * callbacks are invoked on the thread serving the device of the transfer,
+ * so the callbacks of different devices may run concurrently. Such callbacks
+ * must not close device handles; use the
+ * \ref libusb_event_thread_mode::LIBUSB_EVENT_THREAD_QUEUED "queued" mode
+ * if completions need to.
+ *
+ * Splitting the event handling needs support from the backend, which the
+ * Linux and Darwin backends have. Elsewhere, for example on Windows, where
+ * all device I/O completes into the port polled by the first thread, a
+ * single event thread is started whatever num_threads is.
+ *
+ * libusb_stop_event_thread() stops all the threads. This function must not
+ * be called concurrently with it on the same context.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param mode how the event threads deliver transfer completions
+ * \param num_threads the number of event threads, 1 or more
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if the event threads are already running
+ * \returns LIBUSB_ERROR_INVALID_PARAM if mode or num_threads is not valid
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_OTHER if a thread could not be created
+ */
+int API_EXPORTED libusb_start_event_threads(libusb_context *ctx,
+	enum libusb_event_thread_mode mode, int num_threads)
+{
+	struct usbi_event_partition *parts;
+	int i;
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+	if ((mode != LIBUSB_EVENT_THREAD_INLINE
+			&& mode != LIBUSB_EVENT_THREAD_QUEUED) || num_threads < 1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (usbi_atomic_load(&ctx->event_thread_running))
+		return LIBUSB_ERROR_BUSY;
+	if (num_threads > 1 && !(usbi_backend->caps & USBI_CAP_EVENT_PARTITIONS)) {
+		usbi_dbg("backend cannot split event handling, using one thread");
+		num_threads = 1;
+	}
+
+	if (num_threads > 1) {
+		parts = calloc(num_threads - 1, sizeof(*parts));
+		if (!parts)
+			return LIBUSB_ERROR_NO_MEM;
+		for (i = 0; i < num_threads - 1; i++) {
+			r = init_event_partition(ctx, &parts[i], i + 1);
+			if (r < 0) {
+				while (i--)
+					exit_event_partition(&parts[i]);
+				free(parts);
+				return r;
+			}
+		}
+
+		take_over_events(ctx);
+		set_event_partitions(ctx, parts, num_threads);
+		release_events(ctx);
+	}
+
+	usbi_atomic_store(&ctx->event_thread_stop, 0);
+	usbi_atomic_store(&ctx->queue_completions,
+		mode == LIBUSB_EVENT_THREAD_QUEUED);
+	r = usbi_thread_create(&ctx->event_thread, event_thread_main, ctx);
+	if (r) {
+		usbi_err(ctx, "failed to create event thread, error %d", r);
+		goto err;
+	}
+
+	for (i = 0; i < num_threads - 1; i++) {
+		r = usbi_thread_create(&ctx->event_partitions[i].thread,
+			event_partition_main, &ctx->event_partitions[i]);
+		if (r) {
+			usbi_err(ctx, "failed to create event thread %d, error %d",
+				i + 1, r);
+			stop_event_threads(ctx, i);
+			goto err;
+		}
+	}
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_atomic_store(&ctx->event_thread_running, 1);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	return 0;
+
+err:
+	usbi_atomic_store(&ctx->queue_completions, 0);
+	free_event_partitions(ctx);
+	return LIBUSB_ERROR_OTHER;
+}
+
+/** \ingroup poll
+ * Stop the internal event threads of a context, if they are running. On
+ * return, event handling is back in the hands of the application.
+ * Completions that the event threads queued but that were not dispatched yet
+ * are dispatched by the next call to libusb_handle_events() or one of its
+ * variants.
+ *
+ * This function must not be called from a transfer callback, nor
+ * concurrently with libusb_start_event_thread() on the same context.
+ * libusb_exit() stops the event threads automatically.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ */
+void API_EXPORTED libusb_stop_event_thread(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (!usbi_atomic_load(&ctx->event_thread_running))
+		return;
+
+	stop_event_threads(ctx, ctx->num_event_partitions - 1);
+	usbi_atomic_store(&ctx->queue_completions, 0);
+	free_event_partitions(ctx);
+
+	/* waiters go back to handling events by themselves */
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_atomic_store(&ctx->event_thread_running, 0);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
 /** \ingroup poll
  * Handle any pending events by polling file descriptors, without checking if
  * any other threads are already doing so. Must be called with the event lock
@@ -2222,45 +4433,29 @@ int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
 int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv)
 {
-	struct usbi_transfer *transfer;
+	struct usbi_timeout_node *node;
 	struct timespec cur_ts;
 	struct timeval cur_tv;
-	struct timeval *next_timeout;
+	struct timeval next_timeout;
 	int r;
-	int found = 0;
 
 	USBI_GET_CONTEXT(ctx);
 	if (usbi_using_timerfd(ctx))
 		return 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg("no URBs, no timeout!");
-		return 0;
-	}
-
-	/* find next transfer which hasn't already been processed as timed out */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* no timeout for this transfer? */
-		if (!timerisset(&transfer->timeout))
-			continue;
-
-		found = 1;
-		break;
-	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	/* the heap only holds transfers which haven't already been processed
+	 * as timed out, and whose timeout isn't handled by the OS */
+	usbi_mutex_lock(&ctx->timeout_heap_lock);
+	node = timeout_heap_first(&ctx->timeout_heap);
+	if (node)
+		next_timeout = node->tv;
+	usbi_mutex_unlock(&ctx->timeout_heap_lock);
 
-	if (!found) {
+	if (!node) {
 		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
 		return 0;
 	}
 
-	next_timeout = &transfer->timeout;
-
 	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &cur_ts);
 	if (r < 0) {
 		usbi_err(ctx, "failed to read monotonic clock, errno=%d", errno);
@@ -2268,11 +4463,11 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	}
 	TIMESPEC_TO_TIMEVAL(&cur_tv, &cur_ts);
 
-	if (!timercmp(&cur_tv, next_timeout, <)) {
+	if (!timercmp(&cur_tv, &next_timeout, <)) {
 		usbi_dbg("first timeout already expired");
 		timerclear(tv);
 	} else {
-		timersub(next_timeout, &cur_tv, tv);
+		timersub(&next_timeout, &cur_tv, tv);
 		usbi_dbg("next timeout in %d.%06ds", tv->tv_sec, tv->tv_usec);
 	}
 
@@ -2289,6 +4484,10 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
  * Note that file descriptors may have been added even before you register
  * these notifiers (e.g. at libusb_init() time).
  *
+ * When libusbx uses epoll for event handling, the single file descriptor
+ * returned by libusb_get_pollfds() remains valid for the lifetime of the
+ * context, and these notifiers are never called.
+ *
  * Additionally, note that the removal notifier may be called during
  * libusb_exit() (e.g. when it is closing file descriptors that were opened
  * and added to the poll set at libusb_init() time). If you don't want this,
@@ -2310,27 +4509,64 @@ void API_EXPORTED libusb_set_pollfd_notifiers(libusb_context *ctx,
 	ctx->fd_cb_user_data = user_data;
 }
 
-/* Add a file descriptor to the list of file descriptors to be monitored.
- * events should be specified as a bitmask of events passed to poll(), e.g.
- * POLLIN and/or POLLOUT. */
-int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
+static int add_pollfd(struct libusb_context *ctx,
+	struct libusb_device_handle *handle, int fd, short events)
 {
 	struct usbi_pollfd *ipollfd = malloc(sizeof(*ipollfd));
+	struct usbi_event_partition *part = NULL;
+
 	if (!ipollfd)
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_dbg("add fd %d events %d", fd, events);
 	ipollfd->pollfd.fd = fd;
 	ipollfd->pollfd.events = events;
+	ipollfd->handle = handle;
 	usbi_mutex_lock(&ctx->pollfds_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+	ipollfd->in_epoll = 0;
+	if (usbi_using_epoll(ctx) && sync_epoll_fd(ctx, ipollfd) < 0) {
+		usbi_mutex_unlock(&ctx->pollfds_lock);
+		free(ipollfd);
+		return LIBUSB_ERROR_OTHER;
+	}
+#endif
 	list_add_tail(&ipollfd->list, &ctx->pollfds);
+	mark_pollfds_modified(ctx);
+
+	/* the thread of the partition picks the fd up on its next iteration */
+	if (handle)
+		part = handle_event_partition(handle);
+	if (part) {
+		unsigned char dummy = 1;
+		if (usbi_write(part->wake_pipe[1], &dummy, sizeof(dummy)) <= 0)
+			usbi_warn(ctx, "internal signalling write failed");
+	}
 	usbi_mutex_unlock(&ctx->pollfds_lock);
 
-	if (ctx->fd_added_cb)
+	/* with epoll, applications only ever see the epoll fd */
+	if (ctx->fd_added_cb && !usbi_using_epoll(ctx))
 		ctx->fd_added_cb(fd, events, ctx->fd_cb_user_data);
 	return 0;
 }
 
+/* Add a file descriptor to the list of file descriptors to be monitored.
+ * events should be specified as a bitmask of events passed to poll(), e.g.
+ * POLLIN and/or POLLOUT. */
+int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
+{
+	return add_pollfd(ctx, NULL, fd, events);
+}
+
+/* Same as usbi_add_pollfd(), but also records the device handle the file
+ * descriptor belongs to, so that backends can retrieve it in handle_events
+ * through usbi_pollfd_handle(). */
+int usbi_add_handle_pollfd(struct libusb_device_handle *handle, int fd,
+	short events)
+{
+	return add_pollfd(HANDLE_CTX(handle), handle, fd, events);
+}
+
 /* Remove a file descriptor from the list of file descriptors to be polled. */
 void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 {
@@ -2351,10 +4587,16 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 		return;
 	}
 
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx) && ipollfd->in_epoll &&
+			epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+		usbi_dbg("failed to remove fd %d from epoll set (errno %d)", fd, errno);
+#endif
 	list_del(&ipollfd->list);
+	mark_pollfds_modified(ctx);
 	usbi_mutex_unlock(&ctx->pollfds_lock);
 	free(ipollfd);
-	if (ctx->fd_removed_cb)
+	if (ctx->fd_removed_cb && !usbi_using_epoll(ctx))
 		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
 }
 
@@ -2365,6 +4607,10 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
  * The returned list is NULL-terminated and should be freed with free() when
  * done. The actual list contents must not be touched.
  *
+ * When libusbx was built with epoll support (<tt>--enable-epoll</tt>) on
+ * Linux, the list only ever contains a single file descriptor, to be polled
+ * for POLLIN, which aggregates all of libusbx's internal event sources.
+ *
  * As file descriptors are a Unix-specific concept, this function is not
  * available on Windows and will always return NULL.
  *
@@ -2384,6 +4630,15 @@ const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 	size_t cnt = 0;
 	USBI_GET_CONTEXT(ctx);
 
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		ret = calloc(2, sizeof(struct libusb_pollfd *));
+		if (ret)
+			ret[0] = &ctx->epoll_pollfd;
+		return (const struct libusb_pollfd **) ret;
+	}
+#endif
+
 	usbi_mutex_lock(&ctx->pollfds_lock);
 	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
 		cnt++;
@@ -2411,7 +4666,6 @@ out:
  */
 void usbi_handle_disconnect(struct libusb_device_handle *handle)
 {
-	struct usbi_transfer *cur;
 	struct usbi_transfer *to_cancel;
 
 	usbi_dbg("device %d.%d",
@@ -2431,14 +4685,12 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle)
 	 */
 
 	while (1) {
-		usbi_mutex_lock(&HANDLE_CTX(handle)->flying_transfers_lock);
+		usbi_mutex_lock(&handle->flying_transfers_lock);
 		to_cancel = NULL;
-		list_for_each_entry(cur, &HANDLE_CTX(handle)->flying_transfers, list, struct usbi_transfer)
-			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur)->dev_handle == handle) {
-				to_cancel = cur;
-				break;
-			}
-		usbi_mutex_unlock(&HANDLE_CTX(handle)->flying_transfers_lock);
+		if (!list_empty(&handle->flying_transfers))
+			to_cancel = list_entry(handle->flying_transfers.next,
+				struct usbi_transfer, list);
+		usbi_mutex_unlock(&handle->flying_transfers_lock);
 
 		if (!to_cancel)
 			break;
@@ -130,7 +130,7 @@ typedef unsigned __int32  uint32_t;
  * Internally, LIBUSBX_API_VERSION is defined as follows:
  * (libusbx major << 24) | (libusbx minor << 16) | (16 bit incremental)
  */
-#define LIBUSBX_API_VERSION 0x010000FF
+#define LIBUSBX_API_VERSION 0x01000112
 
 #ifdef __cplusplus
 extern "C" {
@@ -303,7 +303,12 @@ enum libusb_transfer_type {
 	LIBUSB_TRANSFER_TYPE_BULK = 2,
 
 	/** Interrupt endpoint */
-	LIBUSB_TRANSFER_TYPE_INTERRUPT = 3
+	LIBUSB_TRANSFER_TYPE_INTERRUPT = 3,
+
+	/** Bulk transfer on a USB 3.0 bulk stream, see libusb_alloc_streams().
+	 * Only valid as \ref libusb_transfer::type "transfer type", never
+	 * found in an endpoint descriptor. */
+	LIBUSB_TRANSFER_TYPE_BULK_STREAM = 4
 };
 
 /** \ingroup misc
@@ -905,6 +910,7 @@ struct libusb_iso_packet_descriptor {
 };
 
 struct libusb_transfer;
+struct libusb_transfer_pool;
 
 /** \ingroup asyncio
  * Asynchronous transfer callback function type. When submitting asynchronous
@@ -981,6 +987,135 @@ struct libusb_transfer {
 	;
 };
 
+/** \ingroup asyncio
+ * Number of buckets of the latency histogram of \ref libusb_transfer_stats.
+ */
+#define LIBUSB_TRANSFER_STATS_BUCKETS 24
+
+/** \ingroup asyncio
+ * Statistics on the transfers of an endpoint, or of a whole context, as
+ * returned by libusb_get_endpoint_stats() and libusb_get_context_stats().
+ * All counters only ever increase, so that rates can be computed by sampling
+ * them at regular intervals. See \ref asyncstats.
+ */
+struct libusb_transfer_stats {
+	/** Number of transfers that completed, whatever their status */
+	uint64_t transfers;
+
+	/** Number of transfers that completed with status
+	 * \ref libusb_transfer_status::LIBUSB_TRANSFER_COMPLETED
+	 * "LIBUSB_TRANSFER_COMPLETED" */
+	uint64_t completed;
+
+	/** Number of completed transfers that transferred less data than
+	 * requested */
+	uint64_t short_transfers;
+
+	/** Number of transfers that failed with LIBUSB_TRANSFER_ERROR */
+	uint64_t errors;
+
+	/** Number of transfers that timed out */
+	uint64_t timeouts;
+
+	/** Number of transfers that were cancelled */
+	uint64_t cancelled;
+
+	/** Number of transfers that failed with LIBUSB_TRANSFER_STALL */
+	uint64_t stalls;
+
+	/** Number of transfers that failed with LIBUSB_TRANSFER_NO_DEVICE */
+	uint64_t no_device;
+
+	/** Number of transfers that failed with LIBUSB_TRANSFER_OVERFLOW */
+	uint64_t overflows;
+
+	/** Total number of bytes requested by the transfers, excluding the setup
+	 * packet of control transfers */
+	uint64_t bytes_requested;
+
+	/** Total number of bytes actually transferred */
+	uint64_t bytes_transferred;
+
+	/** Sum of the latencies of all the transfers, in microseconds. The
+	 * latency of a transfer runs from its submission to its completion being
+	 * handled, before its callback is invoked. */
+	uint64_t latency_total_us;
+
+	/** Lowest latency seen, in microseconds */
+	uint32_t latency_min_us;
+
+	/** Highest latency seen, in microseconds */
+	uint32_t latency_max_us;
+
+	/** Latency histogram. Bucket 0 counts the transfers that completed in
+	 * less than 2 microseconds, bucket N > 0 the transfers that took between
+	 * 2^N and 2^(N+1) microseconds, and the last bucket also counts all the
+	 * slower transfers. */
+	uint64_t latency_histogram[LIBUSB_TRANSFER_STATS_BUCKETS];
+};
+
+/** \ingroup asyncio
+ * Points in the life of a transfer reported to a trace callback, see
+ * \ref asynctrace.
+ */
+enum libusb_trace_event {
+	/** The transfer has been handed to the operating system */
+	LIBUSB_TRACE_SUBMIT = 0,
+
+	/** The backend reaped a completed request of the transfer from the
+	 * operating system. Transfers split into several requests report one
+	 * event per request. Only backends that reap requests individually,
+	 * such as usbfs on Linux, report this event. */
+	LIBUSB_TRACE_REAP = 1,
+
+	/** The transfer completed and its callback is about to be invoked */
+	LIBUSB_TRACE_COMPLETE = 2,
+
+	/** The timeout of the transfer expired and it is being cancelled */
+	LIBUSB_TRACE_TIMEOUT = 3,
+};
+
+/** \ingroup asyncio
+ * A trace event, as passed to a \ref libusb_trace_cb.
+ */
+struct libusb_trace_record {
+	/** The transfer the event is about, which identifies it across events.
+	 * The transfer must not be accessed from the trace callback. */
+	struct libusb_transfer *transfer;
+
+	/** Address of the endpoint of the transfer */
+	unsigned char endpoint;
+
+	/** Type of the endpoint from \ref libusb_transfer_type */
+	unsigned char type;
+
+	/** For LIBUSB_TRACE_SUBMIT and LIBUSB_TRACE_TIMEOUT, the length of the
+	 * transfer. For LIBUSB_TRACE_REAP, the number of bytes transferred by the
+	 * reaped request, and for LIBUSB_TRACE_COMPLETE, by the whole transfer. */
+	int length;
+
+	/** For LIBUSB_TRACE_COMPLETE, the \ref libusb_transfer_status of the
+	 * transfer. For LIBUSB_TRACE_REAP, the status the operating system gave
+	 * to the request, 0 on success. Otherwise 0. */
+	int status;
+
+	/** Time of the event on the monotonic clock, in nanoseconds */
+	uint64_t timestamp_ns;
+};
+
+/** \ingroup asyncio
+ * Trace callback, set with libusb_set_trace_cb(). It is invoked while
+ * libusbx holds internal locks, so it must return quickly and must not call
+ * any libusbx function.
+ * \param ctx the context of the transfer
+ * \param event the point the transfer has reached
+ * \param record details of the event, only valid during the callback
+ * \param user_data user data pointer specified in libusb_set_trace_cb()
+ */
+typedef void (LIBUSB_CALL *libusb_trace_cb)(libusb_context *ctx,
+	enum libusb_trace_event event, const struct libusb_trace_record *record,
+	void *user_data);
+
 /** \ingroup misc
  * Capabilities supported by this instance of libusb. Test if the loaded
  * library supports a given capability by calling
@@ -989,6 +1124,10 @@ struct libusb_transfer {
 enum libusb_capability {
 	/** The libusb_has_capability() API is available. */
 	LIBUSB_CAP_HAS_CAPABILITY = 0,
+	/** Hotplug support is available on this platform, see \ref hotplug. */
+	LIBUSB_CAP_HAS_HOTPLUG = 0x0001,
+	/** Transfer statistics are recorded, see \ref asyncstats. */
+	LIBUSB_CAP_HAS_TRANSFER_STATS = 0x0002,
 };
 
 /** \ingroup lib
@@ -1009,15 +1148,82 @@ enum libusb_log_level {
 	LIBUSB_LOG_LEVEL_DEBUG,
 };
 
+/** \ingroup lib
+ * Callback function for receiving log messages, set with
+ * libusb_set_log_cb(). The message is formatted the way it would have been
+ * printed to stderr, without the trailing newline.
+ * \param ctx the context the message was logged for
+ * \param level the verbosity level of the message
+ * \param str the message, only valid for the duration of the callback
+ * \param user_data user data pointer specified in libusb_set_log_cb()
+ * \see msglog
+ */
+typedef void (LIBUSB_CALL *libusb_log_cb)(libusb_context *ctx,
+	enum libusb_log_level level, const char *str, void *user_data);
+
 int LIBUSB_CALL libusb_init(libusb_context **ctx);
 void LIBUSB_CALL libusb_exit(libusb_context *ctx);
 void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level);
+void LIBUSB_CALL libusb_set_log_cb(libusb_context *ctx, libusb_log_cb cb,
+	void *user_data);
+int LIBUSB_CALL libusb_set_log_ring(libusb_context *ctx, int num_messages);
+int LIBUSB_CALL libusb_drain_log(libusb_context *ctx);
 const struct libusb_version * LIBUSB_CALL libusb_get_version(void);
 int LIBUSB_CALL libusb_has_capability(uint32_t capability);
 const char * LIBUSB_CALL libusb_error_name(int errcode);
 
+/** \ingroup dev
+ * Wildcard for the integer fields of \ref libusb_device_filter.
+ */
+#define LIBUSB_DEVICE_FILTER_ANY -1
+
+/** \ingroup dev
+ * Criteria for libusb_get_device_list_filtered(). A device is listed if it
+ * matches all of them. Use libusb_init_device_filter() to start from a
+ * filter that matches any device.
+ */
+struct libusb_device_filter {
+	/** idVendor to match, or LIBUSB_DEVICE_FILTER_ANY */
+	int vendor_id;
+
+	/** idProduct to match, or LIBUSB_DEVICE_FILTER_ANY */
+	int product_id;
+
+	/** bDeviceClass to match, or LIBUSB_DEVICE_FILTER_ANY */
+	int dev_class;
+
+	/** Bus number to match, or LIBUSB_DEVICE_FILTER_ANY */
+	int bus_number;
+
+	/** Number of entries in port_numbers, or 0 to match any port path */
+	int port_numbers_len;
+
+	/** Port path from the root hub to match, as returned by
+	 * libusb_get_port_path(). As per the USB 3.0 specs, the maximum depth
+	 * is 7. */
+	uint8_t port_numbers[7];
+};
+
+/** \ingroup dev
+ * Set up a \ref libusb_device_filter that matches any device, for the caller
+ * to narrow down.
+ *
+ * \param filter the filter to initialize
+ */
+static inline void libusb_init_device_filter(
+	struct libusb_device_filter *filter)
+{
+	filter->vendor_id = LIBUSB_DEVICE_FILTER_ANY;
+	filter->product_id = LIBUSB_DEVICE_FILTER_ANY;
+	filter->dev_class = LIBUSB_DEVICE_FILTER_ANY;
+	filter->bus_number = LIBUSB_DEVICE_FILTER_ANY;
+	filter->port_numbers_len = 0;
+}
+
 ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx,
 	libusb_device ***list);
+ssize_t LIBUSB_CALL libusb_get_device_list_filtered(libusb_context *ctx,
+	const struct libusb_device_filter *filter, libusb_device ***list);
 void LIBUSB_CALL libusb_free_device_list(libusb_device **list,
 	int unref_devices);
 libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev);
@@ -1073,6 +1279,19 @@ int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev,
 int LIBUSB_CALL libusb_attach_kernel_driver(libusb_device_handle *dev,
 	int interface_number);
 
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev,
+	size_t length);
+int LIBUSB_CALL libusb_set_max_urbs_per_transfer(libusb_device_handle *dev,
+	int max_urbs);
+
+int LIBUSB_CALL libusb_alloc_streams(libusb_device_handle *dev,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
+int LIBUSB_CALL libusb_free_streams(libusb_device_handle *dev,
+	unsigned char *endpoints, int num_endpoints);
+
+int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev,
+	unsigned char *buffer, size_t length);
+
 /* async I/O */
 
 /** \ingroup asyncio
@@ -1147,8 +1366,28 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int count);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_cancel_endpoint_transfers(
+	libusb_device_handle *dev_handle, unsigned char endpoint);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
+void LIBUSB_CALL libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id);
+uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_get_endpoint_stats(libusb_device_handle *dev,
+	unsigned char endpoint, struct libusb_transfer_stats *stats);
+int LIBUSB_CALL libusb_get_context_stats(libusb_context *ctx,
+	struct libusb_transfer_stats *stats);
+void LIBUSB_CALL libusb_set_trace_cb(libusb_context *ctx, libusb_trace_cb cb,
+	void *user_data);
+
+struct libusb_transfer_pool * LIBUSB_CALL libusb_alloc_transfer_pool(
+	libusb_context *ctx, int count, int iso_packets, int max_length);
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_pool_transfer(
+	struct libusb_transfer_pool *pool);
+void LIBUSB_CALL libusb_free_transfer_pool(struct libusb_transfer_pool *pool);
 
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -1223,6 +1462,49 @@ static inline void libusb_fill_bulk_transfer(struct libusb_transfer *transfer,
 	transfer->callback = callback;
 }
 
+/** \ingroup asyncio
+ * Helper function to populate the required \ref libusb_transfer fields
+ * for a bulk transfer on a stream allocated with libusb_alloc_streams().
+ *
+ * \param transfer the transfer to populate
+ * \param dev_handle handle of the device that will handle the transfer
+ * \param endpoint address of the endpoint where this transfer will be sent
+ * \param stream_id bulk stream id for this transfer
+ * \param buffer data buffer
+ * \param length length of data buffer
+ * \param callback callback function to be invoked on transfer completion
+ * \param user_data user data to pass to callback function
+ * \param timeout timeout for the transfer in milliseconds
+ */
+static inline void libusb_fill_bulk_stream_transfer(
+	struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+	unsigned char endpoint, uint32_t stream_id,
+	unsigned char *buffer, int length, libusb_transfer_cb_fn callback,
+	void *user_data, unsigned int timeout)
+{
+	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer,
+		length, callback, user_data, timeout);
+	transfer->type = LIBUSB_TRANSFER_TYPE_BULK_STREAM;
+	libusb_transfer_set_stream_id(transfer, stream_id);
+}
+
+/** \ingroup asyncio
+ * A segment of the data of a vectored bulk transfer, see
+ * libusb_fill_bulk_transfer_iov().
+ */
+struct libusb_iovec {
+	/** Start of the segment */
+	unsigned char *buffer;
+
+	/** Length of the segment */
+	int length;
+};
+
+void LIBUSB_CALL libusb_fill_bulk_transfer_iov(
+	struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+	unsigned char endpoint, const struct libusb_iovec *iov, int num_iov,
+	libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout);
+
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
  * for an interrupt transfer.
@@ -1387,6 +1669,142 @@ int LIBUSB_CALL libusb_interrupt_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *actual_length, unsigned int timeout);
 
+/** \ingroup syncio
+ * The outcome of opening a device with libusb_open_devices().
+ */
+struct libusb_open_result {
+	/** The device to open, set by the caller. */
+	libusb_device *dev;
+
+	/** Handle on the device, or NULL if it could not be opened. To be closed
+	 * with libusb_close(). */
+	libusb_device_handle *handle;
+
+	/** 0 if the device was opened and its strings read, or the
+	 * LIBUSB_ERROR code of the first step that failed. */
+	int status;
+
+	/** Manufacturer string in ASCII, empty if the device has none or it
+	 * could not be read. */
+	unsigned char manufacturer[128];
+
+	/** Product string in ASCII, empty if the device has none or it could
+	 * not be read. */
+	unsigned char product[128];
+
+	/** Serial number string in ASCII, empty if the device has none or it
+	 * could not be read. */
+	unsigned char serial_number[128];
+};
+
+int LIBUSB_CALL libusb_open_devices(struct libusb_open_result *results,
+	int num_results, unsigned int timeout);
+
+/* streaming I/O */
+
+struct libusb_stream;
+
+/** \ingroup stream
+ * Stream callback function type. libusbx calls this function for every
+ * transfer of a stream that completes. See \ref stream for more
+ * information.
+ * \param stream the stream the chunk belongs to
+ * \param buffer for IN streams, the data received. For OUT streams, the
+ * buffer to fill with the next chunk to send.
+ * \param length the number of bytes that were transferred from or to
+ * buffer
+ * \param status the status of the transfer, see \ref libusb_transfer_status
+ * \param user_data the user data passed to libusb_stream_open()
+ * \returns a negative value to stop the stream. Otherwise, 0 for IN streams,
+ * or the number of bytes put in buffer for OUT streams.
+ */
+typedef int (LIBUSB_CALL *libusb_stream_cb_fn)(struct libusb_stream *stream,
+	unsigned char *buffer, int length, enum libusb_transfer_status status,
+	void *user_data);
+
+/** \ingroup stream
+ * A packet received by an isochronous stream.
+ */
+struct libusb_iso_packet {
+	/** Data of the packet, within the stream's ring buffer */
+	unsigned char *data;
+
+	/** Amount of data that was received */
+	unsigned int length;
+
+	/** Status code for the packet */
+	enum libusb_transfer_status status;
+
+	/** Estimated time at which the packet was received, on the monotonic
+	 * clock */
+	struct timeval timestamp;
+};
+
+/** \ingroup stream
+ * Isochronous stream callback function type. libusbx calls this function
+ * for every batch of packets an isochronous stream receives. See
+ * \ref stream for more information.
+ * \param stream the stream the packets belong to
+ * \param packets the packets of the batch, in the order they were received
+ * \param num_packets the number of packets in the batch
+ * \param user_data the user data passed to libusb_stream_open_iso()
+ * \returns a negative value to stop the stream, 0 otherwise
+ */
+typedef int (LIBUSB_CALL *libusb_iso_stream_cb_fn)(
+	struct libusb_stream *stream, const struct libusb_iso_packet *packets,
+	int num_packets, void *user_data);
+
+/** \ingroup stream
+ * A report received by an interrupt stream.
+ */
+struct libusb_interrupt_report {
+	/** Data of the report, valid until the stream callback returns */
+	unsigned char *data;
+
+	/** Amount of data that was received */
+	unsigned int length;
+
+	/** Status code for the report. Anything other than
+	 * LIBUSB_TRANSFER_COMPLETED means that a transfer failed and the stream
+	 * is stopping. */
+	enum libusb_transfer_status status;
+
+	/** Time at which the report was received, on the monotonic clock */
+	struct timeval timestamp;
+};
+
+/** \ingroup stream
+ * Interrupt stream callback function type. libusbx calls this function
+ * for every batch of reports an interrupt stream receives. See
+ * \ref stream for more information.
+ * \param stream the stream the reports belong to
+ * \param reports the reports of the batch, in the order they were received
+ * \param num_reports the number of reports in the batch
+ * \param user_data the user data passed to libusb_stream_open_interrupt()
+ * \returns a negative value to stop the stream, 0 otherwise
+ */
+typedef int (LIBUSB_CALL *libusb_interrupt_stream_cb_fn)(
+	struct libusb_stream *stream,
+	const struct libusb_interrupt_report *reports, int num_reports,
+	void *user_data);
+
+int LIBUSB_CALL libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int depth, int chunk_size,
+	libusb_stream_cb_fn callback, void *user_data,
+	struct libusb_stream **stream);
+int LIBUSB_CALL libusb_stream_open_iso(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int depth, int packets_per_transfer,
+	int packet_size, unsigned char *ring, size_t ring_size,
+	libusb_iso_stream_cb_fn callback, void *user_data,
+	struct libusb_stream **stream);
+int LIBUSB_CALL libusb_stream_open_interrupt(
+	libusb_device_handle *dev_handle, unsigned char endpoint, int depth,
+	int report_size, int batch_size, unsigned int max_delay_ms,
+	libusb_interrupt_stream_cb_fn callback, void *user_data,
+	struct libusb_stream **stream);
+void LIBUSB_CALL libusb_stream_stop(struct libusb_stream *stream);
+int LIBUSB_CALL libusb_stream_close(struct libusb_stream *stream);
+
 /** \ingroup desc
  * Retrieve a descriptor from the default control pipe.
  * This is a convenience function which formulates the appropriate control
@@ -1432,6 +1850,25 @@ static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
 int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	uint8_t desc_index, unsigned char *data, int length);
 
+/** \ingroup desc
+ * Callback function type for libusb_get_string_descriptor_ascii_async().
+ *
+ * \param dev_handle the device handle the string was asked of
+ * \param desc_index the index of the string descriptor
+ * \param status the length of the string in data, or a LIBUSB_ERROR code
+ * on failure
+ * \param data the buffer given to libusb_get_string_descriptor_ascii_async()
+ * \param user_data user data given to
+ * libusb_get_string_descriptor_ascii_async()
+ */
+typedef void (LIBUSB_CALL *libusb_string_cb_fn)(libusb_device_handle *dev_handle,
+	uint8_t desc_index, int status, unsigned char *data, void *user_data);
+
+int LIBUSB_CALL libusb_get_string_descriptor_ascii_async(
+	libusb_device_handle *dev_handle, uint8_t desc_index,
+	unsigned char *data, int length, libusb_string_cb_fn cb,
+	void *user_data, unsigned int timeout);
+
 /* polling and timeouts */
 
 int LIBUSB_CALL libusb_try_lock_events(libusb_context *ctx);
@@ -1455,6 +1892,26 @@ int LIBUSB_CALL libusb_pollfds_handle_timeouts(libusb_context *ctx);
 int LIBUSB_CALL libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv);
 
+/** \ingroup poll
+ * Ways for the internal event thread of a context to deliver transfer
+ * completions, see \ref pollthread and libusb_start_event_thread().
+ */
+enum libusb_event_thread_mode {
+	/** Transfer callbacks are invoked on the event thread */
+	LIBUSB_EVENT_THREAD_INLINE = 0,
+
+	/** Completed transfers are queued by the event thread, and their
+	 * callbacks invoked by the application threads that call
+	 * libusb_handle_events() or one of its variants */
+	LIBUSB_EVENT_THREAD_QUEUED = 1,
+};
+
+int LIBUSB_CALL libusb_start_event_thread(libusb_context *ctx,
+	enum libusb_event_thread_mode mode);
+int LIBUSB_CALL libusb_start_event_threads(libusb_context *ctx,
+	enum libusb_event_thread_mode mode, int num_threads);
+void LIBUSB_CALL libusb_stop_event_thread(libusb_context *ctx);
+
 /** \ingroup poll
  * File descriptor for polling
  */
@@ -1499,6 +1956,66 @@ void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx,
 	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
 	void *user_data);
 
+/** \ingroup hotplug
+ * Callback handle, returned by libusb_hotplug_register_callback() and used
+ * to deregister the callback.
+ */
+typedef int libusb_hotplug_callback_handle;
+
+/** \ingroup hotplug
+ * Hotplug events. Can be combined when registering a callback.
+ */
+typedef enum {
+	/** A device has been plugged in and is ready to use */
+	LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED = 0x01,
+
+	/** A device has left and is no longer available. It is the
+	 * responsibility of the application to close any handle of it. */
+	LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT = 0x02,
+} libusb_hotplug_event;
+
+/** \ingroup hotplug
+ * Flags for libusb_hotplug_register_callback().
+ */
+typedef enum {
+	/** Report the devices already present with
+	 * LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED events before returning */
+	LIBUSB_HOTPLUG_ENUMERATE = 1,
+} libusb_hotplug_flag;
+
+/** \ingroup hotplug
+ * Wildcard for the vendor ID, product ID and device class filters of
+ * libusb_hotplug_register_callback().
+ */
+#define LIBUSB_HOTPLUG_MATCH_ANY -1
+
+/** \ingroup hotplug
+ * Hotplug callback function type. Callbacks are invoked from within event
+ * handling, like transfer callbacks, except for those made by
+ * libusb_hotplug_register_callback() itself with LIBUSB_HOTPLUG_ENUMERATE.
+ *
+ * The device is only guaranteed to stay valid for the duration of the
+ * callback, use libusb_ref_device() to keep it. A callback may call any
+ * libusbx function, except that libusb_open() must not be used on a device
+ * that is leaving.
+ *
+ * \param ctx context of this notification
+ * \param device the device that arrived or left
+ * \param event the event, one of \ref libusb_hotplug_event
+ * \param user_data user data pointer given at registration
+ * \returns 1 to deregister this callback, 0 to keep it
+ */
+typedef int (LIBUSB_CALL *libusb_hotplug_callback_fn)(libusb_context *ctx,
+	libusb_device *device, libusb_hotplug_event event, void *user_data);
+
+int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context *ctx,
+	libusb_hotplug_event events, libusb_hotplug_flag flags,
+	int vendor_id, int product_id, int dev_class,
+	libusb_hotplug_callback_fn cb_fn, void *user_data,
+	libusb_hotplug_callback_handle *handle);
+void LIBUSB_CALL libusb_hotplug_deregister_callback(libusb_context *ctx,
+	libusb_hotplug_callback_handle handle);
+
 #ifdef __cplusplus
 }
 #endif
@@ -131,6 +131,20 @@ static inline void *usbi_reallocf(void *ptr, size_t size)
 
 #define TIMESPEC_IS_SET(ts) ((ts)->tv_sec != 0 || (ts)->tv_nsec != 0)
 
+/* messages above this level are compiled out entirely. can be lowered at
+ * build time, e.g. with CFLAGS=-DUSBI_MAX_LOG_LEVEL=LIBUSB_LOG_LEVEL_WARNING */
+#ifndef USBI_MAX_LOG_LEVEL
+#define USBI_MAX_LOG_LEVEL LIBUSB_LOG_LEVEL_DEBUG
+#endif
+
+/* the highest verbosity any context has ever been set to. it only grows, so
+ * that the logging macros can skip formatting and argument evaluation for a
+ * message no context will print, without looking up a context first. */
+extern int usbi_log_level_max;
+
+#define usbi_log_enabled(level) \
+	((level) <= USBI_MAX_LOG_LEVEL && (level) <= usbi_log_level_max)
+
 void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, ...);
 
@@ -140,7 +154,10 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 #if !defined(_MSC_VER) || _MSC_VER >= 1400
 
 #ifdef ENABLE_LOGGING
-#define _usbi_log(ctx, level, ...) usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__)
+#define _usbi_log(ctx, level, ...) do { \
+	if (usbi_log_enabled(level)) \
+		usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__); \
+	} while (0)
 #define usbi_dbg(...) _usbi_log(NULL, LIBUSB_LOG_LEVEL_DEBUG, __VA_ARGS__)
 #else
 #define _usbi_log(ctx, level, ...) do { (void)(ctx); } while(0)
@@ -157,6 +174,8 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 #define LOG_BODY(ctxt, level) \
 {                             \
 	va_list args;             \
+	if (!usbi_log_enabled(level)) \
+		return;               \
 	va_start (args, format);  \
 	usbi_log_v(ctxt, level, "", format, args); \
 	va_end(args);             \
@@ -220,33 +239,151 @@ int usbi_gettimeofday(struct timeval *tp, void *tzp);
 
 extern struct libusb_context *usbi_default_context;
 
+/* binary min-heap of timeouts. nodes are embedded in the structure whose
+ * timeout they hold, and keep track of their own position in the heap so that
+ * they can be removed in O(log n). */
+struct usbi_timeout_node {
+	struct timeval tv;
+	/* position in the heap, or -1 if not in any heap */
+	int heap_idx;
+};
+
+struct usbi_timeout_heap {
+	struct usbi_timeout_node **nodes;
+	int len;
+	int size;
+};
+
+/* an additional event thread of a context, serving its own share of the
+ * device handles, see libusb_start_event_threads(). the main event thread
+ * serves partition 0 along with the context-wide fds and timeouts, these
+ * serve the partitions from 1 up. */
+struct usbi_event_partition {
+	struct libusb_context *ctx;
+	int index;
+	usbi_thread_t thread;
+
+	/* held by the thread while it handles events, and by libusb_close()
+	 * to keep it away from a device handle that is being closed */
+	usbi_mutex_t lock;
+
+	/* written to to interrupt the poll() of the thread */
+	int wake_pipe[2];
+
+	/* the poll fds of the device handles of the partition, wake pipe
+	 * first, rebuilt by the thread from the pollfds list of the context
+	 * when pollfds_modified is set. pollfds_modified is protected by the
+	 * pollfds_lock of the context. */
+	struct pollfd *fds;
+	struct libusb_device_handle **handles;
+	POLL_NFDS_TYPE nfds;
+	int pollfds_modified;
+
+	/* the counterpart of the timeout heap of the context for the device
+	 * handles of the partition. wake_pending is set while a wakeup for a
+	 * new next timeout has not been seen by the thread yet. */
+	struct usbi_timeout_heap timeout_heap;
+	usbi_mutex_t timeout_heap_lock;
+	int wake_pending;
+};
+
+#define USBI_SESSION_HASH_SIZE	64
+
+#define USBI_LOG_LINE_SIZE	256
+
+/* a formatted message waiting in a log ring. seq tells producers and the
+ * consumer whose turn it is to use the slot, see core.c. */
+struct usbi_log_entry {
+	volatile long seq;
+	enum libusb_log_level level;
+	char str[USBI_LOG_LINE_SIZE];
+};
+
+struct usbi_log_ring {
+	volatile long head;
+	long tail;
+	long size;
+	volatile long dropped;
+	struct usbi_log_entry entries[0];
+};
+
+
 struct libusb_context {
 	int debug;
 	int debug_fixed;
 
+	/* where formatted messages go instead of stderr. the ring is set at most
+	 * once and then lives until libusb_exit(), so that producers can use it
+	 * without locking. log_lock serializes the consumers. */
+	libusb_log_cb log_cb;
+	void *log_cb_user_data;
+	struct usbi_log_ring *log_ring;
+	usbi_mutex_t log_lock;
+
 	/* internal control pipe, used for interrupting event handling when
 	 * something needs to modify poll fds. */
 	int ctrl_pipe[2];
 
+	/* all the devices of the context, also hashed on their session ID */
 	struct list_head usb_devs;
+	struct list_head usb_devs_hash[USBI_SESSION_HASH_SIZE];
 	usbi_mutex_t usb_devs_lock;
 
+	/* the result of the last enumeration, holding a reference on each
+	 * device, and the backend stamp it was taken with. reused by
+	 * libusb_get_device_list() as long as the stamp does not change.
+	 * device_list_lock protects both, and serializes enumerations. */
+	struct discovered_devs *device_list;
+	unsigned long device_list_stamp;
+	usbi_mutex_t device_list_lock;
+
+	/* registered hotplug callbacks, and the notifications waiting for event
+	 * handling to deliver them, see hotplug.c. hotplug_lock protects both.
+	 * hotplug_pipe wakes up event handling when a notification is queued. */
+	struct list_head hotplug_cbs;
+	struct list_head hotplug_msgs;
+	libusb_hotplug_callback_handle next_hotplug_cb_handle;
+	int hotplug_dispatching;
+	usbi_mutex_t hotplug_lock;
+	int hotplug_pipe[2];
+
+	/* entry in active_contexts_list, for backends to notify each context
+	 * of hotplug events */
+	struct list_head list;
+
 	/* A list of open handles. Backends are free to traverse this if required.
 	 */
 	struct list_head open_devs;
 	usbi_mutex_t open_devs_lock;
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
-	struct list_head flying_transfers;
-	usbi_mutex_t flying_transfers_lock;
+#ifdef ENABLE_TRANSFER_STATS
+	/* statistics of the handles that have been closed, for
+	 * libusb_get_context_stats(). protected by open_devs_lock. */
+	struct libusb_transfer_stats closed_stats;
+#endif
+
+	/* in-flight transfers are tracked by each device handle. this heap only
+	 * holds the device handles that have at least one pending timeout, keyed
+	 * on the earliest of them, so that the next timeout for the whole context
+	 * is always found at the top. timeout_heap_lock protects the heap and the
+	 * next_timeout node of all handles, and nests inside the
+	 * flying_transfers_lock of any device handle. */
+	struct usbi_timeout_heap timeout_heap;
+	usbi_mutex_t timeout_heap_lock;
 
 	/* list of poll fds */
 	struct list_head pollfds;
 	usbi_mutex_t pollfds_lock;
 
+	/* array of poll fds handed to usbi_poll(), along with the device handle
+	 * (if any) that owns each entry. both are rebuilt from the pollfds list
+	 * by the event handler only when pollfds_modified is set, and are only
+	 * ever accessed while holding the events lock. */
+	struct pollfd *pollfds_cache;
+	struct libusb_device_handle **pollfds_cache_handles;
+	POLL_NFDS_TYPE pollfds_cache_cnt;
+	int pollfds_modified;
+
 	/* a counter that is set when we want to interrupt event handling, in order
 	 * to modify the poll fd set. and a lock to protect it. */
 	unsigned int pollfd_modify;
@@ -257,6 +394,10 @@ struct libusb_context {
 	libusb_pollfd_removed_cb fd_removed_cb;
 	void *fd_cb_user_data;
 
+	/* user callback for transfer trace events, see usbi_trace() */
+	libusb_trace_cb trace_cb;
+	void *trace_cb_user_data;
+
 	/* ensures that only one thread is handling events at any one time */
 	usbi_mutex_t events_lock;
 
@@ -268,11 +409,46 @@ struct libusb_context {
 	usbi_mutex_t event_waiters_lock;
 	usbi_cond_t event_waiters_cond;
 
+	/* internal event thread, see libusb_start_event_thread(). while it is
+	 * running, it is the only thread to do event handling and other threads
+	 * calling libusb_handle_events*() simply wait for completions. */
+	usbi_thread_t event_thread;
+	int event_thread_running;
+	int event_thread_stop;
+
+	/* set when the event thread queues completed transfers instead of
+	 * invoking their callbacks. the queue is a lock-free stack, linked
+	 * through usbi_transfer.next_completed and most recent first, that is
+	 * drained in one go by whichever thread dispatches the completions. */
+	int queue_completions;
+	struct usbi_transfer * volatile completed_transfers;
+
+	/* number of event threads, and the additional ones beyond the main
+	 * event thread. each device handle is served by the thread of its
+	 * event_partition, those out of range by the main event thread. both
+	 * only change in libusb_start_event_threads() and
+	 * libusb_stop_event_thread(), while holding the events lock, the
+	 * open_devs_lock and the pollfds_lock. next_event_partition hands out
+	 * partitions round-robin under the pollfds_lock. */
+	int num_event_partitions;
+	struct usbi_event_partition *event_partitions;
+	unsigned int next_event_partition;
+
 #ifdef USBI_TIMERFD_AVAILABLE
 	/* used for timeout handling, if supported by OS.
 	 * this timerfd is maintained to trigger on the next pending timeout */
 	int timerfd;
 #endif
+
+#ifdef USBI_EPOLL_AVAILABLE
+	/* used for event handling, if supported by OS.
+	 * all the fds of the pollfds list are registered with this epoll fd,
+	 * which is the only one exposed to applications through
+	 * libusb_get_pollfds(). */
+	int epoll_fd;
+	struct libusb_pollfd epoll_pollfd;
+	struct epoll_event *epoll_events;
+#endif
 };
 
 #ifdef USBI_TIMERFD_AVAILABLE
@@ -281,12 +457,28 @@ struct libusb_context {
 #define usbi_using_timerfd(ctx) (0)
 #endif
 
+#ifdef USBI_EPOLL_AVAILABLE
+#define usbi_using_epoll(ctx) ((ctx)->epoll_fd >= 0)
+#else
+#define usbi_using_epoll(ctx) (0)
+#endif
+
 struct libusb_device {
-	/* lock protects refcnt, everything else is finalized at initialization
-	 * time */
+	/* lock protects refcnt and the configuration and string caches,
+	 * everything else is finalized at initialization time */
 	usbi_mutex_t lock;
 	int refcnt;
 
+	/* parsed configuration descriptors, filled in on demand: one per index,
+	 * and the active one. the latter is forgotten whenever the configuration
+	 * may have changed, which bumps active_config_gen. */
+	struct usbi_config_descriptor **configs;
+	struct usbi_config_descriptor *active_config;
+	unsigned int active_config_gen;
+
+	/* string descriptors read from the device, see usbi_cache_string() */
+	struct usbi_string_descriptor *strings;
+
 	struct libusb_context *ctx;
 
 	uint8_t bus_number;
@@ -296,21 +488,91 @@ struct libusb_device {
 	uint8_t num_configurations;
 	enum libusb_speed speed;
 
+	/* as read by usbi_sanitize_device(), for hotplug filters to work on
+	 * devices that have left */
+	struct libusb_device_descriptor device_descriptor;
+
+	/* set while the context holds a reference on the device for being
+	 * attached, see usbi_connect_device(). protected by the
+	 * device_list_lock of the context. */
+	int attached;
+
 	struct list_head list;
+	struct list_head hash_list;
 	unsigned long session_data;
 	unsigned char os_priv[0];
 };
 
+/* an endpoint of a claimed interface, as seen by a device handle. */
+struct usbi_endpoint {
+	uint8_t claimed;	/* set if the rest is valid */
+	uint8_t interface;	/* bInterfaceNumber of the owning interface */
+	uint8_t type;	/* enum libusb_transfer_type */
+	uint8_t pipe_ref;	/* for the backend to use, left alone by the core */
+	uint16_t max_packet_size;
+};
+
 struct libusb_device_handle {
-	/* lock protects claimed_interfaces */
+	/* lock protects claimed_interfaces and endpoints */
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
+	/* the endpoints of the current altsettings of the claimed interfaces,
+	 * indexed by usbi_handle_endpoint(). rebuilt by the core when interfaces
+	 * are claimed, released or switched to another altsetting. */
+	struct usbi_endpoint endpoints[USB_MAXENDPOINTS];
+
+	/* this is a list of in-flight transfers for this handle, in no particular
+	 * order. the transfers that have a timeout which hasn't been handled yet
+	 * are also kept in timeout_heap, so that the transfer to time out the
+	 * soonest is found at the top. transfers with infinite timeout are never
+	 * placed in the heap. both are protected by flying_transfers_lock.
+	 * next_timeout is the entry of this handle in the heap of the context,
+	 * or in that of timeout_partition if it is not NULL. */
+	struct list_head flying_transfers;
+	struct usbi_timeout_heap timeout_heap;
+	usbi_mutex_t flying_transfers_lock;
+	struct usbi_timeout_node next_timeout;
+	struct usbi_event_partition *timeout_partition;
+
+	/* the number of libusb_cancel_endpoint_transfers() calls cancelling
+	 * transfers they collected from flying_transfers. no transfer of the
+	 * handle leaves the list while it is not 0, cancel_walks_cond is
+	 * signalled when it drops to 0. protected by flying_transfers_lock. */
+	int cancel_walks;
+	usbi_cond_t cancel_walks_cond;
+
+	/* the event thread serving this handle, see
+	 * libusb_context.event_partitions. protected by the pollfds_lock of
+	 * the context. */
+	int event_partition;
+
+#ifdef ENABLE_TRANSFER_STATS
+	/* statistics of the completed transfers of each endpoint, indexed by
+	 * usbi_endpoint_index(). protected by flying_transfers_lock. */
+	struct libusb_transfer_stats stats[USB_MAXENDPOINTS];
+#endif
+
 	struct list_head list;
 	struct libusb_device *dev;
 	unsigned char os_priv[0];
 };
 
+/* index of an endpoint address in the per endpoint arrays of a handle */
+static inline int usbi_endpoint_index(unsigned char endpoint)
+{
+	return (endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK)
+		| ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) >> 3);
+}
+
+/* look up an endpoint of a device handle by its address. the result is only
+ * meaningful if its claimed field is set. */
+static inline struct usbi_endpoint *usbi_handle_endpoint(
+	struct libusb_device_handle *handle, unsigned char endpoint)
+{
+	return &handle->endpoints[usbi_endpoint_index(endpoint)];
+}
+
 enum {
   USBI_CLOCK_MONOTONIC,
   USBI_CLOCK_REALTIME
@@ -332,10 +594,34 @@ enum {
 struct usbi_transfer {
 	int num_iso_packets;
 	struct list_head list;
-	struct timeval timeout;
+	struct usbi_timeout_node timeout;
 	int transferred;
+	/* bulk stream of LIBUSB_TRANSFER_TYPE_BULK_STREAM transfers */
+	uint32_t stream_id;
 	uint8_t flags;
 
+	/* the pool this transfer was taken from, or NULL if it was allocated
+	 * with libusb_alloc_transfer() */
+	struct libusb_transfer_pool *pool;
+	/* set while the transfer is in the free stack of its pool. protected
+	 * by the lock of the pool */
+	int in_pool;
+
+	/* segments of a vectored transfer, see usbi_transfer_has_iov(), and the
+	 * buffer they are linearized into for backends lacking
+	 * USBI_CAP_BULK_IOV */
+	const struct libusb_iovec *iov;
+	int num_iov;
+	unsigned char *iov_bounce;
+
+	/* link in the completion queue of the context */
+	struct usbi_transfer *next_completed;
+
+#ifdef ENABLE_TRANSFER_STATS
+	/* monotonic time of submission, for the latency statistics */
+	struct timespec submit_time;
+#endif
+
 	/* this lock is held during libusb_submit_transfer() and
 	 * libusb_cancel_transfer() (allowing the OS backend to prevent duplicate
 	 * cancellation, submission-during-cancellation, etc). the OS backend
@@ -361,6 +647,9 @@ enum usbi_transfer_flags {
 
 	/* Set by backend submit_transfer() if the fds in use have been updated */
 	USBI_TRANSFER_UPDATED_FDS = 1 << 4,
+
+	/* The backend accepted the last submission of the transfer */
+	USBI_TRANSFER_SUBMITTED = 1 << 5,
 };
 
 #define USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer) \
@@ -370,6 +659,34 @@ enum usbi_transfer_flags {
 	((struct usbi_transfer *)(((unsigned char *)(transfer)) \
 		- sizeof(struct usbi_transfer)))
 
+/* A fixed set of transfers allocated up front by libusb_alloc_transfer_pool().
+ * Transfers are handed out from and returned to the free stack under lock;
+ * the OS private area of each transfer survives across uses so that the
+ * backend can keep its per-submission state allocated. */
+struct libusb_transfer_pool {
+	struct libusb_context *ctx;
+	usbi_mutex_t lock;
+
+	int count;
+	int iso_packets;
+	size_t transfer_size;
+	unsigned char *transfers;
+
+	int num_free;
+	struct usbi_transfer **free_transfers;
+};
+
+/* A transfer filled by libusb_fill_bulk_transfer_iov() has no buffer of its
+ * own. Setting a buffer turns it back into a regular transfer. */
+static inline int usbi_transfer_has_iov(struct usbi_transfer *itransfer)
+{
+	return itransfer->num_iov > 0
+		&& !USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->buffer;
+}
+
+void usbi_iov_move(struct usbi_transfer *itransfer, int offset,
+	const unsigned char *src, int len);
+
 static inline void *usbi_transfer_get_os_priv(struct usbi_transfer *transfer)
 {
 	return ((unsigned char *)transfer) + sizeof(struct usbi_transfer)
@@ -395,17 +712,73 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	unsigned long session_id);
 struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id);
+struct libusb_device *usbi_ref_device_by_session_id(
+	struct libusb_context *ctx, unsigned long session_id);
 int usbi_sanitize_device(struct libusb_device *dev);
 void usbi_handle_disconnect(struct libusb_device_handle *handle);
 
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer);
+int usbi_remove_from_flying_list(struct usbi_transfer *transfer);
+void usbi_wait_for_cancel_walks(struct libusb_device_handle *handle);
+void usbi_init_flying_list(struct libusb_device_handle *handle);
+void usbi_exit_flying_list(struct libusb_device_handle *handle);
+void usbi_retire_transfer_stats(struct libusb_device_handle *handle);
+void usbi_trace_event(struct libusb_context *ctx,
+	enum libusb_trace_event event, struct libusb_transfer *transfer,
+	int length, int status);
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define usbi_trace_probe(name, transfer, length, status) \
+	DTRACE_PROBE4(libusb, name, (transfer), (transfer)->endpoint, \
+		(length), (status))
+#else
+#define usbi_trace_probe(name, transfer, length, status) do {} while (0)
+#endif
+
+/* report that a transfer reached one of the points of enum
+ * libusb_trace_event: through the USDT probe of that name when libusbx is
+ * built with --enable-usdt, and to the trace callback of the context if
+ * there is one. costs a single test when neither is in use. */
+#define usbi_trace(ctx, name, event, transfer, length, status) do { \
+	usbi_trace_probe(name, transfer, length, status); \
+	if ((ctx)->trace_cb) \
+		usbi_trace_event(ctx, event, transfer, length, status); \
+	} while (0)
+int usbi_transfers_pending(struct libusb_context *ctx);
+int usbi_sync_control_transfer(struct libusb_transfer *transfer);
 
 int usbi_parse_descriptor(unsigned char *source, const char *descriptor,
 	void *dest, int host_endian);
 int usbi_get_config_index_by_value(struct libusb_device *dev,
 	uint8_t bConfigurationValue, int *idx);
+void usbi_invalidate_active_config(struct libusb_device *dev);
+void usbi_clear_config_cache(struct libusb_device *dev);
+int usbi_get_cached_string(struct libusb_device *dev, uint8_t desc_index,
+	uint16_t langid, unsigned char *data, int length);
+void usbi_cache_string(struct libusb_device *dev, uint8_t desc_index,
+	uint16_t langid, const unsigned char *data, int length);
+void usbi_clear_string_cache(struct libusb_device *dev);
+int usbi_string_to_ascii(const unsigned char *desc, int len,
+	unsigned char *data, int length);
+int usbi_control_transfer_result(struct libusb_transfer *transfer);
+
+/* hotplug */
+
+/* the contexts in use, for backends that monitor hotplug events on
+ * behalf of all of them */
+extern struct list_head active_contexts_list;
+extern usbi_mutex_static_t active_contexts_lock;
+
+void usbi_hotplug_init(struct libusb_context *ctx);
+void usbi_hotplug_exit(struct libusb_context *ctx);
+void usbi_hotplug_dispatch(struct libusb_context *ctx);
+void usbi_hotplug_notification(struct libusb_context *ctx,
+	struct libusb_device *dev, libusb_hotplug_event event);
+void usbi_connect_device(struct libusb_device *dev, int notify);
+void usbi_disconnect_device(struct libusb_device *dev);
 
 /* polling */
 
@@ -413,13 +786,34 @@ struct usbi_pollfd {
 	/* must come first */
 	struct libusb_pollfd pollfd;
 
+	/* device handle this fd belongs to, or NULL */
+	struct libusb_device_handle *handle;
+
+#ifdef USBI_EPOLL_AVAILABLE
+	/* whether the fd is registered with the epoll fd of the context, which
+	 * it is unless an event partition polls it */
+	int in_epoll;
+#endif
+
 	struct list_head list;
 };
 
 int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events);
+int usbi_add_handle_pollfd(struct libusb_device_handle *handle, int fd,
+	short events);
 void usbi_remove_pollfd(struct libusb_context *ctx, int fd);
 void usbi_fd_notification(struct libusb_context *ctx);
 
+/* for use by backends in handle_events: returns the device handle that
+ * registered the fd at fds[index], or NULL if the fd is not handle specific */
+struct libusb_device_handle *usbi_pollfd_handle(struct libusb_context *ctx,
+	struct pollfd *fds, POLL_NFDS_TYPE index);
+
+void usbi_assign_event_partition(struct libusb_device_handle *handle);
+struct usbi_event_partition *usbi_lock_event_partition(
+	struct libusb_device_handle *handle);
+void usbi_unlock_event_partition(struct usbi_event_partition *part);
+
 /* device discovery */
 
 /* we traverse usbfs without knowing how many devices we are going to find.
@@ -850,6 +1244,15 @@ struct usbi_os_backend {
 	 * above functions. For isochronous transfers, populate the status and
 	 * transferred fields of the iso packet descriptors of the transfer.
 	 *
+	 * If a file descriptor was registered through usbi_add_handle_pollfd(),
+	 * usbi_pollfd_handle() can be used to get the device handle that owns
+	 * fds[i] without having to search for it.
+	 *
+	 * With several event threads, see libusb_start_event_threads(), this
+	 * function is called concurrently for disjoint sets of fds, each device
+	 * handle being served by a single thread. The handles cannot be closed
+	 * while this function handles their fds.
+	 *
 	 * This function should also be able to detect disconnection of the
 	 * device, reporting that situation with usbi_handle_disconnect().
 	 *
@@ -898,13 +1301,180 @@ struct usbi_os_backend {
 	/* FIXME: linux can't use this any more. if other OS's cannot either,
 	 * then remove this */
 	size_t add_iso_packet_size;
+
+	/* Prepare the private data of a transfer that belongs to a transfer
+	 * pool, so that submissions of up to max_length bytes (or with up to
+	 * the transfer's number of iso packets) do not need to allocate memory.
+	 *
+	 * Any private data allocated here must be released in
+	 * destroy_transfer_priv().
+	 *
+	 * Optional. Backends which use positional initializers can leave this
+	 * and the following member out.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_MEM on memory allocation failure
+	 */
+	int (*prealloc_transfer_priv)(struct usbi_transfer *itransfer,
+		int max_length);
+
+	/* Release any private data still attached to a transfer that is about to
+	 * be freed. Called from libusb_free_transfer(), and for pooled transfers
+	 * when their pool is destroyed. This allows backends to keep
+	 * per-submission state attached to a transfer until it is freed.
+	 *
+	 * Optional.
+	 */
+	void (*destroy_transfer_priv)(struct usbi_transfer *itransfer);
+
+	/* Allocate memory that the device can do I/O on directly, e.g. DMA
+	 * memory mapped from the kernel, so that transfers using it as their
+	 * buffer are not copied to and from an OS buffer.
+	 *
+	 * Optional.
+	 *
+	 * Return a pointer to the memory, or NULL on failure.
+	 */
+	unsigned char *(*dev_mem_alloc)(struct libusb_device_handle *handle,
+		size_t len);
+
+	/* Free memory allocated through dev_mem_alloc().
+	 *
+	 * Optional, but must be provided along with dev_mem_alloc().
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - another LIBUSB_ERROR code on failure
+	 */
+	int (*dev_mem_free)(struct libusb_device_handle *handle,
+		unsigned char *buffer, size_t len);
+
+	/* Allocate num_streams USB 3.0 bulk streams on each of the given
+	 * endpoints, for LIBUSB_TRANSFER_TYPE_BULK_STREAM transfers.
+	 *
+	 * Optional.
+	 *
+	 * Return:
+	 * - the number of streams allocated, which may be less than requested
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*alloc_streams)(struct libusb_device_handle *handle,
+		uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
+
+	/* Free the bulk streams allocated through alloc_streams().
+	 *
+	 * Optional, but must be provided along with alloc_streams().
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*free_streams)(struct libusb_device_handle *handle,
+		unsigned char *endpoints, int num_endpoints);
+
+	/* Limit how many URBs (or whatever the OS splits transfers into) of a
+	 * single bulk or interrupt transfer of the handle are outstanding at
+	 * once, the others being submitted as earlier ones complete. 0 means
+	 * no limit. Only affects transfers submitted afterwards.
+	 *
+	 * Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - another LIBUSB_ERROR code on failure
+	 */
+	int (*set_max_urbs)(struct libusb_device_handle *handle, int max_urbs);
+
+	/* Optional features of the backend, see the USBI_CAP_* flags below. */
+	uint32_t caps;
+
+	/* Perform a control transfer synchronously, blocking the calling thread
+	 * until it completes. The synchronous I/O functions call this instead of
+	 * going through an asynchronous transfer whenever the calling thread is
+	 * not needed for event handling in the meantime.
+	 *
+	 * The arguments are the ones of libusb_control_transfer(): data is the
+	 * buffer of wLength bytes for the data stage, and timeout is in
+	 * milliseconds. It is only called for transfers with a timeout, as a
+	 * request without one may not be interruptible once in the kernel.
+	 *
+	 * Optional. Backends may also return LIBUSB_ERROR_NOT_SUPPORTED for the
+	 * requests they cannot handle this way, which then go through the
+	 * asynchronous path as usual.
+	 *
+	 * Return:
+	 * - the number of bytes of the data stage transferred on success
+	 * - LIBUSB_ERROR_TIMEOUT if the transfer timed out
+	 * - LIBUSB_ERROR_PIPE if the request was not supported by the device
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - LIBUSB_ERROR_NOT_SUPPORTED as described above
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*sync_control_transfer)(struct libusb_device_handle *handle,
+		uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *data, uint16_t wLength,
+		unsigned int timeout);
+
+	/* Get a stamp of the set of devices attached to the system, which the
+	 * library uses to tell whether the result of the previous
+	 * get_device_list() call is still current. The stamp must change
+	 * whenever a device may have been attached or detached since the last
+	 * call. It need not be unique, but the backend must refuse to give one
+	 * when it cannot tell changes apart, e.g. at the time of a change.
+	 *
+	 * Optional. Without it, every call to libusb_get_device_list() goes
+	 * through get_device_list().
+	 *
+	 * Return:
+	 * - 0 on success, with the stamp stored in *stamp
+	 * - another LIBUSB_ERROR code if no stamp can be given for now, in which
+	 *   case the device list is enumerated again and not kept
+	 */
+	int (*get_device_list_stamp)(struct libusb_context *ctx,
+		unsigned long *stamp);
+
+	/* Like get_device_list(), but for the devices matching a filter only.
+	 * The backend should leave the other devices out as early as it can,
+	 * before allocating or initializing anything for them.
+	 *
+	 * The library filters the discovered devices again, so the backend
+	 * may let through those it cannot tell apart cheaply, and may ignore
+	 * the criteria it has no quick way to check.
+	 *
+	 * Optional. Without it, libusb_get_device_list_filtered() enumerates
+	 * all the devices and filters them itself.
+	 *
+	 * Return 0 on success, or a LIBUSB_ERROR code on failure.
+	 */
+	int (*get_device_list_filtered)(struct libusb_context *ctx,
+		const struct libusb_device_filter *filter,
+		struct discovered_devs **discdevs);
 };
 
-extern const struct usbi_os_backend * const usbi_backend;
+/* The backend can submit vectored bulk transfers (usbi_transfer_has_iov())
+ * as they are. Otherwise the library copies them to and from a contiguous
+ * buffer. */
+#define USBI_CAP_BULK_IOV		0x00010000
+
+/* The backend monitors device arrivals and departures, and reports them with
+ * usbi_connect_device() and usbi_disconnect_device(). */
+#define USBI_CAP_HAS_HOTPLUG	0x00020000
+
+/* handle_events can be called concurrently from several event threads, each
+ * polling the fds of its own share of the device handles, and the I/O of a
+ * handle only ever wakes up the thread that polls its fds. Without it, the
+ * library never starts more than one event thread. */
+#define USBI_CAP_EVENT_PARTITIONS	0x00040000
+
+extern const struct usbi_os_backend *usbi_backend;
 
 extern const struct usbi_os_backend linux_usbfs_backend;
 extern const struct usbi_os_backend darwin_backend;
 extern const struct usbi_os_backend openbsd_backend;
 extern const struct usbi_os_backend windows_backend;
+extern const struct usbi_os_backend mock_backend;
 
 #endif
@@ -67,6 +67,9 @@ static int darwin_claim_interface(struct libusb_device_handle *dev_handle, int i
 static int darwin_release_interface(struct libusb_device_handle *dev_handle, int iface);
 static int darwin_reset_device(struct libusb_device_handle *dev_handle);
 static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0);
+static int darwin_get_new_device (struct libusb_context *ctx, usb_device_t **device, UInt32 locationID,
+                                  UInt32 parent_location, UInt8 port, struct libusb_device *last_dev,
+                                  struct libusb_device **_dev);
 
 #ifdef ENABLE_LOGGING
 static const char *darwin_error_str (int result) {
@@ -130,28 +133,13 @@ static int darwin_to_libusb (int result) {
 
 
 static int ep_to_pipeRef(struct libusb_device_handle *dev_handle, uint8_t ep, uint8_t *pipep, uint8_t *ifcp) {
-  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)dev_handle->os_priv;
-
-  /* current interface */
-  struct darwin_interface *cInterface;
-
-  int8_t i, iface;
-
-  usbi_dbg ("converting ep address 0x%02x to pipeRef and interface", ep);
-
-  for (iface = 0 ; iface < USB_MAXINTERFACES ; iface++) {
-    cInterface = &priv->interfaces[iface];
+  /* pipe references are kept in the endpoint table of the handle, see get_endpoints */
+  struct usbi_endpoint *endpoint = usbi_handle_endpoint (dev_handle, ep);
 
-    if (dev_handle->claimed_interfaces & (1 << iface)) {
-      for (i = 0 ; i < cInterface->num_endpoints ; i++) {
-        if (cInterface->endpoint_addrs[i] == ep) {
-          *pipep = i + 1;
-          *ifcp = iface;
-          usbi_dbg ("pipe %d on interface %d matches", *pipep, *ifcp);
-          return 0;
-        }
-      }
-    }
+  if (endpoint->pipe_ref && (dev_handle->claimed_interfaces & (1 << endpoint->interface))) {
+    *pipep = endpoint->pipe_ref;
+    *ifcp = endpoint->interface;
+    return 0;
   }
 
   /* No pipe found with the correct endpoint address */
@@ -160,23 +148,55 @@ static int ep_to_pipeRef(struct libusb_device_handle *dev_handle, uint8_t ep, ui
   return -1;
 }
 
-static int usb_setup_device_iterator (io_iterator_t *deviceIterator, long location) {
+/* forget the pipe references of the endpoints of an interface */
+static void clear_pipe_refs (struct libusb_device_handle *dev_handle, int iface) {
+  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)dev_handle->os_priv;
+  struct darwin_interface *cInterface = &priv->interfaces[iface];
+  int i;
+
+  for (i = 0 ; i < cInterface->num_endpoints ; i++)
+    usbi_handle_endpoint (dev_handle, cInterface->endpoint_addrs[i])->pipe_ref = 0;
+
+  cInterface->num_endpoints = 0;
+}
+
+static void set_match_number (CFMutableDictionaryRef propertyMatchDict, CFStringRef key, SInt32 value) {
+  CFTypeRef valueCF = CFNumberCreate (NULL, kCFNumberSInt32Type, &value);
+
+  if (valueCF) {
+    CFDictionarySetValue (propertyMatchDict, key, valueCF);
+    /* release our reference to the CFNumber (CFDictionarySetValue retains it) */
+    CFRelease (valueCF);
+  }
+}
+
+/* filter, if not NULL, narrows the iterator down to the devices with the idVendor, idProduct and bDeviceClass it asks for */
+static int usb_setup_device_iterator (io_iterator_t *deviceIterator, long location, const struct libusb_device_filter *filter) {
   CFMutableDictionaryRef matchingDict = IOServiceMatching(kIOUSBDeviceClassName);
 
   if (!matchingDict)
     return kIOReturnError;
 
-  if (location) {
+  if (location || filter) {
     CFMutableDictionaryRef propertyMatchDict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
                                                                          &kCFTypeDictionaryKeyCallBacks,
                                                                          &kCFTypeDictionaryValueCallBacks);
 
     if (propertyMatchDict) {
-      CFTypeRef locationCF = CFNumberCreate (NULL, kCFNumberLongType, &location);
+      if (location) {
+        CFTypeRef locationCF = CFNumberCreate (NULL, kCFNumberLongType, &location);
+
+        CFDictionarySetValue (propertyMatchDict, CFSTR(kUSBDevicePropertyLocationID), locationCF);
+        /* release our reference to the CFNumber (CFDictionarySetValue retains it) */
+        CFRelease (locationCF);
+      }
 
-      CFDictionarySetValue (propertyMatchDict, CFSTR(kUSBDevicePropertyLocationID), locationCF);
-      /* release our reference to the CFNumber (CFDictionarySetValue retains it) */
-      CFRelease (locationCF);
+      if (filter && filter->vendor_id != LIBUSB_DEVICE_FILTER_ANY)
+        set_match_number (propertyMatchDict, CFSTR(kUSBVendorID), filter->vendor_id);
+      if (filter && filter->product_id != LIBUSB_DEVICE_FILTER_ANY)
+        set_match_number (propertyMatchDict, CFSTR(kUSBProductID), filter->product_id);
+      if (filter && filter->dev_class != LIBUSB_DEVICE_FILTER_ANY)
+        set_match_number (propertyMatchDict, CFSTR(kUSBDeviceClass), filter->dev_class);
 
       CFDictionarySetValue (matchingDict, CFSTR(kIOPropertyMatchKey), propertyMatchDict);
       /* release out reference to the CFMutableDictionaryRef (CFDictionarySetValue retains it) */
@@ -188,6 +208,23 @@ static int usb_setup_device_iterator (io_iterator_t *deviceIterator, long locati
   return IOServiceGetMatchingServices(kIOMasterPortDefault, matchingDict, deviceIterator);
 }
 
+/* the location ID holds the bus number in its top byte, followed by one nibble per port on the path from the root hub */
+static int location_matches (UInt32 location, const struct libusb_device_filter *filter) {
+  int i, shift;
+
+  if (filter->bus_number != LIBUSB_DEVICE_FILTER_ANY && filter->bus_number != (int)(location >> 24))
+    return 0;
+
+  if (filter->port_numbers_len <= 0)
+    return 1;
+
+  for (i = 0, shift = 20 ; shift >= 0 && (location >> shift) & 0xf ; i++, shift -= 4)
+    if (i >= filter->port_numbers_len || filter->port_numbers[i] != ((location >> shift) & 0xf))
+      return 0;
+
+  return i == filter->port_numbers_len;
+}
+
 static int get_ioregistry_value_number (io_service_t service, CFStringRef property, CFNumberType type, void *p) {
   CFTypeRef cfNumber = IORegistryEntryCreateCFProperty (service, property, kCFAllocatorDefault, 0);
   int ret = 0;
@@ -263,7 +300,7 @@ static kern_return_t darwin_get_device (uint32_t dev_location, usb_device_t ***d
   UInt32        location;
   io_iterator_t deviceIterator;
 
-  kresult = usb_setup_device_iterator (&deviceIterator, dev_location);
+  kresult = usb_setup_device_iterator (&deviceIterator, dev_location, NULL);
   if (kresult)
     return kresult;
 
@@ -286,8 +323,9 @@ static kern_return_t darwin_get_device (uint32_t dev_location, usb_device_t ***d
 
 
 static void darwin_devices_detached (void *ptr, io_iterator_t rem_devices) {
-  struct libusb_context *ctx = (struct libusb_context *)ptr;
+  struct libusb_context *ctx;
   struct libusb_device_handle *handle;
+  struct libusb_device *dev;
   struct darwin_device_priv *dpriv;
   struct darwin_device_handle_priv *priv;
 
@@ -297,6 +335,8 @@ static void darwin_devices_detached (void *ptr, io_iterator_t rem_devices) {
   CFTypeRef locationCF;
   UInt32 message;
 
+  UNUSED(ptr);
+
   usbi_dbg ("a device has been detached");
 
   while ((device = IOIteratorNext (rem_devices)) != 0) {
@@ -316,20 +356,58 @@ static void darwin_devices_detached (void *ptr, io_iterator_t rem_devices) {
     if (!locationValid)
       continue;
 
-    usbi_mutex_lock(&ctx->open_devs_lock);
-    list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
-      dpriv = (struct darwin_device_priv *)handle->dev->os_priv;
+    usbi_mutex_static_lock(&active_contexts_lock);
+    list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+      usbi_mutex_lock(&ctx->open_devs_lock);
+      list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+        dpriv = (struct darwin_device_priv *)handle->dev->os_priv;
 
-      /* the device may have been opened several times. write to each handle's event descriptor */
-      if (dpriv->location == location  && handle->os_priv) {
-	priv  = (struct darwin_device_handle_priv *)handle->os_priv;
+        /* the device may have been opened several times. write to each handle's event descriptor */
+        if (dpriv->location == location  && handle->os_priv) {
+          priv  = (struct darwin_device_handle_priv *)handle->os_priv;
 
-	message = MESSAGE_DEVICE_GONE;
-	write (priv->fds[1], &message, sizeof (message));
+          message = MESSAGE_DEVICE_GONE;
+          write (priv->fds[1], &message, sizeof (message));
+        }
+      }
+      usbi_mutex_unlock(&ctx->open_devs_lock);
+
+      usbi_mutex_lock(&ctx->device_list_lock);
+      dev = usbi_ref_device_by_session_id (ctx, (unsigned long) location);
+      if (dev) {
+        usbi_disconnect_device (dev);
+        libusb_unref_device (dev);
       }
+      usbi_mutex_unlock(&ctx->device_list_lock);
     }
+    usbi_mutex_static_unlock(&active_contexts_lock);
+  }
+}
+
+static void darwin_devices_attached (void *ptr, io_iterator_t add_devices) {
+  struct libusb_context *ctx;
+  struct libusb_device *dev;
+  usb_device_t **device;
+  UInt32 location, parent_location;
+  UInt8 port;
+
+  UNUSED(ptr);
 
-    usbi_mutex_unlock(&ctx->open_devs_lock);
+  usbi_dbg ("a device has been attached");
+
+  while ((device = usb_get_next_device (add_devices, &location, &port, &parent_location)) != NULL) {
+    usbi_mutex_static_lock(&active_contexts_lock);
+    list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+      usbi_mutex_lock(&ctx->device_list_lock);
+      if (darwin_get_new_device (ctx, device, location, parent_location, port, NULL, &dev) == 0) {
+        usbi_connect_device (dev, 1);
+        libusb_unref_device (dev);
+      }
+      usbi_mutex_unlock(&ctx->device_list_lock);
+    }
+    usbi_mutex_static_unlock(&active_contexts_lock);
+
+    (*(device))->Release(device);
   }
 }
 
@@ -359,10 +437,11 @@ static void *event_thread_main (void *arg0) {
   objc_registerThreadWithCollector();
 #endif
 
-  /* hotplug (device removal) source */
+  /* hotplug (device arrival and removal) source */
   CFRunLoopSourceRef     libusb_notification_cfsource;
   io_notification_port_t libusb_notification_port;
   io_iterator_t          libusb_rem_device_iterator;
+  io_iterator_t          libusb_add_device_iterator;
 
   usbi_dbg ("creating hotplug event source");
 
@@ -386,8 +465,21 @@ static void *event_thread_main (void *arg0) {
     pthread_exit (NULL);
   }
 
+  /* create notifications for new devices */
+  kresult = IOServiceAddMatchingNotification (libusb_notification_port, kIOFirstMatchNotification,
+                                              IOServiceMatching(kIOUSBDeviceClassName),
+                                              (IOServiceMatchingCallback)darwin_devices_attached,
+                                              (void *)ctx, &libusb_add_device_iterator);
+
+  if (kresult != kIOReturnSuccess) {
+    usbi_err (ctx, "could not add hotplug event source: %s", darwin_error_str (kresult));
+
+    pthread_exit (NULL);
+  }
+
   /* arm notifiers */
   darwin_clear_iterator (libusb_rem_device_iterator);
+  darwin_clear_iterator (libusb_add_device_iterator);
 
   usbi_dbg ("thread ready to receive events");
 
@@ -405,6 +497,7 @@ static void *event_thread_main (void *arg0) {
   /* delete notification port */
   IONotificationPortDestroy (libusb_notification_port);
   IOObjectRelease (libusb_rem_device_iterator);
+  IOObjectRelease (libusb_add_device_iterator);
 
   CFRelease (runloop);
 
@@ -729,22 +822,22 @@ static int darwin_cache_device_descriptor (struct libusb_context *ctx, struct li
   return 0;
 }
 
-static int process_new_device (struct libusb_context *ctx, usb_device_t **device, UInt32 locationID,
-                               UInt32 parent_location, UInt8 port, struct discovered_devs **_discdevs,
-                               struct libusb_device **last_dev) {
+/* look up or set up the device at locationID. on success a reference is held on the returned
+ * device. */
+static int darwin_get_new_device (struct libusb_context *ctx, usb_device_t **device, UInt32 locationID,
+                                  UInt32 parent_location, UInt8 port, struct libusb_device *last_dev,
+                                  struct libusb_device **_dev) {
   struct darwin_device_priv *priv;
   struct libusb_device *dev, *parent = NULL;
-  struct discovered_devs *discdevs;
   UInt16                address;
   UInt8                 devSpeed;
-  int ret = 0, need_unref = 0;
+  int ret = 0;
 
   do {
-    dev = usbi_get_device_by_session_id(ctx, locationID);
+    dev = usbi_ref_device_by_session_id(ctx, locationID);
     if (!dev) {
       usbi_dbg ("allocating new device for location 0x%08x", locationID);
       dev = usbi_alloc_device(ctx, locationID);
-      need_unref = 1;
     } else
       usbi_dbg ("using existing device for location 0x%08x", locationID);
 
@@ -768,7 +861,7 @@ static int process_new_device (struct libusb_context *ctx, usb_device_t **device
 
     /* the device iterator provides devices in increasing order of location. given this property
      * we can use the last device to find the parent. */
-    for (parent = *last_dev ; parent ; parent = parent->parent_dev) {
+    for (parent = last_dev ; parent ; parent = parent->parent_dev) {
       struct darwin_device_priv *parent_priv = (struct darwin_device_priv *) parent->os_priv;
 
       if (parent_priv->location == parent_location) {
@@ -776,6 +869,10 @@ static int process_new_device (struct libusb_context *ctx, usb_device_t **device
       }
     }
 
+    /* a device arriving on its own has no last device, its parent is already known */
+    if (!parent && parent_location)
+      parent = usbi_get_device_by_session_id (ctx, parent_location);
+
     dev->parent_dev = parent;
 
     dev->port_number    = port;
@@ -804,27 +901,48 @@ static int process_new_device (struct libusb_context *ctx, usb_device_t **device
     if (ret < 0)
       break;
 
-    /* append the device to the list of discovered devices */
-    discdevs = discovered_devs_append(*_discdevs, dev);
-    if (!discdevs) {
-      ret = LIBUSB_ERROR_NO_MEM;
-      break;
-    }
-
-    *_discdevs = discdevs;
-    *last_dev = dev;
-
     usbi_dbg ("found device with address %d port = %d parent = %p at %p", dev->device_address,
               dev->port_number, priv->sys_path, (void *) parent);
   } while (0);
 
-  if (need_unref)
-    libusb_unref_device(dev);
+  if (ret < 0) {
+    if (dev)
+      libusb_unref_device(dev);
+    return ret;
+  }
+
+  *_dev = dev;
+  return 0;
+}
+
+static int process_new_device (struct libusb_context *ctx, usb_device_t **device, UInt32 locationID,
+                               UInt32 parent_location, UInt8 port, struct discovered_devs **_discdevs,
+                               struct libusb_device **last_dev) {
+  struct discovered_devs *discdevs;
+  struct libusb_device *dev;
+  int ret;
+
+  ret = darwin_get_new_device (ctx, device, locationID, parent_location, port, *last_dev, &dev);
+  if (ret < 0)
+    return ret;
+
+  /* append the device to the list of discovered devices */
+  discdevs = discovered_devs_append(*_discdevs, dev);
+  if (!discdevs) {
+    ret = LIBUSB_ERROR_NO_MEM;
+  } else {
+    *_discdevs = discdevs;
+    *last_dev = dev;
+  }
+
+  libusb_unref_device(dev);
 
   return ret;
 }
 
-static int darwin_get_device_list(struct libusb_context *ctx, struct discovered_devs **_discdevs) {
+/* enumerates the devices matching filter, or all of them if it is NULL. the ones left out are never allocated */
+static int darwin_scan_devices(struct libusb_context *ctx, const struct libusb_device_filter *filter,
+                               struct discovered_devs **_discdevs) {
   io_iterator_t        deviceIterator;
   usb_device_t         **device;
   kern_return_t        kresult;
@@ -832,12 +950,13 @@ static int darwin_get_device_list(struct libusb_context *ctx, struct discovered_
   UInt8                port;
   struct libusb_device *last_dev = NULL;
 
-  kresult = usb_setup_device_iterator (&deviceIterator, 0);
+  kresult = usb_setup_device_iterator (&deviceIterator, 0, filter);
   if (kresult != kIOReturnSuccess)
     return darwin_to_libusb (kresult);
 
   while ((device = usb_get_next_device (deviceIterator, &location, &port, &parent_location)) != NULL) {
-    (void) process_new_device (ctx, device, location, parent_location, port, _discdevs, &last_dev);
+    if (!filter || location_matches (location, filter))
+      (void) process_new_device (ctx, device, location, parent_location, port, _discdevs, &last_dev);
 
     (*(device))->Release(device);
   }
@@ -847,6 +966,15 @@ static int darwin_get_device_list(struct libusb_context *ctx, struct discovered_
   return 0;
 }
 
+static int darwin_get_device_list(struct libusb_context *ctx, struct discovered_devs **_discdevs) {
+  return darwin_scan_devices (ctx, NULL, _discdevs);
+}
+
+static int darwin_get_device_list_filtered(struct libusb_context *ctx, const struct libusb_device_filter *filter,
+                                           struct discovered_devs **_discdevs) {
+  return darwin_scan_devices (ctx, filter, _discdevs);
+}
+
 static int darwin_open (struct libusb_device_handle *dev_handle) {
   struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)dev_handle->os_priv;
   struct darwin_device_priv *dpriv = (struct darwin_device_priv *)dev_handle->dev->os_priv;
@@ -906,11 +1034,13 @@ static int darwin_open (struct libusb_device_handle *dev_handle) {
 
   /* create a file descriptor for notifications */
   pipe (priv->fds);
+  priv->completed = NULL;
 
-  /* set the pipe to be non-blocking */
-  fcntl (priv->fds[1], F_SETFD, O_NONBLOCK);
+  /* set the pipe to be non-blocking, event handling reads it until empty */
+  fcntl (priv->fds[1], F_SETFL, fcntl (priv->fds[1], F_GETFL) | O_NONBLOCK);
+  fcntl (priv->fds[0], F_SETFL, fcntl (priv->fds[0], F_GETFL) | O_NONBLOCK);
 
-  usbi_add_pollfd(HANDLE_CTX(dev_handle), priv->fds[0], POLLIN);
+  usbi_add_handle_pollfd(dev_handle, priv->fds[0], POLLIN);
 
   usbi_dbg ("device open for access");
 
@@ -1045,10 +1175,13 @@ static int get_endpoints (struct libusb_device_handle *dev_handle, int iface) {
   u_int8_t numep, direction, number;
   u_int8_t dont_care1, dont_care3;
   u_int16_t dont_care2;
+  struct usbi_endpoint *endpoint;
   int i;
 
   usbi_dbg ("building table of endpoints.");
 
+  clear_pipe_refs (dev_handle, iface);
+
   /* retrieve the total number of endpoints on this interface */
   kresult = (*(cInterface->interface))->GetNumEndpoints(cInterface->interface, &numep);
   if (kresult) {
@@ -1070,10 +1203,12 @@ static int get_endpoints (struct libusb_device_handle *dev_handle, int iface) {
     usbi_dbg ("interface: %i pipe %i: dir: %i number: %i", iface, i, direction, number);
 
     cInterface->endpoint_addrs[i - 1] = ((direction << 7 & LIBUSB_ENDPOINT_DIR_MASK) | (number & LIBUSB_ENDPOINT_ADDRESS_MASK));
+    endpoint = usbi_handle_endpoint (dev_handle, cInterface->endpoint_addrs[i - 1]);
+    endpoint->pipe_ref = i;
+    endpoint->interface = iface;
+    cInterface->num_endpoints = i;
   }
 
-  cInterface->num_endpoints = numep;
-
   return 0;
 }
 
@@ -1193,7 +1328,7 @@ static int darwin_release_interface(struct libusb_device_handle *dev_handle, int
     return LIBUSB_SUCCESS;
 
   /* clean up endpoint data */
-  cInterface->num_endpoints = 0;
+  clear_pipe_refs (dev_handle, iface);
 
   /* delete the interface's async event source */
   if (cInterface->cfSource) {
@@ -1604,7 +1739,9 @@ static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0)
   struct usbi_transfer *itransfer = (struct usbi_transfer *)refcon;
   struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
   struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)transfer->dev_handle->os_priv;
-  UInt32 message, size;
+  struct darwin_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+  struct usbi_transfer *head;
+  UInt32 message;
 
   usbi_dbg ("an async io operation has completed");
 
@@ -1612,14 +1749,22 @@ static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0)
   if ((intptr_t) arg0 > UINT32_MAX)
     usbi_err (ITRANSFER_CTX (itransfer),
       "async size truncation detected - please report this error");
-  size = (UInt32) (intptr_t) arg0;
-
-  /* send a completion message to the device's file descriptor */
-  message = MESSAGE_ASYNC_IO_COMPLETE;
-  write (priv->fds[1], &message, sizeof (message));
-  write (priv->fds[1], &itransfer, sizeof (itransfer));
-  write (priv->fds[1], &result, sizeof (IOReturn));
-  write (priv->fds[1], &size, sizeof (size));
+  tpriv->size = (UInt32) (intptr_t) arg0;
+  tpriv->result = result;
+
+  /* queue the completion. only this thread pushes, and event handling takes
+   * the whole queue at once, so there is no ABA problem. */
+  do {
+    head = priv->completed;
+    tpriv->next_completed = head;
+  } while (usbi_atomic_cas_ptr (&priv->completed, head, itransfer) != head);
+
+  /* event handling drains the queue after reading the pipe, so it only needs
+   * waking up when the queue was empty */
+  if (!head) {
+    message = MESSAGE_ASYNC_IO_COMPLETE;
+    write (priv->fds[1], &message, sizeof (message));
+  }
 }
 
 static int darwin_transfer_status (struct usbi_transfer *itransfer, kern_return_t result) {
@@ -1682,13 +1827,35 @@ static void darwin_handle_callback (struct usbi_transfer *itransfer, kern_return
   usbi_handle_transfer_completion (itransfer, darwin_transfer_status (itransfer, result));
 }
 
+/* handle the transfers queued by darwin_async_io_callback, in the order
+ * they completed */
+static void darwin_handle_completions (struct darwin_device_handle_priv *hpriv) {
+  struct usbi_transfer *itransfer, *next, *list = NULL;
+  struct darwin_transfer_priv *tpriv;
+
+  itransfer = usbi_atomic_xchg_ptr (&hpriv->completed, NULL);
+  while (itransfer) {
+    tpriv = usbi_transfer_get_os_priv(itransfer);
+    next = tpriv->next_completed;
+    tpriv->next_completed = list;
+    list = itransfer;
+    itransfer = next;
+  }
+
+  while (list) {
+    tpriv = usbi_transfer_get_os_priv(list);
+    /* the transfer may be resubmitted, and complete again, from its callback */
+    next = tpriv->next_completed;
+    darwin_handle_callback (list, tpriv->result, tpriv->size);
+    list = next;
+  }
+}
+
 static int op_handle_events(struct libusb_context *ctx, struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready) {
-  struct usbi_transfer *itransfer;
-  UInt32 io_size;
-  IOReturn kresult;
   POLL_NFDS_TYPE i = 0;
   ssize_t ret;
-  UInt32 message;
+  UInt32 messages[16];
+  int j, gone, complete;
 
   usbi_mutex_lock(&ctx->open_devs_lock);
   for (i = 0; i < nfds && num_ready > 0; i++) {
@@ -1702,24 +1869,39 @@ static int op_handle_events(struct libusb_context *ctx, struct pollfd *fds, POLL
       continue;
 
     num_ready--;
-    list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
-      hpriv =  (struct darwin_device_handle_priv *)handle->os_priv;
-      if (hpriv->fds[0] == pollfd->fd)
-        break;
-    }
-    if (!hpriv)
+    handle = usbi_pollfd_handle(ctx, fds, i);
+    if (!handle)
       continue;
+    hpriv =  (struct darwin_device_handle_priv *)handle->os_priv;
 
+    gone = complete = 0;
     if (!(pollfd->revents & POLLERR)) {
-      ret = read (hpriv->fds[0], &message, sizeof (message));
-      if (ret < (ssize_t)sizeof (message))
-        continue;
+      /* the pipe must be emptied before the completion queue is taken, or a
+       * wake up for completions queued in between could be lost */
+      while ((ret = read (hpriv->fds[0], messages, sizeof (messages))) > 0) {
+        for (j = 0 ; j < ret / (ssize_t) sizeof (messages[0]) ; j++) {
+          switch (messages[j]) {
+          case MESSAGE_DEVICE_GONE:
+            gone = 1;
+            break;
+          case MESSAGE_ASYNC_IO_COMPLETE:
+            complete = 1;
+            break;
+          default:
+            usbi_warn (ctx, "unknown message received from device pipe");
+          }
+        }
+      }
     } else
       /* could not poll the device-- response is to delete the device (this seems a little heavy-handed) */
-      message = MESSAGE_DEVICE_GONE;
+      gone = 1;
 
-    switch (message) {
-    case MESSAGE_DEVICE_GONE:
+    /* transfers that completed before the device went away get their real
+     * status first */
+    if (complete || gone)
+      darwin_handle_completions (hpriv);
+
+    if (gone) {
       /* remove the device's async port from the runloop */
       if (hpriv->cfSource) {
         if (libusb_darwin_acfl)
@@ -1730,18 +1912,6 @@ static int op_handle_events(struct libusb_context *ctx, struct pollfd *fds, POLL
 
       usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->fds[0]);
       usbi_handle_disconnect(handle);
-
-      /* done with this device */
-      continue;
-    case MESSAGE_ASYNC_IO_COMPLETE:
-      read (hpriv->fds[0], &itransfer, sizeof (itransfer));
-      read (hpriv->fds[0], &kresult, sizeof (IOReturn));
-      read (hpriv->fds[0], &io_size, sizeof (UInt32));
-
-      darwin_handle_callback (itransfer, kresult, io_size);
-      break;
-    default:
-      usbi_warn (ctx, "unknown message received from device pipe");
     }
   }
 
@@ -1809,8 +1979,11 @@ const struct usbi_os_backend darwin_backend = {
 
         .clock_gettime = darwin_clock_gettime,
 
+        .get_device_list_filtered = darwin_get_device_list_filtered,
+
         .device_priv_size = sizeof(struct darwin_device_priv),
         .device_handle_priv_size = sizeof(struct darwin_device_handle_priv),
         .transfer_priv_size = sizeof(struct darwin_transfer_priv),
         .add_iso_packet_size = 0,
+        .caps = USBI_CAP_HAS_HOTPLUG | USBI_CAP_EVENT_PARTITIONS,
 };
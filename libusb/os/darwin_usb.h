@@ -141,6 +141,11 @@ struct darwin_device_handle_priv {
   CFRunLoopSourceRef   cfSource;
   int                  fds[2];
 
+  /* transfers completed by the run loop thread and not handled yet, most
+   * recent first, linked through their next_completed. the pipe only gets a
+   * MESSAGE_ASYNC_IO_COMPLETE when this was empty. */
+  struct usbi_transfer * volatile completed;
+
   struct darwin_interface {
     usb_interface_t    **interface;
     uint8_t              num_endpoints;
@@ -163,6 +168,11 @@ struct darwin_transfer_priv {
 #endif
 
   /* Bulk */
+
+  /* Completion, filled in by the run loop thread */
+  struct usbi_transfer *next_completed;
+  IOReturn result;
+  UInt32 size;
 };
 
 enum {
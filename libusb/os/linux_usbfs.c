@@ -28,10 +28,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/netlink.h>
 
 #include "libusb.h"
 #include "libusbi.h"
@@ -108,15 +112,35 @@ static int sysfs_can_relate_devices = 0;
 /* do we have a descriptors file? */
 static int sysfs_has_descriptors = 0;
 
+/* the uevent monitor reporting device arrivals and departures to all
+ * contexts, running while at least one of them is initialized */
+static usbi_mutex_static_t hotplug_monitor_lock = USBI_MUTEX_INITIALIZER;
+static int hotplug_monitor_refcnt = 0;
+static int hotplug_monitor_fd = -1;
+static int hotplug_monitor_pipe[2] = { -1, -1 };
+static usbi_thread_t hotplug_monitor_thread;
+
+static int linux_start_hotplug_monitor(void);
+static void linux_stop_hotplug_monitor(void);
+static int usbfs_load_active_config(struct libusb_device *dev);
+
 struct linux_device_priv {
 	char *sysfs_dir;
 	unsigned char *dev_descriptor;
 	unsigned char *config_descriptor;
+	/* whether config_descriptor has been set up, on first use */
+	int config_loaded;
+	/* largest bulk URB the kernel could allocate memory for, or 0 while it
+	 * has never failed to, see submit_bulk_transfer(). only ever lowered,
+	 * so racing updates are harmless */
+	int max_bulk_urb_len;
 };
 
 struct linux_device_handle_priv {
 	int fd;
 	uint32_t caps;
+	/* most URBs of a bulk/interrupt transfer submitted at once, 0 for all */
+	int max_urbs;
 };
 
 enum reap_action {
@@ -143,13 +167,42 @@ struct linux_transfer_priv {
 
 	enum reap_action reap_action;
 	int num_urbs;
+	int num_submitted;
 	int num_retired;
 	enum libusb_transfer_status reap_status;
 
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
+
+	/* backing storage for urbs/iso_urbs, kept between submissions */
+	void *urb_mem;
+	size_t urb_mem_len;
+
+	/* what the URBs in urb_mem were last set up for. a resubmission with
+	 * the same geometry reuses them, only moving them to the new buffer if
+	 * it changed, see urb_layout_matches() */
+	struct {
+		int num_urbs;
+		uint32_t caps;
+		int urb_len;
+		unsigned char *buffer;
+		int length;
+		int num_iso_packets;
+		unsigned char endpoint;
+		unsigned char type;
+		uint8_t flags;
+	} layout;
 };
 
+/* iso URBs are laid out in urb_mem after the iso_urbs pointer array, each
+ * one followed by its packet descriptors and padded to pointer alignment */
+#define ISO_URB_ALIGN(len) \
+	(((len) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#define ISO_URBS_ALLOC_SIZE(num_urbs, num_packets) \
+	((num_urbs) * (sizeof(struct usbfs_urb *) + sizeof(struct usbfs_urb) \
+		+ sizeof(void *)) \
+	+ (num_packets) * sizeof(struct usbfs_iso_packet_desc))
+
 static void _get_usbfs_path(struct libusb_device *dev, char *path)
 {
 	if (usbdev_names)
@@ -416,9 +469,22 @@ static int op_init(struct libusb_context *ctx)
 		sysfs_can_relate_devices = 0;
 	}
 
+	usbi_mutex_static_lock(&hotplug_monitor_lock);
+	if (hotplug_monitor_refcnt++ == 0 && linux_start_hotplug_monitor() < 0)
+		usbi_warn(ctx, "could not monitor uevents, no hotplug notifications");
+	usbi_mutex_static_unlock(&hotplug_monitor_lock);
+
 	return 0;
 }
 
+static void op_exit(void)
+{
+	usbi_mutex_static_lock(&hotplug_monitor_lock);
+	if (--hotplug_monitor_refcnt == 0)
+		linux_stop_hotplug_monitor();
+	usbi_mutex_static_unlock(&hotplug_monitor_lock);
+}
+
 static int usbfs_get_device_descriptor(struct libusb_device *dev,
 	unsigned char *buffer)
 {
@@ -523,12 +589,19 @@ static int usbfs_get_active_config_descriptor(struct libusb_device *dev,
 	unsigned char *buffer, size_t len)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
-	if (!priv->config_descriptor)
-		return LIBUSB_ERROR_NOT_FOUND; /* device is unconfigured */
+	int r = 0;
+
+	usbi_mutex_lock(&dev->lock);
+	if (!priv->config_loaded)
+		r = usbfs_load_active_config(dev);
+	if (r == 0 && !priv->config_descriptor)
+		r = LIBUSB_ERROR_NOT_FOUND; /* device is unconfigured */
 
 	/* retrieve cached copy */
-	memcpy(buffer, priv->config_descriptor, len);
-	return 0;
+	if (r == 0)
+		memcpy(buffer, priv->config_descriptor, len);
+	usbi_mutex_unlock(&dev->lock);
+	return r;
 }
 
 /* read the bConfigurationValue for a device */
@@ -856,8 +929,6 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	unsigned char *dev_buf;
 	char path[PATH_MAX];
 	int fd, speed;
-	int active_config = 0;
-	int device_configured = 1;
 	ssize_t r;
 
 	dev->bus_number = busnum;
@@ -888,15 +959,60 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 		return 0;
 
 	/* cache device descriptor in memory so that we can retrieve it later
-	 * without waking the device up (op_get_device_descriptor) */
+	 * without waking the device up (op_get_device_descriptor). the active
+	 * configuration is only looked up once asked for, as it may take a
+	 * request to the device, see usbfs_load_active_config(). */
 
 	priv->dev_descriptor = NULL;
 	priv->config_descriptor = NULL;
+	priv->config_loaded = 0;
+
+	_get_usbfs_path(dev, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		usbi_err(DEVICE_CTX(dev), "open failed, ret=%d errno=%d", fd, errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	dev_buf = malloc(DEVICE_DESC_LENGTH);
+	if (!dev_buf) {
+		close(fd);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	r = read(fd, dev_buf, DEVICE_DESC_LENGTH);
+	close(fd);
+	if (r < 0) {
+		usbi_err(DEVICE_CTX(dev),
+			"read descriptor failed ret=%d errno=%d", fd, errno);
+		free(dev_buf);
+		return LIBUSB_ERROR_IO;
+	} else if (r < DEVICE_DESC_LENGTH) {
+		usbi_err(DEVICE_CTX(dev), "short descriptor read (%d)", r);
+		free(dev_buf);
+		return LIBUSB_ERROR_IO;
+	}
+
+	priv->dev_descriptor = dev_buf;
+	return 0;
+}
+
+/* find out the active configuration of a device and cache its descriptor,
+ * the first time it is needed. only for usbfs, and must be called with the
+ * device lock held. */
+static int usbfs_load_active_config(struct libusb_device *dev)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	char path[PATH_MAX];
+	int fd;
+	int active_config = 0;
+	int device_configured = 1;
+	int r = 0;
 
 	if (sysfs_can_relate_devices) {
-		int tmp = sysfs_get_active_config(dev, &active_config);
-		if (tmp < 0)
-			return tmp;
+		r = sysfs_get_active_config(dev, &active_config);
+		if (r < 0)
+			return r;
 		if (active_config == -1)
 			device_configured = 0;
 	}
@@ -946,53 +1062,24 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 		}
 	}
 
-	dev_buf = malloc(DEVICE_DESC_LENGTH);
-	if (!dev_buf) {
-		close(fd);
-		return LIBUSB_ERROR_NO_MEM;
-	}
-
-	r = read(fd, dev_buf, DEVICE_DESC_LENGTH);
-	if (r < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"read descriptor failed ret=%d errno=%d", fd, errno);
-		free(dev_buf);
-		close(fd);
-		return LIBUSB_ERROR_IO;
-	} else if (r < DEVICE_DESC_LENGTH) {
-		usbi_err(DEVICE_CTX(dev), "short descriptor read (%d)", r);
-		free(dev_buf);
-		close(fd);
-		return LIBUSB_ERROR_IO;
-	}
-
-	/* bit of a hack: set num_configurations now because cache_active_config()
-	 * calls usbi_get_config_index_by_value() which uses it */
-	dev->num_configurations = dev_buf[DEVICE_DESC_LENGTH - 1];
-
-	if (device_configured) {
+	if (device_configured)
 		r = cache_active_config(dev, fd, active_config);
-		if (r < 0) {
-			close(fd);
-			free(dev_buf);
-			return r;
-		}
-	}
-
 	close(fd);
-	priv->dev_descriptor = dev_buf;
+	if (r < 0)
+		return r;
+
+	priv->config_loaded = 1;
 	return 0;
 }
 
-static int enumerate_device(struct libusb_context *ctx,
-	struct discovered_devs **_discdevs, uint8_t busnum, uint8_t devaddr,
-	const char *sysfs_dir)
+/* look up the device at busnum/devaddr, or allocate and initialize it if it
+ * is not known yet. on success, a reference is held on the returned device. */
+static int linux_get_device(struct libusb_context *ctx, uint8_t busnum,
+	uint8_t devaddr, const char *sysfs_dir, struct libusb_device **_dev)
 {
-	struct discovered_devs *discdevs;
 	unsigned long session_id;
-	int need_unref = 0;
 	struct libusb_device *dev;
-	int r = 0;
+	int r;
 
 	/* FIXME: session ID is not guaranteed unique as addresses can wrap and
 	 * will be reused. instead we should add a simple sysfs attribute with
@@ -1001,34 +1088,50 @@ static int enumerate_device(struct libusb_context *ctx,
 	usbi_dbg("busnum %d devaddr %d session_id %ld", busnum, devaddr,
 		session_id);
 
-	dev = usbi_get_device_by_session_id(ctx, session_id);
+	dev = usbi_ref_device_by_session_id(ctx, session_id);
 	if (dev) {
 		usbi_dbg("using existing device for %d/%d (session %ld)",
 			busnum, devaddr, session_id);
-	} else {
-		usbi_dbg("allocating new device for %d/%d (session %ld)",
-			busnum, devaddr, session_id);
-		dev = usbi_alloc_device(ctx, session_id);
-		if (!dev)
-			return LIBUSB_ERROR_NO_MEM;
-		need_unref = 1;
-		r = initialize_device(dev, busnum, devaddr, sysfs_dir);
-		if (r < 0)
-			goto out;
+		*_dev = dev;
+		return 0;
+	}
+
+	usbi_dbg("allocating new device for %d/%d (session %ld)",
+		busnum, devaddr, session_id);
+	dev = usbi_alloc_device(ctx, session_id);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+	r = initialize_device(dev, busnum, devaddr, sysfs_dir);
+	if (r == 0)
 		r = usbi_sanitize_device(dev);
-		if (r < 0)
-			goto out;
+	if (r < 0) {
+		libusb_unref_device(dev);
+		return r;
 	}
 
+	*_dev = dev;
+	return 0;
+}
+
+static int enumerate_device(struct libusb_context *ctx,
+	struct discovered_devs **_discdevs, uint8_t busnum, uint8_t devaddr,
+	const char *sysfs_dir)
+{
+	struct discovered_devs *discdevs;
+	struct libusb_device *dev;
+	int r;
+
+	r = linux_get_device(ctx, busnum, devaddr, sysfs_dir, &dev);
+	if (r < 0)
+		return r;
+
 	discdevs = discovered_devs_append(*_discdevs, dev);
 	if (!discdevs)
 		r = LIBUSB_ERROR_NO_MEM;
 	else
 		*_discdevs = discdevs;
 
-out:
-	if (need_unref)
-		libusb_unref_device(dev);
+	libusb_unref_device(dev);
 	return r;
 }
 
@@ -1225,7 +1328,65 @@ static void sysfs_analyze_topology(struct discovered_devs *discdevs)
 	}
 }
 
+/* whether the sysfs device devname may match a filter, going by its name,
+ * which holds the bus number and port path, and by its device descriptor,
+ * which sysfs keeps in memory. returns 1 when in doubt. */
+static int sysfs_device_may_match(const char *devname,
+	const struct libusb_device_filter *filter)
+{
+	char filename[PATH_MAX];
+	unsigned char desc[DEVICE_DESC_LENGTH];
+	const char *p;
+	int fd, i;
+	ssize_t r;
+
+	/* root hubs are named "usbB", other devices "B-P[.P ...]" */
+	if (filter->bus_number != LIBUSB_DEVICE_FILTER_ANY
+			&& filter->bus_number != atoi(devname[0] == 'u' ?
+				devname + 3 : devname))
+		return 0;
+
+	if (filter->port_numbers_len > 0) {
+		p = strchr(devname, '-');
+		for (i = 0; p; i++, p = strchr(p + 1, '.'))
+			if (i >= filter->port_numbers_len
+					|| filter->port_numbers[i] != atoi(p + 1))
+				return 0;
+		if (i != filter->port_numbers_len)
+			return 0;
+	}
+
+	if (filter->vendor_id == LIBUSB_DEVICE_FILTER_ANY
+			&& filter->product_id == LIBUSB_DEVICE_FILTER_ANY
+			&& filter->dev_class == LIBUSB_DEVICE_FILTER_ANY)
+		return 1;
+
+	snprintf(filename, PATH_MAX, "%s/%s/descriptors", SYSFS_DEVICE_PATH,
+		devname);
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	r = read(fd, desc, DEVICE_DESC_LENGTH);
+	close(fd);
+	if (r < DEVICE_DESC_LENGTH)
+		return 1;
+
+	if (filter->vendor_id != LIBUSB_DEVICE_FILTER_ANY
+			&& filter->vendor_id != (desc[8] | desc[9] << 8))
+		return 0;
+	if (filter->product_id != LIBUSB_DEVICE_FILTER_ANY
+			&& filter->product_id != (desc[10] | desc[11] << 8))
+		return 0;
+	if (filter->dev_class != LIBUSB_DEVICE_FILTER_ANY
+			&& filter->dev_class != desc[4])
+		return 0;
+	return 1;
+}
+
+/* enumerate the devices listed in sysfs, or only those that may match
+ * filter if it is not NULL */
 static int sysfs_get_device_list(struct libusb_context *ctx,
+	const struct libusb_device_filter *filter,
 	struct discovered_devs **_discdevs)
 {
 	struct discovered_devs *discdevs = *_discdevs;
@@ -1245,6 +1406,11 @@ static int sysfs_get_device_list(struct libusb_context *ctx,
 				|| strchr(entry->d_name, ':'))
 			continue;
 
+		if (filter && !sysfs_device_may_match(entry->d_name, filter)) {
+			r = 0;
+			continue;
+		}
+
 		if (sysfs_scan_device(ctx, &discdevs_new, entry->d_name)) {
 			usbi_dbg("failed to enumerate dir entry %s", entry->d_name);
 			continue;
@@ -1275,111 +1441,415 @@ static int op_get_device_list(struct libusb_context *ctx,
 	 * adequacy of sysfs and sets sysfs_can_relate_devices.
 	 */
 	if (sysfs_can_relate_devices != 0)
-		return sysfs_get_device_list(ctx, _discdevs);
+		return sysfs_get_device_list(ctx, NULL, _discdevs);
 	else
 		return usbfs_get_device_list(ctx, _discdevs);
 }
 
-static int op_open(struct libusb_device_handle *handle)
+static int op_get_device_list_filtered(struct libusb_context *ctx,
+	const struct libusb_device_filter *filter,
+	struct discovered_devs **_discdevs)
 {
-	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
-	char filename[PATH_MAX];
-	int r;
-
-	_get_usbfs_path(handle->dev, filename);
-	usbi_dbg("opening %s", filename);
-	hpriv->fd = open(filename, O_RDWR);
-	if (hpriv->fd < 0) {
-		if (errno == EACCES) {
-			usbi_err(HANDLE_CTX(handle), "libusbx couldn't open USB device %s: "
-				"Permission denied.", filename);
-			usbi_err(HANDLE_CTX(handle),
-				"libusbx requires write access to USB device nodes.");
-			return LIBUSB_ERROR_ACCESS;
-		} else if (errno == ENOENT) {
-			usbi_err(HANDLE_CTX(handle), "libusbx couldn't open USB device %s: "
-				"No such file or directory.", filename);
-			return LIBUSB_ERROR_NO_DEVICE;
-		} else {
-			usbi_err(HANDLE_CTX(handle),
-				"open failed, code %d errno %d", hpriv->fd, errno);
-			return LIBUSB_ERROR_IO;
-		}
-	}
-
-	r = ioctl(hpriv->fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
-	if (r < 0) {
-		if (errno == ENOTTY)
-			usbi_dbg("%s: getcap not available", filename);
-		else
-			usbi_err(HANDLE_CTX(handle),
-				 "%s: getcap failed (%d)", filename, errno);
-		hpriv->caps = 0;
-		if (supports_flag_zero_packet)
-			hpriv->caps |= USBFS_CAP_ZERO_PACKET;
-		if (supports_flag_bulk_continuation)
-			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
-	}
-
-	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	/* usbfs gives nothing to filter on without reading the device nodes,
+	 * so that is left to the library. it tells no port numbers either,
+	 * so no device can be on a given port path. */
+	if (sysfs_can_relate_devices != 0)
+		return sysfs_get_device_list(ctx, filter, _discdevs);
+	if (filter->port_numbers_len > 0)
+		return 0;
+	return usbfs_get_device_list(ctx, _discdevs);
 }
 
-static void op_close(struct libusb_device_handle *dev_handle)
+/* the device nodes show in the modification time of their directory, which
+ * only has a resolution of a second: a change within the second of an earlier
+ * one would go unnoticed, so no stamp is given while the last change is that
+ * recent. */
+static int fold_dir_stamp(const char *path, time_t now, unsigned long *stamp)
 {
-	int fd = _device_handle_priv(dev_handle)->fd;
-	usbi_remove_pollfd(HANDLE_CTX(dev_handle), fd);
-	close(fd);
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return LIBUSB_ERROR_IO;
+	if (st.st_mtime >= now - 1)
+		return LIBUSB_ERROR_BUSY;
+
+	*stamp = *stamp * 31 + (unsigned long) st.st_mtime;
+	return 0;
 }
 
-static int op_get_configuration(struct libusb_device_handle *handle,
-	int *config)
+static int op_get_device_list_stamp(struct libusb_context *ctx,
+	unsigned long *stamp)
 {
+	char dirpath[PATH_MAX];
+	struct dirent *entry;
+	time_t now = time(NULL);
+	DIR *buses;
 	int r;
-	if (sysfs_can_relate_devices != 1)
+
+	/* usbfs itself does not keep track of changes */
+	if (!usbdev_names && strcmp(usbfs_path, "/dev/bus/usb") != 0)
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 
-	r = sysfs_get_active_config(handle->dev, config);
-	if (r < 0)
+	*stamp = 0;
+	r = fold_dir_stamp(usbfs_path, now, stamp);
+	if (r < 0 || usbdev_names)
 		return r;
 
-	if (*config == -1) {
-		usbi_err(HANDLE_CTX(handle), "device unconfigured");
-		*config = 0;
+	buses = opendir(usbfs_path);
+	if (!buses) {
+		usbi_err(ctx, "opendir buses failed errno=%d", errno);
+		return LIBUSB_ERROR_IO;
 	}
 
-	return 0;
+	while ((entry = readdir(buses))) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		snprintf(dirpath, PATH_MAX, "%s/%s", usbfs_path, entry->d_name);
+		r = fold_dir_stamp(dirpath, now, stamp);
+		if (r < 0)
+			break;
+	}
+
+	closedir(buses);
+	return r;
 }
 
-static int op_set_configuration(struct libusb_device_handle *handle, int config)
+/* fill in the port number and parent of a device from its sysfs name, like
+ * sysfs_analyze_topology() does for a whole device list */
+static void sysfs_set_parent(struct libusb_device *dev)
 {
-	struct linux_device_priv *priv = _device_priv(handle->dev);
-	int fd = _device_handle_priv(handle)->fd;
-	int r = ioctl(fd, IOCTL_USBFS_SETCONFIG, &config);
-	if (r) {
-		if (errno == EINVAL)
-			return LIBUSB_ERROR_NOT_FOUND;
-		else if (errno == EBUSY)
-			return LIBUSB_ERROR_BUSY;
-		else if (errno == ENODEV)
-			return LIBUSB_ERROR_NO_DEVICE;
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	const char *sysfs_dir = _device_priv(dev)->sysfs_dir;
+	char parent[PATH_MAX];
+	const char *p;
+	int busnum, devaddr;
 
-		usbi_err(HANDLE_CTX(handle), "failed, error %d errno %d", r, errno);
-		return LIBUSB_ERROR_OTHER;
-	}
+	/* root hubs don't have parents or port numbers */
+	if (dev->parent_dev || !sysfs_dir || sysfs_dir[0] == 'u')
+		return;
 
-	if (!sysfs_has_descriptors) {
-		/* update our cached active config descriptor */
-		if (config == -1) {
-			if (priv->config_descriptor) {
-				free(priv->config_descriptor);
-				priv->config_descriptor = NULL;
-			}
-		} else {
-			r = cache_active_config(handle->dev, fd, config);
-			if (r < 0)
-				usbi_warn(HANDLE_CTX(handle),
-					"failed to update cached config descriptor, error %d", r);
-		}
+	p = strrchr(sysfs_dir, '.');
+	if (!p) {
+		p = strchr(sysfs_dir, '-');
+		if (!p)
+			return;
+	}
+	dev->port_number = atoi(p + 1);
+
+	if (*p == '-')
+		snprintf(parent, PATH_MAX, "usb%.*s", (int)(p - sysfs_dir), sysfs_dir);
+	else
+		snprintf(parent, PATH_MAX, "%.*s", (int)(p - sysfs_dir), sysfs_dir);
+
+	busnum = __read_sysfs_attr(ctx, parent, "busnum");
+	devaddr = __read_sysfs_attr(ctx, parent, "devnum");
+	if (busnum < 0 || devaddr < 0)
+		return;
+
+	dev->parent_dev = usbi_get_device_by_session_id(ctx,
+		(unsigned long)(busnum << 8 | devaddr));
+}
+
+static void linux_hotplug_event(int arrived, int busnum, int devaddr,
+	const char *devpath)
+{
+	struct libusb_context *ctx;
+	struct libusb_device *dev;
+	const char *sysfs_dir = NULL;
+	int r;
+
+	usbi_dbg("device %d/%d %s", busnum, devaddr, arrived ? "arrived" : "left");
+
+	/* the name of the device in sysfs is the last component of its path */
+	if (sysfs_can_relate_devices) {
+		sysfs_dir = strrchr(devpath, '/');
+		sysfs_dir = sysfs_dir ? sysfs_dir + 1 : devpath;
+	}
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+		usbi_mutex_lock(&ctx->device_list_lock);
+		if (arrived) {
+			r = linux_get_device(ctx, (uint8_t) busnum, (uint8_t) devaddr,
+				sysfs_dir, &dev);
+			if (r == 0) {
+				sysfs_set_parent(dev);
+				usbi_connect_device(dev, 1);
+				libusb_unref_device(dev);
+			} else {
+				usbi_warn(ctx, "could not set up device %d/%d: %s",
+					busnum, devaddr, libusb_error_name(r));
+			}
+		} else {
+			dev = usbi_ref_device_by_session_id(ctx,
+				(unsigned long)(busnum << 8 | devaddr));
+			if (dev) {
+				usbi_disconnect_device(dev);
+				libusb_unref_device(dev);
+			}
+		}
+		usbi_mutex_unlock(&ctx->device_list_lock);
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+}
+
+/* read one uevent: an "action@devpath" header followed by NUL separated
+ * KEY=value pairs. only usb devices matter here, not their interfaces. */
+static void linux_hotplug_receive(void)
+{
+	char buf[2048];
+	struct sockaddr_nl snl;
+	socklen_t snl_len = sizeof(snl);
+	const char *action = NULL, *subsystem = NULL, *devtype = NULL;
+	const char *devpath = NULL;
+	int busnum = 0, devaddr = 0;
+	size_t off;
+	ssize_t len;
+
+	len = recvfrom(hotplug_monitor_fd, buf, sizeof(buf) - 1, 0,
+		(struct sockaddr *) &snl, &snl_len);
+	if (len <= 0)
+		return;
+
+	/* only trust the kernel, udev sends its own messages from userspace */
+	if (snl_len != sizeof(snl) || snl.nl_pid != 0)
+		return;
+	buf[len] = '\0';
+
+	for (off = strlen(buf) + 1; off < (size_t) len; off += strlen(buf + off) + 1) {
+		const char *kv = buf + off;
+
+		if (strncmp(kv, "ACTION=", 7) == 0)
+			action = kv + 7;
+		else if (strncmp(kv, "SUBSYSTEM=", 10) == 0)
+			subsystem = kv + 10;
+		else if (strncmp(kv, "DEVTYPE=", 8) == 0)
+			devtype = kv + 8;
+		else if (strncmp(kv, "DEVPATH=", 8) == 0)
+			devpath = kv + 8;
+		else if (strncmp(kv, "BUSNUM=", 7) == 0)
+			busnum = atoi(kv + 7);
+		else if (strncmp(kv, "DEVNUM=", 7) == 0)
+			devaddr = atoi(kv + 7);
+	}
+
+	if (!action || !subsystem || !devtype || !devpath
+			|| strcmp(subsystem, "usb") != 0
+			|| strcmp(devtype, "usb_device") != 0)
+		return;
+	if (busnum <= 0 || busnum > 255 || devaddr <= 0 || devaddr > 255)
+		return;
+
+	if (strcmp(action, "add") == 0)
+		linux_hotplug_event(1, busnum, devaddr, devpath);
+	else if (strcmp(action, "remove") == 0)
+		linux_hotplug_event(0, busnum, devaddr, devpath);
+}
+
+static void *linux_hotplug_thread_main(void *arg)
+{
+	struct pollfd fds[2];
+	int r;
+
+	UNUSED(arg);
+
+	fds[0].fd = hotplug_monitor_pipe[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = hotplug_monitor_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		r = poll(fds, 2, -1);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			usbi_err(NULL, "poll failed errno=%d", errno);
+			break;
+		}
+
+		/* woken up to stop */
+		if (fds[0].revents)
+			break;
+		if (fds[1].revents)
+			linux_hotplug_receive();
+	}
+
+	return NULL;
+}
+
+/* must be called with hotplug_monitor_lock held */
+static int linux_start_hotplug_monitor(void)
+{
+	struct sockaddr_nl snl;
+	int r;
+
+	hotplug_monitor_fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+	if (hotplug_monitor_fd < 0) {
+		usbi_dbg("netlink socket failed errno=%d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+	fcntl(hotplug_monitor_fd, F_SETFD, FD_CLOEXEC);
+
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	/* the multicast group of the uevents sent by the kernel */
+	snl.nl_groups = 1;
+	r = bind(hotplug_monitor_fd, (struct sockaddr *) &snl, sizeof(snl));
+	if (r < 0) {
+		usbi_dbg("netlink bind failed errno=%d", errno);
+		goto err_close_fd;
+	}
+
+	r = usbi_pipe(hotplug_monitor_pipe);
+	if (r < 0)
+		goto err_close_fd;
+
+	r = usbi_thread_create(&hotplug_monitor_thread,
+		linux_hotplug_thread_main, NULL);
+	if (r != 0)
+		goto err_close_pipe;
+
+	return 0;
+
+err_close_pipe:
+	close(hotplug_monitor_pipe[0]);
+	close(hotplug_monitor_pipe[1]);
+	hotplug_monitor_pipe[0] = hotplug_monitor_pipe[1] = -1;
+err_close_fd:
+	close(hotplug_monitor_fd);
+	hotplug_monitor_fd = -1;
+	return LIBUSB_ERROR_OTHER;
+}
+
+/* must be called with hotplug_monitor_lock held */
+static void linux_stop_hotplug_monitor(void)
+{
+	unsigned char dummy = 1;
+
+	if (hotplug_monitor_fd < 0)
+		return;
+
+	if (write(hotplug_monitor_pipe[1], &dummy, sizeof(dummy)) == sizeof(dummy))
+		usbi_thread_join(hotplug_monitor_thread);
+	else
+		usbi_err(NULL, "could not stop the uevent monitor");
+
+	close(hotplug_monitor_pipe[0]);
+	close(hotplug_monitor_pipe[1]);
+	hotplug_monitor_pipe[0] = hotplug_monitor_pipe[1] = -1;
+	close(hotplug_monitor_fd);
+	hotplug_monitor_fd = -1;
+}
+
+static int op_open(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	char filename[PATH_MAX];
+	int r;
+
+	_get_usbfs_path(handle->dev, filename);
+	usbi_dbg("opening %s", filename);
+	hpriv->fd = open(filename, O_RDWR);
+	if (hpriv->fd < 0) {
+		if (errno == EACCES) {
+			usbi_err(HANDLE_CTX(handle), "libusbx couldn't open USB device %s: "
+				"Permission denied.", filename);
+			usbi_err(HANDLE_CTX(handle),
+				"libusbx requires write access to USB device nodes.");
+			return LIBUSB_ERROR_ACCESS;
+		} else if (errno == ENOENT) {
+			usbi_err(HANDLE_CTX(handle), "libusbx couldn't open USB device %s: "
+				"No such file or directory.", filename);
+			return LIBUSB_ERROR_NO_DEVICE;
+		} else {
+			usbi_err(HANDLE_CTX(handle),
+				"open failed, code %d errno %d", hpriv->fd, errno);
+			return LIBUSB_ERROR_IO;
+		}
+	}
+
+	r = ioctl(hpriv->fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
+	if (r < 0) {
+		if (errno == ENOTTY)
+			usbi_dbg("%s: getcap not available", filename);
+		else
+			usbi_err(HANDLE_CTX(handle),
+				 "%s: getcap failed (%d)", filename, errno);
+		hpriv->caps = 0;
+		if (supports_flag_zero_packet)
+			hpriv->caps |= USBFS_CAP_ZERO_PACKET;
+		if (supports_flag_bulk_continuation)
+			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
+	}
+
+	return usbi_add_handle_pollfd(handle, hpriv->fd, POLLOUT);
+}
+
+static void op_close(struct libusb_device_handle *dev_handle)
+{
+	int fd = _device_handle_priv(dev_handle)->fd;
+	usbi_remove_pollfd(HANDLE_CTX(dev_handle), fd);
+	close(fd);
+}
+
+static int op_get_configuration(struct libusb_device_handle *handle,
+	int *config)
+{
+	int r;
+	if (sysfs_can_relate_devices != 1)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = sysfs_get_active_config(handle->dev, config);
+	if (r < 0)
+		return r;
+
+	if (*config == -1) {
+		usbi_err(HANDLE_CTX(handle), "device unconfigured");
+		*config = 0;
+	}
+
+	return 0;
+}
+
+static int op_set_configuration(struct libusb_device_handle *handle, int config)
+{
+	struct linux_device_priv *priv = _device_priv(handle->dev);
+	int fd = _device_handle_priv(handle)->fd;
+	int r = ioctl(fd, IOCTL_USBFS_SETCONFIG, &config);
+	if (r) {
+		if (errno == EINVAL)
+			return LIBUSB_ERROR_NOT_FOUND;
+		else if (errno == EBUSY)
+			return LIBUSB_ERROR_BUSY;
+		else if (errno == ENODEV)
+			return LIBUSB_ERROR_NO_DEVICE;
+
+		usbi_err(HANDLE_CTX(handle), "failed, error %d errno %d", r, errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	if (!sysfs_has_descriptors) {
+		/* update our cached active config descriptor */
+		usbi_mutex_lock(&handle->dev->lock);
+		if (config == -1) {
+			if (priv->config_descriptor) {
+				free(priv->config_descriptor);
+				priv->config_descriptor = NULL;
+			}
+			priv->config_loaded = 1;
+		} else {
+			r = cache_active_config(handle->dev, fd, config);
+			if (r < 0) {
+				usbi_warn(HANDLE_CTX(handle),
+					"failed to update cached config descriptor, error %d", r);
+				/* look it up again when next needed */
+				priv->config_loaded = 0;
+			} else {
+				priv->config_loaded = 1;
+			}
+		}
+		usbi_mutex_unlock(&handle->dev->lock);
 	}
 
 	return 0;
@@ -1598,6 +2068,141 @@ static int op_attach_kernel_driver(struct libusb_device_handle *handle,
 	return 0;
 }
 
+/* usbfs (kernel 4.6+) hands out DMA-able memory through mmap() on the device
+ * fd. URBs with a buffer inside such a mapping are submitted without the
+ * kernel bouncing their data through a buffer of its own, so there is
+ * nothing for the submit paths to do to benefit from it. */
+static unsigned char *op_dev_mem_alloc(struct libusb_device_handle *handle,
+	size_t len)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	unsigned char *buffer;
+
+	buffer = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		hpriv->fd, 0);
+	if (buffer == MAP_FAILED) {
+		usbi_err(HANDLE_CTX(handle), "alloc dev mem failed errno %d", errno);
+		return NULL;
+	}
+	return buffer;
+}
+
+static int op_dev_mem_free(struct libusb_device_handle *handle,
+	unsigned char *buffer, size_t len)
+{
+	if (munmap(buffer, len) != 0) {
+		usbi_err(HANDLE_CTX(handle), "free dev mem failed errno %d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+static int op_set_max_urbs(struct libusb_device_handle *handle, int max_urbs)
+{
+	_device_handle_priv(handle)->max_urbs = max_urbs;
+	return LIBUSB_SUCCESS;
+}
+
+/* bulk streams need kernel 3.15+ and a USB 3.0 host controller */
+static int do_streams_ioctl(struct libusb_device_handle *handle,
+	unsigned long req, uint32_t num_streams, unsigned char *endpoints,
+	int num_endpoints)
+{
+	int r, fd = _device_handle_priv(handle)->fd;
+	struct usbfs_streams *streams;
+
+	if (num_endpoints <= 0 || num_endpoints > 30) /* 15 in + 15 out eps */
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	streams = malloc(sizeof(struct usbfs_streams) + num_endpoints);
+	if (!streams)
+		return LIBUSB_ERROR_NO_MEM;
+
+	streams->num_streams = num_streams;
+	streams->num_eps = num_endpoints;
+	memcpy(streams->eps, endpoints, num_endpoints);
+
+	r = ioctl(fd, req, streams);
+
+	free(streams);
+
+	if (r < 0) {
+		if (errno == ENOTTY)
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		else if (errno == EINVAL)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		else if (errno == ENODEV)
+			return LIBUSB_ERROR_NO_DEVICE;
+
+		usbi_err(HANDLE_CTX(handle),
+			"streams-ioctl failed error %d errno %d", r, errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+	return r;
+}
+
+static int op_alloc_streams(struct libusb_device_handle *handle,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+{
+	return do_streams_ioctl(handle, IOCTL_USBFS_ALLOC_STREAMS, num_streams,
+		endpoints, num_endpoints);
+}
+
+static int op_free_streams(struct libusb_device_handle *handle,
+	unsigned char *endpoints, int num_endpoints)
+{
+	return do_streams_ioctl(handle, IOCTL_USBFS_FREE_STREAMS, 0, endpoints,
+		num_endpoints);
+}
+
+/* map the errno of a failed synchronous usbfs transfer */
+static int sync_transfer_error(void)
+{
+	switch (errno) {
+	case ETIMEDOUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case EOVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case ENODEV:
+	case ESHUTDOWN:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case EINVAL:
+		/* rejected before any I/O took place, e.g. a buffer beyond the
+		 * limits of this kernel: the asynchronous path will do */
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	default:
+		usbi_dbg("synchronous transfer failed errno %d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static int op_sync_control_transfer(struct libusb_device_handle *handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+	uint16_t wIndex, unsigned char *data, uint16_t wLength,
+	unsigned int timeout)
+{
+	struct usbfs_ctrltransfer ctrl = {
+		.bmRequestType = bmRequestType,
+		.bRequest = bRequest,
+		.wValue = wValue,
+		.wIndex = wIndex,
+		.wLength = wLength,
+		.timeout = timeout,
+		.data = data
+	};
+	int r;
+
+	if (wLength > MAX_CTRL_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = ioctl(_device_handle_priv(handle)->fd, IOCTL_USBFS_CONTROL, &ctrl);
+	if (r < 0)
+		return sync_transfer_error();
+	return r;
+}
+
 static void op_destroy_device(struct libusb_device *dev)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
@@ -1648,18 +2253,209 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
-static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+/* Return zeroed storage for the URBs of a new submission, reusing the
+ * storage kept from an earlier submission when it is large enough. Any URB
+ * layout saved from that submission is lost. */
+static void *alloc_urb_mem(struct linux_transfer_priv *tpriv, size_t len)
+{
+	tpriv->layout.num_urbs = 0;
+
+	if (tpriv->urb_mem_len < len) {
+		void *mem = malloc(len);
+		if (!mem)
+			return NULL;
+		free(tpriv->urb_mem);
+		tpriv->urb_mem = mem;
+		tpriv->urb_mem_len = len;
+	}
+
+	memset(tpriv->urb_mem, 0, len);
+	return tpriv->urb_mem;
+}
+
+/* Detach the URBs from a transfer that is no longer in flight. The storage
+ * stays attached to the transfer for its next submission and is only freed
+ * along with the transfer, in op_destroy_transfer_priv(). */
+static void release_urbs(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	tpriv->urbs = NULL;
+}
+
+static void save_urb_layout(struct linux_transfer_priv *tpriv,
+	struct libusb_transfer *transfer, uint32_t caps, int num_urbs)
+{
+	tpriv->layout.num_urbs = num_urbs;
+	tpriv->layout.caps = caps;
+	tpriv->layout.buffer = transfer->buffer;
+	tpriv->layout.length = transfer->length;
+	tpriv->layout.num_iso_packets = transfer->num_iso_packets;
+	tpriv->layout.endpoint = transfer->endpoint;
+	tpriv->layout.type = transfer->type;
+	tpriv->layout.flags = transfer->flags;
+}
+
+/* Check whether the URBs in urb_mem were set up for a submission with the
+ * same geometry as this one. The buffer may differ, as long as it has the
+ * same length. For iso transfers the caller must still check the packet
+ * lengths. */
+static int urb_layout_matches(struct linux_transfer_priv *tpriv,
+	struct libusb_transfer *transfer, uint32_t caps)
+{
+	return tpriv->layout.num_urbs > 0
+		&& tpriv->layout.caps == caps
+		&& tpriv->layout.length == transfer->length
+		&& tpriv->layout.num_iso_packets == transfer->num_iso_packets
+		&& tpriv->layout.endpoint == transfer->endpoint
+		&& tpriv->layout.type == transfer->type
+		&& tpriv->layout.flags == transfer->flags;
+}
+
+/* Clear the URB fields written by the kernel on completion, so that a URB
+ * can be submitted again without being set up from scratch, and move it to
+ * the part of the transfer's (possibly new) buffer it was covering. */
+static void reset_urb(struct linux_transfer_priv *tpriv, struct usbfs_urb *urb,
+	unsigned char *buffer)
 {
 	int i;
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		struct usbfs_urb *urb = tpriv->iso_urbs[i];
-		if (!urb)
+
+	if (buffer != tpriv->layout.buffer)
+		urb->buffer = buffer
+			+ ((unsigned char *)urb->buffer - tpriv->layout.buffer);
+	urb->status = 0;
+	urb->actual_length = 0;
+	urb->start_frame = 0;
+	urb->error_count = 0;
+	if (urb->type != USBFS_URB_TYPE_ISO)
+		return;
+	for (i = 0; i < urb->number_of_packets; i++) {
+		urb->iso_frame_desc[i].actual_length = 0;
+		urb->iso_frame_desc[i].status = 0;
+	}
+}
+
+/* Set up the URBs of a vectored bulk transfer: one per segment, split
+ * further where usbfs cannot take a segment in one go, and chained with bulk
+ * continuation so that a short packet ends the transfer as a whole. Empty
+ * segments are skipped. */
+static struct usbfs_urb *setup_iov_urbs(struct usbi_transfer *itransfer,
+	unsigned char urb_type, uint32_t caps, int *num_urbs_out)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
+		== LIBUSB_ENDPOINT_OUT;
+	int use_bulk_continuation = !!(caps & USBFS_CAP_BULK_CONTINUATION);
+	int split = !(caps &
+		(USBFS_CAP_BULK_SCATTER_GATHER | USBFS_CAP_NO_PACKET_SIZE_LIM));
+	struct usbfs_urb *urbs;
+	int num_urbs = 0;
+	int i, j;
+
+	for (i = 0; i < itransfer->num_iov; i++) {
+		int len = itransfer->iov[i].length;
+		if (len > 0)
+			num_urbs += split ?
+				(len + MAX_BULK_BUFFER_LENGTH - 1) / MAX_BULK_BUFFER_LENGTH : 1;
+	}
+	if (num_urbs == 0)
+		num_urbs = 1;
+	usbi_dbg("need %d urbs for %d segments with length %d", num_urbs,
+		itransfer->num_iov, transfer->length);
+
+	urbs = alloc_urb_mem(tpriv, num_urbs * sizeof(struct usbfs_urb));
+	if (!urbs)
+		return NULL;
+
+	for (i = 0, j = 0; i < itransfer->num_iov && j < num_urbs; i++) {
+		unsigned char *buffer = itransfer->iov[i].buffer;
+		int remaining = itransfer->iov[i].length;
+
+		while (remaining > 0) {
+			struct usbfs_urb *urb = &urbs[j];
+			int len = split ? MIN(remaining, MAX_BULK_BUFFER_LENGTH)
+				: remaining;
+
+			urb->buffer = buffer;
+			urb->buffer_length = len;
+			if (use_bulk_continuation && !is_out)
+				urb->flags = USBFS_URB_SHORT_NOT_OK;
+			if (j > 0 && use_bulk_continuation)
+				urb->flags |= USBFS_URB_BULK_CONTINUATION;
+			buffer += len;
+			remaining -= len;
+			j++;
+		}
+	}
+
+	for (j = 0; j < num_urbs; j++) {
+		urbs[j].usercontext = itransfer;
+		urbs[j].type = urb_type;
+		urbs[j].endpoint = transfer->endpoint;
+	}
+
+	/* we have already checked that the flag is supported */
+	if (is_out && transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
+		urbs[num_urbs - 1].flags |= USBFS_URB_ZERO_PACKET;
+
+	*num_urbs_out = num_urbs;
+	return urbs;
+}
+
+/* Submit the URBs of a bulk transfer that have not been submitted yet, as
+ * many as the max_urbs of the device handle allows to be outstanding at
+ * once. Returns 0, or the errno of the submission that failed. */
+static int submit_bulk_urbs(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_device_handle_priv *dpriv =
+		_device_handle_priv(transfer->dev_handle);
+	unsigned int stream_id =
+		transfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM
+		? itransfer->stream_id : 0;
+	int max_urbs = dpriv->max_urbs;
+
+	while (tpriv->num_submitted < tpriv->num_urbs) {
+		struct usbfs_urb *urb = &tpriv->urbs[tpriv->num_submitted];
+
+		if (max_urbs > 0
+				&& tpriv->num_submitted - tpriv->num_retired >= max_urbs)
 			break;
-		free(urb);
+
+		/* shares its storage with the unused number_of_packets */
+		urb->stream_id = stream_id;
+		if (ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb) < 0)
+			return errno;
+		tpriv->num_submitted++;
 	}
+	return 0;
+}
+
+/* Give up on the URBs of a bulk transfer that have not been submitted yet,
+ * so that the transfer completes once the submitted ones are reaped. */
+static void stop_bulk_urbs(struct linux_transfer_priv *tpriv)
+{
+	tpriv->num_urbs = tpriv->num_submitted;
+}
+
+/* Lower the URB size limit of a device after the kernel failed to allocate
+ * memory for a URB of len bytes. Returns 0 if the limit cannot go lower. */
+static int lower_bulk_urb_len(struct linux_device_priv *priv, int len)
+{
+	int new_len = (len / 2) & ~(MAX_BULK_BUFFER_LENGTH - 1);
 
-	free(tpriv->iso_urbs);
-	tpriv->iso_urbs = NULL;
+	if (len <= MAX_BULK_BUFFER_LENGTH)
+		return 0;
+	if (new_len < MAX_BULK_BUFFER_LENGTH)
+		new_len = MAX_BULK_BUFFER_LENGTH;
+	if (!priv->max_bulk_urb_len || new_len < priv->max_bulk_urb_len)
+		priv->max_bulk_urb_len = new_len;
+	usbi_dbg("bulk urbs now limited to %d bytes", priv->max_bulk_urb_len);
+	return 1;
 }
 
 static int submit_bulk_transfer(struct usbi_transfer *itransfer,
@@ -1670,10 +2466,12 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
 	struct linux_device_handle_priv *dpriv =
 		_device_handle_priv(transfer->dev_handle);
+	struct linux_device_priv *priv = _device_priv(transfer->dev_handle->dev);
 	struct usbfs_urb *urbs;
 	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
 		== LIBUSB_ENDPOINT_OUT;
 	int bulk_buffer_len, use_bulk_continuation;
+	int num_urbs;
 	int r;
 	int i;
 	size_t alloc_size;
@@ -1685,16 +2483,22 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 			!(dpriv->caps & USBFS_CAP_ZERO_PACKET))
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 
+retry:
 	/*
 	 * Older versions of usbfs place a 16kb limit on bulk URBs. We work
 	 * around this by splitting large transfers into 16k blocks, and then
 	 * submit all urbs at once. it would be simpler to submit one urb at
 	 * a time, but there is a big performance gain doing it this way.
+	 * The max_urbs of the device handle can still limit how many of them
+	 * are outstanding, the others being submitted as earlier ones
+	 * complete.
 	 *
 	 * Newer versions lift the 16k limit (USBFS_CAP_NO_PACKET_SIZE_LIM),
 	 * using arbritary large transfers can still be a bad idea though, as
 	 * the kernel needs to allocate physical contiguous memory for this,
-	 * which may fail for large buffers.
+	 * which may fail for large buffers. With bulk continuation we can
+	 * split anywhere, so we start with a single URB and halve the URB
+	 * size for the device each time the kernel fails to allocate one.
 	 *
 	 * The kernel solves this problem by splitting the transfer into
 	 * blocks itself when the host-controller is scatter-gather capable
@@ -1708,6 +2512,15 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 		/* Good! Just submit everything in one go */
 		bulk_buffer_len = transfer->length ? transfer->length : 1;
 		use_bulk_continuation = 0;
+	} else if ((dpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM) &&
+			(dpriv->caps & USBFS_CAP_BULK_CONTINUATION)) {
+		/* Split at the largest size known to work, using
+		   bulk-continuation for short-transfers */
+		bulk_buffer_len = transfer->length ? transfer->length : 1;
+		if (priv->max_bulk_urb_len
+				&& bulk_buffer_len > priv->max_bulk_urb_len)
+			bulk_buffer_len = priv->max_bulk_urb_len;
+		use_bulk_continuation = 1;
 	} else if (dpriv->caps & USBFS_CAP_BULK_CONTINUATION) {
 		/* Split the transfers and use bulk-continuation to
 		   avoid issues with short-transfers */
@@ -1727,106 +2540,157 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 		use_bulk_continuation = 0;
 	}
 
-	int num_urbs = transfer->length / bulk_buffer_len;
-	int last_urb_partial = 0;
+	if (usbi_transfer_has_iov(itransfer)) {
+		urbs = setup_iov_urbs(itransfer, urb_type, dpriv->caps, &num_urbs);
+		if (!urbs)
+			return LIBUSB_ERROR_NO_MEM;
+	} else if (urb_layout_matches(tpriv, transfer, dpriv->caps)
+			&& tpriv->layout.urb_len == bulk_buffer_len) {
+		urbs = tpriv->urb_mem;
+		num_urbs = tpriv->layout.num_urbs;
+		for (i = 0; i < num_urbs; i++)
+			reset_urb(tpriv, &urbs[i], transfer->buffer);
+		tpriv->layout.buffer = transfer->buffer;
+	} else {
+		int last_urb_partial = 0;
 
-	if (transfer->length == 0) {
-		num_urbs = 1;
-	} else if ((transfer->length % bulk_buffer_len) > 0) {
-		last_urb_partial = 1;
-		num_urbs++;
+		num_urbs = transfer->length / bulk_buffer_len;
+		if (transfer->length == 0) {
+			num_urbs = 1;
+		} else if ((transfer->length % bulk_buffer_len) > 0) {
+			last_urb_partial = 1;
+			num_urbs++;
+		}
+		usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
+			transfer->length);
+		alloc_size = num_urbs * sizeof(struct usbfs_urb);
+		urbs = alloc_urb_mem(tpriv, alloc_size);
+		if (!urbs)
+			return LIBUSB_ERROR_NO_MEM;
+
+		for (i = 0; i < num_urbs; i++) {
+			struct usbfs_urb *urb = &urbs[i];
+			urb->usercontext = itransfer;
+			urb->type = urb_type;
+			urb->endpoint = transfer->endpoint;
+			urb->buffer = transfer->buffer + (i * bulk_buffer_len);
+			if (use_bulk_continuation && !is_out)
+				urb->flags = USBFS_URB_SHORT_NOT_OK;
+			if (i == num_urbs - 1 && last_urb_partial)
+				urb->buffer_length = transfer->length % bulk_buffer_len;
+			else if (transfer->length == 0)
+				urb->buffer_length = 0;
+			else
+				urb->buffer_length = bulk_buffer_len;
+
+			if (i > 0 && use_bulk_continuation)
+				urb->flags |= USBFS_URB_BULK_CONTINUATION;
+
+			/* we have already checked that the flag is supported */
+			if (is_out && i == num_urbs - 1 &&
+			    transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
+				urb->flags |= USBFS_URB_ZERO_PACKET;
+		}
+		save_urb_layout(tpriv, transfer, dpriv->caps, num_urbs);
+		tpriv->layout.urb_len = bulk_buffer_len;
 	}
-	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
-		transfer->length);
-	alloc_size = num_urbs * sizeof(struct usbfs_urb);
-	urbs = calloc(1, alloc_size);
-	if (!urbs)
-		return LIBUSB_ERROR_NO_MEM;
+
 	tpriv->urbs = urbs;
 	tpriv->num_urbs = num_urbs;
+	tpriv->num_submitted = 0;
 	tpriv->num_retired = 0;
 	tpriv->reap_action = NORMAL;
 	tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
 
-	for (i = 0; i < num_urbs; i++) {
-		struct usbfs_urb *urb = &urbs[i];
-		urb->usercontext = itransfer;
-		urb->type = urb_type;
-		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
-		if (use_bulk_continuation && !is_out)
-			urb->flags = USBFS_URB_SHORT_NOT_OK;
-		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % bulk_buffer_len;
-		else if (transfer->length == 0)
-			urb->buffer_length = 0;
-		else
-			urb->buffer_length = bulk_buffer_len;
-
-		if (i > 0 && use_bulk_continuation)
-			urb->flags |= USBFS_URB_BULK_CONTINUATION;
+	r = submit_bulk_urbs(itransfer);
+	if (r) {
+		int err = r;
+
+		/* out of contiguous memory for the URB: use smaller ones from
+		 * now on, and right away if nothing has been submitted */
+		i = tpriv->num_submitted;
+		if (err == ENOMEM && use_bulk_continuation
+				&& !usbi_transfer_has_iov(itransfer)
+				&& lower_bulk_urb_len(priv, urbs[i].buffer_length)
+				&& i == 0) {
+			release_urbs(itransfer);
+			goto retry;
+		}
 
-		/* we have already checked that the flag is supported */
-		if (is_out && i == num_urbs - 1 &&
-		    transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
-			urb->flags |= USBFS_URB_ZERO_PACKET;
+		if (err == ENODEV) {
+			r = LIBUSB_ERROR_NO_DEVICE;
+		} else {
+			usbi_err(TRANSFER_CTX(transfer),
+				"submiturb failed errno=%d", err);
+			r = LIBUSB_ERROR_IO;
+		}
 
-		r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
-		if (r < 0) {
-			if (errno == ENODEV) {
-				r = LIBUSB_ERROR_NO_DEVICE;
-			} else {
-				usbi_err(TRANSFER_CTX(transfer),
-					"submiturb failed error %d errno=%d", r, errno);
-				r = LIBUSB_ERROR_IO;
-			}
-	
-			/* if the first URB submission fails, we can simply free up and
-			 * return failure immediately. */
-			if (i == 0) {
-				usbi_dbg("first URB failed, easy peasy");
-				free(urbs);
-				tpriv->urbs = NULL;
-				return r;
-			}
+		/* if the first URB submission fails, we can simply free up and
+		 * return failure immediately. */
+		if (i == 0) {
+			usbi_dbg("first URB failed, easy peasy");
+			release_urbs(itransfer);
+			return r;
+		}
 
-			/* if it's not the first URB that failed, the situation is a bit
-			 * tricky. we may need to discard all previous URBs. there are
-			 * complications:
-			 *  - discarding is asynchronous - discarded urbs will be reaped
-			 *    later. the user must not have freed the transfer when the
-			 *    discarded URBs are reaped, otherwise libusbx will be using
-			 *    freed memory.
-			 *  - the earlier URBs may have completed successfully and we do
-			 *    not want to throw away any data.
-			 *  - this URB failing may be no error; EREMOTEIO means that
-			 *    this transfer simply didn't need all the URBs we submitted
-			 * so, we report that the transfer was submitted successfully and
-			 * in case of error we discard all previous URBs. later when
-			 * the final reap completes we can report error to the user,
-			 * or success if an earlier URB was completed successfully.
-			 */
-			tpriv->reap_action = EREMOTEIO == errno ? COMPLETED_EARLY : SUBMIT_FAILED;
+		/* if it's not the first URB that failed, the situation is a bit
+		 * tricky. we may need to discard all previous URBs. there are
+		 * complications:
+		 *  - discarding is asynchronous - discarded urbs will be reaped
+		 *    later. the user must not have freed the transfer when the
+		 *    discarded URBs are reaped, otherwise libusbx will be using
+		 *    freed memory.
+		 *  - the earlier URBs may have completed successfully and we do
+		 *    not want to throw away any data.
+		 *  - this URB failing may be no error; EREMOTEIO means that
+		 *    this transfer simply didn't need all the URBs we submitted
+		 * so, we report that the transfer was submitted successfully and
+		 * in case of error we discard all previous URBs. later when
+		 * the final reap completes we can report error to the user,
+		 * or success if an earlier URB was completed successfully.
+		 */
+		tpriv->reap_action = EREMOTEIO == err ? COMPLETED_EARLY : SUBMIT_FAILED;
 
-			/* The URBs we haven't submitted yet we count as already
-			 * retired. */
-			tpriv->num_retired += num_urbs - i;
+		/* The URBs we haven't submitted yet are not waited for. */
+		stop_bulk_urbs(tpriv);
 
-			/* If we completed short then don't try to discard. */
-			if (COMPLETED_EARLY == tpriv->reap_action)
-				return 0;
+		/* If we completed short then don't try to discard. */
+		if (COMPLETED_EARLY == tpriv->reap_action)
+			return 0;
 
-			discard_urbs(itransfer, 0, i);
+		discard_urbs(itransfer, 0, i);
 
-			usbi_dbg("reporting successful submission but waiting for %d "
-				"discards before reporting error", i);
-			return 0;
-		}
+		usbi_dbg("reporting successful submission but waiting for %d "
+			"discards before reporting error", i);
 	}
 
 	return 0;
 }
 
+/* Reuse the iso URBs left from the previous submission if they were set up
+ * for the same geometry and packet lengths, resetting them on the way. */
+static int reuse_iso_urbs(struct linux_transfer_priv *tpriv,
+	struct libusb_transfer *transfer, uint32_t caps)
+{
+	struct usbfs_urb **urbs = tpriv->urb_mem;
+	int i, j, k = 0;
+
+	if (!urb_layout_matches(tpriv, transfer, caps))
+		return 0;
+
+	for (i = 0; i < tpriv->layout.num_urbs; i++) {
+		struct usbfs_urb *urb = urbs[i];
+
+		for (j = 0; j < urb->number_of_packets; j++, k++)
+			if (urb->iso_frame_desc[j].length
+					!= transfer->iso_packet_desc[k].length)
+				return 0;
+		reset_urb(tpriv, urb, transfer->buffer);
+	}
+	tpriv->layout.buffer = transfer->buffer;
+	return 1;
+}
+
 static int submit_iso_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -1835,7 +2699,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	struct linux_device_handle_priv *dpriv =
 		_device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb **urbs;
-	size_t alloc_size;
+	unsigned char *urb_mem;
 	int num_packets = transfer->num_iso_packets;
 	int i;
 	int this_urb_len = 0;
@@ -1847,6 +2711,12 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	if (tpriv->iso_urbs)
 		return LIBUSB_ERROR_BUSY;
 
+	if (reuse_iso_urbs(tpriv, transfer, dpriv->caps)) {
+		urbs = tpriv->urb_mem;
+		num_urbs = tpriv->layout.num_urbs;
+		goto submit;
+	}
+
 	/* usbfs places a 32kb limit on iso URBs. we divide up larger requests
 	 * into smaller units to meet such restriction, then fire off all the
 	 * units at once. it would be simpler if we just fired one unit at a time,
@@ -1872,18 +2742,12 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	}
 	usbi_dbg("need %d 32k URBs for transfer", num_urbs);
 
-	alloc_size = num_urbs * sizeof(*urbs);
-	urbs = calloc(1, alloc_size);
+	urbs = alloc_urb_mem(tpriv, ISO_URBS_ALLOC_SIZE(num_urbs, num_packets));
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
+	urb_mem = (unsigned char *)(urbs + num_urbs);
 
-	tpriv->iso_urbs = urbs;
-	tpriv->num_urbs = num_urbs;
-	tpriv->num_retired = 0;
-	tpriv->reap_action = NORMAL;
-	tpriv->iso_packet_offset = 0;
-
-	/* allocate + initialize each URB with the correct number of packets */
+	/* lay out + initialize each URB with the correct number of packets */
 	for (i = 0; i < num_urbs; i++) {
 		struct usbfs_urb *urb;
 		unsigned int space_remaining_in_urb = MAX_ISO_BUFFER_LENGTH;
@@ -1907,13 +2771,9 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 			}
 		}
 
-		alloc_size = sizeof(*urb)
-			+ (urb_packet_offset * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
-		if (!urb) {
-			free_iso_urbs(tpriv);
-			return LIBUSB_ERROR_NO_MEM;
-		}
+		urb = (struct usbfs_urb *)urb_mem;
+		urb_mem += ISO_URB_ALIGN(sizeof(*urb)
+			+ (urb_packet_offset * sizeof(struct usbfs_iso_packet_desc)));
 		urbs[i] = urb;
 
 		/* populate packet lengths */
@@ -1931,6 +2791,14 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		urb->number_of_packets = urb_packet_offset;
 		urb->buffer = urb_buffer_orig;
 	}
+	save_urb_layout(tpriv, transfer, dpriv->caps, num_urbs);
+
+submit:
+	tpriv->iso_urbs = urbs;
+	tpriv->num_urbs = num_urbs;
+	tpriv->num_retired = 0;
+	tpriv->reap_action = NORMAL;
+	tpriv->iso_packet_offset = 0;
 
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
@@ -1948,7 +2816,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 			 * return failure immediately. */
 			if (i == 0) {
 				usbi_dbg("first URB failed, easy peasy");
-				free_iso_urbs(tpriv);
+				release_urbs(itransfer);
 				return r;
 			}
 
@@ -1997,7 +2865,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(struct usbfs_urb));
+	urb = alloc_urb_mem(tpriv, sizeof(struct usbfs_urb));
 	if (!urb)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urb;
@@ -2012,8 +2880,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
-		tpriv->urbs = NULL;
+		release_urbs(itransfer);
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
 
@@ -2033,6 +2900,7 @@ static int op_submit_transfer(struct usbi_transfer *itransfer)
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
 		return submit_control_transfer(itransfer);
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 		return submit_bulk_transfer(itransfer, USBFS_URB_TYPE_BULK);
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		return submit_bulk_transfer(itransfer, USBFS_URB_TYPE_INTERRUPT);
@@ -2053,11 +2921,15 @@ static int op_cancel_transfer(struct usbi_transfer *itransfer)
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_BULK:
-		if (tpriv->reap_action == ERROR)
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		stop_bulk_urbs(tpriv);
+		if (tpriv->reap_action == ERROR
+				&& transfer->type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
 			break;
-		/* else, fall through */
+		tpriv->reap_action = CANCELLED;
+		break;
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
-	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		tpriv->reap_action = CANCELLED;
 		break;
@@ -2073,6 +2945,37 @@ static int op_cancel_transfer(struct usbi_transfer *itransfer)
 	return discard_urbs(itransfer, 0, tpriv->num_urbs);
 }
 
+static int op_prealloc_transfer_priv(struct usbi_transfer *itransfer,
+	int max_length)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int num_packets = itransfer->num_iso_packets;
+	int num_urbs = (max_length + MAX_BULK_BUFFER_LENGTH - 1)
+		/ MAX_BULK_BUFFER_LENGTH;
+	size_t bulk_size = (num_urbs ? num_urbs : 1) * sizeof(struct usbfs_urb);
+	size_t iso_size = 0;
+
+	/* a pooled transfer may be used for any transfer type, so size for the
+	 * worst case of either. bulk transfers are split at most into chunks of
+	 * MAX_BULK_BUFFER_LENGTH, iso transfers need at most one URB per packet
+	 * plus one. */
+	if (num_packets > 0)
+		iso_size = ISO_URBS_ALLOC_SIZE(num_packets + 1, num_packets);
+
+	if (!alloc_urb_mem(tpriv, MAX(bulk_size, iso_size)))
+		return LIBUSB_ERROR_NO_MEM;
+	return 0;
+}
+
+static void op_destroy_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	free(tpriv->urb_mem);
+	tpriv->urb_mem = NULL;
+	tpriv->urb_mem_len = 0;
+}
+
 static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -2083,17 +2986,17 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		usbi_mutex_lock(&itransfer->lock);
 		if (tpriv->urbs)
-			free(tpriv->urbs);
-		tpriv->urbs = NULL;
+			release_urbs(itransfer);
 		usbi_mutex_unlock(&itransfer->lock);
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		usbi_mutex_lock(&itransfer->lock);
 		if (tpriv->iso_urbs)
-			free_iso_urbs(tpriv);
+			release_urbs(itransfer);
 		usbi_mutex_unlock(&itransfer->lock);
 		break;
 	default:
@@ -2135,7 +3038,12 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 		 * (closing any holes), so that libusbx reports the total amount of
 		 * transferred data and presents it in a contiguous chunk.
 		 */
-		if (urb->actual_length > 0) {
+		if (urb->actual_length > 0 && usbi_transfer_has_iov(itransfer)) {
+			usbi_dbg("received %d bytes of surplus data", urb->actual_length);
+			usbi_iov_move(itransfer, itransfer->transferred, urb->buffer,
+				urb->actual_length);
+			itransfer->transferred += urb->actual_length;
+		} else if (urb->actual_length > 0) {
 			unsigned char *target = transfer->buffer + itransfer->transferred;
 			usbi_dbg("received %d bytes of surplus data", urb->actual_length);
 			if (urb->buffer != target) {
@@ -2181,11 +3089,12 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 			tpriv->reap_status = LIBUSB_TRANSFER_STALL;
 		goto cancel_remaining;
 	case -EOVERFLOW:
-		/* overflow can only ever occur in the last urb */
+		/* overflow can only ever occur in the last urb, but later ones
+		 * may still be outstanding */
 		usbi_dbg("overflow, actual_length=%d", urb->actual_length);
 		if (tpriv->reap_status == LIBUSB_TRANSFER_COMPLETED)
 			tpriv->reap_status = LIBUSB_TRANSFER_OVERFLOW;
-		goto completed;
+		goto cancel_remaining;
 	case -ETIME:
 	case -EPROTO:
 	case -EILSEQ:
@@ -2211,11 +3120,30 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 			urb->actual_length, urb->buffer_length);
 		if (tpriv->reap_action == NORMAL)
 			tpriv->reap_action = COMPLETED_EARLY;
-	} else
-		goto out_unlock;
+	} else {
+		/* keep the window of outstanding URBs full */
+		int err = submit_bulk_urbs(itransfer);
+
+		if (!err)
+			goto out_unlock;
+		usbi_dbg("submitting further urbs failed errno %d", err);
+		if (ENOMEM == err)
+			lower_bulk_urb_len(_device_priv(transfer->dev_handle->dev),
+				tpriv->urbs[tpriv->num_submitted].buffer_length);
+		if (EREMOTEIO == err) {
+			tpriv->reap_action = COMPLETED_EARLY;
+		} else {
+			tpriv->reap_action = SUBMIT_FAILED;
+			if (ENODEV == err)
+				tpriv->reap_status = LIBUSB_TRANSFER_NO_DEVICE;
+		}
+	}
 
 cancel_remaining:
-	if (ERROR == tpriv->reap_action && LIBUSB_TRANSFER_COMPLETED == tpriv->reap_status)
+	stop_bulk_urbs(tpriv);
+
+	if ((ERROR == tpriv->reap_action || SUBMIT_FAILED == tpriv->reap_action)
+			&& LIBUSB_TRANSFER_COMPLETED == tpriv->reap_status)
 		tpriv->reap_status = LIBUSB_TRANSFER_ERROR;
 
 	if (tpriv->num_retired == tpriv->num_urbs) /* nothing to cancel */
@@ -2230,8 +3158,7 @@ out_unlock:
 	return 0;
 
 completed:
-	free(tpriv->urbs);
-	tpriv->urbs = NULL;
+	release_urbs(itransfer);
 	usbi_mutex_unlock(&itransfer->lock);
 	return CANCELLED == tpriv->reap_action ?
 		usbi_handle_transfer_cancellation(itransfer) :
@@ -2316,7 +3243,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 
 		if (tpriv->num_retired == num_urbs) {
 			usbi_dbg("CANCEL: last URB handled, reporting");
-			free_iso_urbs(tpriv);
+			release_urbs(itransfer);
 			if (tpriv->reap_action == CANCELLED) {
 				usbi_mutex_unlock(&itransfer->lock);
 				return usbi_handle_transfer_cancellation(itransfer);
@@ -2349,7 +3276,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	/* if we're the last urb then we're done */
 	if (urb_idx == num_urbs) {
 		usbi_dbg("last URB in transfer --> complete!");
-		free_iso_urbs(tpriv);
+		release_urbs(itransfer);
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_completion(itransfer, status);
 	}
@@ -2374,8 +3301,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status != 0 && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer),
 				"cancel: unrecognised urb status %d", urb->status);
-		free(tpriv->urbs);
-		tpriv->urbs = NULL;
+		release_urbs(itransfer);
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_cancellation(itransfer);
 	}
@@ -2415,42 +3341,28 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
-	tpriv->urbs = NULL;
+	release_urbs(itransfer);
 	usbi_mutex_unlock(&itransfer->lock);
 	return usbi_handle_transfer_completion(itransfer, status);
 }
 
-static int reap_for_handle(struct libusb_device_handle *handle)
+static int handle_reaped_urb(struct libusb_device_handle *handle,
+	struct usbfs_urb *urb)
 {
-	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
-	int r;
-	struct usbfs_urb *urb;
-	struct usbi_transfer *itransfer;
-	struct libusb_transfer *transfer;
-
-	r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urb);
-	if (r == -1 && errno == EAGAIN)
-		return 1;
-	if (r < 0) {
-		if (errno == ENODEV)
-			return LIBUSB_ERROR_NO_DEVICE;
-
-		usbi_err(HANDLE_CTX(handle), "reap failed error %d errno=%d",
-			r, errno);
-		return LIBUSB_ERROR_IO;
-	}
-
-	itransfer = urb->usercontext;
-	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct usbi_transfer *itransfer = urb->usercontext;
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
 	usbi_dbg("urb type=%d status=%d transferred=%d", urb->type, urb->status,
 		urb->actual_length);
+	usbi_trace(HANDLE_CTX(handle), reap, LIBUSB_TRACE_REAP, transfer,
+		urb->actual_length, urb->status);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		return handle_iso_completion(itransfer, urb);
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		return handle_bulk_completion(itransfer, urb);
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
@@ -2462,30 +3374,74 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+/* reap up to MAX_REAP_BATCH completed URBs from the device, then process
+ * them in the order the kernel returned them. the URBs are all collected
+ * before processing starts, as completion callbacks may resubmit or free
+ * transfers. returns 1 if there was nothing to reap. */
+static int reap_for_handle(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct usbfs_urb *urbs[MAX_REAP_BATCH];
+	int num_urbs = 0;
+	int ret = 0;
+	int r;
+	int i;
+
+	while (num_urbs < MAX_REAP_BATCH) {
+		r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urbs[num_urbs]);
+		if (r == -1 && errno == EAGAIN)
+			break;
+		if (r < 0) {
+			if (errno == ENODEV) {
+				ret = LIBUSB_ERROR_NO_DEVICE;
+			} else {
+				usbi_err(HANDLE_CTX(handle), "reap failed error %d errno=%d",
+					r, errno);
+				ret = LIBUSB_ERROR_IO;
+			}
+			break;
+		}
+		num_urbs++;
+	}
+
+	if (num_urbs == 0)
+		return ret ? ret : 1;
+
+	usbi_dbg("reaped %d urbs", num_urbs);
+	for (i = 0; i < num_urbs; i++) {
+		r = handle_reaped_urb(handle, urbs[i]);
+		if (r < 0 && ret == 0)
+			ret = r;
+	}
+
+	return ret;
+}
+
 static int op_handle_events(struct libusb_context *ctx,
 	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
 {
 	int r;
 	unsigned int i = 0;
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
+	/* the handles cannot be closed under us: libusb_close() first locks
+	 * out the event thread handling them. not taking the open_devs_lock
+	 * here lets several event threads reap concurrently. */
 	for (i = 0; i < nfds && num_ready > 0; i++) {
 		struct pollfd *pollfd = &fds[i];
 		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
 
 		if (!pollfd->revents)
 			continue;
 
 		num_ready--;
-		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
-			hpriv = _device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
+		handle = usbi_pollfd_handle(ctx, fds, i);
+		if (!handle) {
+			usbi_dbg("no device handle for fd %d", pollfd->fd);
+			continue;
 		}
 
 		if (pollfd->revents & POLLERR) {
-			usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->fd);
+			usbi_remove_pollfd(HANDLE_CTX(handle), pollfd->fd);
 			usbi_handle_disconnect(handle);
 			continue;
 		}
@@ -2494,13 +3450,10 @@ static int op_handle_events(struct libusb_context *ctx,
 		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
 			continue;
 		else if (r < 0)
-			goto out;
+			return r;
 	}
 
-	r = 0;
-out:
-	usbi_mutex_unlock(&ctx->open_devs_lock);
-	return r;
+	return 0;
 }
 
 static int op_clock_gettime(int clk_id, struct timespec *tp)
@@ -2526,7 +3479,7 @@ static clockid_t op_get_timerfd_clockid(void)
 const struct usbi_os_backend linux_usbfs_backend = {
 	.name = "Linux usbfs",
 	.init = op_init,
-	.exit = NULL,
+	.exit = op_exit,
 	.get_device_list = op_get_device_list,
 	.get_device_descriptor = op_get_device_descriptor,
 	.get_active_config_descriptor = op_get_active_config_descriptor,
@@ -2565,4 +3518,20 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.device_handle_priv_size = sizeof(struct linux_device_handle_priv),
 	.transfer_priv_size = sizeof(struct linux_transfer_priv),
 	.add_iso_packet_size = 0,
+
+	.prealloc_transfer_priv = op_prealloc_transfer_priv,
+	.destroy_transfer_priv = op_destroy_transfer_priv,
+
+	.dev_mem_alloc = op_dev_mem_alloc,
+	.dev_mem_free = op_dev_mem_free,
+	.alloc_streams = op_alloc_streams,
+	.free_streams = op_free_streams,
+	.set_max_urbs = op_set_max_urbs,
+
+	.caps = USBI_CAP_BULK_IOV | USBI_CAP_HAS_HOTPLUG
+		| USBI_CAP_EVENT_PARTITIONS,
+
+	.sync_control_transfer = op_sync_control_transfer,
+	.get_device_list_stamp = op_get_device_list_stamp,
+	.get_device_list_filtered = op_get_device_list_filtered,
 };
@@ -85,6 +85,13 @@ struct usbfs_iso_packet_desc {
 #define MAX_BULK_BUFFER_LENGTH		16384
 #define MAX_CTRL_BUFFER_LENGTH		4096
 
+/* maximum number of URBs reaped from a device in a single event handling
+ * pass. may be overridden at build time; a value of 1 restores the former
+ * behaviour of reaping only one URB per poll() wakeup */
+#ifndef MAX_REAP_BATCH
+#define MAX_REAP_BATCH			32
+#endif
+
 struct usbfs_urb {
 	unsigned char type;
 	unsigned char endpoint;
@@ -94,7 +101,10 @@ struct usbfs_urb {
 	int buffer_length;
 	int actual_length;
 	int start_frame;
-	int number_of_packets;
+	union {
+		int number_of_packets;	/* Only used for isoc urbs */
+		unsigned int stream_id;	/* Only used with bulk streams */
+	};
 	int error_count;
 	unsigned int signr;
 	void *usercontext;
@@ -113,6 +123,12 @@ struct usbfs_ioctl {
 	void *data;	/* param buffer (in, or out) */
 };
 
+struct usbfs_streams {
+	unsigned int num_streams; /* Not used by USBDEVFS_FREE_STREAMS */
+	unsigned int num_eps;
+	unsigned char eps[0];
+};
+
 struct usbfs_hub_portinfo {
 	unsigned char numports;
 	unsigned char port[127];	/* port to device num mapping */
@@ -145,5 +161,7 @@ struct usbfs_hub_portinfo {
 #define IOCTL_USBFS_CLAIM_PORT	_IOR('U', 24, unsigned int)
 #define IOCTL_USBFS_RELEASE_PORT	_IOR('U', 25, unsigned int)
 #define IOCTL_USBFS_GET_CAPABILITIES	_IOR('U', 26, __u32)
+#define IOCTL_USBFS_ALLOC_STREAMS	_IOR('U', 28, struct usbfs_streams)
+#define IOCTL_USBFS_FREE_STREAMS	_IOR('U', 29, struct usbfs_streams)
 
 #endif
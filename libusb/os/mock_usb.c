@@ -0,0 +1,1076 @@
+/*
+ * Mock backend for libusbx, simulating devices in process
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This backend doesn't talk to any hardware. It is built with
+ * --enable-mock-backend and selected by setting LIBUSB_BACKEND=mock in the
+ * environment before the first libusb_init() of the process. It exists to
+ * measure and debug the overhead of libusbx itself, independently of the
+ * kernel and the bus.
+ *
+ * The simulated devices look like a "Gadget Zero" in its source/sink
+ * configuration: one vendor specific interface with a bulk IN endpoint that
+ * returns as much data as asked for, and a bulk OUT endpoint that accepts
+ * anything, plus an interrupt IN endpoint that reports as the bulk IN one
+ * does. The control endpoint answers the standard requests, and echoes
+ * back the data of the last vendor OUT request on vendor IN requests.
+ *
+ * The following environment variables shape the simulation:
+ * - LIBUSB_MOCK_DEVICES: comma separated list of vid:pid pairs, in
+ *   hexadecimal, one per device. Defaults to a single 0525:a4a0 device.
+ * - LIBUSB_MOCK_LATENCY: time in microseconds for a transfer to complete,
+ *   on top of the time it spends on the bus.
+ * - LIBUSB_MOCK_BANDWIDTH: bytes per second each endpoint can carry. The
+ *   transfers of an endpoint are completed one after the other, as on a
+ *   real bus.
+ * - LIBUSB_MOCK_HOTPLUG: "arrive:leave", in milliseconds. The last device
+ *   of LIBUSB_MOCK_DEVICES is only plugged in arrive ms after the first
+ *   libusb_init(), and unplugged again leave ms after it, unless leave is 0
+ *   or omitted. Hotplug callbacks are notified of both.
+ *
+ * The configuration is read again whenever no context uses the backend
+ * any more, so that a test program can try several in turn.
+ *
+ * With neither latency nor bandwidth limit, transfers complete as soon as
+ * they are submitted. Otherwise a thread completes them when they are due.
+ * The same thread plugs and unplugs the device of LIBUSB_MOCK_HOTPLUG.
+ * Either way completions are signalled through a pipe per device handle, so
+ * that they go through the same poll() based event handling as with the
+ * other backends.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libusbi.h"
+
+#define MOCK_MAX_DEVICES	16
+#define MOCK_BUS_NUMBER		1
+#define MOCK_CTRL_BUF_SIZE	256
+
+#define MOCK_EP_IN		0x81
+#define MOCK_EP_OUT		0x01
+#define MOCK_EP_INT_IN		0x82
+#define MOCK_MAX_PACKET_SIZE	512
+#define MOCK_INT_PACKET_SIZE	64
+
+static const char *mock_strings[] = {
+	NULL,			/* string 0 is the language table */
+	"libusbx",
+	"Mock device",
+};
+
+struct mock_device_spec {
+	uint16_t vid;
+	uint16_t pid;
+};
+
+struct mock_device_priv {
+	int index;
+	int config;
+};
+
+struct mock_device_handle_priv {
+	int pipe[2];
+
+	/* transfers ready to be handed back by handle_events */
+	struct list_head completed;
+	usbi_mutex_t lock;
+
+	/* data of the last vendor OUT control request */
+	unsigned char ctrl_buf[MOCK_CTRL_BUF_SIZE];
+	int ctrl_len;
+
+	/* when each endpoint is done with the transfers submitted so far.
+	 * protected by mock_lock. */
+	struct timespec busy_until[USB_MAXENDPOINTS];
+};
+
+enum mock_transfer_state {
+	MOCK_IDLE,
+	MOCK_PENDING,
+	MOCK_COMPLETED,
+};
+
+struct mock_transfer_priv {
+	struct list_head list;
+	struct usbi_transfer *itransfer;
+	struct libusb_device_handle *handle;
+	struct timespec due;
+	enum mock_transfer_state state;
+	enum libusb_transfer_status status;
+	int cancelled;
+};
+
+/* configuration, read from the environment by the first init */
+static struct mock_device_spec mock_devices[MOCK_MAX_DEVICES];
+static int mock_num_devices;
+static long mock_latency_us;
+static long mock_bandwidth;
+static int mock_hotplug;
+static long mock_arrive_ms;
+static long mock_leave_ms;
+
+/* how far the hotplug simulation got: 0 before the arrival of the last
+ * device, 1 while it is plugged in, 2 once it left. the changes count from
+ * mock_origin, the time of the first init. protected by mock_lock. */
+static int mock_hotplug_step;
+static struct timespec mock_origin;
+
+/* transfers waiting for their due time, in due order, for the completion
+ * thread. mock_lock also protects the state of every transfer and the
+ * busy_until times of every handle. */
+static usbi_mutex_static_t mock_lock = USBI_MUTEX_INITIALIZER;
+static usbi_cond_t mock_cond;
+static struct list_head mock_pending;
+static usbi_thread_t mock_thread;
+static int mock_thread_running;
+static int mock_thread_stop;
+static int mock_init_count;
+
+static struct mock_device_priv *_device_priv(struct libusb_device *dev)
+{
+	return (struct mock_device_priv *)dev->os_priv;
+}
+
+static struct mock_device_handle_priv *_device_handle_priv(
+	struct libusb_device_handle *handle)
+{
+	return (struct mock_device_handle_priv *)handle->os_priv;
+}
+
+static void timespec_add_ns(struct timespec *ts, long long ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += (time_t)(ns / 1000000000);
+	ts->tv_nsec = (long)(ns % 1000000000);
+}
+
+static int timespec_cmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	if (a->tv_nsec != b->tv_nsec)
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+	return 0;
+}
+
+static void parse_config(void)
+{
+	const char *env;
+
+	mock_num_devices = 0;
+	env = getenv("LIBUSB_MOCK_DEVICES");
+	while (env && *env && mock_num_devices < MOCK_MAX_DEVICES) {
+		unsigned int vid, pid;
+		const char *next = strchr(env, ',');
+
+		if (sscanf(env, "%x:%x", &vid, &pid) == 2) {
+			mock_devices[mock_num_devices].vid = (uint16_t)vid;
+			mock_devices[mock_num_devices].pid = (uint16_t)pid;
+			mock_num_devices++;
+		} else {
+			usbi_warn(NULL, "ignoring malformed mock device '%s'", env);
+		}
+		env = next ? next + 1 : NULL;
+	}
+	if (!env && !getenv("LIBUSB_MOCK_DEVICES")) {
+		mock_devices[0].vid = 0x0525;
+		mock_devices[0].pid = 0xa4a0;
+		mock_num_devices = 1;
+	}
+
+	env = getenv("LIBUSB_MOCK_LATENCY");
+	mock_latency_us = env ? atol(env) : 0;
+	if (mock_latency_us < 0)
+		mock_latency_us = 0;
+	env = getenv("LIBUSB_MOCK_BANDWIDTH");
+	mock_bandwidth = env ? atol(env) : 0;
+	if (mock_bandwidth < 0)
+		mock_bandwidth = 0;
+
+	mock_hotplug = 0;
+	mock_arrive_ms = 0;
+	mock_leave_ms = 0;
+	env = getenv("LIBUSB_MOCK_HOTPLUG");
+	if (env && mock_num_devices > 0) {
+		if (sscanf(env, "%ld:%ld", &mock_arrive_ms, &mock_leave_ms) >= 1
+				&& mock_arrive_ms >= 0 && mock_leave_ms >= 0)
+			mock_hotplug = 1;
+		else
+			usbi_warn(NULL, "ignoring malformed mock hotplug '%s'", env);
+	}
+	mock_hotplug_step = 0;
+	clock_gettime(CLOCK_MONOTONIC, &mock_origin);
+
+	usbi_dbg("%d devices, latency %ldus, bandwidth %ldB/s", mock_num_devices,
+		mock_latency_us, mock_bandwidth);
+}
+
+/* hand a transfer over to the event handling of its device handle. must be
+ * called with mock_lock held. */
+static void complete_transfer(struct mock_transfer_priv *tpriv)
+{
+	struct mock_device_handle_priv *hpriv = _device_handle_priv(tpriv->handle);
+	unsigned char dummy = 1;
+
+	tpriv->state = MOCK_COMPLETED;
+	usbi_mutex_lock(&hpriv->lock);
+	list_add_tail(&tpriv->list, &hpriv->completed);
+	usbi_mutex_unlock(&hpriv->lock);
+	if (usbi_write(hpriv->pipe[1], &dummy, sizeof(dummy)) <= 0
+			&& errno != EAGAIN)
+		usbi_warn(NULL, "mock completion write failed, errno=%d", errno);
+}
+
+/* whether simulated device i is plugged in. must be called with mock_lock
+ * held. */
+static int mock_device_present(int i)
+{
+	return !mock_hotplug || i != mock_num_devices - 1
+		|| mock_hotplug_step == 1;
+}
+
+/* when the hotplug simulation takes its next step. returns 0 if it is
+ * done. must be called with mock_lock held. */
+static int mock_next_hotplug(struct timespec *due)
+{
+	if (!mock_hotplug || mock_hotplug_step == 2
+			|| (mock_hotplug_step == 1 && !mock_leave_ms))
+		return 0;
+
+	*due = mock_origin;
+	timespec_add_ns(due, (long long)(mock_hotplug_step == 0 ?
+		mock_arrive_ms : mock_leave_ms) * 1000000);
+	return 1;
+}
+
+static int mock_get_device(struct libusb_context *ctx, int i,
+	struct libusb_device **device);
+
+/* tell all contexts about the arrival or departure of the hotplugged
+ * device */
+static void mock_hotplug_event(int arrived)
+{
+	struct libusb_context *ctx;
+	struct libusb_device *dev;
+	int i = mock_num_devices - 1;
+	int r;
+
+	usbi_dbg("mock device %d %s", i + 1, arrived ? "arrived" : "left");
+	usbi_mutex_static_lock(&active_contexts_lock);
+	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+		usbi_mutex_lock(&ctx->device_list_lock);
+		if (arrived) {
+			r = mock_get_device(ctx, i, &dev);
+			if (r == 0) {
+				usbi_connect_device(dev, 1);
+				libusb_unref_device(dev);
+			} else {
+				usbi_warn(ctx, "could not set up mock device %d: %s", i + 1,
+					libusb_error_name(r));
+			}
+		} else {
+			dev = usbi_ref_device_by_session_id(ctx,
+				MOCK_BUS_NUMBER << 8 | (i + 1));
+			if (dev) {
+				usbi_disconnect_device(dev);
+				libusb_unref_device(dev);
+			}
+		}
+		usbi_mutex_unlock(&ctx->device_list_lock);
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+}
+
+static void *mock_thread_main(void *arg)
+{
+	struct mock_transfer_priv *tpriv;
+	struct timespec now, due, wake;
+	int have_due;
+
+	UNUSED(arg);
+
+	usbi_mutex_static_lock(&mock_lock);
+	while (!mock_thread_stop) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		have_due = mock_next_hotplug(&due);
+		if (have_due && timespec_cmp(&due, &now) <= 0) {
+			/* the contexts are notified without mock_lock, which
+			 * scan_devices() takes under their device_list_lock */
+			mock_hotplug_step++;
+			usbi_mutex_static_unlock(&mock_lock);
+			mock_hotplug_event(mock_hotplug_step == 1);
+			usbi_mutex_static_lock(&mock_lock);
+			continue;
+		}
+
+		if (!list_empty(&mock_pending)) {
+			tpriv = list_entry(mock_pending.next, struct mock_transfer_priv,
+				list);
+			if (timespec_cmp(&tpriv->due, &now) <= 0) {
+				list_del(&tpriv->list);
+				complete_transfer(tpriv);
+				continue;
+			}
+			if (!have_due || timespec_cmp(&tpriv->due, &due) < 0)
+				due = tpriv->due;
+			have_due = 1;
+		}
+
+		if (!have_due) {
+			usbi_cond_wait(&mock_cond, &mock_lock);
+			continue;
+		}
+
+		/* condition variables wait on the realtime clock */
+		clock_gettime(CLOCK_REALTIME, &wake);
+		timespec_add_ns(&wake,
+			(long long)(due.tv_sec - now.tv_sec) * 1000000000
+			+ (due.tv_nsec - now.tv_nsec));
+		usbi_cond_timedwait(&mock_cond, &mock_lock, &wake);
+	}
+	usbi_mutex_static_unlock(&mock_lock);
+
+	return NULL;
+}
+
+static int op_init(struct libusb_context *ctx)
+{
+	int r = 0;
+
+	UNUSED(ctx);
+
+	usbi_mutex_static_lock(&mock_lock);
+	if (mock_init_count++ == 0) {
+		parse_config();
+		list_init(&mock_pending);
+		if (mock_latency_us || mock_bandwidth || mock_hotplug) {
+			usbi_cond_init(&mock_cond, NULL);
+			mock_thread_stop = 0;
+			if (usbi_thread_create(&mock_thread, mock_thread_main, NULL)) {
+				usbi_cond_destroy(&mock_cond);
+				mock_init_count--;
+				r = LIBUSB_ERROR_OTHER;
+			} else {
+				mock_thread_running = 1;
+			}
+		}
+	}
+	usbi_mutex_static_unlock(&mock_lock);
+
+	return r;
+}
+
+static void op_exit(void)
+{
+	int join = 0;
+
+	usbi_mutex_static_lock(&mock_lock);
+	if (--mock_init_count == 0 && mock_thread_running) {
+		mock_thread_stop = 1;
+		mock_thread_running = 0;
+		usbi_cond_signal(&mock_cond);
+		join = 1;
+	}
+	usbi_mutex_static_unlock(&mock_lock);
+
+	if (join) {
+		usbi_thread_join(mock_thread);
+		usbi_cond_destroy(&mock_cond);
+	}
+}
+
+/* whether a simulated device may match a filter, going by its spec. the
+ * devices hang off the root hub directly, without a port path to match. */
+static int mock_device_may_match(int i,
+	const struct libusb_device_filter *filter)
+{
+	const struct mock_device_spec *spec = &mock_devices[i];
+
+	if (!filter)
+		return 1;
+	if (filter->vendor_id != LIBUSB_DEVICE_FILTER_ANY
+			&& filter->vendor_id != spec->vid)
+		return 0;
+	if (filter->product_id != LIBUSB_DEVICE_FILTER_ANY
+			&& filter->product_id != spec->pid)
+		return 0;
+	if (filter->dev_class != LIBUSB_DEVICE_FILTER_ANY
+			&& filter->dev_class != LIBUSB_CLASS_VENDOR_SPEC)
+		return 0;
+	if (filter->bus_number != LIBUSB_DEVICE_FILTER_ANY
+			&& filter->bus_number != MOCK_BUS_NUMBER)
+		return 0;
+	return filter->port_numbers_len <= 0;
+}
+
+/* get a reference on the device of simulated device i, setting it up if
+ * the context does not know it yet */
+static int mock_get_device(struct libusb_context *ctx, int i,
+	struct libusb_device **device)
+{
+	struct libusb_device *dev;
+	unsigned long session_id = MOCK_BUS_NUMBER << 8 | (i + 1);
+	int r;
+
+	dev = usbi_ref_device_by_session_id(ctx, session_id);
+	if (!dev) {
+		dev = usbi_alloc_device(ctx, session_id);
+		if (!dev)
+			return LIBUSB_ERROR_NO_MEM;
+		dev->bus_number = MOCK_BUS_NUMBER;
+		dev->device_address = (uint8_t)(i + 1);
+		dev->speed = LIBUSB_SPEED_HIGH;
+		_device_priv(dev)->index = i;
+		_device_priv(dev)->config = 1;
+		r = usbi_sanitize_device(dev);
+		if (r < 0) {
+			libusb_unref_device(dev);
+			return r;
+		}
+	}
+
+	*device = dev;
+	return 0;
+}
+
+static int scan_devices(struct libusb_context *ctx,
+	const struct libusb_device_filter *filter,
+	struct discovered_devs **discdevs)
+{
+	struct discovered_devs *new_discdevs;
+	struct libusb_device *dev;
+	int present;
+	int r, i;
+
+	for (i = 0; i < mock_num_devices; i++) {
+		if (!mock_device_may_match(i, filter))
+			continue;
+
+		usbi_mutex_static_lock(&mock_lock);
+		present = mock_device_present(i);
+		usbi_mutex_static_unlock(&mock_lock);
+		if (!present)
+			continue;
+
+		r = mock_get_device(ctx, i, &dev);
+		if (r < 0)
+			return r;
+
+		new_discdevs = discovered_devs_append(*discdevs, dev);
+		libusb_unref_device(dev);
+		if (!new_discdevs)
+			return LIBUSB_ERROR_NO_MEM;
+		*discdevs = new_discdevs;
+	}
+
+	return 0;
+}
+
+static int op_get_device_list(struct libusb_context *ctx,
+	struct discovered_devs **discdevs)
+{
+	return scan_devices(ctx, NULL, discdevs);
+}
+
+static int op_get_device_list_filtered(struct libusb_context *ctx,
+	const struct libusb_device_filter *filter,
+	struct discovered_devs **discdevs)
+{
+	return scan_devices(ctx, filter, discdevs);
+}
+
+/* the simulated devices only change with the hotplug simulation, after
+ * each step of which the list has to be built again */
+static int op_get_device_list_stamp(struct libusb_context *ctx,
+	unsigned long *stamp)
+{
+	UNUSED(ctx);
+	usbi_mutex_static_lock(&mock_lock);
+	*stamp = (unsigned long)mock_hotplug_step;
+	usbi_mutex_static_unlock(&mock_lock);
+	return 0;
+}
+
+static int op_get_device_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, int *host_endian)
+{
+	const struct mock_device_spec *spec = &mock_devices[_device_priv(dev)->index];
+	unsigned char desc[DEVICE_DESC_LENGTH] = {
+		DEVICE_DESC_LENGTH, LIBUSB_DT_DEVICE,
+		0x00, 0x02,		/* bcdUSB */
+		LIBUSB_CLASS_VENDOR_SPEC, 0x00, 0x00,
+		64,			/* bMaxPacketSize0 */
+		0, 0, 0, 0,		/* idVendor, idProduct */
+		0x00, 0x01,		/* bcdDevice */
+		1, 2, 3,		/* iManufacturer, iProduct, iSerialNumber */
+		1,			/* bNumConfigurations */
+	};
+
+	desc[8] = spec->vid & 0xff;
+	desc[9] = spec->vid >> 8;
+	desc[10] = spec->pid & 0xff;
+	desc[11] = spec->pid >> 8;
+	memcpy(buffer, desc, DEVICE_DESC_LENGTH);
+	*host_endian = 0;
+	return 0;
+}
+
+static const unsigned char mock_config_desc[] = {
+	LIBUSB_DT_CONFIG_SIZE, LIBUSB_DT_CONFIG,
+	LIBUSB_DT_CONFIG_SIZE + LIBUSB_DT_INTERFACE_SIZE
+		+ 3 * LIBUSB_DT_ENDPOINT_SIZE, 0,	/* wTotalLength */
+	1,			/* bNumInterfaces */
+	1,			/* bConfigurationValue */
+	0,			/* iConfiguration */
+	0x80,			/* bmAttributes */
+	50,			/* bMaxPower */
+
+	LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE,
+	0, 0,			/* bInterfaceNumber, bAlternateSetting */
+	3,			/* bNumEndpoints */
+	LIBUSB_CLASS_VENDOR_SPEC, 0x00, 0x00,
+	0,			/* iInterface */
+
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT,
+	MOCK_EP_IN, LIBUSB_TRANSFER_TYPE_BULK,
+	MOCK_MAX_PACKET_SIZE & 0xff, MOCK_MAX_PACKET_SIZE >> 8,
+	0,			/* bInterval */
+
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT,
+	MOCK_EP_OUT, LIBUSB_TRANSFER_TYPE_BULK,
+	MOCK_MAX_PACKET_SIZE & 0xff, MOCK_MAX_PACKET_SIZE >> 8,
+	0,			/* bInterval */
+
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT,
+	MOCK_EP_INT_IN, LIBUSB_TRANSFER_TYPE_INTERRUPT,
+	MOCK_INT_PACKET_SIZE, 0,
+	1,			/* bInterval */
+};
+
+static int op_get_config_descriptor(struct libusb_device *dev,
+	uint8_t config_index, unsigned char *buffer, size_t len, int *host_endian)
+{
+	UNUSED(dev);
+
+	if (config_index != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+	len = MIN(len, sizeof(mock_config_desc));
+	memcpy(buffer, mock_config_desc, len);
+	*host_endian = 0;
+	return (int)len;
+}
+
+static int op_get_active_config_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, size_t len, int *host_endian)
+{
+	if (_device_priv(dev)->config != 1)
+		return LIBUSB_ERROR_NOT_FOUND;
+	return op_get_config_descriptor(dev, 0, buffer, len, host_endian);
+}
+
+static int op_open(struct libusb_device_handle *handle)
+{
+	struct mock_device_handle_priv *hpriv = _device_handle_priv(handle);
+	int r;
+
+	if (usbi_pipe(hpriv->pipe) < 0) {
+		usbi_err(HANDLE_CTX(handle), "pipe creation failed, errno=%d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+	/* completions can pile up faster than they are handled, a full pipe
+	 * still signals that there is something to do */
+	fcntl(hpriv->pipe[1], F_SETFL, fcntl(hpriv->pipe[1], F_GETFL) | O_NONBLOCK);
+	fcntl(hpriv->pipe[0], F_SETFL, fcntl(hpriv->pipe[0], F_GETFL) | O_NONBLOCK);
+
+	list_init(&hpriv->completed);
+	usbi_mutex_init(&hpriv->lock, NULL);
+
+	r = usbi_add_handle_pollfd(handle, hpriv->pipe[0], POLLIN);
+	if (r < 0) {
+		usbi_mutex_destroy(&hpriv->lock);
+		usbi_close(hpriv->pipe[0]);
+		usbi_close(hpriv->pipe[1]);
+	}
+	return r;
+}
+
+static void op_close(struct libusb_device_handle *handle)
+{
+	struct mock_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct mock_transfer_priv *tpriv, *tmp;
+
+	/* forget about the transfers the application didn't wait for */
+	usbi_mutex_static_lock(&mock_lock);
+	list_for_each_entry_safe(tpriv, tmp, &mock_pending, list,
+			struct mock_transfer_priv)
+		if (tpriv->handle == handle) {
+			list_del(&tpriv->list);
+			tpriv->state = MOCK_IDLE;
+		}
+	usbi_mutex_lock(&hpriv->lock);
+	list_for_each_entry_safe(tpriv, tmp, &hpriv->completed, list,
+			struct mock_transfer_priv) {
+		list_del(&tpriv->list);
+		tpriv->state = MOCK_IDLE;
+	}
+	usbi_mutex_unlock(&hpriv->lock);
+	usbi_mutex_static_unlock(&mock_lock);
+
+	usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->pipe[0]);
+	usbi_close(hpriv->pipe[0]);
+	usbi_close(hpriv->pipe[1]);
+	usbi_mutex_destroy(&hpriv->lock);
+}
+
+static int op_get_configuration(struct libusb_device_handle *handle,
+	int *config)
+{
+	*config = _device_priv(handle->dev)->config;
+	return 0;
+}
+
+static int op_set_configuration(struct libusb_device_handle *handle,
+	int config)
+{
+	if (config != -1 && config != 0 && config != 1)
+		return LIBUSB_ERROR_NOT_FOUND;
+	_device_priv(handle->dev)->config = config == -1 ? 0 : config;
+	return 0;
+}
+
+static int op_claim_interface(struct libusb_device_handle *handle, int iface)
+{
+	UNUSED(handle);
+	return iface == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int op_release_interface(struct libusb_device_handle *handle, int iface)
+{
+	UNUSED(handle);
+	return iface == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int op_set_interface(struct libusb_device_handle *handle, int iface,
+	int altsetting)
+{
+	UNUSED(handle);
+	if (iface != 0 || altsetting != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+	return 0;
+}
+
+static int op_clear_halt(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	UNUSED(handle);
+	UNUSED(endpoint);
+	return 0;
+}
+
+static int op_reset_device(struct libusb_device_handle *handle)
+{
+	UNUSED(handle);
+	return 0;
+}
+
+static void op_destroy_device(struct libusb_device *dev)
+{
+	UNUSED(dev);
+}
+
+/* build string descriptor idx in buf, returning its length */
+static int get_string_descriptor(struct libusb_device *dev, int idx,
+	unsigned char *buf, int len)
+{
+	char serial[8];
+	const char *str;
+	int i, n;
+
+	if (idx == 0) {
+		const unsigned char langids[] = { 4, LIBUSB_DT_STRING, 0x09, 0x04 };
+		n = MIN(len, (int)sizeof(langids));
+		memcpy(buf, langids, n);
+		return n;
+	}
+
+	if (idx == 3) {
+		snprintf(serial, sizeof(serial), "%04d", _device_priv(dev)->index);
+		str = serial;
+	} else if (idx < (int)(sizeof(mock_strings) / sizeof(mock_strings[0]))) {
+		str = mock_strings[idx];
+	} else {
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	n = 2 + 2 * (int)strlen(str);
+	if (len > 0)
+		buf[0] = (unsigned char)n;
+	if (len > 1)
+		buf[1] = LIBUSB_DT_STRING;
+	for (i = 2; i < n && i < len; i++)
+		buf[i] = (i & 1) ? 0 : str[(i - 2) / 2];
+	return MIN(n, len);
+}
+
+/* answer a control request, returning the length of its data stage or a
+ * LIBUSB_ERROR_PIPE stall */
+static int do_control_request(struct libusb_device_handle *handle,
+	struct libusb_control_setup *setup, unsigned char *data)
+{
+	struct mock_device_handle_priv *hpriv = _device_handle_priv(handle);
+	uint16_t wValue = libusb_le16_to_cpu(setup->wValue);
+	int len = libusb_le16_to_cpu(setup->wLength);
+	int host_endian;
+
+	switch (setup->bmRequestType & (0x03 << 5)) {
+	case LIBUSB_REQUEST_TYPE_VENDOR:
+		if (setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
+			len = MIN(len, hpriv->ctrl_len);
+			memcpy(data, hpriv->ctrl_buf, len);
+		} else {
+			len = MIN(len, MOCK_CTRL_BUF_SIZE);
+			memcpy(hpriv->ctrl_buf, data, len);
+			hpriv->ctrl_len = len;
+		}
+		return len;
+	case LIBUSB_REQUEST_TYPE_STANDARD:
+		break;
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	switch (setup->bRequest) {
+	case LIBUSB_REQUEST_GET_STATUS:
+		len = MIN(len, 2);
+		memset(data, 0, len);
+		return len;
+	case LIBUSB_REQUEST_GET_CONFIGURATION:
+		if (len > 0)
+			data[0] = (unsigned char)_device_priv(handle->dev)->config;
+		return MIN(len, 1);
+	case LIBUSB_REQUEST_SET_CONFIGURATION:
+		return op_set_configuration(handle, wValue & 0xff) < 0
+			? LIBUSB_ERROR_PIPE : 0;
+	case LIBUSB_REQUEST_SET_INTERFACE:
+	case LIBUSB_REQUEST_CLEAR_FEATURE:
+	case LIBUSB_REQUEST_SET_FEATURE:
+		return 0;
+	case LIBUSB_REQUEST_GET_DESCRIPTOR:
+		switch (wValue >> 8) {
+		case LIBUSB_DT_DEVICE:
+			op_get_device_descriptor(handle->dev, hpriv->ctrl_buf,
+				&host_endian);
+			len = MIN(len, DEVICE_DESC_LENGTH);
+			memcpy(data, hpriv->ctrl_buf, len);
+			return len;
+		case LIBUSB_DT_CONFIG:
+			if ((wValue & 0xff) != 0)
+				return LIBUSB_ERROR_PIPE;
+			len = MIN(len, (int)sizeof(mock_config_desc));
+			memcpy(data, mock_config_desc, len);
+			return len;
+		case LIBUSB_DT_STRING:
+			return get_string_descriptor(handle->dev, wValue & 0xff, data, len);
+		}
+		return LIBUSB_ERROR_PIPE;
+	}
+	return LIBUSB_ERROR_PIPE;
+}
+
+static int op_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *handle = transfer->dev_handle;
+	struct mock_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct mock_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct mock_transfer_priv *pos;
+	struct timespec *busy;
+	int length = transfer->length;
+	int present;
+	int r, i;
+
+	usbi_mutex_static_lock(&mock_lock);
+	present = mock_device_present(_device_priv(handle->dev)->index);
+	usbi_mutex_static_unlock(&mock_lock);
+	if (!present)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	tpriv->itransfer = itransfer;
+	tpriv->handle = handle;
+	tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+	tpriv->cancelled = 0;
+
+	/* the data moves at submission, the simulated bus time only delays the
+	 * completion */
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		if (length < LIBUSB_CONTROL_SETUP_SIZE)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		r = do_control_request(handle,
+			libusb_control_transfer_get_setup(transfer),
+			libusb_control_transfer_get_data(transfer));
+		if (r < 0) {
+			tpriv->status = LIBUSB_TRANSFER_STALL;
+			r = 0;
+		}
+		itransfer->transferred = r;
+		break;
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		if (transfer->endpoint != MOCK_EP_IN
+				&& transfer->endpoint != MOCK_EP_OUT
+				&& transfer->endpoint != MOCK_EP_INT_IN)
+			return LIBUSB_ERROR_NOT_FOUND;
+		if (transfer->endpoint & LIBUSB_ENDPOINT_IN)
+			memset(transfer->buffer, 0, length);
+		itransfer->transferred = length;
+		break;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		for (i = 0; i < transfer->num_iso_packets; i++) {
+			transfer->iso_packet_desc[i].actual_length =
+				transfer->iso_packet_desc[i].length;
+			transfer->iso_packet_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
+		}
+		itransfer->transferred = length;
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	usbi_mutex_static_lock(&mock_lock);
+	if (!mock_latency_us && !mock_bandwidth) {
+		complete_transfer(tpriv);
+		usbi_mutex_static_unlock(&mock_lock);
+		return 0;
+	}
+
+	/* the endpoint carries one transfer at a time, at the configured
+	 * bandwidth, then the transfer takes the configured latency to be
+	 * reported */
+	clock_gettime(CLOCK_MONOTONIC, &tpriv->due);
+	busy = &hpriv->busy_until[usbi_endpoint_index(transfer->endpoint)];
+	if (timespec_cmp(busy, &tpriv->due) > 0)
+		tpriv->due = *busy;
+	if (mock_bandwidth)
+		timespec_add_ns(&tpriv->due,
+			(long long)length * 1000000000 / mock_bandwidth);
+	*busy = tpriv->due;
+	timespec_add_ns(&tpriv->due, (long long)mock_latency_us * 1000);
+
+	/* transfers mostly come due in submission order, so look for the
+	 * insertion point from the end */
+	tpriv->state = MOCK_PENDING;
+	for (pos = list_entry(mock_pending.prev, struct mock_transfer_priv, list);
+			&pos->list != &mock_pending;
+			pos = list_entry(pos->list.prev, struct mock_transfer_priv, list))
+		if (timespec_cmp(&pos->due, &tpriv->due) <= 0)
+			break;
+	list_add(&tpriv->list, &pos->list);
+	if (mock_pending.next == &tpriv->list)
+		usbi_cond_signal(&mock_cond);
+	usbi_mutex_static_unlock(&mock_lock);
+
+	return 0;
+}
+
+/* the blocking counterpart of a control transfer, which takes the
+ * configured latency, but no bus time */
+static int op_sync_control_transfer(struct libusb_device_handle *handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+	uint16_t wIndex, unsigned char *data, uint16_t wLength,
+	unsigned int timeout)
+{
+	struct libusb_control_setup setup;
+	struct timespec delay;
+
+	UNUSED(timeout);
+	setup.bmRequestType = bmRequestType;
+	setup.bRequest = bRequest;
+	setup.wValue = libusb_cpu_to_le16(wValue);
+	setup.wIndex = libusb_cpu_to_le16(wIndex);
+	setup.wLength = libusb_cpu_to_le16(wLength);
+
+	if (mock_latency_us) {
+		delay.tv_sec = mock_latency_us / 1000000;
+		delay.tv_nsec = (mock_latency_us % 1000000) * 1000L;
+		nanosleep(&delay, NULL);
+	}
+	return do_control_request(handle, &setup, data);
+}
+
+static int op_cancel_transfer(struct usbi_transfer *itransfer)
+{
+	struct mock_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int r = 0;
+
+	usbi_mutex_static_lock(&mock_lock);
+	if (tpriv->state == MOCK_PENDING) {
+		list_del(&tpriv->list);
+		tpriv->cancelled = 1;
+		itransfer->transferred = 0;
+		complete_transfer(tpriv);
+	} else {
+		r = LIBUSB_ERROR_NOT_FOUND;
+	}
+	usbi_mutex_static_unlock(&mock_lock);
+
+	return r;
+}
+
+static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
+{
+	UNUSED(itransfer);
+}
+
+static int handle_completions(struct libusb_device_handle *handle)
+{
+	struct mock_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct mock_transfer_priv *tpriv;
+	struct usbi_transfer *itransfer;
+	unsigned char dummy[64];
+	int r;
+
+	while (usbi_read(hpriv->pipe[0], dummy, sizeof(dummy)) > 0)
+		;
+
+	while (1) {
+		usbi_mutex_static_lock(&mock_lock);
+		usbi_mutex_lock(&hpriv->lock);
+		if (list_empty(&hpriv->completed)) {
+			usbi_mutex_unlock(&hpriv->lock);
+			usbi_mutex_static_unlock(&mock_lock);
+			return 0;
+		}
+		tpriv = list_entry(hpriv->completed.next, struct mock_transfer_priv,
+			list);
+		list_del(&tpriv->list);
+		tpriv->state = MOCK_IDLE;
+		usbi_mutex_unlock(&hpriv->lock);
+		usbi_mutex_static_unlock(&mock_lock);
+
+		itransfer = tpriv->itransfer;
+		if (tpriv->cancelled)
+			r = usbi_handle_transfer_cancellation(itransfer);
+		else
+			r = usbi_handle_transfer_completion(itransfer, tpriv->status);
+		if (r < 0)
+			return r;
+	}
+}
+
+static int op_handle_events(struct libusb_context *ctx,
+	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
+{
+	struct libusb_device_handle *handle;
+	POLL_NFDS_TYPE i;
+	int r = 0;
+
+	/* as on Linux, libusb_close() keeps the handles alive, and several
+	 * event threads may be in here at once */
+	for (i = 0; i < nfds && num_ready > 0; i++) {
+		if (!fds[i].revents)
+			continue;
+
+		num_ready--;
+		handle = usbi_pollfd_handle(ctx, fds, i);
+		if (!handle) {
+			usbi_dbg("no device handle for fd %d", fds[i].fd);
+			continue;
+		}
+
+		r = handle_completions(handle);
+		if (r < 0)
+			break;
+	}
+
+	return r;
+}
+
+static int op_clock_gettime(int clk_id, struct timespec *tp)
+{
+	switch (clk_id) {
+	case USBI_CLOCK_MONOTONIC:
+		return clock_gettime(CLOCK_MONOTONIC, tp);
+	case USBI_CLOCK_REALTIME:
+		return clock_gettime(CLOCK_REALTIME, tp);
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static clockid_t op_get_timerfd_clockid(void)
+{
+	return CLOCK_MONOTONIC;
+}
+#endif
+
+const struct usbi_os_backend mock_backend = {
+	.name = "Mock",
+	.init = op_init,
+	.exit = op_exit,
+	.get_device_list = op_get_device_list,
+	.get_device_descriptor = op_get_device_descriptor,
+	.get_active_config_descriptor = op_get_active_config_descriptor,
+	.get_config_descriptor = op_get_config_descriptor,
+
+	.open = op_open,
+	.close = op_close,
+	.get_configuration = op_get_configuration,
+	.set_configuration = op_set_configuration,
+	.claim_interface = op_claim_interface,
+	.release_interface = op_release_interface,
+
+	.set_interface_altsetting = op_set_interface,
+	.clear_halt = op_clear_halt,
+	.reset_device = op_reset_device,
+
+	.destroy_device = op_destroy_device,
+
+	.submit_transfer = op_submit_transfer,
+	.cancel_transfer = op_cancel_transfer,
+	.clear_transfer_priv = op_clear_transfer_priv,
+
+	.handle_events = op_handle_events,
+
+	.clock_gettime = op_clock_gettime,
+	.sync_control_transfer = op_sync_control_transfer,
+
+#ifdef USBI_TIMERFD_AVAILABLE
+	.get_timerfd_clockid = op_get_timerfd_clockid,
+#endif
+
+	.device_priv_size = sizeof(struct mock_device_priv),
+	.device_handle_priv_size = sizeof(struct mock_device_handle_priv),
+	.transfer_priv_size = sizeof(struct mock_transfer_priv),
+	.add_iso_packet_size = 0,
+	.caps = USBI_CAP_HAS_HOTPLUG | USBI_CAP_EVENT_PARTITIONS,
+
+	.get_device_list_stamp = op_get_device_list_stamp,
+	.get_device_list_filtered = op_get_device_list_filtered,
+};
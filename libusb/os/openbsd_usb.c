@@ -21,6 +21,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,9 +40,41 @@ struct device_priv {
 	usb_device_descriptor_t ddesc;		/* usb device descriptor */
 };
 
+/*
+ * Transfers to an endpoint are carried out, one after the other, by a
+ * thread of its own so that submitting never blocks.  Control transfers
+ * go through the worker of endpoint 0.
+ */
+struct endpoint_worker {
+	struct handle_priv *hpriv;
+	pthread_t thread;
+	pthread_cond_t cond;
+	struct list_head queue;			/* transfers waiting to run */
+	int started;
+	int stop;
+};
+
 struct handle_priv {
 	int pipe[2];				/* for event notification */
 	int endpoints[USB_MAX_ENDPOINTS];
+
+	pthread_mutex_t lock;			/* protects what follows */
+	struct endpoint_worker workers[USB_MAX_ENDPOINTS];
+	struct list_head completed;		/* transfers to report */
+};
+
+enum transfer_state {
+	TRANSFER_QUEUED,
+	TRANSFER_RUNNING,
+	TRANSFER_DONE,
+};
+
+struct transfer_priv {
+	struct list_head list;
+	struct usbi_transfer *itransfer;
+	enum transfer_state state;
+	int cancelled;
+	int err;				/* result of the request */
 };
 
 /*
@@ -82,13 +115,17 @@ static int obsd_clock_gettime(int, struct timespec *);
  * Private functions
  */
 static int _errno_to_libusb(int);
+static enum libusb_transfer_status _err_to_status(int);
 static int _cache_active_config_descriptor(struct libusb_device *, int);
 static int _sync_control_transfer(struct usbi_transfer *);
 static int _sync_gen_transfer(struct usbi_transfer *);
 static int _access_endpoint(struct libusb_transfer *);
+static void *_endpoint_worker(void *);
+static void _stop_workers(struct handle_priv *, int);
+static void _complete_transfer(struct handle_priv *, struct transfer_priv *);
 
 const struct usbi_os_backend openbsd_backend = {
-	"Synchronous OpenBSD backend",
+	"OpenBSD backend",
 	NULL,				/* init() */
 	NULL,				/* exit() */
 	obsd_get_device_list,
@@ -124,7 +161,7 @@ const struct usbi_os_backend openbsd_backend = {
 	obsd_clock_gettime,
 	sizeof(struct device_priv),
 	sizeof(struct handle_priv),
-	0,				/* transfer_priv_size */
+	sizeof(struct transfer_priv),
 	0,				/* add_iso_packet_size */
 };
 
@@ -217,7 +254,10 @@ obsd_open(struct libusb_device_handle *handle)
 	if (pipe(hpriv->pipe) < 0)
 		return _errno_to_libusb(errno);
 
-	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->pipe[0], POLLIN);
+	pthread_mutex_init(&hpriv->lock, NULL);
+	list_init(&hpriv->completed);
+
+	return usbi_add_handle_pollfd(handle, hpriv->pipe[0], POLLIN);
 }
 
 void
@@ -228,6 +268,9 @@ obsd_close(struct libusb_device_handle *handle)
 
 	usbi_dbg("close: fd %d", dpriv->fd);
 
+	_stop_workers(hpriv, 0);
+	pthread_mutex_destroy(&hpriv->lock);
+
 	close(dpriv->fd);
 	dpriv->fd = -1;
 
@@ -355,6 +398,9 @@ obsd_release_interface(struct libusb_device_handle *handle, int iface)
 	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
 	int i;
 
+	/* The endpoint 0 worker does not use the endpoint nodes */
+	_stop_workers(hpriv, 1);
+
 	for (i = 0; i < USB_MAX_ENDPOINTS; i++)
 		if (hpriv->endpoints[i] >= 0)
 			close(hpriv->endpoints[i]);
@@ -425,16 +471,18 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer;
 	struct handle_priv *hpriv;
-	int err = 0;
+	struct transfer_priv *tpriv;
+	struct endpoint_worker *w;
+	int endpt = 0, err = 0;
 
 	usbi_dbg("");
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+	tpriv = usbi_transfer_get_os_priv(itransfer);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		err = _sync_control_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		if (IS_XFEROUT(transfer)) {
@@ -442,7 +490,7 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
+		endpt = UE_GET_ADDR(transfer->endpoint);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
@@ -451,15 +499,37 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
+		endpt = UE_GET_ADDR(transfer->endpoint);
 		break;
 	}
 
 	if (err)
 		return (err);
 
-	if (write(hpriv->pipe[1], &itransfer, sizeof(itransfer)) < 0)
-		return _errno_to_libusb(errno);
+	tpriv->itransfer = itransfer;
+	tpriv->state = TRANSFER_QUEUED;
+	tpriv->cancelled = 0;
+	tpriv->err = 0;
+
+	w = &hpriv->workers[endpt];
+
+	pthread_mutex_lock(&hpriv->lock);
+	if (!w->started) {
+		w->hpriv = hpriv;
+		w->stop = 0;
+		list_init(&w->queue);
+		pthread_cond_init(&w->cond, NULL);
+		if ((err = pthread_create(&w->thread, NULL, _endpoint_worker,
+		    w))) {
+			pthread_cond_destroy(&w->cond);
+			pthread_mutex_unlock(&hpriv->lock);
+			return _errno_to_libusb(err);
+		}
+		w->started = 1;
+	}
+	list_add_tail(&tpriv->list, &w->queue);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&hpriv->lock);
 
 	return (LIBUSB_SUCCESS);
 }
@@ -467,9 +537,38 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 int
 obsd_cancel_transfer(struct usbi_transfer *itransfer)
 {
+	struct libusb_transfer *transfer;
+	struct handle_priv *hpriv;
+	struct transfer_priv *tpriv;
+	int err = LIBUSB_SUCCESS;
+
 	usbi_dbg("");
 
-	return (LIBUSB_ERROR_NOT_SUPPORTED);
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+	tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	/*
+	 * A request given to the kernel cannot be aborted, it ends with
+	 * its timeout.  One still waiting for the endpoint can be dropped.
+	 */
+	pthread_mutex_lock(&hpriv->lock);
+	switch (tpriv->state) {
+	case TRANSFER_QUEUED:
+		list_del(&tpriv->list);
+		tpriv->cancelled = 1;
+		_complete_transfer(hpriv, tpriv);
+		break;
+	case TRANSFER_RUNNING:
+		err = LIBUSB_ERROR_NOT_SUPPORTED;
+		break;
+	case TRANSFER_DONE:
+		err = LIBUSB_ERROR_NOT_FOUND;
+		break;
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return (err);
 }
 
 void
@@ -486,9 +585,11 @@ obsd_handle_events(struct libusb_context *ctx, struct pollfd *fds, nfds_t nfds,
 {
 	struct libusb_device_handle *handle;
 	struct handle_priv *hpriv = NULL;
-	struct usbi_transfer *itransfer;
+	struct transfer_priv *tpriv, *next;
+	struct list_head completed;
 	struct pollfd *pollfd;
-	int i, err = 0;
+	char dummy;
+	int i, r, err = 0;
 
 	usbi_dbg("");
 
@@ -499,23 +600,15 @@ obsd_handle_events(struct libusb_context *ctx, struct pollfd *fds, nfds_t nfds,
 		if (!pollfd->revents)
 			continue;
 
-		hpriv = NULL;
 		num_ready--;
-		list_for_each_entry(handle, &ctx->open_devs, list,
-		    struct libusb_device_handle) {
-			hpriv = (struct handle_priv *)handle->os_priv;
-
-			if (hpriv->pipe[0] == pollfd->fd)
-				break;
-
-			hpriv = NULL;
-		}
+		handle = usbi_pollfd_handle(ctx, fds, i);
 
-		if (NULL == hpriv) {
+		if (NULL == handle) {
 			usbi_dbg("fd %d is not an event pipe!", pollfd->fd);
-			err = ENOENT;
+			err = LIBUSB_ERROR_NO_DEVICE;
 			break;
 		}
+		hpriv = (struct handle_priv *)handle->os_priv;
 
 		if (pollfd->revents & POLLERR) {
 			usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->pipe[0]);
@@ -523,21 +616,44 @@ obsd_handle_events(struct libusb_context *ctx, struct pollfd *fds, nfds_t nfds,
 			continue;
 		}
 
-		if (read(hpriv->pipe[0], &itransfer, sizeof(itransfer)) < 0) {
-			err = errno;
+		if (read(hpriv->pipe[0], &dummy, sizeof(dummy)) < 0) {
+			err = _errno_to_libusb(errno);
 			break;
 		}
 
-		if ((err = usbi_handle_transfer_completion(itransfer,
-		    LIBUSB_TRANSFER_COMPLETED)))
+		/*
+		 * The workers only write to the pipe when the list was
+		 * empty, so everything queued since is taken at once.
+		 */
+		pthread_mutex_lock(&hpriv->lock);
+		list_init(&completed);
+		if (!list_empty(&hpriv->completed)) {
+			completed.next = hpriv->completed.next;
+			completed.prev = hpriv->completed.prev;
+			completed.next->prev = &completed;
+			completed.prev->next = &completed;
+			list_init(&hpriv->completed);
+		}
+		pthread_mutex_unlock(&hpriv->lock);
+
+		list_for_each_entry_safe(tpriv, next, &completed, list,
+		    struct transfer_priv) {
+			list_del(&tpriv->list);
+			if (tpriv->cancelled)
+				r = usbi_handle_transfer_cancellation(
+				    tpriv->itransfer);
+			else
+				r = usbi_handle_transfer_completion(
+				    tpriv->itransfer, _err_to_status(tpriv->err));
+			if (r)
+				err = r;
+		}
+		if (err)
 			break;
 	}
 	pthread_mutex_unlock(&ctx->open_devs_lock);
 
-	if (err)
-		return _errno_to_libusb(err);
-
-	return (LIBUSB_SUCCESS);
+	return (err);
 }
 
 int
@@ -566,6 +682,8 @@ _errno_to_libusb(int err)
 		return (LIBUSB_ERROR_NO_DEVICE);
 	case ENOMEM:
 		return (LIBUSB_ERROR_NO_MEM);
+	case ETIMEDOUT:
+		return (LIBUSB_ERROR_TIMEOUT);
 	}
 
 	usbi_dbg("error: %s", strerror(err));
@@ -573,6 +691,21 @@ _errno_to_libusb(int err)
 	return (LIBUSB_ERROR_OTHER);
 }
 
+enum libusb_transfer_status
+_err_to_status(int err)
+{
+	switch (err) {
+	case 0:
+		return (LIBUSB_TRANSFER_COMPLETED);
+	case LIBUSB_ERROR_TIMEOUT:
+		return (LIBUSB_TRANSFER_TIMED_OUT);
+	case LIBUSB_ERROR_NO_DEVICE:
+		return (LIBUSB_TRANSFER_NO_DEVICE);
+	}
+
+	return (LIBUSB_TRANSFER_ERROR);
+}
+
 int
 _cache_active_config_descriptor(struct libusb_device *dev, int fd)
 {
@@ -725,3 +858,90 @@ _sync_gen_transfer(struct usbi_transfer *itransfer)
 
 	return (0);
 }
+
+/* Called with hpriv->lock held */
+void
+_complete_transfer(struct handle_priv *hpriv, struct transfer_priv *tpriv)
+{
+	int wakeup = list_empty(&hpriv->completed);
+	char dummy = 0;
+
+	tpriv->state = TRANSFER_DONE;
+	list_add_tail(&tpriv->list, &hpriv->completed);
+
+	/* One byte is enough until handle_events takes the list */
+	if (wakeup && write(hpriv->pipe[1], &dummy, sizeof(dummy)) < 0)
+		usbi_dbg("error: %s", strerror(errno));
+}
+
+void *
+_endpoint_worker(void *arg)
+{
+	struct endpoint_worker *w = arg;
+	struct handle_priv *hpriv = w->hpriv;
+	struct libusb_transfer *transfer;
+	struct transfer_priv *tpriv;
+	int err;
+
+	pthread_mutex_lock(&hpriv->lock);
+	for (;;) {
+		while (list_empty(&w->queue) && !w->stop)
+			pthread_cond_wait(&w->cond, &hpriv->lock);
+
+		if (list_empty(&w->queue))
+			break;
+
+		tpriv = list_entry(w->queue.next, struct transfer_priv, list);
+		list_del(&tpriv->list);
+
+		/* Whatever is left when stopping is dropped */
+		if (w->stop) {
+			tpriv->cancelled = 1;
+			_complete_transfer(hpriv, tpriv);
+			continue;
+		}
+
+		tpriv->state = TRANSFER_RUNNING;
+		pthread_mutex_unlock(&hpriv->lock);
+
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(tpriv->itransfer);
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			err = _sync_control_transfer(tpriv->itransfer);
+		else
+			err = _sync_gen_transfer(tpriv->itransfer);
+
+		pthread_mutex_lock(&hpriv->lock);
+		tpriv->err = err;
+		_complete_transfer(hpriv, tpriv);
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return (NULL);
+}
+
+/* Stop and wait for the workers of endpoints first and above */
+void
+_stop_workers(struct handle_priv *hpriv, int first)
+{
+	struct endpoint_worker *w;
+	int i;
+
+	pthread_mutex_lock(&hpriv->lock);
+	for (i = first; i < USB_MAX_ENDPOINTS; i++) {
+		w = &hpriv->workers[i];
+		if (!w->started)
+			continue;
+		w->stop = 1;
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	for (i = first; i < USB_MAX_ENDPOINTS; i++) {
+		w = &hpriv->workers[i];
+		if (!w->started)
+			continue;
+		pthread_join(w->thread, NULL);
+		pthread_cond_destroy(&w->cond);
+		w->started = 0;
+	}
+}
@@ -38,6 +38,17 @@
  * The pipe pollable synchronous I/O works using the overlapped event associated
  * with a fake pipe. The read/write functions are only meant to be used in that
  * context.
+ *
+ * Rather than waiting on the events of the fds, which WaitForMultipleObjects
+ * limits to 64, poll waits on an I/O completion port. Each set of fds polled
+ * together gets one, held by the first fake pipe of the set, and:
+ * - the Windows handles the fds are created from must be attached to it with
+ *   usbi_attach_handle, before any I/O is issued, so that their overlapped I/O
+ *   completes into the port
+ * - writing to a fake pipe of the set posts to it
+ * A completion packet only tells poll that something happened: poll then
+ * checks the overlapped of each fd, as the packet may be for an fd that was
+ * already reported and freed.
  */
 #include <errno.h>
 #include <fcntl.h>
@@ -67,26 +78,47 @@
 
 #if defined(__CYGWIN__)
 // cygwin produces a warning unless these prototypes are defined
-extern int _open(char* name, int flags);
-extern int _close(int fd);
 extern int _snprintf(char *buffer, size_t count, const char *format, ...);
-#define NUL_DEVICE "/dev/null"
-#else
-#define NUL_DEVICE "NUL"
 #endif
 
 #define CHECK_INIT_POLLING do {if(!is_polling_set) init_polling();} while(0)
 
 // public fd data
 const struct winfd INVALID_WINFD = {-1, INVALID_HANDLE_VALUE, NULL, RW_NONE};
-struct winfd poll_fd[MAX_FDS];
-// internal fd data
-struct {
+
+/*
+ * The fds are not CRT file descriptors: an fd encodes the index of its slot
+ * in the fd table in its low FD_INDEX_BITS, so that it can be looked up
+ * directly, and a generation count above them, so that an fd that was freed
+ * doesn't match the next one using the same slot.
+ * The table grows by chunks, that never move nor get freed before
+ * exit_polling, so that slots can be accessed without a global lock.
+ */
+#define FD_INDEX_BITS		16
+#define FD_INDEX_MASK		((1 << FD_INDEX_BITS) - 1)
+#define FD_GENERATION_MASK	0x7FFF
+#define FD_CHUNK_SIZE		256
+#define FD_MAX_CHUNKS		(MAX_FDS / FD_CHUNK_SIZE)
+
+struct poll_slot {
+	struct winfd wfd;
 	CRITICAL_SECTION mutex; // lock for fds
 	// Additional variables for XP CancelIoEx partial emulation
 	HANDLE original_handle;
 	DWORD thread_id;
-} _poll_fd[MAX_FDS];
+	// Completion port a fake pipe wakes up poll through
+	HANDLE port;
+	BOOLEAN owns_port;
+	int generation;
+	int next_free;
+};
+static struct poll_slot *poll_chunks[FD_MAX_CHUNKS];
+#define SLOT(_index) (&poll_chunks[(_index) / FD_CHUNK_SIZE][(_index) % FD_CHUNK_SIZE])
+
+// fd allocator: slots that were freed are reused first, most recent first
+static CRITICAL_SECTION alloc_mutex;
+static int free_slots = -1;
+static volatile LONG nb_slots = 0;
 
 // globals
 BOOLEAN is_polling_set = FALSE;
@@ -98,21 +130,35 @@ static volatile LONG compat_spinlock = 0;
 // platform headers, we hook into the Kernel32 system DLL directly to seek it.
 static BOOL (__stdcall *pCancelIoEx)(HANDLE, LPOVERLAPPED) = NULL;
 #define CancelIoEx_Available (pCancelIoEx != NULL)
+
+// GetQueuedCompletionStatusEx, Vista and later, dequeues several completion
+// packets at once. Its OVERLAPPED_ENTRY array is declared here as it may not
+// be part of the platform headers either.
+struct poll_completion {
+	ULONG_PTR key;
+	LPOVERLAPPED overlapped;
+	ULONG_PTR internal;
+	DWORD bytes;
+};
+#define POLL_COMPLETION_BATCH	64
+static BOOL (__stdcall *pGetQueuedCompletionStatusEx)(HANDLE,
+	struct poll_completion *, ULONG, PULONG, DWORD, BOOL) = NULL;
+
 static __inline BOOL cancel_io(int _index)
 {
-	if ((_index < 0) || (_index >= MAX_FDS)) {
+	if ((_index < 0) || (_index >= nb_slots)) {
 		return FALSE;
 	}
 
-	if ( (poll_fd[_index].fd < 0) || (poll_fd[_index].handle == INVALID_HANDLE_VALUE)
-	  || (poll_fd[_index].handle == 0) || (poll_fd[_index].overlapped == NULL) ) {
+	if ( (SLOT(_index)->wfd.fd < 0) || (SLOT(_index)->wfd.handle == INVALID_HANDLE_VALUE)
+	  || (SLOT(_index)->wfd.handle == 0) || (SLOT(_index)->wfd.overlapped == NULL) ) {
 		return TRUE;
 	}
 	if (CancelIoEx_Available) {
-		return (*pCancelIoEx)(poll_fd[_index].handle, poll_fd[_index].overlapped);
+		return (*pCancelIoEx)(SLOT(_index)->wfd.handle, SLOT(_index)->wfd.overlapped);
 	}
-	if (_poll_fd[_index].thread_id == GetCurrentThreadId()) {
-		return CancelIo(poll_fd[_index].handle);
+	if (SLOT(_index)->thread_id == GetCurrentThreadId()) {
+		return CancelIo(SLOT(_index)->wfd.handle);
 	}
 	usbi_warn(NULL, "Unable to cancel I/O that was started from another thread");
 	return FALSE;
@@ -131,12 +177,12 @@ void init_polling(void)
 			GetProcAddress(GetModuleHandleA("KERNEL32"), "CancelIoEx");
 		usbi_dbg("Will use CancelIo%s for I/O cancellation",
 			CancelIoEx_Available?"Ex":"");
-		for (i=0; i<MAX_FDS; i++) {
-			poll_fd[i] = INVALID_WINFD;
-			_poll_fd[i].original_handle = INVALID_HANDLE_VALUE;
-			_poll_fd[i].thread_id = 0;
-			InitializeCriticalSection(&_poll_fd[i].mutex);
-		}
+		pGetQueuedCompletionStatusEx = (BOOL (__stdcall *)(HANDLE,
+			struct poll_completion *, ULONG, PULONG, DWORD, BOOL))
+			GetProcAddress(GetModuleHandleA("KERNEL32"), "GetQueuedCompletionStatusEx");
+		InitializeCriticalSection(&alloc_mutex);
+		free_slots = -1;
+		nb_slots = 0;
 		is_polling_set = TRUE;
 	}
 	InterlockedExchange((LONG *)&compat_spinlock, 0);
@@ -150,18 +196,68 @@ int _fd_to_index_and_lock(int fd)
 	if (fd <= 0)
 		return -1;
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].fd == fd) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			// fd might have changed before we got to critical
-			if (poll_fd[i].fd != fd) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
-				continue;
+	i = fd & FD_INDEX_MASK;
+	if (i >= nb_slots)
+		return -1;
+
+	EnterCriticalSection(&SLOT(i)->mutex);
+	// fd might have been freed, or the slot reused
+	if (SLOT(i)->wfd.fd != fd) {
+		LeaveCriticalSection(&SLOT(i)->mutex);
+		return -1;
+	}
+	return i;
+}
+
+// Internal function to get a free slot, returned with its fd mutex locked and
+// its new fd in *fd. Returns the slot index, or -1 if the table is full.
+static int alloc_index_and_lock(int *fd)
+{
+	struct poll_slot *chunk;
+	int i, j;
+
+	EnterCriticalSection(&alloc_mutex);
+	if (free_slots >= 0) {
+		i = free_slots;
+		free_slots = SLOT(i)->next_free;
+	} else if (nb_slots < MAX_FDS) {
+		i = nb_slots;
+		if (poll_chunks[i / FD_CHUNK_SIZE] == NULL) {
+			chunk = (struct poll_slot*) calloc(FD_CHUNK_SIZE, sizeof(struct poll_slot));
+			if (chunk == NULL) {
+				LeaveCriticalSection(&alloc_mutex);
+				return -1;
+			}
+			for (j=0; j<FD_CHUNK_SIZE; j++) {
+				chunk[j].wfd = INVALID_WINFD;
+				chunk[j].original_handle = INVALID_HANDLE_VALUE;
+				InitializeCriticalSection(&chunk[j].mutex);
 			}
-			return i;
+			poll_chunks[i / FD_CHUNK_SIZE] = chunk;
 		}
+		// only make the slot visible to lookups once its chunk exists
+		InterlockedExchange((LONG *)&nb_slots, i + 1);
+	} else {
+		LeaveCriticalSection(&alloc_mutex);
+		usbi_warn(NULL, "no more fds available");
+		return -1;
 	}
-	return -1;
+	LeaveCriticalSection(&alloc_mutex);
+
+	EnterCriticalSection(&SLOT(i)->mutex);
+	SLOT(i)->generation = (SLOT(i)->generation % FD_GENERATION_MASK) + 1;
+	*fd = (SLOT(i)->generation << FD_INDEX_BITS) | i;
+	return i;
+}
+
+// Internal function to put a slot back in the free list, once its winfd has
+// been invalidated. The fd mutex must be held.
+static void put_free_index(int _index)
+{
+	EnterCriticalSection(&alloc_mutex);
+	SLOT(_index)->next_free = free_slots;
+	free_slots = _index;
+	LeaveCriticalSection(&alloc_mutex);
 }
 
 OVERLAPPED *create_overlapped(void)
@@ -204,6 +300,31 @@ void reset_overlapped(OVERLAPPED *overlapped)
 	overlapped->hEvent = event_handle;
 }
 
+// Returns the completion port of the poll set of fake pipe _index, creating
+// it if needed. The fd mutex must be held.
+static HANDLE get_port(int _index)
+{
+	if (SLOT(_index)->port == NULL) {
+		SLOT(_index)->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+		if (SLOT(_index)->port == NULL) {
+			usbi_err(NULL, "could not create completion port: %d", (int)GetLastError());
+			return NULL;
+		}
+		SLOT(_index)->owns_port = TRUE;
+	}
+	return SLOT(_index)->port;
+}
+
+// The fd mutex must be held
+static void release_port(int _index)
+{
+	if (SLOT(_index)->owns_port) {
+		CloseHandle(SLOT(_index)->port);
+	}
+	SLOT(_index)->port = NULL;
+	SLOT(_index)->owns_port = FALSE;
+}
+
 void exit_polling(void)
 {
 	int i;
@@ -214,28 +335,37 @@ void exit_polling(void)
 	if (is_polling_set) {
 		is_polling_set = FALSE;
 
-		for (i=0; i<MAX_FDS; i++) {
+		for (i=0; i<nb_slots; i++) {
 			// Cancel any async I/O (handle can be invalid)
 			cancel_io(i);
 			// If anything was pending on that I/O, it should be
 			// terminating, and we should be able to access the fd
 			// mutex lock before too long
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			if ( (poll_fd[i].fd > 0) && (poll_fd[i].handle != INVALID_HANDLE_VALUE) && (poll_fd[i].handle != 0)
-			  && (GetFileType(poll_fd[i].handle) == FILE_TYPE_UNKNOWN) ) {
-				_close(poll_fd[i].fd);
-			}
-			free_overlapped(poll_fd[i].overlapped);
+			EnterCriticalSection(&SLOT(i)->mutex);
+			free_overlapped(SLOT(i)->wfd.overlapped);
 			if (!CancelIoEx_Available) {
 				// Close duplicate handle
-				if (_poll_fd[i].original_handle != INVALID_HANDLE_VALUE) {
-					CloseHandle(poll_fd[i].handle);
+				if (SLOT(i)->original_handle != INVALID_HANDLE_VALUE) {
+					CloseHandle(SLOT(i)->wfd.handle);
+				}
+			}
+			release_port(i);
+			SLOT(i)->wfd = INVALID_WINFD;
+			LeaveCriticalSection(&SLOT(i)->mutex);
+		}
+		for (i=0; i<FD_MAX_CHUNKS; i++) {
+			if (poll_chunks[i] != NULL) {
+				int j;
+				for (j=0; j<FD_CHUNK_SIZE; j++) {
+					DeleteCriticalSection(&poll_chunks[i][j].mutex);
 				}
+				free(poll_chunks[i]);
+				poll_chunks[i] = NULL;
 			}
-			poll_fd[i] = INVALID_WINFD;
-			LeaveCriticalSection(&_poll_fd[i].mutex);
-			DeleteCriticalSection(&_poll_fd[i].mutex);
 		}
+		nb_slots = 0;
+		free_slots = -1;
+		DeleteCriticalSection(&alloc_mutex);
 	}
 	InterlockedExchange((LONG *)&compat_spinlock, 0);
 }
@@ -261,45 +391,35 @@ int usbi_pipe(int filedes[2])
 	overlapped->Internal = STATUS_PENDING;
 	overlapped->InternalHigh = 0;
 
-	// Read end of the "pipe"
-	filedes[0] = _open(NUL_DEVICE, _O_WRONLY);
-	if (filedes[0] < 0) {
-		usbi_err(NULL, "could not create pipe: errno %d", errno);
-		goto out1;
-	}
-	// We can use the same handle for both ends
-	filedes[1] = filedes[0];
-	poll_dbg("pipe filedes = %d", filedes[0]);
-
 	// Note: manual reset must be true (second param) as the reset occurs in read
 	overlapped->hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 	if(!overlapped->hEvent) {
-		goto out2;
+		goto out1;
 	}
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].fd < 0) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			// fd might have been allocated before we got to critical
-			if (poll_fd[i].fd >= 0) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
-				continue;
-			}
-
-			poll_fd[i].fd = filedes[0];
-			poll_fd[i].handle = DUMMY_HANDLE;
-			poll_fd[i].overlapped = overlapped;
-			// There's no polling on the write end, so we just use READ for our needs
-			poll_fd[i].rw = RW_READ;
-			_poll_fd[i].original_handle = INVALID_HANDLE_VALUE;
-			LeaveCriticalSection(&_poll_fd[i].mutex);
-			return 0;
-		}
+	// Read end of the "pipe"
+	i = alloc_index_and_lock(&filedes[0]);
+	if (i < 0) {
+		usbi_err(NULL, "could not create pipe: no fd available");
+		goto out2;
 	}
+	// We can use the same fd for both ends
+	filedes[1] = filedes[0];
+	poll_dbg("pipe filedes = %d", filedes[0]);
+
+	SLOT(i)->wfd.fd = filedes[0];
+	SLOT(i)->wfd.handle = DUMMY_HANDLE;
+	SLOT(i)->wfd.overlapped = overlapped;
+	// There's no polling on the write end, so we just use READ for our needs
+	SLOT(i)->wfd.rw = RW_READ;
+	SLOT(i)->original_handle = INVALID_HANDLE_VALUE;
+	SLOT(i)->port = NULL;
+	SLOT(i)->owns_port = FALSE;
+	LeaveCriticalSection(&SLOT(i)->mutex);
+	return 0;
 
-	CloseHandle(overlapped->hEvent);
 out2:
-	_close(filedes[0]);
+	CloseHandle(overlapped->hEvent);
 out1:
 	free(overlapped);
 	return -1;
@@ -314,7 +434,7 @@ out1:
  *
  * Note that the fd returned by this function is a per-transfer fd, rather
  * than a per-session fd and cannot be used for anything else but our
- * custom functions (the fd itself points to the NUL: device)
+ * custom functions (it is not a CRT file descriptor)
  * if you plan to do R/W on the same handle, you MUST create 2 fds: one for
  * read and one for write. Using a single R/W fd is unsupported and will
  * produce unexpected results
@@ -342,74 +462,54 @@ struct winfd usbi_create_fd(HANDLE handle, int access_mode)
 		wfd.rw = RW_WRITE;
 	}
 
-	// Ensure that we get a non system conflicting unique fd, using
-	// the same fd attribution system as the pipe ends
-	fd = _open(NUL_DEVICE, _O_WRONLY);
-	if (fd < 0) {
-		return INVALID_WINFD;
-	}
-
 	overlapped = create_overlapped();
 	if(overlapped == NULL) {
-		_close(fd);
 		return INVALID_WINFD;
 	}
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].fd < 0) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			// fd might have been removed before we got to critical
-			if (poll_fd[i].fd >= 0) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
-				continue;
-			}
-			wfd.fd = fd;
-			// Attempt to emulate some of the CancelIoEx behaviour on platforms
-			// that don't have it
-			if (!CancelIoEx_Available) {
-				_poll_fd[i].thread_id = GetCurrentThreadId();
-				if (!DuplicateHandle(GetCurrentProcess(), handle, GetCurrentProcess(),
-					&wfd.handle, 0, TRUE, DUPLICATE_SAME_ACCESS)) {
-					usbi_dbg("could not duplicate handle for CancelIo - using original one");
-					wfd.handle = handle;
-					// Make sure we won't close the original handle on fd deletion then
-					_poll_fd[i].original_handle = INVALID_HANDLE_VALUE;
-				} else {
-					_poll_fd[i].original_handle = handle;
-				}
-			} else {
-				wfd.handle = handle;
-			}
-			wfd.overlapped = overlapped;
-			memcpy(&poll_fd[i], &wfd, sizeof(struct winfd));
-			LeaveCriticalSection(&_poll_fd[i].mutex);
-			return wfd;
+	i = alloc_index_and_lock(&fd);
+	if (i < 0) {
+		free_overlapped(overlapped);
+		return INVALID_WINFD;
+	}
+	wfd.fd = fd;
+	// Attempt to emulate some of the CancelIoEx behaviour on platforms
+	// that don't have it
+	if (!CancelIoEx_Available) {
+		SLOT(i)->thread_id = GetCurrentThreadId();
+		if (!DuplicateHandle(GetCurrentProcess(), handle, GetCurrentProcess(),
+			&wfd.handle, 0, TRUE, DUPLICATE_SAME_ACCESS)) {
+			usbi_dbg("could not duplicate handle for CancelIo - using original one");
+			wfd.handle = handle;
+			// Make sure we won't close the original handle on fd deletion then
+			SLOT(i)->original_handle = INVALID_HANDLE_VALUE;
+		} else {
+			SLOT(i)->original_handle = handle;
 		}
+	} else {
+		wfd.handle = handle;
 	}
-	free_overlapped(overlapped);
-	_close(fd);
-	return INVALID_WINFD;
+	wfd.overlapped = overlapped;
+	memcpy(&SLOT(i)->wfd, &wfd, sizeof(struct winfd));
+	LeaveCriticalSection(&SLOT(i)->mutex);
+	return wfd;
 }
 
 void _free_index(int _index)
 {
 	// Cancel any async IO (Don't care about the validity of our handles for this)
 	cancel_io(_index);
-	// close fake handle for devices
-	if ( (poll_fd[_index].handle != INVALID_HANDLE_VALUE) && (poll_fd[_index].handle != 0)
-	  && (GetFileType(poll_fd[_index].handle) == FILE_TYPE_UNKNOWN) ) {
-		_close(poll_fd[_index].fd);
-	}
 	// close the duplicate handle (if we have an actual duplicate)
 	if (!CancelIoEx_Available) {
-		if (_poll_fd[_index].original_handle != INVALID_HANDLE_VALUE) {
-			CloseHandle(poll_fd[_index].handle);
+		if (SLOT(_index)->original_handle != INVALID_HANDLE_VALUE) {
+			CloseHandle(SLOT(_index)->wfd.handle);
 		}
-		_poll_fd[_index].original_handle = INVALID_HANDLE_VALUE;
-		_poll_fd[_index].thread_id = 0;
+		SLOT(_index)->original_handle = INVALID_HANDLE_VALUE;
+		SLOT(_index)->thread_id = 0;
 	}
-	free_overlapped(poll_fd[_index].overlapped);
-	poll_fd[_index] = INVALID_WINFD;
+	free_overlapped(SLOT(_index)->wfd.overlapped);
+	SLOT(_index)->wfd = INVALID_WINFD;
+	put_free_index(_index);
 }
 
 /*
@@ -428,7 +528,46 @@ void usbi_free_fd(int fd)
 		return;
 	}
 	_free_index(_index);
-	LeaveCriticalSection(&_poll_fd[_index].mutex);
+	LeaveCriticalSection(&SLOT(_index)->mutex);
+}
+
+/*
+ * Have the overlapped I/O of a Windows handle complete into the completion
+ * port of the poll set of a fake pipe, so that poll wakes up for it.
+ * This must be done once per handle, before any overlapped I/O is issued on
+ * it, and the handle must be the one the I/O is actually performed on (for
+ * WinUSB, the file handle and not the interface handle).
+ * Return 0 on success, -1 on error
+ */
+int usbi_attach_handle(int pipe_fd, HANDLE handle)
+{
+	int _index;
+	HANDLE port;
+	int r = -1;
+
+	CHECK_INIT_POLLING;
+
+	_index = _fd_to_index_and_lock(pipe_fd);
+	if (_index < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (SLOT(_index)->wfd.handle != DUMMY_HANDLE) {
+		errno = EINVAL;
+	} else {
+		port = get_port(_index);
+		if (port == NULL) {
+			errno = ENOMEM;
+		} else if (CreateIoCompletionPort(handle, port, 0, 0) == NULL) {
+			usbi_warn(NULL, "could not attach handle to completion port: %d", (int)GetLastError());
+			errno = EIO;
+		} else {
+			r = 0;
+		}
+	}
+	LeaveCriticalSection(&SLOT(_index)->mutex);
+	return r;
 }
 
 /*
@@ -436,28 +575,18 @@ void usbi_free_fd(int fd)
  */
 struct winfd fd_to_winfd(int fd)
 {
-	int i;
+	int _index;
 	struct winfd wfd;
 
 	CHECK_INIT_POLLING;
 
-	if (fd <= 0)
+	_index = _fd_to_index_and_lock(fd);
+	if (_index < 0)
 		return INVALID_WINFD;
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].fd == fd) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			// fd might have been deleted before we got to critical
-			if (poll_fd[i].fd != fd) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
-				continue;
-			}
-			memcpy(&wfd, &poll_fd[i], sizeof(struct winfd));
-			LeaveCriticalSection(&_poll_fd[i].mutex);
-			return wfd;
-		}
-	}
-	return INVALID_WINFD;
+	memcpy(&wfd, &SLOT(_index)->wfd, sizeof(struct winfd));
+	LeaveCriticalSection(&SLOT(_index)->mutex);
+	return wfd;
 }
 
 struct winfd handle_to_winfd(HANDLE handle)
@@ -470,16 +599,17 @@ struct winfd handle_to_winfd(HANDLE handle)
 	if ((handle == 0) || (handle == INVALID_HANDLE_VALUE))
 		return INVALID_WINFD;
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].handle == handle) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
+	// only used when resetting a device, a scan is good enough
+	for (i=0; i<nb_slots; i++) {
+		if (SLOT(i)->wfd.handle == handle) {
+			EnterCriticalSection(&SLOT(i)->mutex);
 			// fd might have been deleted before we got to critical
-			if (poll_fd[i].handle != handle) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
+			if (SLOT(i)->wfd.handle != handle) {
+				LeaveCriticalSection(&SLOT(i)->mutex);
 				continue;
 			}
-			memcpy(&wfd, &poll_fd[i], sizeof(struct winfd));
-			LeaveCriticalSection(&_poll_fd[i].mutex);
+			memcpy(&wfd, &SLOT(i)->wfd, sizeof(struct winfd));
+			LeaveCriticalSection(&SLOT(i)->mutex);
 			return wfd;
 		}
 	}
@@ -496,16 +626,16 @@ struct winfd overlapped_to_winfd(OVERLAPPED* overlapped)
 	if (overlapped == NULL)
 		return INVALID_WINFD;
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].overlapped == overlapped) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
+	for (i=0; i<nb_slots; i++) {
+		if (SLOT(i)->wfd.overlapped == overlapped) {
+			EnterCriticalSection(&SLOT(i)->mutex);
 			// fd might have been deleted before we got to critical
-			if (poll_fd[i].overlapped != overlapped) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
+			if (SLOT(i)->wfd.overlapped != overlapped) {
+				LeaveCriticalSection(&SLOT(i)->mutex);
 				continue;
 			}
-			memcpy(&wfd, &poll_fd[i], sizeof(struct winfd));
-			LeaveCriticalSection(&_poll_fd[i].mutex);
+			memcpy(&wfd, &SLOT(i)->wfd, sizeof(struct winfd));
+			LeaveCriticalSection(&SLOT(i)->mutex);
 			return wfd;
 		}
 	}
@@ -513,29 +643,15 @@ struct winfd overlapped_to_winfd(OVERLAPPED* overlapped)
 }
 
 /*
- * POSIX poll equivalent, using Windows OVERLAPPED
- * Currently, this function only accepts one of POLLIN or POLLOUT per fd
- * (but you can create multiple fds from the same handle for read and write)
+ * Check the fds of a poll set against their overlapped, setting revents for
+ * the ones that completed. Also retrieves the completion port of the set,
+ * binding every fake pipe of the set to it.
+ * Return the number of fds that completed, or -1 on error
  */
-int usbi_poll(struct pollfd *fds, unsigned int nfds, int timeout)
+static int poll_scan(struct pollfd *fds, unsigned int nfds, HANDLE *port)
 {
 	unsigned i;
-	int _index, object_index, triggered;
-	HANDLE *handles_to_wait_on;
-	int *handle_to_index;
-	DWORD nb_handles_to_wait_on = 0;
-	DWORD ret;
-
-	CHECK_INIT_POLLING;
-
-	triggered = 0;
-	handles_to_wait_on = (HANDLE*) calloc(nfds+1, sizeof(HANDLE));	// +1 for fd_update
-	handle_to_index = (int*) calloc(nfds, sizeof(int));
-	if ((handles_to_wait_on == NULL) || (handle_to_index == NULL)) {
-		errno = ENOMEM;
-		triggered = -1;
-		goto poll_exit;
-	}
+	int _index, triggered = 0;
 
 	for (i = 0; i < nfds; ++i) {
 		fds[i].revents = 0;
@@ -545,95 +661,133 @@ int usbi_poll(struct pollfd *fds, unsigned int nfds, int timeout)
 			fds[i].revents |= POLLERR;
 			errno = EACCES;
 			usbi_warn(NULL, "unsupported set of events");
-			triggered = -1;
-			goto poll_exit;
+			return -1;
 		}
 
 		_index = _fd_to_index_and_lock(fds[i].fd);
-		poll_dbg("fd[%d]=%d: (overlapped=%p) got events %04X", i, poll_fd[_index].fd, poll_fd[_index].overlapped, fds[i].events);
+		poll_dbg("fd[%d]=%d: (overlapped=%p) got events %04X", i, SLOT(_index)->wfd.fd, SLOT(_index)->wfd.overlapped, fds[i].events);
 
-		if ( (_index < 0) || (poll_fd[_index].handle == INVALID_HANDLE_VALUE)
-		  || (poll_fd[_index].handle == 0) || (poll_fd[_index].overlapped == NULL)) {
+		if ( (_index < 0) || (SLOT(_index)->wfd.handle == INVALID_HANDLE_VALUE)
+		  || (SLOT(_index)->wfd.handle == 0) || (SLOT(_index)->wfd.overlapped == NULL)) {
 			fds[i].revents |= POLLNVAL | POLLERR;
 			errno = EBADF;
 			if (_index >= 0) {
-				LeaveCriticalSection(&_poll_fd[_index].mutex);
+				LeaveCriticalSection(&SLOT(_index)->mutex);
 			}
 			usbi_warn(NULL, "invalid fd");
-			triggered = -1;
-			goto poll_exit;
+			return -1;
 		}
 
 		// IN or OUT must match our fd direction
-		if ((fds[i].events & POLLIN) && (poll_fd[_index].rw != RW_READ)) {
+		if ((fds[i].events & POLLIN) && (SLOT(_index)->wfd.rw != RW_READ)) {
 			fds[i].revents |= POLLNVAL | POLLERR;
 			errno = EBADF;
 			usbi_warn(NULL, "attempted POLLIN on fd without READ access");
-			LeaveCriticalSection(&_poll_fd[_index].mutex);
-			triggered = -1;
-			goto poll_exit;
+			LeaveCriticalSection(&SLOT(_index)->mutex);
+			return -1;
 		}
 
-		if ((fds[i].events & POLLOUT) && (poll_fd[_index].rw != RW_WRITE)) {
+		if ((fds[i].events & POLLOUT) && (SLOT(_index)->wfd.rw != RW_WRITE)) {
 			fds[i].revents |= POLLNVAL | POLLERR;
 			errno = EBADF;
 			usbi_warn(NULL, "attempted POLLOUT on fd without WRITE access");
-			LeaveCriticalSection(&_poll_fd[_index].mutex);
-			triggered = -1;
-			goto poll_exit;
+			LeaveCriticalSection(&SLOT(_index)->mutex);
+			return -1;
+		}
+
+		// The first fake pipe of the set provides the port, the others post to it
+		if (SLOT(_index)->wfd.handle == DUMMY_HANDLE) {
+			if (*port == NULL) {
+				*port = get_port(_index);
+			} else if (SLOT(_index)->port != *port) {
+				release_port(_index);
+				SLOT(_index)->port = *port;
+			}
 		}
 
 		// The following macro only works if overlapped I/O was reported pending
-		if ( (HasOverlappedIoCompleted(poll_fd[_index].overlapped))
-		  || (HasOverlappedIoCompletedSync(poll_fd[_index].overlapped)) ) {
+		if ( (HasOverlappedIoCompleted(SLOT(_index)->wfd.overlapped))
+		  || (HasOverlappedIoCompletedSync(SLOT(_index)->wfd.overlapped)) ) {
 			poll_dbg("  completed");
 			// checks above should ensure this works:
 			fds[i].revents = fds[i].events;
 			triggered++;
-		} else {
-			handles_to_wait_on[nb_handles_to_wait_on] = poll_fd[_index].overlapped->hEvent;
-			handle_to_index[nb_handles_to_wait_on] = i;
-			nb_handles_to_wait_on++;
 		}
-		LeaveCriticalSection(&_poll_fd[_index].mutex);
+		LeaveCriticalSection(&SLOT(_index)->mutex);
+	}
+
+	return triggered;
+}
+
+/*
+ * POSIX poll equivalent, using Windows OVERLAPPED
+ * Currently, this function only accepts one of POLLIN or POLLOUT per fd
+ * (but you can create multiple fds from the same handle for read and write)
+ * The set must contain a fake pipe, see usbi_attach_handle.
+ */
+int usbi_poll(struct pollfd *fds, unsigned int nfds, int timeout)
+{
+	struct poll_completion completions[POLL_COMPLETION_BATCH];
+	HANDLE port = NULL;
+	DWORD start = 0, elapsed, wait;
+	ULONG nb_completions;
+	ULONG_PTR key;
+	DWORD bytes;
+	LPOVERLAPPED overlapped;
+	BOOL ret;
+	int triggered;
+
+	CHECK_INIT_POLLING;
+
+	if (timeout > 0) {
+		start = GetTickCount();
 	}
 
-	// If nothing was triggered, wait on all fds that require it
-	if ((timeout != 0) && (triggered == 0) && (nb_handles_to_wait_on != 0)) {
+	while (1) {
+		triggered = poll_scan(fds, nfds, &port);
+		if ((triggered != 0) || (timeout == 0)) {
+			return triggered;
+		}
+		if (port == NULL) {
+			usbi_warn(NULL, "no completion port to wait on");
+			errno = EINVAL;
+			return -1;
+		}
+
 		if (timeout < 0) {
-			poll_dbg("starting infinite wait for %d handles...", (int)nb_handles_to_wait_on);
+			wait = INFINITE;
 		} else {
-			poll_dbg("starting %d ms wait for %d handles...", timeout, (int)nb_handles_to_wait_on);
-		}
-		ret = WaitForMultipleObjects(nb_handles_to_wait_on, handles_to_wait_on,
-			FALSE, (timeout<0)?INFINITE:(DWORD)timeout);
-		object_index = ret-WAIT_OBJECT_0;
-		if ((object_index >= 0) && ((DWORD)object_index < nb_handles_to_wait_on)) {
-			poll_dbg("  completed after wait");
-			i = handle_to_index[object_index];
-			_index = _fd_to_index_and_lock(fds[i].fd);
-			fds[i].revents = fds[i].events;
-			triggered++;
-			if (_index >= 0) {
-				LeaveCriticalSection(&_poll_fd[_index].mutex);
+			elapsed = GetTickCount() - start;
+			if (elapsed >= (DWORD)timeout) {
+				poll_dbg("  timed out");
+				return 0;
 			}
-		} else if (ret == WAIT_TIMEOUT) {
-			poll_dbg("  timed out");
-			triggered = 0;	// 0 = timeout
+			wait = (DWORD)timeout - elapsed;
+		}
+
+		// Drain as many packets as we can in one go, they will all be
+		// accounted for by the next scan
+		poll_dbg("starting %d ms wait on completion port...", (int)wait);
+		if (pGetQueuedCompletionStatusEx != NULL) {
+			ret = (*pGetQueuedCompletionStatusEx)(port, completions,
+				POLL_COMPLETION_BATCH, &nb_completions, wait, FALSE);
 		} else {
+			ret = GetQueuedCompletionStatus(port, &bytes, &key, &overlapped, wait);
+			// a failed I/O still dequeued a packet
+			if (!ret && (overlapped != NULL)) {
+				ret = TRUE;
+			}
+		}
+		if (!ret) {
+			if (GetLastError() == WAIT_TIMEOUT) {
+				poll_dbg("  timed out");
+				return 0;
+			}
 			errno = EIO;
-			triggered = -1;	// error
+			return -1;
 		}
+		poll_dbg("  woken up");
 	}
-
-poll_exit:
-	if (handles_to_wait_on != NULL) {
-		free(handles_to_wait_on);
-	}
-	if (handle_to_index != NULL) {
-		free(handle_to_index);
-	}
-	return triggered;
 }
 
 /*
@@ -651,17 +805,16 @@ int usbi_close(int fd)
 	if (_index < 0) {
 		errno = EBADF;
 	} else {
-		if (poll_fd[_index].overlapped != NULL) {
+		if (SLOT(_index)->wfd.overlapped != NULL) {
 			// Must be a different event for each end of the pipe
-			CloseHandle(poll_fd[_index].overlapped->hEvent);
-			free(poll_fd[_index].overlapped);
-		}
-		r = _close(poll_fd[_index].fd);
-		if (r != 0) {
-			errno = EIO;
+			CloseHandle(SLOT(_index)->wfd.overlapped->hEvent);
+			free(SLOT(_index)->wfd.overlapped);
 		}
-		poll_fd[_index] = INVALID_WINFD;
-		LeaveCriticalSection(&_poll_fd[_index].mutex);
+		release_port(_index);
+		SLOT(_index)->wfd = INVALID_WINFD;
+		put_free_index(_index);
+		r = 0;
+		LeaveCriticalSection(&SLOT(_index)->mutex);
 	}
 	return r;
 }
@@ -683,22 +836,25 @@ ssize_t usbi_write(int fd, const void *buf, size_t count)
 
 	_index = _fd_to_index_and_lock(fd);
 
-	if ( (_index < 0) || (poll_fd[_index].overlapped == NULL) ) {
+	if ( (_index < 0) || (SLOT(_index)->wfd.overlapped == NULL) ) {
 		errno = EBADF;
 		if (_index >= 0) {
-			LeaveCriticalSection(&_poll_fd[_index].mutex);
+			LeaveCriticalSection(&SLOT(_index)->mutex);
 		}
 		return -1;
 	}
 
 	poll_dbg("set pipe event (fd = %d, thread = %08X)", _index, GetCurrentThreadId());
-	SetEvent(poll_fd[_index].overlapped->hEvent);
-	poll_fd[_index].overlapped->Internal = STATUS_WAIT_0;
+	SetEvent(SLOT(_index)->wfd.overlapped->hEvent);
+	SLOT(_index)->wfd.overlapped->Internal = STATUS_WAIT_0;
 	// If two threads write on the pipe at the same time, we need to
 	// process two separate reads => use the overlapped as a counter
-	poll_fd[_index].overlapped->InternalHigh++;
+	SLOT(_index)->wfd.overlapped->InternalHigh++;
+	if (SLOT(_index)->port != NULL) {
+		PostQueuedCompletionStatus(SLOT(_index)->port, 0, 0, NULL);
+	}
 
-	LeaveCriticalSection(&_poll_fd[_index].mutex);
+	LeaveCriticalSection(&SLOT(_index)->mutex);
 	return sizeof(unsigned char);
 }
 
@@ -725,23 +881,23 @@ ssize_t usbi_read(int fd, void *buf, size_t count)
 		return -1;
 	}
 
-	if (WaitForSingleObject(poll_fd[_index].overlapped->hEvent, INFINITE) != WAIT_OBJECT_0) {
+	if (WaitForSingleObject(SLOT(_index)->wfd.overlapped->hEvent, INFINITE) != WAIT_OBJECT_0) {
 		usbi_warn(NULL, "waiting for event failed: %d", (int)GetLastError());
 		errno = EIO;
 		goto out;
 	}
 
 	poll_dbg("clr pipe event (fd = %d, thread = %08X)", _index, GetCurrentThreadId());
-	poll_fd[_index].overlapped->InternalHigh--;
+	SLOT(_index)->wfd.overlapped->InternalHigh--;
 	// Don't reset unless we don't have any more events to process
-	if (poll_fd[_index].overlapped->InternalHigh <= 0) {
-		ResetEvent(poll_fd[_index].overlapped->hEvent);
-		poll_fd[_index].overlapped->Internal = STATUS_PENDING;
+	if (SLOT(_index)->wfd.overlapped->InternalHigh <= 0) {
+		ResetEvent(SLOT(_index)->wfd.overlapped->hEvent);
+		SLOT(_index)->wfd.overlapped->Internal = STATUS_PENDING;
 	}
 
 	r = sizeof(unsigned char);
 
 out:
-	LeaveCriticalSection(&_poll_fd[_index].mutex);
+	LeaveCriticalSection(&SLOT(_index)->mutex);
 	return r;
 }
@@ -43,7 +43,7 @@ enum windows_version {
 };
 extern enum windows_version windows_version;
 
-#define MAX_FDS     256
+#define MAX_FDS     65536	// fds encode their table index on 16 bits
 
 #define POLLIN      0x0001    /* There is data to read */
 #define POLLPRI     0x0002    /* There is urgent data to read */
@@ -83,6 +83,7 @@ int usbi_close(int fd);
 void init_polling(void);
 void exit_polling(void);
 struct winfd usbi_create_fd(HANDLE handle, int access_mode);
+int usbi_attach_handle(int pipe_fd, HANDLE handle);
 void usbi_free_fd(int fd);
 struct winfd fd_to_winfd(int fd);
 struct winfd handle_to_winfd(HANDLE handle);
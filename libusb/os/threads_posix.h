@@ -43,6 +43,27 @@
 #define usbi_cond_destroy		pthread_cond_destroy
 #define usbi_cond_signal		pthread_cond_signal
 
+#define usbi_thread_t			pthread_t
+#define usbi_thread_create(thread, start, arg) \
+	pthread_create((thread), NULL, (start), (arg))
+#define usbi_thread_join(thread)	pthread_join((thread), NULL)
+
+/* full barrier atomic operations on pointers, and on longs that return the
+ * new value */
+#define usbi_atomic_cas_ptr(ptr, oldval, newval) \
+	__sync_val_compare_and_swap((ptr), (oldval), (newval))
+#define usbi_atomic_xchg_ptr(ptr, newval) \
+	__sync_lock_test_and_set((ptr), (newval))
+#define usbi_atomic_inc(ptr)		__sync_add_and_fetch((ptr), 1)
+#define usbi_atomic_dec(ptr)		__sync_sub_and_fetch((ptr), 1)
+/* compare and swap on longs, returning the previous value */
+#define usbi_atomic_cas(ptr, oldval, newval) \
+	__sync_val_compare_and_swap((ptr), (oldval), (newval))
+/* full barrier load and store of ints */
+#define usbi_atomic_load(ptr)		__sync_fetch_and_add((ptr), 0)
+#define usbi_atomic_store(ptr, val) \
+	((void)__sync_lock_test_and_set((ptr), (val)), __sync_synchronize())
+
 extern int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr);
 
 int usbi_get_tid(void);
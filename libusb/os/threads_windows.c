@@ -21,6 +21,7 @@
 #include <config.h>
 #include <objbase.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <stdarg.h>
 
 #include "libusbi.h"
@@ -206,6 +207,40 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 	return usbi_cond_intwait(cond, mutex, millis);
 }
 
+struct usbi_thread_start {
+	void *(*start)(void *);
+	void *arg;
+};
+
+static DWORD WINAPI usbi_thread_entry(LPVOID param) {
+	struct usbi_thread_start thread_start = *(struct usbi_thread_start *)param;
+	free(param);
+	thread_start.start(thread_start.arg);
+	return 0;
+}
+
+int usbi_thread_create(usbi_thread_t *thread, void *(*start)(void *),
+					   void *arg) {
+	struct usbi_thread_start *thread_start;
+	if(!thread || !start) return ((errno=EINVAL));
+	thread_start = malloc(sizeof(*thread_start));
+	if(!thread_start) return ((errno=ENOMEM));
+	thread_start->start = start;
+	thread_start->arg = arg;
+	*thread = CreateThread(NULL, 0, usbi_thread_entry, thread_start, 0, NULL);
+	if(!*thread) {
+		free(thread_start);
+		return ((errno=EAGAIN));
+	}
+	return 0;
+}
+int usbi_thread_join(usbi_thread_t thread) {
+	if(WaitForSingleObject(thread, INFINITE) != WAIT_OBJECT_0)
+		return ((errno=EINVAL));
+	CloseHandle(thread);
+	return 0;
+}
+
 int usbi_get_tid(void) {
 	return GetCurrentThreadId();
 }
@@ -82,6 +82,29 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 int usbi_cond_broadcast(usbi_cond_t *cond);
 int usbi_cond_signal(usbi_cond_t *cond);
 
+#define usbi_thread_t HANDLE
+
+int usbi_thread_create(usbi_thread_t *thread, void *(*start)(void *),
+					   void *arg);
+int usbi_thread_join(usbi_thread_t thread);
+
+// full barrier atomic operations on pointers, and on longs that return the
+//   new value
+#define usbi_atomic_cas_ptr(ptr, oldval, newval) \
+	InterlockedCompareExchangePointer((PVOID volatile *)(ptr), (newval), (oldval))
+#define usbi_atomic_xchg_ptr(ptr, newval) \
+	InterlockedExchangePointer((PVOID volatile *)(ptr), (newval))
+#define usbi_atomic_inc(ptr) InterlockedIncrement((LONG volatile *)(ptr))
+#define usbi_atomic_dec(ptr) InterlockedDecrement((LONG volatile *)(ptr))
+// compare and swap on longs, returning the previous value
+#define usbi_atomic_cas(ptr, oldval, newval) \
+	InterlockedCompareExchange((LONG volatile *)(ptr), (newval), (oldval))
+// full barrier load and store of ints
+#define usbi_atomic_load(ptr) \
+	InterlockedCompareExchange((LONG volatile *)(ptr), 0, 0)
+#define usbi_atomic_store(ptr, val) \
+	((void)InterlockedExchange((LONG volatile *)(ptr), (val)))
+
 int usbi_get_tid(void);
 
 #endif /* LIBUSB_THREADS_WINDOWS_H */
@@ -1915,7 +1915,6 @@ static void windows_clear_transfer_priv(struct usbi_transfer *itransfer)
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_context *ctx = DEVICE_CTX(transfer->dev_handle->dev);
 	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
 	int r;
@@ -1925,7 +1924,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		return r;
 	}
 
-	usbi_add_pollfd(ctx, transfer_priv->pollable_fd.fd,
+	usbi_add_handle_pollfd(transfer->dev_handle, transfer_priv->pollable_fd.fd,
 		(short)(IS_XFERIN(transfer) ? POLLIN : POLLOUT));
 
 	itransfer->flags |= USBI_TRANSFER_UPDATED_FDS;
@@ -1935,7 +1934,6 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 static int submit_iso_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_context *ctx = DEVICE_CTX(transfer->dev_handle->dev);
 	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
 	int r;
@@ -1945,7 +1943,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		return r;
 	}
 
-	usbi_add_pollfd(ctx, transfer_priv->pollable_fd.fd,
+	usbi_add_handle_pollfd(transfer->dev_handle, transfer_priv->pollable_fd.fd,
 		(short)(IS_XFERIN(transfer) ? POLLIN : POLLOUT));
 
 	itransfer->flags |= USBI_TRANSFER_UPDATED_FDS;
@@ -1955,7 +1953,6 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 static int submit_control_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_context *ctx = DEVICE_CTX(transfer->dev_handle->dev);
 	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
 	int r;
@@ -1965,7 +1962,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 		return r;
 	}
 
-	usbi_add_pollfd(ctx, transfer_priv->pollable_fd.fd, POLLIN);
+	usbi_add_handle_pollfd(transfer->dev_handle, transfer_priv->pollable_fd.fd, POLLIN);
 
 	itransfer->flags |= USBI_TRANSFER_UPDATED_FDS;
 	return LIBUSB_SUCCESS;
@@ -2085,6 +2082,7 @@ static int windows_handle_events(struct libusb_context *ctx, struct pollfd *fds,
 	struct windows_transfer_priv* transfer_priv = NULL;
 	POLL_NFDS_TYPE i = 0;
 	bool found = false;
+	struct libusb_device_handle *handle;
 	struct usbi_transfer *transfer;
 	DWORD io_size, io_result;
 
@@ -2101,15 +2099,19 @@ static int windows_handle_events(struct libusb_context *ctx, struct pollfd *fds,
 
 		// Because a Windows OVERLAPPED is used for poll emulation,
 		// a pollable fd is created and stored with each transfer
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-			transfer_priv = usbi_transfer_get_os_priv(transfer);
-			if (transfer_priv->pollable_fd.fd == fds[i].fd) {
-				found = true;
-				break;
+		found = false;
+		handle = usbi_pollfd_handle(ctx, fds, i);
+		if (handle != NULL) {
+			usbi_mutex_lock(&handle->flying_transfers_lock);
+			list_for_each_entry(transfer, &handle->flying_transfers, list, struct usbi_transfer) {
+				transfer_priv = usbi_transfer_get_os_priv(transfer);
+				if (transfer_priv->pollable_fd.fd == fds[i].fd) {
+					found = true;
+					break;
+				}
 			}
+			usbi_mutex_unlock(&handle->flying_transfers_lock);
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
 		if (found) {
 			// Handle async requests that completed synchronously first
@@ -2580,6 +2582,12 @@ static int winusbx_open(int sub_api, struct libusb_device_handle *dev_handle)
 					return LIBUSB_ERROR_IO;
 				}
 			}
+			// Overlapped I/O goes through the WinUSB handle, but completes on this one
+			if (usbi_attach_handle(ctx->ctrl_pipe[0], file_handle) != 0) {
+				usbi_err(ctx, "could not attach device %s (interface %d) to the event loop", priv->usb_interface[i].path, i);
+				CloseHandle(file_handle);
+				return LIBUSB_ERROR_IO;
+			}
 			handle_priv->interface_handle[i].dev_handle = file_handle;
 		}
 	}
@@ -2708,6 +2716,9 @@ static int winusbx_claim_interface(int sub_api, struct libusb_device_handle *dev
 							NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
 						if (file_handle == INVALID_HANDLE_VALUE) {
 							usbi_err(ctx, "could not open device %s: %s", filter_path, windows_error_str(0));
+						} else if (usbi_attach_handle(ctx->ctrl_pipe[0], file_handle) != 0) {
+							usbi_err(ctx, "could not attach device %s to the event loop", filter_path);
+							CloseHandle(file_handle);
 						} else {
 							WinUSBX[sub_api].Free(winusb_handle);
 							if (!WinUSBX[sub_api].Initialize(file_handle, &winusb_handle)) {
@@ -2810,10 +2821,23 @@ static int get_valid_interface(struct libusb_device_handle *dev_handle, int api_
 /*
  * Lookup interface by endpoint address. -1 if not found
  */
-static int interface_by_endpoint(struct windows_device_priv *priv,
-	struct windows_device_handle_priv *handle_priv, uint8_t endpoint_address)
+static int interface_by_endpoint(struct libusb_device_handle *dev_handle,
+	struct windows_device_priv *priv, struct windows_device_handle_priv *handle_priv,
+	uint8_t endpoint_address)
 {
+	struct usbi_endpoint *ep = usbi_handle_endpoint(dev_handle, endpoint_address);
 	int i, j;
+
+	// The endpoint table of the handle normally has the answer
+	if (ep->claimed) {
+		i = ep->interface;
+		if ( (handle_priv->interface_handle[i].api_handle != INVALID_HANDLE_VALUE)
+		  && (handle_priv->interface_handle[i].api_handle != 0)
+		  && (priv->usb_interface[i].endpoint != NULL) ) {
+			return i;
+		}
+	}
+
 	for (i=0; i<USB_MAXINTERFACES; i++) {
 		if (handle_priv->interface_handle[i].api_handle == INVALID_HANDLE_VALUE)
 			continue;
@@ -2941,7 +2965,7 @@ static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itran
 
 	transfer_priv->pollable_fd = INVALID_WINFD;
 
-	current_interface = interface_by_endpoint(priv, handle_priv, transfer->endpoint);
+	current_interface = interface_by_endpoint(transfer->dev_handle, priv, handle_priv, transfer->endpoint);
 	if (current_interface < 0) {
 		usbi_err(ctx, "unable to match endpoint to an open interface - cancelling transfer");
 		return LIBUSB_ERROR_NOT_FOUND;
@@ -2991,7 +3015,7 @@ static int winusbx_clear_halt(int sub_api, struct libusb_device_handle *dev_hand
 
 	CHECK_WINUSBX_AVAILABLE(sub_api);
 
-	current_interface = interface_by_endpoint(priv, handle_priv, endpoint);
+	current_interface = interface_by_endpoint(dev_handle, priv, handle_priv, endpoint);
 	if (current_interface < 0) {
 		usbi_err(ctx, "unable to match endpoint to an open interface - cannot clear");
 		return LIBUSB_ERROR_NOT_FOUND;
@@ -3666,6 +3690,11 @@ static int hid_open(int sub_api, struct libusb_device_handle *dev_handle)
 				}
 				priv->usb_interface[i].restricted_functionality = true;
 			}
+			if (usbi_attach_handle(ctx->ctrl_pipe[0], hid_handle) != 0) {
+				usbi_err(ctx, "could not attach device %s (interface %d) to the event loop", priv->path, i);
+				CloseHandle(hid_handle);
+				return LIBUSB_ERROR_IO;
+			}
 			handle_priv->interface_handle[i].api_handle = hid_handle;
 		}
 	}
@@ -3979,7 +4008,7 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 	transfer_priv->hid_dest = NULL;
 	safe_free(transfer_priv->hid_buffer);
 
-	current_interface = interface_by_endpoint(priv, handle_priv, transfer->endpoint);
+	current_interface = interface_by_endpoint(transfer->dev_handle, priv, handle_priv, transfer->endpoint);
 	if (current_interface < 0) {
 		usbi_err(ctx, "unable to match endpoint to an open interface - cancelling transfer");
 		return LIBUSB_ERROR_NOT_FOUND;
@@ -4100,7 +4129,7 @@ static int hid_clear_halt(int sub_api, struct libusb_device_handle *dev_handle,
 
 	CHECK_HID_AVAILABLE;
 
-	current_interface = interface_by_endpoint(priv, handle_priv, endpoint);
+	current_interface = interface_by_endpoint(dev_handle, priv, handle_priv, endpoint);
 	if (current_interface < 0) {
 		usbi_err(ctx, "unable to match endpoint to an open interface - cannot clear");
 		return LIBUSB_ERROR_NOT_FOUND;
@@ -4282,7 +4311,7 @@ static int composite_submit_bulk_transfer(int sub_api, struct usbi_transfer *itr
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
 	int current_interface;
 
-	current_interface = interface_by_endpoint(priv, handle_priv, transfer->endpoint);
+	current_interface = interface_by_endpoint(transfer->dev_handle, priv, handle_priv, transfer->endpoint);
 	if (current_interface < 0) {
 		usbi_err(ctx, "unable to match endpoint to an open interface - cancelling transfer");
 		return LIBUSB_ERROR_NOT_FOUND;
@@ -4298,7 +4327,7 @@ static int composite_submit_iso_transfer(int sub_api, struct usbi_transfer *itra
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
 	int current_interface;
 
-	current_interface = interface_by_endpoint(priv, handle_priv, transfer->endpoint);
+	current_interface = interface_by_endpoint(transfer->dev_handle, priv, handle_priv, transfer->endpoint);
 	if (current_interface < 0) {
 		usbi_err(ctx, "unable to match endpoint to an open interface - cancelling transfer");
 		return LIBUSB_ERROR_NOT_FOUND;
@@ -4314,7 +4343,7 @@ static int composite_clear_halt(int sub_api, struct libusb_device_handle *dev_ha
 	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
 	int current_interface;
 
-	current_interface = interface_by_endpoint(priv, handle_priv, endpoint);
+	current_interface = interface_by_endpoint(dev_handle, priv, handle_priv, endpoint);
 	if (current_interface < 0) {
 		usbi_err(ctx, "unable to match endpoint to an open interface - cannot clear");
 		return LIBUSB_ERROR_NOT_FOUND;
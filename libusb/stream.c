@@ -0,0 +1,1006 @@
+/*
+ * Streaming I/O functions for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusbi.h"
+
+/**
+ * @defgroup stream Streaming I/O
+ *
+ * This page documents libusbx's streaming API for continuous bulk and
+ * isochronous I/O.
+ *
+ * A stream keeps a fixed number of transfers in flight on an endpoint
+ * at all times, and hands the data to the application one chunk at a time
+ * through a callback. It is built on top of the
+ * \ref asyncio "asynchronous I/O API", and implements the usual pattern of
+ * resubmitting each transfer from its completion callback for you.
+ *
+ * Each completed transfer is resubmitted with a spare buffer \em before the
+ * stream callback is invoked, so the endpoint is kept busy while the
+ * application processes the chunk it was given. Streams therefore use one
+ * more buffer than they have transfers in flight.
+ *
+ * \section streamin IN streams
+ *
+ * For IN endpoints, the callback is given each chunk of data received, in
+ * order. A chunk may be shorter than the chunk size requested when the
+ * stream was opened, if the device ended the transfer with a short packet.
+ *
+ * \section streamout OUT streams
+ *
+ * For OUT endpoints, the callback is given a buffer that has just been sent
+ * and should fill it with the next chunk to send, returning its length. The
+ * callback is first called from within libusb_stream_open() once for every
+ * buffer of the stream, with a length of 0, to fill all of them up front.
+ * Returning 0 marks the end of the stream: the buffer is not sent, and the
+ * stream stops once the chunks already filled have been sent.
+ *
+ * \section streamstop Stopping a stream
+ *
+ * A stream stops when the callback returns a negative value, when an OUT
+ * stream runs out of data, when
+ * libusb_stream_stop() is called, or when a transfer fails, e.g. because
+ * the endpoint stalled or the device was disconnected. In-flight transfers
+ * are then cancelled; the callback is still invoked for each of them, with
+ * the transfer status and whatever data was transferred before the
+ * cancellation.
+ *
+ * \section streamiso Isochronous streams
+ *
+ * Isochronous streams, opened with libusb_stream_open_iso(), receive
+ * packets from an IN endpoint into a ring buffer supplied by the
+ * application. Rather than one chunk at a time, the callback is given
+ * each completed batch of packets, along with the length, status and
+ * estimated completion time of each packet.
+ *
+ * \section streamint Interrupt streams
+ *
+ * Interrupt streams, opened with libusb_stream_open_interrupt(), keep
+ * several transfers queued on an interrupt IN endpoint so that no report
+ * is missed between resubmissions, and collect the reports received into
+ * batches. The callback is given a batch once it holds the requested number
+ * of reports, or once the oldest report in it has waited for the maximum
+ * delay, whichever comes first. Each report carries its data, status and
+ * completion time.
+ *
+ * Event handling is required for streams to make progress, as with any
+ * other asynchronous transfer. libusb_stream_close() handles events itself
+ * until all of the stream's transfers are done.
+ *
+ * The callback of a stream is invoked by one thread at a time, even when
+ * completions are dispatched by several threads, see \ref pollthread. The
+ * chunks and batches it is given are then not reused before it returns.
+ * Chunks are delivered in order as long as a single thread dispatches the
+ * completions of the stream.
+ */
+
+struct stream_slot {
+	struct libusb_stream *stream;
+	struct libusb_transfer *transfer;
+	int busy;
+};
+
+struct libusb_stream {
+	struct libusb_device_handle *dev_handle;
+	unsigned char endpoint;
+	int depth;
+	void *user_data;
+
+	struct libusb_transfer_pool *pool;
+	struct stream_slot *slots;
+
+	/* set while libusb_stream_open*() takes back transfers it submitted,
+	 * so that the application does not hear about them */
+	int silent;
+
+	/* held by the transfer callbacks of the stream for their whole
+	 * duration, so that the spare buffer and the batches handed to the
+	 * application are not taken over by another dispatching thread. taken
+	 * before lock, and released before the stream may be freed */
+	usbi_mutex_t dispatch_lock;
+
+	/* protects the slots, buffer bookkeeping and state below. in_flight
+	 * counts submitted transfers whose callback has not returned yet.
+	 * stopping is set once no transfer is to be resubmitted, cancelled once
+	 * the transfers in flight have been cancelled. */
+	usbi_mutex_t lock;
+	int in_flight;
+	int stopping;
+	int cancelled;
+	int done;
+
+	/* bulk streams */
+	libusb_stream_cb_fn callback;
+	int chunk_size;
+
+	/* all depth + 1 buffers, allocated in one block */
+	unsigned char *buffers;
+	int dev_mem;
+
+	/* the buffer that is not owned by any transfer, and for OUT streams the
+	 * number of bytes the callback put in it */
+	unsigned char *spare;
+	int spare_length;
+
+	/* isochronous streams. the application's ring is split into
+	 * num_segments segments of one transfer each, which are submitted in
+	 * ring order. packets has one entry per packet in the ring. */
+	libusb_iso_stream_cb_fn iso_callback;
+	unsigned char *ring;
+	int num_segments;
+	int next_segment;
+	int packets_per_transfer;
+	int packet_size;
+	unsigned int packet_interval_us;
+	struct libusb_iso_packet *packets;
+
+	/* interrupt streams. completed reports are copied into one of two
+	 * batches of batch_size reports, so that one can be filled while the
+	 * other is being handed to the application. the data of the batches
+	 * follows the transfer buffers in the buffers block. timer is the slot
+	 * whose transfer was submitted with a timeout, to bound the time the
+	 * oldest report of the batch being filled has to wait. */
+	libusb_interrupt_stream_cb_fn interrupt_callback;
+	int report_size;
+	int batch_size;
+	unsigned int max_delay_ms;
+	struct libusb_interrupt_report *reports;
+	int fill;
+	int num_reports;
+	long long deadline_us;
+	struct stream_slot *timer;
+};
+
+static int stream_is_out(struct libusb_stream *stream)
+{
+	return (stream->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
+		== LIBUSB_ENDPOINT_OUT;
+}
+
+/* cancel every transfer still in flight. the stream lock must be held */
+static void stream_cancel_locked(struct libusb_stream *stream)
+{
+	int i;
+
+	stream->stopping = 1;
+	stream->cancelled = 1;
+	for (i = 0; i < stream->depth; i++)
+		if (stream->slots[i].busy)
+			libusb_cancel_transfer(stream->slots[i].transfer);
+}
+
+/* Resubmit a transfer that just completed with the given status, or stop
+ * the stream if it failed or the stream is already stopping. The stream
+ * lock must be held. Returns 1 if the transfer was resubmitted. */
+static int stream_resubmit_locked(struct libusb_stream *stream,
+	struct stream_slot *slot, enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer = slot->transfer;
+	int r;
+
+	if (status != LIBUSB_TRANSFER_COMPLETED && !stream->cancelled) {
+		usbi_dbg("stream transfer status %d, stopping", status);
+		stream_cancel_locked(stream);
+		return 0;
+	}
+
+	if (stream->stopping)
+		return 0;
+
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		usbi_warn(HANDLE_CTX(stream->dev_handle),
+			"stream resubmission failed: %s", libusb_error_name(r));
+		stream_cancel_locked(stream);
+		return 0;
+	}
+
+	slot->busy = 1;
+	stream->in_flight++;
+	return 1;
+}
+
+/* Check that an endpoint of the handle belongs to a claimed interface and
+ * is of the given type. */
+static int stream_check_endpoint(libusb_device_handle *dev_handle,
+	unsigned char endpoint, enum libusb_transfer_type type)
+{
+	struct usbi_endpoint *ep;
+	int r = 0;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	ep = usbi_handle_endpoint(dev_handle, endpoint);
+	if (!ep->claimed || ep->type != type)
+		r = LIBUSB_ERROR_INVALID_PARAM;
+	usbi_mutex_unlock(&dev_handle->lock);
+	return r;
+}
+
+/* account for the end of a transfer callback */
+static void stream_transfer_done(struct libusb_stream *stream)
+{
+	usbi_mutex_lock(&stream->lock);
+	stream->in_flight--;
+	if (stream->stopping && stream->in_flight == 0)
+		stream->done = 1;
+	usbi_mutex_unlock(&stream->lock);
+}
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct stream_slot *slot = transfer->user_data;
+	struct libusb_stream *stream = slot->stream;
+	enum libusb_transfer_status status = transfer->status;
+	unsigned char *buffer = transfer->buffer;
+	int length = transfer->actual_length;
+	int swapped = 0;
+	int r;
+
+	/* the completed transfer stays counted in in_flight until the callback
+	 * has returned, so that the stream cannot be freed before that */
+	usbi_mutex_lock(&stream->dispatch_lock);
+	usbi_mutex_lock(&stream->lock);
+	slot->busy = 0;
+
+	/* keep the endpoint busy while the callback runs, unless an OUT stream
+	 * has no more data to send, in which case the transfers in flight are
+	 * left to finish */
+	if (status == LIBUSB_TRANSFER_COMPLETED && !stream->stopping) {
+		if (stream_is_out(stream) && stream->spare_length == 0) {
+			usbi_dbg("end of stream on endpoint %02x", stream->endpoint);
+			stream->stopping = 1;
+		} else {
+			transfer->buffer = stream->spare;
+			if (stream_is_out(stream))
+				transfer->length = stream->spare_length;
+			stream->spare = buffer;
+			swapped = 1;
+		}
+	}
+	stream_resubmit_locked(stream, slot, status);
+	usbi_mutex_unlock(&stream->lock);
+
+	/* the callback is not called with the lock held, so it may call
+	 * libusb_stream_stop(). for OUT streams, the value it returns is only
+	 * used if it was handed the spare buffer. */
+	if (!stream->silent) {
+		r = stream->callback(stream, buffer, length, status,
+			stream->user_data);
+		if (r < 0) {
+			libusb_stream_stop(stream);
+		} else if (swapped && stream_is_out(stream)) {
+			usbi_mutex_lock(&stream->lock);
+			stream->spare_length = MIN(r, stream->chunk_size);
+			usbi_mutex_unlock(&stream->lock);
+		}
+	}
+
+	usbi_mutex_unlock(&stream->dispatch_lock);
+	stream_transfer_done(stream);
+}
+
+/* the current time on the monotonic clock, in microseconds */
+static long long stream_now_us(void)
+{
+	struct timespec now;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) < 0)
+		return 0;
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void LIBUSB_CALL iso_stream_transfer_cb(
+	struct libusb_transfer *transfer)
+{
+	struct stream_slot *slot = transfer->user_data;
+	struct libusb_stream *stream = slot->stream;
+	size_t segment_size = (size_t)stream->packets_per_transfer
+		* stream->packet_size;
+	int segment = (int)((transfer->buffer - stream->ring) / segment_size);
+	struct libusb_iso_packet *packets =
+		&stream->packets[segment * stream->packets_per_transfer];
+	long long usec = stream_now_us();
+	int i;
+
+	/* move on to the next segment of the ring. the packet results are in
+	 * the transfer's descriptors, which are read below */
+	usbi_mutex_lock(&stream->dispatch_lock);
+	usbi_mutex_lock(&stream->lock);
+	slot->busy = 0;
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED && !stream->stopping) {
+		transfer->buffer = stream->ring
+			+ (size_t)stream->next_segment * segment_size;
+		stream->next_segment = (stream->next_segment + 1)
+			% stream->num_segments;
+	}
+
+	/* the last packet completed now, earlier ones one service interval
+	 * apart from each other */
+	for (i = 0; i < stream->packets_per_transfer; i++) {
+		struct libusb_iso_packet_descriptor *desc =
+			&transfer->iso_packet_desc[i];
+		long long t = usec - (long long)stream->packet_interval_us
+			* (stream->packets_per_transfer - 1 - i);
+
+		if (t < 0)
+			t = 0;
+		packets[i].data = stream->ring + (size_t)segment * segment_size
+			+ (size_t)i * stream->packet_size;
+		packets[i].length = desc->actual_length;
+		packets[i].status = transfer->status == LIBUSB_TRANSFER_COMPLETED ?
+			desc->status : transfer->status;
+		packets[i].timestamp.tv_sec = t / 1000000;
+		packets[i].timestamp.tv_usec = t % 1000000;
+		desc->actual_length = 0;
+	}
+	stream_resubmit_locked(stream, slot, transfer->status);
+	usbi_mutex_unlock(&stream->lock);
+
+	if (!stream->silent && stream->iso_callback(stream, packets,
+			stream->packets_per_transfer, stream->user_data) < 0)
+		libusb_stream_stop(stream);
+
+	usbi_mutex_unlock(&stream->dispatch_lock);
+	stream_transfer_done(stream);
+}
+
+static void LIBUSB_CALL interrupt_stream_transfer_cb(
+	struct libusb_transfer *transfer)
+{
+	struct stream_slot *slot = transfer->user_data;
+	struct libusb_stream *stream = slot->stream;
+	enum libusb_transfer_status status = transfer->status;
+	struct libusb_interrupt_report *batch = NULL;
+	long long usec = stream_now_us();
+	int num_reports = 0;
+
+	usbi_mutex_lock(&stream->dispatch_lock);
+	usbi_mutex_lock(&stream->lock);
+	slot->busy = 0;
+	if (stream->timer == slot)
+		stream->timer = NULL;
+
+	/* a transfer only times out to flush the batch, and one that is
+	 * cancelled after receiving a report still delivers it. interrupt
+	 * reports fit in a single packet, so they are never cut short. */
+	if (transfer->actual_length > 0 || (status != LIBUSB_TRANSFER_TIMED_OUT
+			&& status != LIBUSB_TRANSFER_CANCELLED)) {
+		int index = stream->fill * stream->batch_size + stream->num_reports;
+		struct libusb_interrupt_report *report = &stream->reports[index];
+
+		if (stream->num_reports == 0)
+			stream->deadline_us = usec + (long long)stream->max_delay_ms * 1000;
+		memcpy(report->data, transfer->buffer, transfer->actual_length);
+		report->length = transfer->actual_length;
+		report->status = transfer->actual_length > 0 ?
+			LIBUSB_TRANSFER_COMPLETED : status;
+		report->timestamp.tv_sec = usec / 1000000;
+		report->timestamp.tv_usec = usec % 1000000;
+		stream->num_reports++;
+	}
+	if (status == LIBUSB_TRANSFER_TIMED_OUT)
+		status = LIBUSB_TRANSFER_COMPLETED;
+
+	if (stream->num_reports == stream->batch_size
+			|| (stream->num_reports > 0 && stream->max_delay_ms
+				&& usec >= stream->deadline_us)) {
+		batch = &stream->reports[stream->fill * stream->batch_size];
+		num_reports = stream->num_reports;
+		stream->fill = !stream->fill;
+		stream->num_reports = 0;
+	}
+
+	/* make sure one of the queued transfers expires when the time is up
+	 * for the batch being filled. being queued last, it is the last one to
+	 * receive a report, so the endpoint keeps receiving into the others
+	 * until then. */
+	transfer->timeout = 0;
+	if (!stream->timer && stream->num_reports > 0 && stream->max_delay_ms)
+		transfer->timeout = (unsigned int)MAX(1,
+			(stream->deadline_us - usec + 999) / 1000);
+	if (stream_resubmit_locked(stream, slot, status) && transfer->timeout)
+		stream->timer = slot;
+
+	/* while the stream stops, the rest of the batch goes out with the
+	 * last transfer to come back */
+	if (stream->stopping && stream->in_flight == 1
+			&& stream->num_reports > 0) {
+		batch = &stream->reports[stream->fill * stream->batch_size];
+		num_reports = stream->num_reports;
+		stream->num_reports = 0;
+	}
+	usbi_mutex_unlock(&stream->lock);
+
+	/* the dispatch lock keeps the batch handed out here from being refilled
+	 * before the callback has returned */
+	if (num_reports && !stream->silent && stream->interrupt_callback(stream,
+			batch, num_reports, stream->user_data) < 0)
+		libusb_stream_stop(stream);
+
+	usbi_mutex_unlock(&stream->dispatch_lock);
+	stream_transfer_done(stream);
+}
+
+static int stream_wait_done(struct libusb_stream *stream)
+{
+	struct libusb_context *ctx = HANDLE_CTX(stream->dev_handle);
+	int r;
+
+	while (!stream->done) {
+		r = libusb_handle_events_completed(ctx, &stream->done);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			return r;
+	}
+	return 0;
+}
+
+static void stream_free(struct libusb_stream *stream)
+{
+	int i;
+
+	if (stream->slots)
+		for (i = 0; i < stream->depth; i++)
+			libusb_free_transfer(stream->slots[i].transfer);
+	libusb_free_transfer_pool(stream->pool);
+
+	/* the ring of an iso stream belongs to the application */
+	if (stream->dev_mem)
+		libusb_dev_mem_free(stream->dev_handle, stream->buffers,
+			(size_t)(stream->depth + 1) * stream->chunk_size);
+	else
+		free(stream->buffers);
+
+	usbi_mutex_destroy(&stream->lock);
+	usbi_mutex_destroy(&stream->dispatch_lock);
+	free(stream->packets);
+	free(stream->reports);
+	free(stream->slots);
+	free(stream);
+}
+
+static int stream_alloc(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int depth, int iso_packets, int max_length,
+	void *user_data, struct libusb_stream **stream)
+{
+	struct libusb_stream *_stream;
+	int i;
+
+	_stream = calloc(1, sizeof(*_stream));
+	if (!_stream)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_stream->dev_handle = dev_handle;
+	_stream->endpoint = endpoint;
+	_stream->depth = depth;
+	_stream->user_data = user_data;
+	usbi_mutex_init(&_stream->lock, NULL);
+	usbi_mutex_init(&_stream->dispatch_lock, NULL);
+
+	_stream->slots = calloc(depth, sizeof(*_stream->slots));
+	_stream->pool = libusb_alloc_transfer_pool(HANDLE_CTX(dev_handle), depth,
+		iso_packets, max_length);
+	if (!_stream->slots || !_stream->pool) {
+		stream_free(_stream);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < depth; i++) {
+		_stream->slots[i].stream = _stream;
+		_stream->slots[i].transfer =
+			libusb_alloc_pool_transfer(_stream->pool);
+	}
+
+	*stream = _stream;
+	return 0;
+}
+
+/* Submit the first count transfers of a stream, the stream ending once
+ * they are done if that is not all of them. On failure, the transfers that
+ * had been submitted are cancelled and reaped, without calling back into
+ * the application, and the stream is freed. */
+static int stream_start(struct libusb_stream *stream, int count)
+{
+	struct libusb_transfer **transfers;
+	int batched = 0;
+	int i;
+	int r = 0;
+
+	usbi_mutex_lock(&stream->lock);
+	transfers = malloc(sizeof(*transfers) * stream->depth);
+	if (transfers && count > 0) {
+		for (i = 0; i < count; i++)
+			transfers[i] = stream->slots[i].transfer;
+		batched = libusb_submit_transfers(transfers, count);
+	}
+	free(transfers);
+
+	/* a partial batch does not tell what stopped it, so carry on one
+	 * transfer at a time from there to get hold of the error */
+	for (i = 0; i < count; i++) {
+		if (i >= batched) {
+			r = libusb_submit_transfer(stream->slots[i].transfer);
+			if (r < 0)
+				break;
+		}
+		stream->slots[i].busy = 1;
+		stream->in_flight++;
+	}
+
+	if (i == count) {
+		if (count < stream->depth) {
+			stream->stopping = 1;
+			stream->done = (stream->in_flight == 0);
+		}
+		usbi_mutex_unlock(&stream->lock);
+		return 0;
+	}
+
+	stream->silent = 1;
+	stream_cancel_locked(stream);
+	stream->done = (stream->in_flight == 0);
+	usbi_mutex_unlock(&stream->lock);
+	if (stream_wait_done(stream) < 0) {
+		/* the stream cannot be freed under the transfers' feet */
+		usbi_err(HANDLE_CTX(stream->dev_handle),
+			"failed to reap stream transfers, leaking stream");
+		return r;
+	}
+
+	stream_free(stream);
+	return r;
+}
+
+/** \ingroup stream
+ * Open a stream on a bulk endpoint and start transferring data.
+ *
+ * The stream keeps depth transfers of up to chunk_size bytes each in flight
+ * on the endpoint, resubmitting them as they complete, until it is stopped.
+ * Where the platform supports it, the stream's buffers are allocated with
+ * libusb_dev_mem_alloc() so that their data is not copied by the OS.
+ *
+ * The callback is invoked from within libusbx event handling for every
+ * transfer that completes, including transfers that are cancelled when the
+ * stream stops. See the \ref stream "streaming I/O" page for the meaning of
+ * its arguments and return value for IN and OUT endpoints.
+ *
+ * If this function fails, the callback is not invoked for any transfer
+ * that had already been submitted.
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint the address of a bulk endpoint of a claimed interface to
+ * stream on
+ * \param depth the number of transfers to keep in flight
+ * \param chunk_size the length of each transfer
+ * \param callback the function to process each chunk of data
+ * \param user_data user data to pass to the callback
+ * \param stream output location for the newly opened stream. Only populated
+ * if the return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if depth or chunk_size is not
+ * positive, or if the endpoint is not a bulk endpoint of a claimed interface
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure, or a negative value
+ * returned by the callback while filling the buffers of an OUT stream
+ */
+int API_EXPORTED libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int depth, int chunk_size,
+	libusb_stream_cb_fn callback, void *user_data,
+	struct libusb_stream **stream)
+{
+	struct libusb_stream *_stream;
+	size_t buffers_size;
+	int count = depth;
+	int i;
+	int r;
+
+	if (depth <= 0 || chunk_size <= 0 || !callback)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	r = stream_check_endpoint(dev_handle, endpoint,
+		LIBUSB_TRANSFER_TYPE_BULK);
+	if (r < 0)
+		return r;
+
+	r = stream_alloc(dev_handle, endpoint, depth, 0, chunk_size, user_data,
+		&_stream);
+	if (r < 0)
+		return r;
+
+	_stream->callback = callback;
+	_stream->chunk_size = chunk_size;
+
+	buffers_size = (size_t)(depth + 1) * chunk_size;
+	_stream->buffers = libusb_dev_mem_alloc(dev_handle, buffers_size);
+	if (_stream->buffers)
+		_stream->dev_mem = 1;
+	else
+		_stream->buffers = malloc(buffers_size);
+	if (!_stream->buffers) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err_free;
+	}
+
+	for (i = 0; i < depth; i++)
+		libusb_fill_bulk_transfer(_stream->slots[i].transfer, dev_handle,
+			endpoint, _stream->buffers + (size_t)i * chunk_size, chunk_size,
+			stream_transfer_cb, &_stream->slots[i], 0);
+	_stream->spare = _stream->buffers + (size_t)depth * chunk_size;
+	_stream->spare_length = chunk_size;
+
+	/* let the application fill all of an OUT stream's buffers first, in
+	 * the order they are sent. only the transfers filled before it ran out
+	 * of data are submitted. */
+	if (stream_is_out(_stream)) {
+		for (i = 0; i < depth; i++) {
+			struct libusb_transfer *transfer = _stream->slots[i].transfer;
+
+			r = callback(_stream, transfer->buffer, 0,
+				LIBUSB_TRANSFER_COMPLETED, user_data);
+			if (r < 0)
+				goto err_free;
+			if (r == 0)
+				break;
+			transfer->length = MIN(r, chunk_size);
+		}
+		count = i;
+
+		r = 0;
+		if (count == depth)
+			r = callback(_stream, _stream->spare, 0,
+				LIBUSB_TRANSFER_COMPLETED, user_data);
+		if (r < 0)
+			goto err_free;
+		_stream->spare_length = MIN(r, chunk_size);
+	}
+
+	r = stream_start(_stream, count);
+	if (r < 0)
+		return r;
+
+	usbi_dbg("stream on endpoint %02x, %d x %d bytes%s", endpoint, depth,
+		chunk_size, _stream->dev_mem ? " (device memory)" : "");
+	*stream = _stream;
+	return 0;
+
+err_free:
+	stream_free(_stream);
+	return r;
+}
+
+/* the time between two packets on an iso endpoint, from its descriptor and
+ * the speed of the device. falls back to one packet per (micro)frame. */
+static unsigned int iso_packet_interval_us(libusb_device_handle *dev_handle,
+	unsigned char endpoint)
+{
+	struct libusb_device *dev = libusb_get_device(dev_handle);
+	struct libusb_config_descriptor *config;
+	unsigned int frame_us;
+	int interval = 1;
+	int i, j, k;
+
+	switch (libusb_get_device_speed(dev)) {
+	case LIBUSB_SPEED_HIGH:
+	case LIBUSB_SPEED_SUPER:
+		frame_us = 125;
+		break;
+	default:
+		frame_us = 1000;
+		break;
+	}
+
+	if (libusb_get_active_config_descriptor(dev, &config) < 0)
+		return frame_us;
+
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+		for (j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *altsetting =
+				&iface->altsetting[j];
+			for (k = 0; k < altsetting->bNumEndpoints; k++) {
+				const struct libusb_endpoint_descriptor *ep =
+					&altsetting->endpoint[k];
+				if (ep->bEndpointAddress == endpoint
+						&& ep->bInterval >= 1 && ep->bInterval <= 16) {
+					interval = 1 << (ep->bInterval - 1);
+					goto out;
+				}
+			}
+		}
+	}
+
+out:
+	libusb_free_config_descriptor(config);
+	return frame_us * interval;
+}
+
+/** \ingroup stream
+ * Open a stream on an isochronous IN endpoint and start receiving packets
+ * into a ring buffer.
+ *
+ * The ring is split into segments of packets_per_transfer packets of
+ * packet_size bytes each, and the stream keeps depth of them queued on the
+ * endpoint at all times. As each segment completes, the next segment of the
+ * ring is queued in its place before the callback is given the completed
+ * batch of packets, so that no frames are missed while the application
+ * processes it. Consecutive batches are laid out one after the other in the
+ * ring (wrapping around at its end).
+ *
+ * Each packet is described to the callback by a \ref libusb_iso_packet,
+ * giving the location of its data in the ring, its length and status, and
+ * an estimate of its completion time on the monotonic clock. The estimate
+ * is derived from the completion time of the batch and the service
+ * interval of the endpoint.
+ *
+ * The data of a batch stays valid until the ring wraps around to it again,
+ * which is after num_segments - depth more batches have completed, where
+ * num_segments is ring_size / (packets_per_transfer * packet_size). The
+ * ring must hold at least depth + 1 segments, and should not be freed
+ * before the stream is closed.
+ *
+ * The stream is handled like a bulk stream otherwise, and is stopped and
+ * freed with libusb_stream_stop() and libusb_stream_close().
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint the address of a valid isochronous IN endpoint
+ * \param depth the number of transfers to keep queued
+ * \param packets_per_transfer the number of packets in each transfer
+ * \param packet_size the maximum size of each packet, usually the value
+ * returned by libusb_get_max_iso_packet_size()
+ * \param ring the buffer to receive packets into, for example allocated
+ * with libusb_dev_mem_alloc()
+ * \param ring_size the size of ring, in bytes
+ * \param callback the function to process each batch of packets
+ * \param user_data user data to pass to the callback
+ * \param stream output location for the newly opened stream. Only populated
+ * if the return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not an isochronous
+ * IN endpoint of a claimed interface, or the ring cannot hold depth + 1
+ * segments
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_stream_open_iso(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int depth, int packets_per_transfer,
+	int packet_size, unsigned char *ring, size_t ring_size,
+	libusb_iso_stream_cb_fn callback, void *user_data,
+	struct libusb_stream **stream)
+{
+	struct libusb_stream *_stream;
+	size_t segment_size;
+	int num_segments;
+	int i;
+	int r;
+
+	if (depth <= 0 || packets_per_transfer <= 0 || packet_size <= 0
+			|| !ring || !callback)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	r = stream_check_endpoint(dev_handle, endpoint,
+		LIBUSB_TRANSFER_TYPE_ISOCHRONOUS);
+	if (r < 0)
+		return r;
+
+	segment_size = (size_t)packets_per_transfer * packet_size;
+	num_segments = (int)MIN(ring_size / segment_size, INT_MAX);
+	if (num_segments < depth + 1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = stream_alloc(dev_handle, endpoint, depth, packets_per_transfer,
+		(int)segment_size, user_data, &_stream);
+	if (r < 0)
+		return r;
+
+	_stream->iso_callback = callback;
+	_stream->ring = ring;
+	_stream->num_segments = num_segments;
+	_stream->next_segment = depth;
+	_stream->packets_per_transfer = packets_per_transfer;
+	_stream->packet_size = packet_size;
+	_stream->packet_interval_us = iso_packet_interval_us(dev_handle,
+		endpoint);
+	_stream->packets = calloc((size_t)num_segments * packets_per_transfer,
+		sizeof(*_stream->packets));
+	if (!_stream->packets) {
+		stream_free(_stream);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < depth; i++) {
+		struct libusb_transfer *transfer = _stream->slots[i].transfer;
+
+		libusb_fill_iso_transfer(transfer, dev_handle, endpoint,
+			ring + (size_t)i * segment_size, (int)segment_size,
+			packets_per_transfer, iso_stream_transfer_cb,
+			&_stream->slots[i], 0);
+		libusb_set_iso_packet_lengths(transfer, packet_size);
+	}
+
+	r = stream_start(_stream, depth);
+	if (r < 0)
+		return r;
+
+	usbi_dbg("iso stream on endpoint %02x, %d x %d x %d bytes, %d segments, "
+		"%uus per packet", endpoint, depth, packets_per_transfer,
+		packet_size, num_segments, _stream->packet_interval_us);
+	*stream = _stream;
+	return 0;
+}
+
+/** \ingroup stream
+ * Open a stream on an interrupt IN endpoint and start receiving reports in
+ * batches.
+ *
+ * The stream keeps depth transfers of report_size bytes queued on the
+ * endpoint, so that the device always has somewhere to send its next
+ * report, and resubmits each of them as soon as its report has been copied
+ * into the current batch. The callback is given up to batch_size reports at
+ * a time, in the order they were received, each with its completion time on
+ * the monotonic clock.
+ *
+ * A batch is handed out when it is full, or when its oldest report has
+ * waited for max_delay_ms milliseconds. To enforce the delay while no
+ * reports arrive, one queued transfer is given a timeout; a transfer that
+ * times out is simply resubmitted, and if it had received a report before
+ * being cancelled, the report is kept. With a max_delay_ms of 0, batches are
+ * only handed out when full, or when the stream stops.
+ *
+ * The reports of a batch are only valid until the callback returns. A
+ * transfer that fails is passed as a report with no data and the transfer
+ * status, and stops the stream. Transfers that are cancelled without data
+ * while the stream stops are not reported; the reports still pending are
+ * handed out once they are all done.
+ *
+ * The stream is handled like a bulk stream otherwise, and is stopped and
+ * freed with libusb_stream_stop() and libusb_stream_close().
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint the address of a valid interrupt IN endpoint
+ * \param depth the number of transfers to keep queued
+ * \param report_size the maximum size of a report, usually the
+ * wMaxPacketSize of the endpoint
+ * \param batch_size the maximum number of reports in a batch
+ * \param max_delay_ms the maximum time a report waits for its batch to be
+ * handed out, in milliseconds, or 0 for no limit
+ * \param callback the function to process each batch of reports
+ * \param user_data user data to pass to the callback
+ * \param stream output location for the newly opened stream. Only populated
+ * if the return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not an interrupt IN
+ * endpoint of a claimed interface, or depth, report_size or batch_size is not
+ * positive
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_stream_open_interrupt(
+	libusb_device_handle *dev_handle, unsigned char endpoint, int depth,
+	int report_size, int batch_size, unsigned int max_delay_ms,
+	libusb_interrupt_stream_cb_fn callback, void *user_data,
+	struct libusb_stream **stream)
+{
+	struct libusb_stream *_stream;
+	unsigned char *batch_data;
+	int i;
+	int r;
+
+	if (depth <= 0 || report_size <= 0 || batch_size <= 0 || !callback)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	r = stream_check_endpoint(dev_handle, endpoint,
+		LIBUSB_TRANSFER_TYPE_INTERRUPT);
+	if (r < 0)
+		return r;
+
+	r = stream_alloc(dev_handle, endpoint, depth, 0, report_size, user_data,
+		&_stream);
+	if (r < 0)
+		return r;
+
+	_stream->interrupt_callback = callback;
+	_stream->report_size = report_size;
+	_stream->batch_size = batch_size;
+	_stream->max_delay_ms = max_delay_ms;
+	_stream->buffers = malloc((size_t)(depth + 2 * batch_size) * report_size);
+	_stream->reports = calloc(2 * (size_t)batch_size,
+		sizeof(*_stream->reports));
+	if (!_stream->buffers || !_stream->reports) {
+		stream_free(_stream);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	batch_data = _stream->buffers + (size_t)depth * report_size;
+	for (i = 0; i < 2 * batch_size; i++)
+		_stream->reports[i].data = batch_data + (size_t)i * report_size;
+
+	for (i = 0; i < depth; i++)
+		libusb_fill_interrupt_transfer(_stream->slots[i].transfer,
+			dev_handle, endpoint, _stream->buffers + (size_t)i * report_size,
+			report_size, interrupt_stream_transfer_cb, &_stream->slots[i], 0);
+
+	r = stream_start(_stream, depth);
+	if (r < 0)
+		return r;
+
+	usbi_dbg("interrupt stream on endpoint %02x, %d x %d bytes, batches of "
+		"%d reports within %ums", endpoint, depth, report_size, batch_size,
+		max_delay_ms);
+	*stream = _stream;
+	return 0;
+}
+
+/** \ingroup stream
+ * Stop a stream. All of the stream's transfers in flight are cancelled and
+ * none of them will be resubmitted. The callback is still invoked for each
+ * of them as the cancellations complete.
+ *
+ * This function does not block, and can be called from any thread,
+ * including from within the stream callback. It is safe to call it on a
+ * stream that has already stopped.
+ *
+ * \param stream the stream to stop
+ */
+void API_EXPORTED libusb_stream_stop(struct libusb_stream *stream)
+{
+	usbi_mutex_lock(&stream->lock);
+	if (!stream->cancelled) {
+		usbi_dbg("stopping stream on endpoint %02x", stream->endpoint);
+		stream_cancel_locked(stream);
+		if (stream->in_flight == 0)
+			stream->done = 1;
+	}
+	usbi_mutex_unlock(&stream->lock);
+}
+
+/** \ingroup stream
+ * Stop a stream if it is still running, wait for all of its transfers to
+ * complete and free it.
+ *
+ * This function handles events until the stream's transfers are done, in
+ * the same way as the \ref syncio "synchronous I/O functions". It must not
+ * be called from within the stream callback; return a negative value from
+ * the callback to stop the stream instead.
+ *
+ * \param stream the stream to close
+ * \returns 0 on success, in which case the stream has been freed
+ * \returns a LIBUSB_ERROR code if event handling failed. The stream has not
+ * been freed and libusb_stream_close() can be called again.
+ */
+int API_EXPORTED libusb_stream_close(struct libusb_stream *stream)
+{
+	int r;
+
+	libusb_stream_stop(stream);
+	r = stream_wait_done(stream);
+	if (r < 0)
+		return r;
+
+	stream_free(stream);
+	return 0;
+}
@@ -31,8 +31,26 @@
  * This page documents libusbx's synchronous (blocking) API for USB device I/O.
  * This interface is easy to use but has some limitations. More advanced users
  * may wish to consider using the \ref asyncio "asynchronous I/O API" instead.
+ *
+ * Where the platform allows it, a control transfer with a timeout is carried
+ * out by a single blocking request to the operating system when the calling
+ * thread does not need to handle events for other transfers in the meantime.
+ * This keeps the cost of small requests, such as register accesses, to a
+ * minimum.
  */
 
+/* Whether a synchronous transfer can be handed over to the backend in one
+ * blocking call, rather than submitted asynchronously and waited for through
+ * event handling. Blocking is fine when another thread is doing the event
+ * handling, or when there is nothing else to handle events for. */
+static int can_block_in_backend(struct libusb_context *ctx)
+{
+	if (usbi_atomic_load(&ctx->event_thread_running)
+			|| ctx->event_handler_active)
+		return 1;
+	return !usbi_transfers_pending(ctx);
+}
+
 static void LIBUSB_CALL ctrl_transfer_cb(struct libusb_transfer *transfer)
 {
 	int *completed = transfer->user_data;
@@ -41,6 +59,31 @@ static void LIBUSB_CALL ctrl_transfer_cb(struct libusb_transfer *transfer)
 	/* caller interprets result and frees transfer */
 }
 
+/* the outcome of a completed control transfer: the number of bytes actually
+ * transferred, or a LIBUSB_ERROR code */
+int usbi_control_transfer_result(struct libusb_transfer *transfer)
+{
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return transfer->actual_length;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_IO;
+	default:
+		usbi_warn(TRANSFER_CTX(transfer),
+			"unrecognised status code %d", transfer->status);
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
 /** \ingroup syncio
  * Perform a USB control transfer.
  *
@@ -73,11 +116,12 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct libusb_transfer *transfer;
 	unsigned char *buffer;
 	int completed = 0;
 	int r;
 
+	transfer = libusb_alloc_transfer(0);
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -95,6 +139,21 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
 		ctrl_transfer_cb, &completed, timeout);
 	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+	/* without a timeout, the request could not be interrupted once in the
+	 * backend, so it goes through the asynchronous path */
+	if (timeout && usbi_backend->sync_control_transfer
+			&& can_block_in_backend(HANDLE_CTX(dev_handle))) {
+		r = usbi_sync_control_transfer(transfer);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+			if (r > 0 && (bmRequestType & LIBUSB_ENDPOINT_DIR_MASK)
+					== LIBUSB_ENDPOINT_IN)
+				memcpy(data, libusb_control_transfer_get_data(transfer), r);
+			libusb_free_transfer(transfer);
+			return r;
+		}
+	}
+
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
@@ -119,32 +178,7 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 		memcpy(data, libusb_control_transfer_get_data(transfer),
 			transfer->actual_length);
 
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
-		r = transfer->actual_length;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_CANCELLED:
-		r = LIBUSB_ERROR_IO;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
-	}
-
+	r = usbi_control_transfer_result(transfer);
 	libusb_free_transfer(transfer);
 	return r;
 }
@@ -161,10 +195,11 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
 	int *transferred, unsigned int timeout, unsigned char type)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct libusb_transfer *transfer;
 	int completed = 0;
 	int r;
 
+	transfer = libusb_alloc_transfer(0);
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -319,3 +354,311 @@ int API_EXPORTED libusb_interrupt_transfer(
 	return do_sync_bulk_transfer(dev_handle, endpoint, data, length,
 		transferred, timeout, LIBUSB_TRANSFER_TYPE_INTERRUPT);
 }
+
+/* the strings read for each device by libusb_open_devices(), in order */
+#define OPEN_STRINGS 3
+
+/* the reads libusb_open_devices() carries out on one device: the language
+ * IDs (step -1), then each of its strings in turn, with a single transfer */
+struct open_request {
+	struct libusb_open_result *result;
+	struct libusb_transfer *transfer;
+	uint8_t indices[OPEN_STRINGS];
+	unsigned char *strings[OPEN_STRINGS];
+	int step;
+	uint16_t langid;
+
+	/* shared by all the requests, and protected by the context's
+	 * event_waiters_lock, as the reads may complete on another thread than
+	 * the one that submits them */
+	int *pending;
+	int *completed;
+	int *stopping;
+};
+
+/* skip the strings a device does not have, and those it had read before.
+ * returns 1 once none is left to read. */
+static int open_request_skip(struct open_request *req)
+{
+	unsigned char tbuf[255];
+	int r;
+
+	for (; req->step < OPEN_STRINGS; req->step++) {
+		if (!req->indices[req->step])
+			continue;
+
+		r = usbi_get_cached_string(req->result->dev, req->indices[req->step],
+			req->langid, tbuf, sizeof(tbuf));
+		if (r < 0)
+			return 0;
+		usbi_string_to_ascii(tbuf, r, req->strings[req->step],
+			(int) sizeof(req->result->manufacturer));
+	}
+	return 1;
+}
+
+/* set up the read for the current step of a device */
+static void open_request_fill(struct open_request *req, unsigned char *buffer)
+{
+	/* some devices choke on reads of more than 255 bytes */
+	if (req->step < 0)
+		libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8, 0, 255);
+	else
+		libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_DESCRIPTOR,
+			(uint16_t)((LIBUSB_DT_STRING << 8) | req->indices[req->step]),
+			req->langid, 255);
+}
+
+static int open_request_stopping(struct open_request *req)
+{
+	struct libusb_context *ctx = DEVICE_CTX(req->result->dev);
+	int stopping;
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	stopping = *req->stopping;
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	return stopping;
+}
+
+/* submit the read of the next string of a device, if any is left. */
+static int open_request_next(struct open_request *req)
+{
+	int r;
+
+	if (open_request_skip(req))
+		return LIBUSB_ERROR_NOT_FOUND;
+	if (open_request_stopping(req))
+		return LIBUSB_ERROR_INTERRUPTED;
+
+	open_request_fill(req, req->transfer->buffer);
+	r = libusb_submit_transfer(req->transfer);
+
+	/* libusb_open_devices() may have missed the transfer while it was not
+	 * in flight */
+	if (r == 0 && open_request_stopping(req))
+		libusb_cancel_transfer(req->transfer);
+	return r;
+}
+
+/* account for a device whose reads are over, or never started. the
+ * transfer is freed by libusb_open_devices() once all of them are over. */
+static void open_request_done(struct open_request *req)
+{
+	struct libusb_context *ctx = DEVICE_CTX(req->result->dev);
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	if (--*req->pending == 0)
+		*req->completed = 1;
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+static void LIBUSB_CALL open_request_cb(struct libusb_transfer *transfer)
+{
+	struct open_request *req = transfer->user_data;
+	unsigned char *desc = libusb_control_transfer_get_data(transfer);
+	int r = usbi_control_transfer_result(transfer);
+
+	if (r >= 0)
+		usbi_cache_string(req->result->dev,
+			req->step < 0 ? 0 : req->indices[req->step],
+			req->step < 0 ? 0 : req->langid, desc, r);
+
+	if (req->step < 0) {
+		/* the language IDs start at the third byte, use the first one */
+		if (r >= 0 && r < 4)
+			r = LIBUSB_ERROR_IO;
+		if (r < 0) {
+			req->result->status = r;
+			open_request_done(req);
+			return;
+		}
+		req->langid = desc[2] | (desc[3] << 8);
+		req->step = 0;
+	} else {
+		if (r >= 0)
+			r = usbi_string_to_ascii(desc, r, req->strings[req->step],
+				(int) sizeof(req->result->manufacturer));
+		if (r < 0 && req->result->status == 0)
+			req->result->status = r;
+		/* don't keep asking a device that went away */
+		if (r == LIBUSB_ERROR_NO_DEVICE) {
+			open_request_done(req);
+			return;
+		}
+		req->step++;
+	}
+
+	r = open_request_next(req);
+	if (r < 0) {
+		if (r != LIBUSB_ERROR_NOT_FOUND && r != LIBUSB_ERROR_INTERRUPTED
+				&& req->result->status == 0)
+			req->result->status = r;
+		open_request_done(req);
+	}
+}
+
+/* open a device and start reading its strings. returns 1 if reads are
+ * under way. */
+static int open_request_start(struct open_request *req,
+	struct libusb_open_result *result, unsigned int timeout)
+{
+	struct libusb_device_descriptor desc;
+	unsigned char tbuf[255];
+	unsigned char *buffer;
+	int r;
+
+	req->result = result;
+	req->step = -1;
+	req->strings[0] = result->manufacturer;
+	req->strings[1] = result->product;
+	req->strings[2] = result->serial_number;
+	result->handle = NULL;
+	result->manufacturer[0] = 0;
+	result->product[0] = 0;
+	result->serial_number[0] = 0;
+
+	result->status = libusb_open(result->dev, &result->handle);
+	if (result->status < 0)
+		return 0;
+
+	r = libusb_get_device_descriptor(result->dev, &desc);
+	if (r < 0) {
+		result->status = r;
+		return 0;
+	}
+
+	req->indices[0] = desc.iManufacturer;
+	req->indices[1] = desc.iProduct;
+	req->indices[2] = desc.iSerialNumber;
+	if (!req->indices[0] && !req->indices[1] && !req->indices[2])
+		return 0;
+
+	/* the strings read before are kept by the device */
+	r = usbi_get_cached_string(result->dev, 0, 0, tbuf, sizeof(tbuf));
+	if (r >= 4) {
+		req->langid = tbuf[2] | (tbuf[3] << 8);
+		req->step = 0;
+		if (open_request_skip(req))
+			return 0;
+	}
+
+	req->transfer = libusb_alloc_transfer(0);
+	buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + 255);
+	if (!req->transfer || !buffer) {
+		libusb_free_transfer(req->transfer);
+		req->transfer = NULL;
+		free(buffer);
+		result->status = LIBUSB_ERROR_NO_MEM;
+		return 0;
+	}
+
+	open_request_fill(req, buffer);
+	libusb_fill_control_transfer(req->transfer, result->handle, buffer,
+		open_request_cb, req, timeout);
+	req->transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+	r = libusb_submit_transfer(req->transfer);
+	if (r < 0) {
+		libusb_free_transfer(req->transfer);
+		req->transfer = NULL;
+		result->status = r;
+		return 0;
+	}
+
+	return 1;
+}
+
+/** \ingroup syncio
+ * Open several devices and read their manufacturer, product and serial
+ * number strings, as libusb_open() and libusb_get_string_descriptor_ascii()
+ * would. The reads on the different devices are carried out concurrently
+ * on the asynchronous I/O engine, so that the latencies of the devices
+ * overlap rather than add up.
+ *
+ * The caller sets the dev field of each result. This function fills in the
+ * other fields, whether it succeeds or not. Each device that could be opened
+ * has a handle, even if reading its strings failed. The caller should close
+ * these handles with libusb_close(). The strings of a device that it cannot
+ * be read from are left empty.
+ *
+ * All the devices must belong to the same context.
+ *
+ * \param results the devices to open and, on return, the outcome for each
+ * \param num_results the number of items in results
+ * \param timeout timeout (in millseconds) of each read on a device. For an
+ * unlimited timeout, use value 0.
+ * \returns 0 once all the devices have been dealt with. The outcome for
+ * each is in its status.
+ * \returns LIBUSB_ERROR_INVALID_PARAM if no devices are given, or if they
+ * belong to different contexts
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if event handling failed
+ */
+int API_EXPORTED libusb_open_devices(struct libusb_open_result *results,
+	int num_results, unsigned int timeout)
+{
+	struct libusb_context *ctx;
+	struct open_request *reqs;
+	int pending = num_results;
+	int completed = 0;
+	int stopping = 0;
+	int started = 0;
+	int i, r = 0;
+
+	if (num_results <= 0 || !results[0].dev)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	ctx = DEVICE_CTX(results[0].dev);
+	for (i = 1; i < num_results; i++)
+		if (!results[i].dev || DEVICE_CTX(results[i].dev) != ctx)
+			return LIBUSB_ERROR_INVALID_PARAM;
+
+	reqs = calloc(num_results, sizeof(*reqs));
+	if (!reqs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	/* every device is counted as pending up front, so that those that
+	 * complete early cannot make the others look done */
+	for (i = 0; i < num_results; i++) {
+		reqs[i].pending = &pending;
+		reqs[i].completed = &completed;
+		reqs[i].stopping = &stopping;
+		if (open_request_start(&reqs[i], &results[i], timeout))
+			started++;
+		else
+			open_request_done(&reqs[i]);
+	}
+	usbi_dbg("reading strings of %d out of %d devices", started, num_results);
+
+	while (!completed) {
+		r = libusb_handle_events_completed(ctx, &completed);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			break;
+	}
+
+	if (!completed) {
+		int r2;
+
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		stopping = 1;
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+		for (i = 0; i < num_results; i++)
+			if (reqs[i].transfer)
+				libusb_cancel_transfer(reqs[i].transfer);
+
+		while (!completed) {
+			r2 = libusb_handle_events_completed(ctx, &completed);
+			if (r2 < 0 && r2 != LIBUSB_ERROR_INTERRUPTED) {
+				/* the requests cannot be freed under the transfers' feet */
+				usbi_err(ctx, "failed to reap string reads, leaking them");
+				return r;
+			}
+		}
+	}
+
+	for (i = 0; i < num_results; i++)
+		libusb_free_transfer(reqs[i].transfer);
+	free(reqs);
+	return r < 0 ? r : 0;
+}
@@ -23,6 +23,15 @@
 /* Message logging */
 #define ENABLE_LOGGING 1
 
+/* Transfer statistics */
+#define ENABLE_TRANSFER_STATS 1
+
+/* C99 formatting functions, which older MSVC only has with a prefix */
+#if _MSC_VER < 1900
+#define snprintf _snprintf
+#define vsnprintf _vsnprintf
+#endif
+
 /* Windows backend */
 #define OS_WINDOWS 1
 
@@ -98,6 +98,10 @@ SOURCE=..\libusb\descriptor.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\libusb\hotplug.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\libusb\io.c
 # End Source File
 # Begin Source File
@@ -111,6 +115,10 @@ SOURCE=..\libusb\os\poll_windows.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\libusb\stream.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\libusb\sync.c
 # End Source File
 # Begin Source File
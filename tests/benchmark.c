@@ -0,0 +1,562 @@
+/*
+ * libusbx benchmark program, measuring the cost of the I/O paths
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The I/O benchmarks run against a loopback device, by default the Linux
+ * "Gadget Zero" (g_zero, which can be run on dummy_hcd) in its source/sink
+ * configuration: a bulk IN endpoint that sources data and a bulk OUT endpoint
+ * that sinks it. Another device can be picked with the LIBUSBX_BENCH_DEVICE
+ * environment variable, set to "vid:pid" in hexadecimal. Benchmarks are
+ * skipped when no such device is present.
+ *
+ * When libusbx is configured with --enable-mock-backend, running with
+ * LIBUSB_BACKEND=mock swaps the hardware for simulated devices that behave
+ * like Gadget Zero, which measures the library alone and gives repeatable
+ * numbers. LIBUSB_MOCK_LATENCY and LIBUSB_MOCK_BANDWIDTH, documented in
+ * libusb/os/mock_usb.c, add a simulated bus cost.
+ *
+ * Setting LIBUSBX_BENCH_EVENT_THREAD to "inline" or "queued" runs the I/O
+ * benchmarks with the internal event thread of the context started in that
+ * mode, see libusb_start_event_thread().
+ *
+ * Every measurement is written as a tab separated line:
+ *   result <benchmark> <metric> <value> <unit>
+ * so that results can be extracted with grep and compared between builds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <pthread.h>
+#endif
+
+#include "libusb.h"
+
+#include "libusbx_testlib.h"
+
+#define GZERO_VID		0x0525
+#define GZERO_PID		0xa4a0
+
+#define BULK_SIZE		16384
+#define BULK_COUNT		2048
+#define ASYNC_DEPTH		16
+#define SMALL_SIZE		512
+#define SMALL_COUNT		20000
+#define SMALL_DEPTH		256
+#define CONTROL_COUNT		2000
+#define ENUM_COUNT		200
+#define EVENT_COUNT		20000
+
+struct bench_device {
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	unsigned char ep_in;
+	unsigned char ep_out;
+};
+
+/* with an event thread, transfer callbacks run concurrently with the
+ * benchmark itself */
+#ifdef _WIN32
+typedef CRITICAL_SECTION bench_mutex;
+#define bench_mutex_init(m)	InitializeCriticalSection(m)
+#define bench_mutex_lock(m)	EnterCriticalSection(m)
+#define bench_mutex_unlock(m)	LeaveCriticalSection(m)
+#define bench_mutex_destroy(m)	DeleteCriticalSection(m)
+#else
+typedef pthread_mutex_t bench_mutex;
+#define bench_mutex_init(m)	pthread_mutex_init((m), NULL)
+#define bench_mutex_lock(m)	pthread_mutex_lock(m)
+#define bench_mutex_unlock(m)	pthread_mutex_unlock(m)
+#define bench_mutex_destroy(m)	pthread_mutex_destroy(m)
+#endif
+
+/* the state of an asynchronous run, protected by lock. done is set once
+ * no transfer is in flight any more, for libusb_handle_events_completed() */
+struct async_run {
+	bench_mutex lock;
+	int remaining;
+	int in_flight;
+	int failed;
+	long long bytes;
+	int done;
+};
+
+/** Monotonic time in microseconds */
+static double now_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart * 1000000.0 / (double)freq.QuadPart;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec * 1000000.0 + (double)tv.tv_usec;
+#endif
+}
+
+static void report(libusbx_testlib_ctx * tctx, const char *bench,
+	const char *metric, double value, const char *unit)
+{
+	libusbx_testlib_logf(tctx, "result\t%s\t%s\t%.3f\t%s",
+		bench, metric, value, unit);
+}
+
+/** Opens the loopback device and finds its bulk endpoints. */
+static libusbx_testlib_result open_bench_device(libusbx_testlib_ctx * tctx,
+	struct bench_device *bdev)
+{
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *altsetting;
+	unsigned int vid = GZERO_VID, pid = GZERO_PID;
+	const char *env = getenv("LIBUSBX_BENCH_DEVICE");
+	const char *evt = getenv("LIBUSBX_BENCH_EVENT_THREAD");
+	int r, i;
+
+	if (env && sscanf(env, "%x:%x", &vid, &pid) != 2) {
+		libusbx_testlib_logf(tctx, "Invalid LIBUSBX_BENCH_DEVICE: %s", env);
+		return TEST_STATUS_ERROR;
+	}
+
+	memset(bdev, 0, sizeof(*bdev));
+	r = libusb_init(&bdev->ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	if (evt && *evt) {
+		if (strcmp(evt, "inline") == 0)
+			r = libusb_start_event_thread(bdev->ctx,
+				LIBUSB_EVENT_THREAD_INLINE);
+		else if (strcmp(evt, "queued") == 0)
+			r = libusb_start_event_thread(bdev->ctx,
+				LIBUSB_EVENT_THREAD_QUEUED);
+		else
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to start the event thread "
+				"for LIBUSBX_BENCH_EVENT_THREAD=%s: %d", evt, r);
+			libusb_exit(bdev->ctx);
+			return TEST_STATUS_ERROR;
+		}
+	}
+
+	bdev->handle = libusb_open_device_with_vid_pid(bdev->ctx,
+		(uint16_t)vid, (uint16_t)pid);
+	if (!bdev->handle) {
+		libusbx_testlib_logf(tctx, "No %04x:%04x device to benchmark",
+			vid, pid);
+		libusb_exit(bdev->ctx);
+		return TEST_STATUS_SKIP;
+	}
+
+	r = libusb_get_active_config_descriptor(libusb_get_device(bdev->handle),
+		&config);
+	if (r != LIBUSB_SUCCESS || config->bNumInterfaces < 1
+			|| config->interface[0].num_altsetting < 1) {
+		libusbx_testlib_logf(tctx, "Failed to get the configuration: %d", r);
+		if (r == LIBUSB_SUCCESS)
+			libusb_free_config_descriptor(config);
+		goto err_close;
+	}
+	altsetting = &config->interface[0].altsetting[0];
+	for (i = 0; i < altsetting->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep = &altsetting->endpoint[i];
+		if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+				!= LIBUSB_TRANSFER_TYPE_BULK)
+			continue;
+		if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+			bdev->ep_in = ep->bEndpointAddress;
+		else
+			bdev->ep_out = ep->bEndpointAddress;
+	}
+	libusb_free_config_descriptor(config);
+
+	if (!bdev->ep_in || !bdev->ep_out) {
+		libusbx_testlib_logf(tctx, "No bulk endpoint pair on interface 0");
+		goto err_close;
+	}
+
+	if (libusb_kernel_driver_active(bdev->handle, 0) == 1)
+		libusb_detach_kernel_driver(bdev->handle, 0);
+	r = libusb_claim_interface(bdev->handle, 0);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to claim interface 0: %d", r);
+		goto err_close;
+	}
+	return TEST_STATUS_SUCCESS;
+
+err_close:
+	libusb_close(bdev->handle);
+	libusb_exit(bdev->ctx);
+	return TEST_STATUS_SKIP;
+}
+
+static void close_bench_device(struct bench_device *bdev)
+{
+	libusb_release_interface(bdev->handle, 0);
+	libusb_close(bdev->handle);
+	libusb_exit(bdev->ctx);
+}
+
+static libusbx_testlib_result sync_bulk(libusbx_testlib_ctx * tctx,
+	const char *bench, int in)
+{
+	struct bench_device bdev;
+	unsigned char *buffer;
+	long long bytes = 0;
+	double start, elapsed;
+	int transferred;
+	int r, i;
+
+	r = open_bench_device(tctx, &bdev);
+	if (r != TEST_STATUS_SUCCESS)
+		return r;
+
+	buffer = calloc(1, BULK_SIZE);
+	if (!buffer) {
+		close_bench_device(&bdev);
+		return TEST_STATUS_ERROR;
+	}
+
+	start = now_us();
+	for (i = 0; i < BULK_COUNT; i++) {
+		r = libusb_bulk_transfer(bdev.handle, in ? bdev.ep_in : bdev.ep_out,
+			buffer, BULK_SIZE, &transferred, 1000);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Bulk transfer %d failed: %d", i, r);
+			break;
+		}
+		bytes += transferred;
+	}
+	elapsed = now_us() - start;
+
+	free(buffer);
+	close_bench_device(&bdev);
+	if (r != LIBUSB_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	report(tctx, bench, "throughput", (double)bytes / elapsed, "MB/s");
+	report(tctx, bench, "per_transfer", elapsed / BULK_COUNT, "us");
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Synchronous bulk IN throughput. */
+static libusbx_testlib_result test_sync_bulk_in(libusbx_testlib_ctx * tctx)
+{
+	return sync_bulk(tctx, "sync_bulk_in", 1);
+}
+
+/** Synchronous bulk OUT throughput. */
+static libusbx_testlib_result test_sync_bulk_out(libusbx_testlib_ctx * tctx)
+{
+	return sync_bulk(tctx, "sync_bulk_out", 0);
+}
+
+/** Accounts for n transfers that are no longer in flight. The run lock
+ * must be held. */
+static void async_run_end(struct async_run *run, int n)
+{
+	run->in_flight -= n;
+	if (run->in_flight == 0)
+		run->done = 1;
+}
+
+static void LIBUSB_CALL async_cb(struct libusb_transfer *transfer)
+{
+	struct async_run *run = transfer->user_data;
+	int resubmit = 0;
+
+	bench_mutex_lock(&run->lock);
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		run->failed = 1;
+	} else {
+		run->bytes += transfer->actual_length;
+		if (run->remaining > 0 && !run->failed) {
+			run->remaining--;
+			resubmit = 1;
+		}
+	}
+	if (!resubmit)
+		async_run_end(run, 1);
+	bench_mutex_unlock(&run->lock);
+
+	/* the transfer stays counted in flight while it is resubmitted */
+	if (resubmit && libusb_submit_transfer(transfer) != LIBUSB_SUCCESS) {
+		bench_mutex_lock(&run->lock);
+		run->failed = 1;
+		async_run_end(run, 1);
+		bench_mutex_unlock(&run->lock);
+	}
+}
+
+/** Keeps depth transfers of size bytes in flight on the bulk IN endpoint
+ * until count have completed, and reports the results. */
+static libusbx_testlib_result async_bulk(libusbx_testlib_ctx * tctx,
+	const char *bench, int size, int depth, int count)
+{
+	struct bench_device bdev;
+	struct libusb_transfer **transfers;
+	struct async_run run;
+	double start, elapsed;
+	int status = TEST_STATUS_SUCCESS;
+	int r, i;
+
+	r = open_bench_device(tctx, &bdev);
+	if (r != TEST_STATUS_SUCCESS)
+		return r;
+
+	transfers = calloc(depth, sizeof(*transfers));
+	if (!transfers) {
+		close_bench_device(&bdev);
+		return TEST_STATUS_ERROR;
+	}
+	memset(&run, 0, sizeof(run));
+	bench_mutex_init(&run.lock);
+	for (i = 0; i < depth; i++) {
+		unsigned char *buffer = malloc(size);
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!buffer || !transfers[i]) {
+			free(buffer);
+			status = TEST_STATUS_ERROR;
+			goto out;
+		}
+		libusb_fill_bulk_transfer(transfers[i], bdev.handle, bdev.ep_in,
+			buffer, size, async_cb, &run, 1000);
+		transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	}
+
+	/* the transfers may complete before libusb_submit_transfers() even
+	 * returns, so they are counted in flight up front */
+	run.remaining = count - depth;
+	run.in_flight = depth;
+	start = now_us();
+	r = libusb_submit_transfers(transfers, depth);
+	if (r != depth) {
+		libusbx_testlib_logf(tctx, "Failed to submit transfers: %d", r);
+		if (r < 0)
+			r = 0;
+		bench_mutex_lock(&run.lock);
+		run.failed = 1;
+		async_run_end(&run, depth - r);
+		bench_mutex_unlock(&run.lock);
+		for (i = 0; i < r; i++)
+			libusb_cancel_transfer(transfers[i]);
+	}
+	while (!run.done) {
+		r = libusb_handle_events_completed(bdev.ctx, &run.done);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Event handling failed: %d", r);
+			status = TEST_STATUS_FAILURE;
+			break;
+		}
+	}
+	elapsed = now_us() - start;
+
+	bench_mutex_lock(&run.lock);
+	if (run.failed)
+		status = TEST_STATUS_FAILURE;
+	bench_mutex_unlock(&run.lock);
+	if (status == TEST_STATUS_SUCCESS) {
+		report(tctx, bench, "throughput", (double)run.bytes / elapsed, "MB/s");
+		report(tctx, bench, "per_transfer", elapsed / count, "us");
+		report(tctx, bench, "transfers_per_second",
+			count * 1000000.0 / elapsed, "1/s");
+	}
+
+out:
+	for (i = 0; i < depth; i++)
+		libusb_free_transfer(transfers[i]);
+	free(transfers);
+	bench_mutex_destroy(&run.lock);
+	close_bench_device(&bdev);
+	return status;
+}
+
+/** Asynchronous bulk IN throughput, with a few large transfers in flight. */
+static libusbx_testlib_result test_async_bulk_in(libusbx_testlib_ctx * tctx)
+{
+	return async_bulk(tctx, "async_bulk_in", BULK_SIZE, ASYNC_DEPTH,
+		BULK_COUNT);
+}
+
+/** Per transfer cost of submission and completion, with many small
+ * transfers in flight. */
+static libusbx_testlib_result test_async_many_in_flight(
+	libusbx_testlib_ctx * tctx)
+{
+	return async_bulk(tctx, "async_many_in_flight", SMALL_SIZE, SMALL_DEPTH,
+		SMALL_COUNT);
+}
+
+/** Round-trip latency of a control transfer: a standard GET_STATUS request,
+ * that any device answers. */
+static libusbx_testlib_result test_control_latency(libusbx_testlib_ctx * tctx)
+{
+	struct bench_device bdev;
+	unsigned char status[2];
+	double start, elapsed, t, min = 0, max = 0;
+	int r, i;
+
+	r = open_bench_device(tctx, &bdev);
+	if (r != TEST_STATUS_SUCCESS)
+		return r;
+
+	start = now_us();
+	for (i = 0; i < CONTROL_COUNT; i++) {
+		t = now_us();
+		r = libusb_control_transfer(bdev.handle, LIBUSB_ENDPOINT_IN
+			| LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE,
+			LIBUSB_REQUEST_GET_STATUS, 0, 0, status, sizeof(status), 1000);
+		if (r < 0) {
+			libusbx_testlib_logf(tctx, "Control transfer %d failed: %d",
+				i, r);
+			break;
+		}
+		t = now_us() - t;
+		if (i == 0 || t < min)
+			min = t;
+		if (t > max)
+			max = t;
+	}
+	elapsed = now_us() - start;
+
+	close_bench_device(&bdev);
+	if (r < 0)
+		return TEST_STATUS_FAILURE;
+
+	report(tctx, "control_latency", "mean", elapsed / CONTROL_COUNT, "us");
+	report(tctx, "control_latency", "min", min, "us");
+	report(tctx, "control_latency", "max", max, "us");
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Time taken to enumerate devices, for the first list of a context and
+ * for the following ones. */
+static libusbx_testlib_result test_enumeration(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx = NULL;
+	libusb_device **list;
+	double start, first = 0, elapsed;
+	ssize_t count = 0;
+	int r, i;
+
+	start = now_us();
+	for (i = 0; i < ENUM_COUNT; i++) {
+		double t = now_us();
+		r = libusb_init(&ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+			return TEST_STATUS_FAILURE;
+		}
+		count = libusb_get_device_list(ctx, &list);
+		if (count < 0) {
+			libusbx_testlib_logf(tctx, "Failed to get device list: %d",
+				(int)count);
+			libusb_exit(ctx);
+			return TEST_STATUS_FAILURE;
+		}
+		first += now_us() - t;
+		libusb_free_device_list(list, 1);
+		libusb_exit(ctx);
+	}
+	elapsed = now_us() - start;
+	report(tctx, "enumeration", "init_and_list", first / ENUM_COUNT, "us");
+	report(tctx, "enumeration", "init_list_exit", elapsed / ENUM_COUNT, "us");
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	start = now_us();
+	for (i = 0; i < ENUM_COUNT; i++) {
+		count = libusb_get_device_list(ctx, &list);
+		if (count < 0)
+			break;
+		libusb_free_device_list(list, 1);
+	}
+	elapsed = now_us() - start;
+	libusb_exit(ctx);
+	if (count < 0) {
+		libusbx_testlib_logf(tctx, "Failed to get device list: %d",
+			(int)count);
+		return TEST_STATUS_FAILURE;
+	}
+
+	report(tctx, "enumeration", "list", elapsed / ENUM_COUNT, "us");
+	report(tctx, "enumeration", "devices", (double)count, "count");
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Cost of a pass through the event loop that finds nothing to do: polling
+ * all the file descriptors of a context and checking for timeouts. */
+static libusbx_testlib_result test_event_loop(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx = NULL;
+	struct timeval tv = { 0, 0 };
+	double start, elapsed;
+	int r, i;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	start = now_us();
+	for (i = 0; i < EVENT_COUNT; i++) {
+		r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		if (r != LIBUSB_SUCCESS)
+			break;
+	}
+	elapsed = now_us() - start;
+	libusb_exit(ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Event handling failed: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	report(tctx, "event_loop", "idle_iteration", elapsed / EVENT_COUNT, "us");
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Fill in the list of tests. */
+static const libusbx_testlib_test tests[] = {
+	{"enumeration", &test_enumeration},
+	{"event_loop", &test_event_loop},
+	{"control_latency", &test_control_latency},
+	{"sync_bulk_in", &test_sync_bulk_in},
+	{"sync_bulk_out", &test_sync_bulk_out},
+	{"async_bulk_in", &test_async_bulk_in},
+	{"async_many_in_flight", &test_async_many_in_flight},
+	LIBUSBX_NULL_TEST
+};
+
+int main (int argc, char ** argv)
+{
+	return libusbx_testlib_run_tests(argc, argv, tests);
+}
@@ -0,0 +1,1136 @@
+/*
+ * libusbx behavioural tests, run against the simulated devices of the mock
+ * backend
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * These tests are only built when libusbx is configured with
+ * --enable-mock-backend, and are run by "make check". They select the mock
+ * backend themselves, and give each test the simulated devices it needs
+ * through the LIBUSB_MOCK_* environment variables documented in
+ * libusb/os/mock_usb.c, which the backend reads again for every test as
+ * each test exits all of its contexts.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "libusb.h"
+
+#include "libusbx_testlib.h"
+
+#define EP_IN			0x81
+#define EP_OUT			0x01
+#define EP_INT_IN		0x82
+#define CHUNK_SIZE		512
+#define WAIT_MS			2000
+
+/** Milliseconds on the wall clock */
+static double now_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec * 1000.0 + (double)tv.tv_usec / 1000.0;
+}
+
+static void set_env(const char *name, const char *value)
+{
+	if (value)
+		setenv(name, value, 1);
+	else
+		unsetenv(name);
+}
+
+/** Sets up the simulated devices and creates a context using them. A NULL
+ * setting leaves the default of the backend. */
+static libusbx_testlib_result mock_init(libusbx_testlib_ctx * tctx,
+	const char *devices, const char *latency_us, const char *hotplug,
+	libusb_context **ctx)
+{
+	int r;
+
+	set_env("LIBUSB_MOCK_DEVICES", devices);
+	set_env("LIBUSB_MOCK_LATENCY", latency_us);
+	set_env("LIBUSB_MOCK_BANDWIDTH", NULL);
+	set_env("LIBUSB_MOCK_HOTPLUG", hotplug);
+
+	*ctx = NULL;
+	r = libusb_init(ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_ERROR;
+	}
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Opens the first simulated device and claims its interface. */
+static libusb_device_handle *open_first_device(libusbx_testlib_ctx * tctx,
+	libusb_context *ctx)
+{
+	libusb_device **list;
+	libusb_device_handle *handle = NULL;
+	ssize_t count;
+	int r;
+
+	count = libusb_get_device_list(ctx, &list);
+	if (count < 1) {
+		libusbx_testlib_logf(tctx, "No simulated device: %d", (int)count);
+		if (count == 0)
+			libusb_free_device_list(list, 1);
+		return NULL;
+	}
+	r = libusb_open(list[0], &handle);
+	libusb_free_device_list(list, 1);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open the device: %d", r);
+		return NULL;
+	}
+	r = libusb_claim_interface(handle, 0);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to claim interface 0: %d", r);
+		libusb_close(handle);
+		return NULL;
+	}
+	return handle;
+}
+
+static void close_device(libusb_device_handle *handle)
+{
+	libusb_release_interface(handle, 0);
+	libusb_close(handle);
+}
+
+/** Handles events until *done is set, for at most timeout_ms. */
+static int wait_for(libusb_context *ctx, int *done, int timeout_ms)
+{
+	double end = now_ms() + timeout_ms;
+	int r;
+
+	while (!*done) {
+		struct timeval tv = { 0, 10000 };
+
+		if (now_ms() > end)
+			return LIBUSB_ERROR_TIMEOUT;
+		r = libusb_handle_events_timeout_completed(ctx, &tv, done);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+/* the transfers of a test. all_done is set once as many of them called
+ * back as were submitted since transfer_set_reset() */
+struct transfer_set {
+	struct libusb_transfer *transfers[8];
+	int count;
+	int submitted;
+	int completed;
+	int all_done;
+};
+
+static void LIBUSB_CALL transfer_set_cb(struct libusb_transfer *transfer)
+{
+	struct transfer_set *set = transfer->user_data;
+
+	if (++set->completed == set->submitted)
+		set->all_done = 1;
+}
+
+static void transfer_set_reset(struct transfer_set *set)
+{
+	set->submitted = 0;
+	set->completed = 0;
+	set->all_done = 0;
+}
+
+/** Submits count transfers of the set from first, one at a time. */
+static int transfer_set_submit(struct transfer_set *set, int first,
+	int count)
+{
+	int i, r;
+
+	for (i = first; i < first + count; i++) {
+		r = libusb_submit_transfer(set->transfers[i]);
+		if (r < 0)
+			return r;
+		set->submitted++;
+	}
+	return 0;
+}
+
+/** Allocates count bulk transfers on endpoint, none of which is
+ * submitted. */
+static int transfer_set_alloc(struct transfer_set *set,
+	libusb_device_handle *handle, unsigned char endpoint, int count,
+	unsigned int timeout)
+{
+	int i;
+
+	memset(set, 0, sizeof(*set));
+	for (i = 0; i < count; i++) {
+		unsigned char *buffer = calloc(1, CHUNK_SIZE);
+
+		set->transfers[i] = libusb_alloc_transfer(0);
+		if (!buffer || !set->transfers[i]) {
+			free(buffer);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		set->count++;
+		libusb_fill_bulk_transfer(set->transfers[i], handle, endpoint,
+			buffer, CHUNK_SIZE, transfer_set_cb, set, timeout);
+		set->transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	}
+	return 0;
+}
+
+static void transfer_set_free(struct transfer_set *set)
+{
+	int i;
+
+	for (i = 0; i < set->count; i++)
+		libusb_free_transfer(set->transfers[i]);
+}
+
+/** Tests that a transfer times out when the device does not answer in
+ * time, and that one with a longer timeout still completes. */
+static libusbx_testlib_result test_transfer_timeout(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct transfer_set set;
+	unsigned char buffer[CHUNK_SIZE];
+	double start, elapsed;
+	int status = TEST_STATUS_FAILURE;
+	int transferred;
+	int r;
+
+	/* every transfer takes 300ms to complete */
+	if (mock_init(tctx, NULL, "300000", NULL, &ctx) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_ERROR;
+	handle = open_first_device(tctx, ctx);
+	if (!handle) {
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	if (transfer_set_alloc(&set, handle, EP_IN, 1, 50) < 0) {
+		status = TEST_STATUS_ERROR;
+		goto out;
+	}
+	start = now_ms();
+	r = transfer_set_submit(&set, 0, 1);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to submit: %d", r);
+		goto out_free;
+	}
+	r = wait_for(ctx, &set.all_done, WAIT_MS);
+	elapsed = now_ms() - start;
+	if (r < 0) {
+		/* the transfer cannot be freed while in flight */
+		libusbx_testlib_logf(tctx, "Transfer did not come back: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	if (set.transfers[0]->status != LIBUSB_TRANSFER_TIMED_OUT
+			|| elapsed > 250) {
+		libusbx_testlib_logf(tctx, "Transfer ended with status %d after %.0fms",
+			set.transfers[0]->status, elapsed);
+		goto out_free;
+	}
+
+	/* a timeout longer than the device takes does not expire */
+	transfer_set_reset(&set);
+	set.transfers[0]->timeout = 1000;
+	r = transfer_set_submit(&set, 0, 1);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to resubmit: %d", r);
+		goto out_free;
+	}
+	r = wait_for(ctx, &set.all_done, WAIT_MS);
+	if (r < 0) {
+		libusbx_testlib_logf(tctx, "Transfer did not come back: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	if (set.transfers[0]->status != LIBUSB_TRANSFER_COMPLETED
+			|| set.transfers[0]->actual_length != CHUNK_SIZE) {
+		libusbx_testlib_logf(tctx, "Transfer ended with status %d, %d bytes",
+			set.transfers[0]->status, set.transfers[0]->actual_length);
+		goto out_free;
+	}
+
+	/* the synchronous functions time out in the same way */
+	r = libusb_bulk_transfer(handle, EP_IN, buffer, sizeof(buffer),
+		&transferred, 50);
+	if (r != LIBUSB_ERROR_TIMEOUT) {
+		libusbx_testlib_logf(tctx, "Synchronous transfer returned %d", r);
+		goto out_free;
+	}
+	status = TEST_STATUS_SUCCESS;
+
+out_free:
+	transfer_set_free(&set);
+out:
+	close_device(handle);
+	libusb_exit(ctx);
+	return status;
+}
+
+/** Tests that transfers can be cancelled one by one and by endpoint, and
+ * that cancelling the transfers of an endpoint leaves the others alone. */
+static libusbx_testlib_result test_cancel(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct transfer_set in, out;
+	int status = TEST_STATUS_FAILURE;
+	int r, i;
+
+	if (mock_init(tctx, NULL, "200000", NULL, &ctx) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_ERROR;
+	handle = open_first_device(tctx, ctx);
+	if (!handle) {
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	if (transfer_set_alloc(&in, handle, EP_IN, 4, 0) < 0
+			|| transfer_set_alloc(&out, handle, EP_OUT, 2, 0) < 0) {
+		status = TEST_STATUS_ERROR;
+		goto out_free;
+	}
+	if (transfer_set_submit(&in, 0, in.count) < 0
+			|| transfer_set_submit(&out, 0, out.count) < 0) {
+		libusbx_testlib_logf(tctx, "Failed to submit the transfers");
+		status = TEST_STATUS_ERROR;
+		goto out_wait;
+	}
+
+	r = libusb_cancel_transfer(in.transfers[0]);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to cancel a transfer: %d", r);
+		goto out_wait;
+	}
+	r = libusb_cancel_endpoint_transfers(handle, EP_IN);
+	if (r != in.count - 1) {
+		libusbx_testlib_logf(tctx, "Cancelled %d transfers of the endpoint, "
+			"expected %d", r, in.count - 1);
+		goto out_wait;
+	}
+	status = TEST_STATUS_SUCCESS;
+
+out_wait:
+	if (status != TEST_STATUS_SUCCESS) {
+		libusb_cancel_endpoint_transfers(handle, EP_IN);
+		libusb_cancel_endpoint_transfers(handle, EP_OUT);
+	}
+	if ((in.submitted && wait_for(ctx, &in.all_done, WAIT_MS) < 0)
+			|| (out.submitted && wait_for(ctx, &out.all_done, WAIT_MS) < 0)) {
+		/* the transfers cannot be freed while in flight */
+		libusbx_testlib_logf(tctx, "Transfers did not come back");
+		return TEST_STATUS_FAILURE;
+	}
+	if (status != TEST_STATUS_SUCCESS)
+		goto out_free;
+	for (i = 0; i < in.count; i++)
+		if (in.transfers[i]->status != LIBUSB_TRANSFER_CANCELLED) {
+			libusbx_testlib_logf(tctx, "IN transfer %d ended with status %d",
+				i, in.transfers[i]->status);
+			status = TEST_STATUS_FAILURE;
+		}
+	for (i = 0; i < out.count; i++)
+		if (out.transfers[i]->status != LIBUSB_TRANSFER_COMPLETED) {
+			libusbx_testlib_logf(tctx, "OUT transfer %d ended with status %d",
+				i, out.transfers[i]->status);
+			status = TEST_STATUS_FAILURE;
+		}
+
+	/* nothing is left to cancel */
+	r = libusb_cancel_endpoint_transfers(handle, EP_OUT);
+	if (r != 0) {
+		libusbx_testlib_logf(tctx, "Cancelled %d idle transfers", r);
+		status = TEST_STATUS_FAILURE;
+	}
+
+out_free:
+	transfer_set_free(&in);
+	transfer_set_free(&out);
+	close_device(handle);
+	libusb_exit(ctx);
+	return status;
+}
+
+/** Tests that a batch of transfers is submitted and completed like as many
+ * single transfers, and that submission stops at the first failure. */
+static libusbx_testlib_result test_submit_transfers(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct transfer_set set;
+	int status = TEST_STATUS_FAILURE;
+	int r, i;
+
+	if (mock_init(tctx, NULL, NULL, NULL, &ctx) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_ERROR;
+	handle = open_first_device(tctx, ctx);
+	if (!handle) {
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	if (transfer_set_alloc(&set, handle, EP_IN, 8, 1000) < 0) {
+		status = TEST_STATUS_ERROR;
+		goto out;
+	}
+	r = libusb_submit_transfers(set.transfers, set.count);
+	set.submitted = r > 0 ? r : 0;
+	if (r != set.count) {
+		libusbx_testlib_logf(tctx, "Submitted %d of %d transfers", r,
+			set.count);
+		if (r > 0)
+			wait_for(ctx, &set.all_done, WAIT_MS);
+		goto out;
+	}
+	if (wait_for(ctx, &set.all_done, WAIT_MS) < 0) {
+		libusbx_testlib_logf(tctx, "Transfers did not come back");
+		return TEST_STATUS_FAILURE;
+	}
+	for (i = 0; i < set.count; i++)
+		if (set.transfers[i]->status != LIBUSB_TRANSFER_COMPLETED
+				|| set.transfers[i]->actual_length != CHUNK_SIZE) {
+			libusbx_testlib_logf(tctx, "Transfer %d: status %d, %d bytes", i,
+				set.transfers[i]->status, set.transfers[i]->actual_length);
+			goto out;
+		}
+
+	/* the simulated device has no endpoint 3 */
+	transfer_set_reset(&set);
+	set.transfers[2]->endpoint = 0x83;
+	r = libusb_submit_transfers(set.transfers, 4);
+	set.submitted = r > 0 ? r : 0;
+	if (r != 2) {
+		libusbx_testlib_logf(tctx, "Partial batch returned %d", r);
+		if (r > 0)
+			wait_for(ctx, &set.all_done, WAIT_MS);
+		goto out;
+	}
+	if (wait_for(ctx, &set.all_done, WAIT_MS) < 0) {
+		libusbx_testlib_logf(tctx, "Transfers did not come back");
+		return TEST_STATUS_FAILURE;
+	}
+	r = libusb_submit_transfers(set.transfers + 2, 2);
+	if (r != LIBUSB_ERROR_NOT_FOUND) {
+		libusbx_testlib_logf(tctx, "Failed batch returned %d", r);
+		goto out;
+	}
+	status = TEST_STATUS_SUCCESS;
+
+out:
+	transfer_set_free(&set);
+	close_device(handle);
+	libusb_exit(ctx);
+	return status;
+}
+
+/* a thread cancelling the transfers of an endpoint over and over */
+struct cancel_walker {
+	libusb_device_handle *handle;
+	pthread_mutex_t lock;
+	int stop;
+	int errors;
+};
+
+static void *cancel_walker_main(void *arg)
+{
+	struct cancel_walker *walker = arg;
+	int stop;
+
+	do {
+		int r = libusb_cancel_endpoint_transfers(walker->handle, EP_IN);
+
+		pthread_mutex_lock(&walker->lock);
+		if (r < 0)
+			walker->errors++;
+		stop = walker->stop;
+		pthread_mutex_unlock(&walker->lock);
+	} while (!stop);
+	return NULL;
+}
+
+static void cancel_walker_stop(struct cancel_walker *walker, pthread_t thread)
+{
+	pthread_mutex_lock(&walker->lock);
+	walker->stop = 1;
+	pthread_mutex_unlock(&walker->lock);
+	pthread_join(thread, NULL);
+	pthread_mutex_destroy(&walker->lock);
+}
+
+/** Tests that the transfers of a partial batch that were not submitted can
+ * be freed straight away while another thread cancels the transfers of
+ * their endpoint. */
+static libusbx_testlib_result test_cancel_race(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct transfer_set set;
+	struct cancel_walker walker;
+	pthread_t thread;
+	int status = TEST_STATUS_SUCCESS;
+	int iter, r, i;
+
+	if (mock_init(tctx, NULL, "100", NULL, &ctx) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_ERROR;
+	handle = open_first_device(tctx, ctx);
+	if (!handle) {
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	memset(&walker, 0, sizeof(walker));
+	walker.handle = handle;
+	pthread_mutex_init(&walker.lock, NULL);
+	if (pthread_create(&thread, NULL, cancel_walker_main, &walker) != 0) {
+		libusbx_testlib_logf(tctx, "Failed to start the cancelling thread");
+		pthread_mutex_destroy(&walker.lock);
+		close_device(handle);
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	for (iter = 0; iter < 500 && status == TEST_STATUS_SUCCESS; iter++) {
+		if (transfer_set_alloc(&set, handle, EP_IN, 4, 1000) < 0) {
+			transfer_set_free(&set);
+			status = TEST_STATUS_ERROR;
+			break;
+		}
+
+		/* the simulated device has no endpoint 3 */
+		set.transfers[2]->endpoint = 0x83;
+		r = libusb_submit_transfers(set.transfers, 4);
+		set.submitted = r > 0 ? r : 0;
+		for (i = set.submitted; i < set.count; i++) {
+			libusb_free_transfer(set.transfers[i]);
+			set.transfers[i] = NULL;
+		}
+		if (r != 2) {
+			libusbx_testlib_logf(tctx, "Partial batch returned %d", r);
+			status = TEST_STATUS_FAILURE;
+		}
+
+		if (set.submitted && wait_for(ctx, &set.all_done, WAIT_MS) < 0) {
+			/* the transfers cannot be freed while in flight */
+			libusbx_testlib_logf(tctx, "Transfers did not come back");
+			cancel_walker_stop(&walker, thread);
+			return TEST_STATUS_FAILURE;
+		}
+		for (i = 0; i < set.submitted; i++)
+			if (set.transfers[i]->status != LIBUSB_TRANSFER_COMPLETED
+					&& set.transfers[i]->status != LIBUSB_TRANSFER_CANCELLED) {
+				libusbx_testlib_logf(tctx, "Transfer %d ended with status %d",
+					i, set.transfers[i]->status);
+				status = TEST_STATUS_FAILURE;
+			}
+		transfer_set_free(&set);
+	}
+
+	cancel_walker_stop(&walker, thread);
+	if (walker.errors) {
+		libusbx_testlib_logf(tctx, "%d endpoint cancellations failed",
+			walker.errors);
+		status = TEST_STATUS_FAILURE;
+	}
+
+	close_device(handle);
+	libusb_exit(ctx);
+	return status;
+}
+
+/** Tests that a pooled transfer freed twice is only handed out once. */
+static libusbx_testlib_result test_transfer_pool(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx;
+	struct libusb_transfer_pool *pool;
+	struct libusb_transfer *first, *second, *third;
+	int status = TEST_STATUS_SUCCESS;
+
+	if (mock_init(tctx, NULL, NULL, NULL, &ctx) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_ERROR;
+	pool = libusb_alloc_transfer_pool(ctx, 2, 0, CHUNK_SIZE);
+	if (!pool) {
+		libusbx_testlib_logf(tctx, "Failed to allocate a transfer pool");
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	first = libusb_alloc_pool_transfer(pool);
+	libusb_free_transfer(first);
+	libusb_free_transfer(first);
+
+	first = libusb_alloc_pool_transfer(pool);
+	second = libusb_alloc_pool_transfer(pool);
+	third = libusb_alloc_pool_transfer(pool);
+	if (!first || !second || first == second || third) {
+		libusbx_testlib_logf(tctx, "Pool handed out %p, %p and %p",
+			(void *)first, (void *)second, (void *)third);
+		status = TEST_STATUS_FAILURE;
+	}
+
+	libusb_free_transfer(first);
+	if (second != first)
+		libusb_free_transfer(second);
+	libusb_free_transfer_pool(pool);
+	libusb_exit(ctx);
+	return status;
+}
+
+/** Tests that libusb_open_devices() opens all the devices and reads their
+ * strings. */
+static libusbx_testlib_result test_open_devices(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx;
+	libusb_device **list;
+	struct libusb_open_result results[3];
+	int status = TEST_STATUS_SUCCESS;
+	ssize_t count;
+	int r, i;
+
+	if (mock_init(tctx, "1234:0001,1234:0002,1234:0003", "1000", NULL, &ctx)
+			!= TEST_STATUS_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	count = libusb_get_device_list(ctx, &list);
+	if (count != 3) {
+		libusbx_testlib_logf(tctx, "Listed %d devices, expected 3",
+			(int)count);
+		if (count >= 0)
+			libusb_free_device_list(list, 1);
+		libusb_exit(ctx);
+		return TEST_STATUS_FAILURE;
+	}
+	memset(results, 0, sizeof(results));
+	for (i = 0; i < 3; i++)
+		results[i].dev = list[i];
+
+	r = libusb_open_devices(results, 3, 1000);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open the devices: %d", r);
+		status = TEST_STATUS_FAILURE;
+	}
+	for (i = 0; i < 3; i++) {
+		struct libusb_device_descriptor desc;
+		char serial[8];
+
+		libusb_get_device_descriptor(results[i].dev, &desc);
+		snprintf(serial, sizeof(serial), "%04d", desc.idProduct - 1);
+		if (r == LIBUSB_SUCCESS && (results[i].status != LIBUSB_SUCCESS
+				|| !results[i].handle
+				|| strcmp((char *)results[i].manufacturer, "libusbx")
+				|| strcmp((char *)results[i].product, "Mock device")
+				|| strcmp((char *)results[i].serial_number, serial))) {
+			libusbx_testlib_logf(tctx, "Device %d: status %d, strings "
+				"\"%s\" \"%s\" \"%s\"", i, results[i].status,
+				results[i].manufacturer, results[i].product,
+				results[i].serial_number);
+			status = TEST_STATUS_FAILURE;
+		}
+		if (results[i].handle)
+			libusb_close(results[i].handle);
+	}
+
+	libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+	return status;
+}
+
+/* what a stream test saw */
+struct stream_run {
+	int chunks;
+	int bad;
+	int limit;
+	int stopped;
+};
+
+static int LIBUSB_CALL bulk_stream_cb(struct libusb_stream *stream,
+	unsigned char *buffer, int length, enum libusb_transfer_status status,
+	void *user_data)
+{
+	struct stream_run *run = user_data;
+
+	(void)stream;
+	(void)buffer;
+	if (run->stopped) {
+		/* the transfers being cancelled */
+		if (status != LIBUSB_TRANSFER_CANCELLED
+				&& status != LIBUSB_TRANSFER_COMPLETED)
+			run->bad++;
+		return CHUNK_SIZE;
+	}
+	if (status != LIBUSB_TRANSFER_COMPLETED || length != CHUNK_SIZE)
+		run->bad++;
+	if (++run->chunks == run->limit) {
+		run->stopped = 1;
+		return -1;
+	}
+	return CHUNK_SIZE;
+}
+
+static int LIBUSB_CALL interrupt_stream_cb(struct libusb_stream *stream,
+	const struct libusb_interrupt_report *reports, int num_reports,
+	void *user_data)
+{
+	struct stream_run *run = user_data;
+	int i;
+
+	(void)stream;
+	if (run->stopped)
+		return 0;
+	if (num_reports != 8)
+		run->bad++;
+	for (i = 0; i < num_reports; i++)
+		if (reports[i].status != LIBUSB_TRANSFER_COMPLETED
+				|| reports[i].length != 64)
+			run->bad++;
+	run->chunks += num_reports;
+	if (run->chunks >= run->limit) {
+		run->stopped = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/** Runs a stream until its callback stops it, then closes it. */
+static libusbx_testlib_result run_stream(libusbx_testlib_ctx * tctx,
+	libusb_context *ctx, const char *name, struct libusb_stream *stream,
+	struct stream_run *run)
+{
+	int r;
+
+	r = wait_for(ctx, &run->stopped, WAIT_MS);
+	if (r < 0)
+		libusbx_testlib_logf(tctx, "%s stream did not stop: %d", name, r);
+	libusb_stream_stop(stream);
+	if (libusb_stream_close(stream) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to close %s stream", name);
+		return TEST_STATUS_FAILURE;
+	}
+	if (r < 0 || run->bad) {
+		libusbx_testlib_logf(tctx, "%s stream: %d chunks, %d bad", name,
+			run->chunks, run->bad);
+		return TEST_STATUS_FAILURE;
+	}
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Tests bulk IN and OUT streams and interrupt streams. */
+static libusbx_testlib_result test_streams(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct libusb_stream *stream;
+	struct stream_run run;
+	int status = TEST_STATUS_SUCCESS;
+	int r;
+
+	if (mock_init(tctx, NULL, NULL, NULL, &ctx) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_ERROR;
+	handle = open_first_device(tctx, ctx);
+	if (!handle) {
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	memset(&run, 0, sizeof(run));
+	run.limit = 100;
+	r = libusb_stream_open(handle, EP_IN, 4, CHUNK_SIZE, bulk_stream_cb,
+		&run, &stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open IN stream: %d", r);
+		status = TEST_STATUS_FAILURE;
+	} else if (run_stream(tctx, ctx, "IN", stream, &run)
+			!= TEST_STATUS_SUCCESS) {
+		status = TEST_STATUS_FAILURE;
+	}
+
+	/* OUT streams call back once per buffer to fill them up front */
+	memset(&run, 0, sizeof(run));
+	run.limit = 100;
+	r = libusb_stream_open(handle, EP_OUT, 4, CHUNK_SIZE, bulk_stream_cb,
+		&run, &stream);
+	run.chunks = 0;
+	run.bad = 0;
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open OUT stream: %d", r);
+		status = TEST_STATUS_FAILURE;
+	} else if (run_stream(tctx, ctx, "OUT", stream, &run)
+			!= TEST_STATUS_SUCCESS) {
+		status = TEST_STATUS_FAILURE;
+	}
+
+	memset(&run, 0, sizeof(run));
+	run.limit = 80;
+	r = libusb_stream_open_interrupt(handle, EP_INT_IN, 4, 64, 8, 0,
+		interrupt_stream_cb, &run, &stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open interrupt stream: %d", r);
+		status = TEST_STATUS_FAILURE;
+	} else if (run_stream(tctx, ctx, "Interrupt", stream, &run)
+			!= TEST_STATUS_SUCCESS) {
+		status = TEST_STATUS_FAILURE;
+	}
+
+	close_device(handle);
+	libusb_exit(ctx);
+	return status;
+}
+
+/* an OUT stream that runs out of data after to_fill chunks */
+struct out_stream_run {
+	int to_fill;
+	int filled;
+	int sent;
+	int bad;
+	int all_sent;
+};
+
+static int LIBUSB_CALL out_stream_cb(struct libusb_stream *stream,
+	unsigned char *buffer, int length, enum libusb_transfer_status status,
+	void *user_data)
+{
+	struct out_stream_run *run = user_data;
+
+	(void)stream;
+	(void)buffer;
+	if (length) {
+		if (status != LIBUSB_TRANSFER_COMPLETED || length != CHUNK_SIZE)
+			run->bad++;
+		if (++run->sent == run->to_fill)
+			run->all_sent = 1;
+	}
+	if (run->filled == run->to_fill)
+		return 0;
+	run->filled++;
+	return CHUNK_SIZE;
+}
+
+/** Runs an OUT stream of to_fill chunks until it ends by itself. */
+static libusbx_testlib_result run_out_stream(libusbx_testlib_ctx * tctx,
+	libusb_context *ctx, libusb_device_handle *handle, int to_fill)
+{
+	struct libusb_stream *stream;
+	struct out_stream_run run;
+	int r;
+
+	memset(&run, 0, sizeof(run));
+	run.to_fill = to_fill;
+	run.all_sent = (to_fill == 0);
+	r = libusb_stream_open(handle, EP_OUT, 4, CHUNK_SIZE, out_stream_cb,
+		&run, &stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open OUT stream: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	r = wait_for(ctx, &run.all_sent, WAIT_MS);
+	if (r < 0) {
+		libusbx_testlib_logf(tctx, "OUT stream of %d chunks sent %d: %d",
+			to_fill, run.sent, r);
+		libusb_stream_stop(stream);
+	}
+	if (libusb_stream_close(stream) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to close OUT stream");
+		return TEST_STATUS_FAILURE;
+	}
+	if (r < 0 || run.bad || run.sent != to_fill) {
+		libusbx_testlib_logf(tctx, "OUT stream of %d chunks: %d sent, %d bad",
+			to_fill, run.sent, run.bad);
+		return TEST_STATUS_FAILURE;
+	}
+	return TEST_STATUS_SUCCESS;
+}
+
+static int LIBUSB_CALL iso_stream_cb(struct libusb_stream *stream,
+	const struct libusb_iso_packet *packets, int num_packets,
+	void *user_data)
+{
+	(void)stream;
+	(void)packets;
+	(void)num_packets;
+	(void)user_data;
+	return 0;
+}
+
+/** Tests the endpoint checks of the stream openers and OUT streams that run
+ * out of data. */
+static libusbx_testlib_result test_stream_end(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct libusb_stream *stream;
+	struct stream_run run;
+	unsigned char ring[8 * CHUNK_SIZE];
+	int status = TEST_STATUS_SUCCESS;
+	int r;
+
+	if (mock_init(tctx, NULL, NULL, NULL, &ctx) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_ERROR;
+	handle = open_first_device(tctx, ctx);
+	if (!handle) {
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	r = libusb_stream_open_iso(handle, EP_IN, 2, 1, CHUNK_SIZE, ring,
+		sizeof(ring), iso_stream_cb, NULL, &stream);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx,
+			"Opened an iso stream on a bulk endpoint: %d", r);
+		status = TEST_STATUS_FAILURE;
+	}
+	if (r == LIBUSB_SUCCESS)
+		libusb_stream_close(stream);
+
+	memset(&run, 0, sizeof(run));
+	r = libusb_stream_open_interrupt(handle, EP_IN, 4, 64, 8, 0,
+		interrupt_stream_cb, &run, &stream);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx,
+			"Opened an interrupt stream on a bulk endpoint: %d", r);
+		status = TEST_STATUS_FAILURE;
+	}
+	if (r == LIBUSB_SUCCESS)
+		libusb_stream_close(stream);
+
+	r = libusb_stream_open(handle, 0x83, 4, CHUNK_SIZE, bulk_stream_cb,
+		&run, &stream);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx, "Opened a stream on a missing endpoint: %d",
+			r);
+		status = TEST_STATUS_FAILURE;
+	}
+
+	libusb_release_interface(handle, 0);
+	r = libusb_stream_open(handle, EP_IN, 4, CHUNK_SIZE, bulk_stream_cb,
+		&run, &stream);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx,
+			"Opened a stream on an unclaimed interface: %d", r);
+		status = TEST_STATUS_FAILURE;
+	}
+	if (r == LIBUSB_SUCCESS)
+		libusb_stream_close(stream);
+	if (libusb_claim_interface(handle, 0) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to claim interface 0 again");
+		libusb_close(handle);
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	/* more chunks than buffers, fewer chunks than transfers, no chunk */
+	if (run_out_stream(tctx, ctx, handle, 10) != TEST_STATUS_SUCCESS
+			|| run_out_stream(tctx, ctx, handle, 2) != TEST_STATUS_SUCCESS
+			|| run_out_stream(tctx, ctx, handle, 0) != TEST_STATUS_SUCCESS)
+		status = TEST_STATUS_FAILURE;
+
+	close_device(handle);
+	libusb_exit(ctx);
+	return status;
+}
+
+/** Lists the devices matching filter and checks their number. */
+static int check_filtered(libusbx_testlib_ctx * tctx, libusb_context *ctx,
+	const struct libusb_device_filter *filter, const char *what,
+	ssize_t expected)
+{
+	libusb_device **list;
+	ssize_t count;
+
+	count = libusb_get_device_list_filtered(ctx, filter, &list);
+	if (count >= 0)
+		libusb_free_device_list(list, 1);
+	if (count != expected) {
+		libusbx_testlib_logf(tctx, "Listed %d devices %s, expected %d",
+			(int)count, what, (int)expected);
+		return 0;
+	}
+	return 1;
+}
+
+/** Tests that filtered lists only hold the matching devices. */
+static libusbx_testlib_result test_filtered_list(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct libusb_device_filter filter;
+	int ok = 1;
+
+	if (mock_init(tctx, "1234:0001,1234:0002,5678:0001", NULL, NULL, &ctx)
+			!= TEST_STATUS_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	libusb_init_device_filter(&filter);
+	ok &= check_filtered(tctx, ctx, &filter, "without criteria", 3);
+	filter.vendor_id = 0x1234;
+	ok &= check_filtered(tctx, ctx, &filter, "of vendor 1234", 2);
+	filter.product_id = 0x0002;
+	ok &= check_filtered(tctx, ctx, &filter, "of 1234:0002", 1);
+	libusb_init_device_filter(&filter);
+	filter.dev_class = LIBUSB_CLASS_VENDOR_SPEC;
+	ok &= check_filtered(tctx, ctx, &filter, "of vendor class", 3);
+	filter.dev_class = LIBUSB_CLASS_HUB;
+	ok &= check_filtered(tctx, ctx, &filter, "of hub class", 0);
+	libusb_init_device_filter(&filter);
+	filter.bus_number = 2;
+	ok &= check_filtered(tctx, ctx, &filter, "on bus 2", 0);
+
+	handle = libusb_open_device_with_vid_pid(ctx, 0x5678, 0x0001);
+	if (handle) {
+		libusb_close(handle);
+	} else {
+		libusbx_testlib_logf(tctx, "Failed to open 5678:0001 by ID");
+		ok = 0;
+	}
+
+	libusb_exit(ctx);
+	return ok ? TEST_STATUS_SUCCESS : TEST_STATUS_FAILURE;
+}
+
+/* what a hotplug callback saw */
+struct hotplug_run {
+	int arrived;
+	int left;
+	int last_product;
+	int done;
+};
+
+static int LIBUSB_CALL hotplug_cb(libusb_context *ctx, libusb_device *device,
+	libusb_hotplug_event event, void *user_data)
+{
+	struct hotplug_run *run = user_data;
+	struct libusb_device_descriptor desc;
+
+	(void)ctx;
+	if (libusb_get_device_descriptor(device, &desc) == LIBUSB_SUCCESS)
+		run->last_product = desc.idProduct;
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		run->arrived++;
+	else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+		run->left++;
+	if (run->left)
+		run->done = 1;
+	return 0;
+}
+
+/** Tests that hotplug callbacks hear of the devices present, and of those
+ * that arrive and leave later on. */
+static libusbx_testlib_result test_hotplug(libusbx_testlib_ctx * tctx)
+{
+	libusb_context *ctx;
+	libusb_device **list;
+	libusb_hotplug_callback_handle cb, other_cb;
+	struct hotplug_run run, other;
+	int status = TEST_STATUS_FAILURE;
+	ssize_t count;
+	int r;
+
+	/* the second device arrives after 100ms and leaves after 300ms */
+	if (mock_init(tctx, "1234:0001,1234:0002", NULL, "100:300", &ctx)
+			!= TEST_STATUS_SUCCESS)
+		return TEST_STATUS_ERROR;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	}
+
+	memset(&run, 0, sizeof(run));
+	memset(&other, 0, sizeof(other));
+	r = libusb_hotplug_register_callback(ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb, &run,
+		&cb);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to register callback: %d", r);
+		libusb_exit(ctx);
+		return TEST_STATUS_FAILURE;
+	}
+	r = libusb_hotplug_register_callback(ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE, 0x9999, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb, &other, &other_cb);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to register callback: %d", r);
+		goto out;
+	}
+
+	if (run.arrived != 1 || run.last_product != 0x0001) {
+		libusbx_testlib_logf(tctx, "Enumerated %d devices, last %04x",
+			run.arrived, run.last_product);
+		goto out;
+	}
+
+	r = wait_for(ctx, &run.done, WAIT_MS);
+	if (r < 0 || run.arrived != 2 || run.left != 1
+			|| run.last_product != 0x0002) {
+		libusbx_testlib_logf(tctx, "Saw %d arrivals and %d departures, "
+			"last %04x: %d", run.arrived, run.left, run.last_product, r);
+		goto out;
+	}
+	if (other.arrived || other.left) {
+		libusbx_testlib_logf(tctx, "Callback of another vendor was invoked");
+		goto out;
+	}
+
+	count = libusb_get_device_list(ctx, &list);
+	if (count >= 0)
+		libusb_free_device_list(list, 1);
+	if (count != 1) {
+		libusbx_testlib_logf(tctx, "Listed %d devices after departure",
+			(int)count);
+		goto out;
+	}
+	status = TEST_STATUS_SUCCESS;
+
+	libusb_hotplug_deregister_callback(ctx, other_cb);
+
+out:
+	libusb_hotplug_deregister_callback(ctx, cb);
+	libusb_exit(ctx);
+	return status;
+}
+
+/* Fill in the list of tests. */
+static const libusbx_testlib_test tests[] = {
+	{"transfer_timeout", &test_transfer_timeout},
+	{"cancel", &test_cancel},
+	{"submit_transfers", &test_submit_transfers},
+	{"cancel_race", &test_cancel_race},
+	{"transfer_pool", &test_transfer_pool},
+	{"open_devices", &test_open_devices},
+	{"streams", &test_streams},
+	{"stream_end", &test_stream_end},
+	{"filtered_list", &test_filtered_list},
+	{"hotplug", &test_hotplug},
+	LIBUSBX_NULL_TEST
+};
+
+int main (int argc, char ** argv)
+{
+	/* picked by the first libusb_init() of the process */
+	setenv("LIBUSB_BACKEND", "mock", 1);
+	return libusbx_testlib_run_tests(argc, argv, tests);
+}